@@ -0,0 +1,57 @@
+//! Measures the allocation fast path through [`da_tcmalloc::TCMalloc`]:
+//!
+//! ```sh
+//! cargo bench --bench fast_path
+//! ```
+
+use std::alloc::{GlobalAlloc, Layout};
+use std::hint::black_box;
+use std::time::{Duration, Instant};
+
+use da_tcmalloc::TCMalloc;
+
+const BATCH: usize = 1024;
+const ROUNDS: usize = 2000;
+
+// Frees each block right after allocating it, the best case for the
+// thread cache, where call overhead matters most.
+fn pairs(layout: Layout) -> Duration {
+    let start = Instant::now();
+    for _ in 0..BATCH {
+        unsafe {
+            let p = TCMalloc.alloc(black_box(layout));
+            TCMalloc.dealloc(black_box(p), layout);
+        }
+    }
+    start.elapsed()
+}
+
+// Allocates a batch, then frees it, like building and dropping a tree.
+fn batch(layout: Layout, ptrs: &mut [*mut u8]) -> Duration {
+    let start = Instant::now();
+    for p in ptrs.iter_mut() {
+        *p = unsafe { TCMalloc.alloc(black_box(layout)) };
+    }
+    for &p in ptrs.iter() {
+        unsafe { TCMalloc.dealloc(black_box(p), layout) };
+    }
+    start.elapsed()
+}
+
+fn per_op(d: Duration) -> f64 {
+    d.as_nanos() as f64 / BATCH as f64
+}
+
+fn main() {
+    let mut ptrs = vec![std::ptr::null_mut(); BATCH];
+    println!("{:>8} {:>6}  {:>14} {:>14}", "size", "align", "pair ns", "batch ns");
+    for &(size, align) in &[(8, 8), (16, 8), (64, 8), (256, 8), (1024, 8), (64, 64)] {
+        let layout = Layout::from_size_align(size, align).unwrap();
+        let mut best = (Duration::MAX, Duration::MAX);
+        for _ in 0..ROUNDS {
+            best.0 = best.0.min(pairs(layout));
+            best.1 = best.1.min(batch(layout, &mut ptrs));
+        }
+        println!("{:>8} {:>6}  {:>14.2} {:>14.2}", size, align, per_op(best.0), per_op(best.1));
+    }
+}
@@ -0,0 +1,125 @@
+//! Compares freeing through `free()` with sized deallocation through
+//! [`da_tcmalloc::TCMalloc`].
+//!
+//! ```sh
+//! cargo bench --bench sized_dealloc
+//! ```
+
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::hint::black_box;
+use std::time::{Duration, Instant};
+
+use da_tcmalloc::TCMalloc;
+
+const BATCH: usize = 4096;
+const ROUNDS: usize = 200;
+
+// Frees in shuffled order, so that consecutive frees hit different
+// pages, like they tend to in real programs.
+fn shuffled(n: usize) -> Vec<usize> {
+    let mut order: Vec<usize> = (0..n).collect();
+    let mut x: u64 = 0x9e3779b97f4a7c15;
+    for i in (1..n).rev() {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        order.swap(i, (x % (i as u64 + 1)) as usize);
+    }
+    order
+}
+
+// Stands for the rest of the program: touching it between frees evicts
+// allocator metadata from CPU caches, like real work does.
+struct WorkingSet {
+    lines: Vec<u64>,
+    next: usize,
+}
+
+impl WorkingSet {
+    fn new(bytes: usize) -> Self {
+        WorkingSet { lines: vec![1; bytes / 8], next: 0 }
+    }
+
+    fn touch(&mut self) -> u64 {
+        let mut sum = 0;
+        for _ in 0..4 {
+            // Large odd stride in 64 byte lines visits all of them.
+            self.next = (self.next + 8 * 4099) % self.lines.len();
+            sum += self.lines[self.next];
+        }
+        sum
+    }
+}
+
+// Allocates and frees BATCH blocks, returning time taken by each. Time
+// to free includes touching working set, if any.
+fn run(alloc: &impl GlobalAlloc, layout: Layout, order: &[usize], ptrs: &mut [*mut u8], ws: Option<&mut WorkingSet>) -> (Duration, Duration) {
+    let start = Instant::now();
+    for p in ptrs.iter_mut() {
+        *p = unsafe { alloc.alloc(layout) };
+    }
+    let allocated = Instant::now();
+    match ws {
+        Some(ws) => {
+            for &i in order {
+                black_box(ws.touch());
+                unsafe { alloc.dealloc(black_box(ptrs[i]), layout) };
+            }
+        }
+        None => {
+            for &i in order {
+                unsafe { alloc.dealloc(black_box(ptrs[i]), layout) };
+            }
+        }
+    }
+    (allocated - start, allocated.elapsed())
+}
+
+// Returns the best times over ROUNDS for System (i.e. malloc/free) and
+// TCMalloc. Runs interleave and take turns going first, so that both see
+// the same conditions.
+fn bench(layout: Layout, order: &[usize], mut ws: Option<&mut WorkingSet>) -> [(Duration, Duration); 2] {
+    let mut ptrs = vec![std::ptr::null_mut(); BATCH];
+    let mut best = [(Duration::MAX, Duration::MAX); 2];
+    for round in 0..ROUNDS {
+        let mut times = [(Duration::ZERO, Duration::ZERO); 2];
+        for k in 0..2 {
+            let which = (round + k) % 2;
+            times[which] = if which == 0 {
+                run(&System, layout, order, &mut ptrs, ws.as_deref_mut())
+            } else {
+                run(&TCMalloc, layout, order, &mut ptrs, ws.as_deref_mut())
+            };
+        }
+        for (best, time) in best.iter_mut().zip(times) {
+            *best = (best.0.min(time.0), best.1.min(time.1));
+        }
+    }
+    best
+}
+
+fn per_op(d: Duration) -> f64 {
+    d.as_nanos() as f64 / BATCH as f64
+}
+
+fn main() {
+    let order = shuffled(BATCH);
+    let mut ws = WorkingSet::new(64 << 20);
+    for (title, mut ws) in [("hot caches", None), ("64 MiB working set", Some(&mut ws))] {
+        println!("{}:", title);
+        println!("{:>8} {:>6}  {:>14} {:>14}  {:>14} {:>14}", "size", "align", "malloc ns", "free ns", "tc_malloc ns", "sized free ns");
+        for &(size, align) in &[(16, 8), (64, 8), (256, 8), (1024, 8), (4096, 8), (32768, 8), (64, 64), (1024, 256)] {
+            let layout = Layout::from_size_align(size, align).unwrap();
+            let [(system_alloc, system_free), (tc_alloc, tc_free)] = bench(layout, &order, ws.as_deref_mut());
+            println!(
+                "{:>8} {:>6}  {:>14.1} {:>14.1}  {:>14.1} {:>14.1}",
+                size,
+                align,
+                per_op(system_alloc),
+                per_op(system_free),
+                per_op(tc_alloc),
+                per_op(tc_free)
+            );
+        }
+    }
+}
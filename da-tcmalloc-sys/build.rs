@@ -14,6 +14,10 @@ fn main() {
     let manifest_dir = env::var("CARGO_MANIFEST_DIR").expect("CARGO_MANIFEST_DIR was not set");
     let num_jobs = env::var("NUM_JOBS").expect("NUM_JOBS was not set");
     let no_libunwind = env::var("CARGO_FEATURE_NO_LIBUNWIND");
+    let per_cpu_caches = env::var("CARGO_FEATURE_PER_CPU_CACHES");
+    let hugepage_aware = env::var("CARGO_FEATURE_HUGEPAGE_AWARE");
+    let minimal = env::var("CARGO_FEATURE_MINIMAL");
+    let align_8 = env::var("CARGO_FEATURE_ALIGN_8");
     let out_dir = PathBuf::from(env::var_os("OUT_DIR").expect("OUT_DIR was not set"));
     let src_dir = env::current_dir().expect("failed to get current directory");
     let build_dir = out_dir.join("build");
@@ -64,14 +68,34 @@ fn main() {
             configure_cmd.arg("--disable-libunwind");
             configure_cmd.arg("--enable-libgcc-unwinder-by-default");
         }
+        if per_cpu_caches.is_ok() {
+            configure_cmd.arg("--enable-per-cpu-caches-by-default");
+        }
+        if hugepage_aware.is_ok() {
+            configure_cmd.arg("--enable-hugepage-aware-by-default");
+        }
+        if align_8.is_ok() {
+            configure_cmd.arg("--with-tcmalloc-alignment=8");
+        }
+        if minimal.is_ok() {
+            // Keep just the allocator and the heap profiler. This is
+            // only a configure flag change, the autotools build is
+            // otherwise the same.
+            configure_cmd.arg("--disable-heap-checker");
+            configure_cmd.arg("--disable-debugalloc");
+            configure_cmd.arg("--disable-cpu-profiler");
+        }
         run(&mut configure_cmd);
     }
 
+    // Only the library we link, not the other libraries, tests and
+    // benchmarks.
     let mut make_cmd = Command::new("make");
     make_cmd.current_dir(&build_dir)
         .arg("srcroot=../gperftools/")
         .arg("-j")
-        .arg(num_jobs);
+        .arg(num_jobs)
+        .arg("libtcmalloc.la");
     run(&mut make_cmd);
 
     let bindings = bindgen::Builder::default()
@@ -1,3 +1,16 @@
 #![allow(non_upper_case_globals, non_camel_case_types)]
 
 include!(concat!(env!("OUT_DIR"), "/bindings.rs"));
+
+// tcmalloc.h is generated by configure and mixes in C++ overloads, so
+// the entry points used by the Rust global allocator are declared here.
+extern "C" {
+    pub fn tc_malloc(size: usize) -> *mut ::std::os::raw::c_void;
+    pub fn tc_memalign(align: usize, size: usize) -> *mut ::std::os::raw::c_void;
+    pub fn tc_calloc(count: usize, size: usize) -> *mut ::std::os::raw::c_void;
+    pub fn tc_realloc(ptr: *mut ::std::os::raw::c_void, size: usize) -> *mut ::std::os::raw::c_void;
+    pub fn tc_free_sized(ptr: *mut ::std::os::raw::c_void, size: usize);
+    /// `align` is `std::align_val_t`, which is passed as `size_t`.
+    pub fn tc_delete_sized_aligned(ptr: *mut ::std::os::raw::c_void, size: usize, align: usize);
+    pub fn tc_nallocx(size: usize, flags: ::std::os::raw::c_int) -> usize;
+}
@@ -0,0 +1,105 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+//
+// Measures how long short-lived processes take to start, which
+// includes malloc initialization. Runs itself as child processes that
+// do a few allocations and exit, and reports latency from spawn to
+// main() and from spawn to exit.
+//
+// Compare startup_bench (linked with tcmalloc) with
+// startup_bench_libc (same code, system malloc) to see what
+// tcmalloc adds.
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+extern char** environ;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Like a small CLI tool: a handful of allocations of various sizes.
+static void child_work() {
+  std::vector<void*> ptrs;
+  for (size_t size = 8; size <= (64 << 10); size *= 2) {
+    ptrs.push_back(malloc(size));
+  }
+  for (void* p : ptrs) {
+    free(p);
+  }
+}
+
+static void print_stats(const char* name, std::vector<uint64_t>* ns) {
+  std::sort(ns->begin(), ns->end());
+  const size_t n = ns->size();
+  printf("%-16s median %8.1f us   p90 %8.1f us   min %8.1f us\n",
+         name, (*ns)[n / 2] / 1e3, (*ns)[n * 9 / 10] / 1e3, (*ns)[0] / 1e3);
+}
+
+int main(int argc, char** argv) {
+  if (argc == 3 && strcmp(argv[1], "--child") == 0) {
+    const uint64_t entered = now_ns();
+    child_work();
+    const int fd = atoi(argv[2]);
+    if (write(fd, &entered, sizeof(entered)) != sizeof(entered)) {
+      _exit(1);
+    }
+    return 0;
+  }
+
+  const int iterations = argc > 1 ? atoi(argv[1]) : 500;
+  if (iterations <= 0) {
+    fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<uint64_t> to_main, to_exit;
+  for (int i = 0; i < iterations; i++) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+      perror("pipe");
+      return 1;
+    }
+    char fd_arg[16];
+    snprintf(fd_arg, sizeof(fd_arg), "%d", fds[1]);
+    char child_flag[] = "--child";
+    char* child_argv[] = {argv[0], child_flag, fd_arg, nullptr};
+
+    const uint64_t start = now_ns();
+    pid_t pid;
+    if (posix_spawn(&pid, argv[0], nullptr, nullptr, child_argv, environ) != 0) {
+      perror("posix_spawn");
+      return 1;
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    const uint64_t exited = now_ns();
+    close(fds[1]);
+
+    uint64_t entered;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0
+        || read(fds[0], &entered, sizeof(entered)) != sizeof(entered)) {
+      fprintf(stderr, "child failed\n");
+      return 1;
+    }
+    close(fds[0]);
+    to_main.push_back(entered - start);
+    to_exit.push_back(exited - start);
+  }
+
+  print_stats("spawn to main", &to_main);
+  print_stats("spawn to exit", &to_exit);
+  return 0;
+}
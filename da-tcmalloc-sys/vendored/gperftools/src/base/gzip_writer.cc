@@ -0,0 +1,285 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "base/gzip_writer.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace tcmalloc {
+
+namespace {
+
+// Longest hash chain we walk looking for a match. Larger values give
+// (slightly) better compression at the expense of speed.
+constexpr int kMaxChain = 32;
+
+constexpr int kMinMatch = 3;
+constexpr int kMaxMatch = 258;
+
+constexpr int kEndOfBlock = 256;
+
+// Base values and extra bits counts of length codes 257..285 and
+// distance codes 0..29. See section 3.2.5 of RFC 1951.
+constexpr uint16_t kLengthBase[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+constexpr uint8_t kLengthExtra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+constexpr uint16_t kDistanceBase[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+  8193, 12289, 16385, 24577};
+constexpr uint8_t kDistanceExtra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+struct Crc32Table {
+  uint32_t entries[256];
+
+  constexpr Crc32Table() : entries() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? (0xEDB88320U ^ (c >> 1)) : (c >> 1);
+      }
+      entries[i] = c;
+    }
+  }
+};
+
+constexpr Crc32Table kCrc32Table;
+
+uint32_t UpdateCrc32(uint32_t crc, const char* data, size_t size) {
+  uint32_t c = ~crc;
+  for (size_t i = 0; i < size; i++) {
+    c = kCrc32Table.entries[(c ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (c >> 8);
+  }
+  return ~c;
+}
+
+void PutLE32(uint8_t* dst, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    dst[i] = static_cast<uint8_t>(v >> (8 * i));
+  }
+}
+
+}  // namespace
+
+GzipWriter::GzipWriter(GenericWriter* out) : out_(out) {
+  memset(head_, 0, sizeof(head_));
+
+  // Gzip member header: magic, CM=deflate, no flags, no mtime, no
+  // extra flags, OS=unix.
+  static const char kHeader[] = {'\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, 3};
+  out_->AppendMem(kHeader, sizeof(kHeader));
+
+  // We emit everything as one long fixed Huffman block. BFINAL=0,
+  // BTYPE=01.
+  PutBits(2, 3);
+}
+
+GzipWriter::~GzipWriter() {
+  FinalRecycle();
+
+  PutLiteral(kEndOfBlock);
+  // Empty final block to terminate deflate stream.
+  PutBits(3, 3);
+  PutLiteral(kEndOfBlock);
+  FlushBits(true);
+
+  uint8_t trailer[8];
+  PutLE32(trailer, crc_);
+  PutLE32(trailer + 4, input_size_);
+  out_->AppendMem(reinterpret_cast<const char*>(trailer), sizeof(trailer));
+}
+
+std::pair<char*, char*> GzipWriter::RecycleBuffer(char* buf_begin, char* buf_end, int want_at_least) {
+  if (buf_begin != nullptr) {
+    RAW_DCHECK(buf_begin == buffer_ + buffer_fill_, "");
+    const int filled = buf_end - buf_begin;
+    crc_ = UpdateCrc32(crc_, buf_begin, filled);
+    input_size_ += filled;
+
+    Compress(buffer_fill_, buffer_fill_ + filled);
+    buffer_fill_ += filled;
+  }
+
+  // Keep last kWindowSize bytes around and make rest of buffer
+  // available for next chunk of input.
+  if (buffer_fill_ > kWindowSize) {
+    const int shift = buffer_fill_ - kWindowSize;
+    memmove(buffer_, buffer_ + shift, kWindowSize);
+    base_ += shift;
+    buffer_fill_ = kWindowSize;
+  }
+
+  RAW_DCHECK(want_at_least <= kBufferSize - buffer_fill_, "");
+  return {buffer_ + buffer_fill_, buffer_ + kBufferSize};
+}
+
+static inline uint32_t HashAt(const char* p) {
+  uint32_t v = static_cast<uint8_t>(p[0])
+    | (static_cast<uint8_t>(p[1]) << 8)
+    | (static_cast<uint8_t>(p[2]) << 16);
+  return v * 0x9E3779B1U;
+}
+
+void GzipWriter::InsertString(int pos) {
+  const size_t offset = base_ + pos;
+  const uint32_t h = HashAt(buffer_ + pos) >> (32 - kHashBits);
+  prev_[offset & (kWindowSize - 1)] = head_[h];
+  head_[h] = offset + 1;
+}
+
+int GzipWriter::LongestMatch(int pos, int end, int* distance) const {
+  const size_t offset = base_ + pos;
+  const int limit = std::min(kMaxMatch, end - pos);
+  const uint32_t h = HashAt(buffer_ + pos) >> (32 - kHashBits);
+
+  int best = 0;
+  size_t candidate = head_[h];
+  for (int chain = 0; candidate != 0 && chain < kMaxChain; chain++) {
+    const size_t c = candidate - 1;
+    if (c < base_ || offset - c > kWindowSize) {
+      break;
+    }
+
+    const char* a = buffer_ + (c - base_);
+    const char* b = buffer_ + pos;
+    int len = 0;
+    while (len < limit && a[len] == b[len]) {
+      len++;
+    }
+    if (len > best) {
+      best = len;
+      *distance = offset - c;
+      if (len == limit) {
+        break;
+      }
+    }
+
+    const size_t next = prev_[c & (kWindowSize - 1)];
+    if (next >= candidate) {
+      break;
+    }
+    candidate = next;
+  }
+  return best;
+}
+
+void GzipWriter::Compress(int start, int end) {
+  int pos = start;
+  while (pos < end) {
+    int distance = 0;
+    int length = 0;
+    if (end - pos >= kMinMatch) {
+      length = LongestMatch(pos, end, &distance);
+    }
+
+    if (length < kMinMatch) {
+      PutLiteral(static_cast<uint8_t>(buffer_[pos]));
+      length = 1;
+    } else {
+      PutMatch(length, distance);
+    }
+
+    for (int i = 0; i < length; i++, pos++) {
+      if (end - pos >= kMinMatch) {
+        InsertString(pos);
+      }
+    }
+  }
+}
+
+void GzipWriter::PutBits(uint32_t bits, int count) {
+  bit_buffer_ |= static_cast<uint64_t>(bits) << bit_count_;
+  bit_count_ += count;
+  while (bit_count_ >= 8) {
+    out_buffer_[out_fill_++] = static_cast<uint8_t>(bit_buffer_);
+    bit_buffer_ >>= 8;
+    bit_count_ -= 8;
+    if (out_fill_ == sizeof(out_buffer_)) {
+      FlushBits(false);
+    }
+  }
+}
+
+void GzipWriter::PutHuffman(uint32_t code, int length) {
+  // Huffman codes are packed starting with most significant bit.
+  uint32_t reversed = 0;
+  for (int i = 0; i < length; i++) {
+    reversed = (reversed << 1) | ((code >> i) & 1);
+  }
+  PutBits(reversed, length);
+}
+
+void GzipWriter::PutLiteral(int literal) {
+  // Fixed literal/length code. See section 3.2.6 of RFC 1951.
+  if (literal < 144) {
+    PutHuffman(0x30 + literal, 8);
+  } else if (literal < 256) {
+    PutHuffman(0x190 + literal - 144, 9);
+  } else if (literal < 280) {
+    PutHuffman(literal - 256, 7);
+  } else {
+    PutHuffman(0xC0 + literal - 280, 8);
+  }
+}
+
+void GzipWriter::PutMatch(int length, int distance) {
+  int lcode = 28;
+  while (kLengthBase[lcode] > length) {
+    lcode--;
+  }
+  PutLiteral(257 + lcode);
+  PutBits(length - kLengthBase[lcode], kLengthExtra[lcode]);
+
+  int dcode = 29;
+  while (kDistanceBase[dcode] > distance) {
+    dcode--;
+  }
+  PutHuffman(dcode, 5);
+  PutBits(distance - kDistanceBase[dcode], kDistanceExtra[dcode]);
+}
+
+void GzipWriter::FlushBits(bool align) {
+  if (align && bit_count_ > 0) {
+    PutBits(0, 8 - bit_count_);
+  }
+  if (out_fill_ > 0) {
+    out_->AppendMem(reinterpret_cast<const char*>(out_buffer_), out_fill_);
+    out_fill_ = 0;
+  }
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,104 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef BASE_GZIP_WRITER_H_
+#define BASE_GZIP_WRITER_H_
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+
+#include "base/basictypes.h"
+#include "base/generic_writer.h"
+
+namespace tcmalloc {
+
+// GzipWriter is GenericWriter that gzip-compresses everything
+// written into it and passes compressed bytes to another
+// GenericWriter.
+//
+// Compression is plain LZ77 with fixed Huffman codes (see RFC
+// 1951). It is not as good as zlib's, but it is simple, doesn't
+// depend on anything and, importantly, does no memory allocation. All
+// state is held within instance itself (which is somewhat large, so
+// it is best to place it in memory allocated via ProfilerMalloc or
+// similar). Gzip trailer is written by destructor.
+class ATTRIBUTE_VISIBILITY_HIDDEN GzipWriter : public GenericWriter {
+public:
+  explicit GzipWriter(GenericWriter* out);
+  ~GzipWriter() override;
+
+  static constexpr int kWindowSize = 32 << 10;
+
+private:
+  static constexpr int kHashBits = 15;
+  static constexpr int kBufferSize = 2 * kWindowSize;
+
+  std::pair<char*, char*> RecycleBuffer(char* buf_begin, char* buf_end, int want_at_least) override;
+
+  void Compress(int start, int end);
+  int LongestMatch(int pos, int end, int* distance) const;
+  void InsertString(int pos);
+
+  void PutBits(uint32_t bits, int count);
+  void PutHuffman(uint32_t code, int length);
+  void PutLiteral(int literal);
+  void PutMatch(int length, int distance);
+  void FlushBits(bool align);
+
+  GenericWriter* const out_;
+
+  uint32_t crc_ = 0;
+  uint32_t input_size_ = 0;
+
+  // Uncompressed input. We keep last kWindowSize bytes of already
+  // compressed input, so that matches can refer to it.
+  char buffer_[kBufferSize];
+  int buffer_fill_ = 0;
+  // Stream offset of buffer_[0].
+  size_t base_ = 0;
+
+  // head_[hash] is the stream offset + 1 of the most recent position
+  // with 3-byte prefix hashing to 'hash' (0 means none). prev_ links
+  // each position to the previous one in the same hash chain.
+  size_t head_[1 << kHashBits];
+  size_t prev_[kWindowSize];
+
+  uint64_t bit_buffer_ = 0;
+  int bit_count_ = 0;
+  uint8_t out_buffer_[4096];
+  int out_fill_ = 0;
+};
+
+}  // namespace tcmalloc
+
+#endif  // BASE_GZIP_WRITER_H_
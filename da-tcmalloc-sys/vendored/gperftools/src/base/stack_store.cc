@@ -0,0 +1,161 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "base/stack_store.h"
+
+#include <string.h>
+
+#include "base/logging.h"
+
+namespace tcmalloc {
+
+StackStore::StackStore(Allocator alloc, DeAllocator dealloc)
+    : alloc_(alloc), dealloc_(dealloc) {
+}
+
+StackStore::~StackStore() {
+  for (std::atomic<Node*>& chunk : chunks_) {
+    Node* nodes = chunk.load(std::memory_order_relaxed);
+    if (nodes == nullptr) {
+      break;
+    }
+    dealloc_(nodes);
+  }
+  if (index_ != nullptr) {
+    dealloc_(index_);
+  }
+}
+
+uint32_t StackStore::Hash(const void* pc, uint32_t caller) {
+  uint64_t h = (reinterpret_cast<uintptr_t>(pc) ^ (uint64_t{caller} << 32)) * 0x9E3779B97F4A7C15ULL;
+  return static_cast<uint32_t>(h >> 32);
+}
+
+void StackStore::GrowIndex() {
+  const uint32_t new_size = index_size_ == 0 ? 4096 : index_size_ * 2;
+  uint32_t* new_index = static_cast<uint32_t*>(alloc_(sizeof(uint32_t) * new_size));
+  memset(new_index, 0, sizeof(uint32_t) * new_size);
+
+  // Re-link all nodes into new index. Readers never look at index_
+  // or Node::next, so this is safe.
+  const uint32_t count = node_count_.load(std::memory_order_relaxed);
+  for (uint32_t id = 1; id < count; id++) {
+    Node* n = mutable_node(id);
+    uint32_t* head = &new_index[Hash(n->pc, n->caller) & (new_size - 1)];
+    n->next = *head;
+    *head = id;
+  }
+
+  if (index_ != nullptr) {
+    dealloc_(index_);
+  }
+  index_ = new_index;
+  index_size_ = new_size;
+}
+
+uint32_t StackStore::FindOrAdd(const void* pc, uint32_t caller) {
+  const uint32_t h = Hash(pc, caller);
+  for (uint32_t id = index_[h & (index_size_ - 1)]; id != 0; ) {
+    const Node* n = mutable_node(id);
+    if (n->pc == pc && n->caller == caller) {
+      return id;
+    }
+    id = n->next;
+  }
+
+  const uint32_t id = node_count_.load(std::memory_order_relaxed);
+  if ((id >> kChunkBits) >= kMaxChunks) {
+    return 0;
+  }
+  std::atomic<Node*>* chunk = &chunks_[id >> kChunkBits];
+  if (chunk->load(std::memory_order_relaxed) == nullptr) {
+    chunk->store(static_cast<Node*>(alloc_(sizeof(Node) * kChunkNodes)),
+                 std::memory_order_release);
+  }
+
+  Node* n = mutable_node(id);
+  n->pc = pc;
+  n->caller = caller;
+  uint32_t* head = &index_[h & (index_size_ - 1)];
+  n->next = *head;
+  *head = id;
+  // Readers only learn about new ids via whatever caller publishes
+  // them with (e.g. CAS-ed bucket), which orders node fields too.
+  node_count_.store(id + 1, std::memory_order_relaxed);
+
+  if (id + 1 > index_size_) {
+    GrowIndex();
+  }
+  return id;
+}
+
+bool StackStore::Intern(const void* const stack[], int depth, uint32_t* id) {
+  SpinLockHolder h(&lock_);
+  if (index_ == nullptr) {
+    GrowIndex();
+  }
+
+  // Outermost frame goes first, so that stacks share nodes of their
+  // common callers.
+  uint32_t caller = 0;
+  for (int i = depth - 1; i >= 0; i--) {
+    caller = FindOrAdd(stack[i], caller);
+    if (caller == 0) {
+      return false;
+    }
+  }
+  *id = caller;
+  return true;
+}
+
+void StackStore::Get(uint32_t id, int depth, const void** result) const {
+  for (int i = 0; i < depth; i++) {
+    RAW_DCHECK(id != 0, "stack is shorter than requested depth");
+    const Node& n = node(id);
+    result[i] = n.pc;
+    id = n.caller;
+  }
+}
+
+bool StackStore::Equals(uint32_t id, const void* const stack[], int depth) const {
+  for (int i = 0; i < depth; i++) {
+    if (id == 0) {
+      return false;
+    }
+    const Node& n = node(id);
+    if (n.pc != stack[i]) {
+      return false;
+    }
+    id = n.caller;
+  }
+  return id == 0;
+}
+
+}  // namespace tcmalloc
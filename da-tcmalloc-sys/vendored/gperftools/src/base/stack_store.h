@@ -0,0 +1,121 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef BASE_STACK_STORE_H_
+#define BASE_STACK_STORE_H_
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "base/basictypes.h"
+#include "base/spinlock.h"
+
+namespace tcmalloc {
+
+// StackStore interns stack traces as chains of (pc, caller node)
+// nodes, so that stacks with common outer frames share storage. A
+// stack is referred to by 32-bit id of the node of its innermost
+// frame (plus its depth, which the store doesn't keep).
+//
+// Interning new stacks takes a lock, but reading stacks back is
+// lock-free and can run concurrently with interning, since nodes are
+// never moved or removed while the store exists. Like
+// HeapProfileTable, it allocates memory only via given allocator.
+class StackStore {
+public:
+  typedef void* (*Allocator)(size_t size);
+  typedef void  (*DeAllocator)(void* ptr);
+
+  StackStore(Allocator alloc, DeAllocator dealloc);
+  ~StackStore();
+
+  // Sets *id to id of given stack, adding nodes for any frames we
+  // haven't seen with same callers before. Returns false if store is
+  // full. Empty stack has id 0.
+  bool Intern(const void* const stack[], int depth, uint32_t* id);
+
+  // Fills 'result' with 'depth' frames of stack 'id'.
+  void Get(uint32_t id, int depth, const void** result) const;
+
+  // Returns true if stack 'id' of given depth equals 'stack'.
+  bool Equals(uint32_t id, const void* const stack[], int depth) const;
+
+  // Number of nodes (i.e. distinct (frame, callers) pairs) stored.
+  size_t nodes() const { return node_count_.load(std::memory_order_relaxed) - 1; }
+
+private:
+  struct Node {
+    const void* pc;
+    uint32_t caller;  // id of caller's node, 0 for outermost frame
+    uint32_t next;    // next node in the same index_ chain
+  };
+
+  static constexpr int kChunkBits = 10;
+  static constexpr uint32_t kChunkNodes = 1 << kChunkBits;
+  static constexpr int kMaxChunks = 1 << 12;
+
+  const Node& node(uint32_t id) const {
+    return chunks_[id >> kChunkBits].load(std::memory_order_acquire)[id & (kChunkNodes - 1)];
+  }
+  Node* mutable_node(uint32_t id) {
+    return &chunks_[id >> kChunkBits].load(std::memory_order_relaxed)[id & (kChunkNodes - 1)];
+  }
+
+  static uint32_t Hash(const void* pc, uint32_t caller);
+
+  // Returns id of node (pc, caller), adding it if needed, or 0 if
+  // store is full.
+  uint32_t FindOrAdd(const void* pc, uint32_t caller);
+  void GrowIndex();
+
+  Allocator alloc_;
+  DeAllocator dealloc_;
+
+  // Protects index_ and adding nodes.
+  SpinLock lock_;
+
+  // Node ids start at 1, 0 is the "no node" value.
+  std::atomic<uint32_t> node_count_{1};
+  std::atomic<Node*> chunks_[kMaxChunks] = {};
+
+  // Hash index of nodes by (pc, caller): heads of chains linked via
+  // Node::next.
+  uint32_t* index_ = nullptr;
+  uint32_t index_size_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(StackStore);
+};
+
+}  // namespace tcmalloc
+
+#endif  // BASE_STACK_STORE_H_
@@ -34,6 +34,7 @@
 #include "config.h"
 #include <algorithm>
 #include "central_freelist.h"
+#include "cpu_cache.h"         // for CpuCache::CurrentCpu
 #include "internal_logging.h"  // for ASSERT, MESSAGE
 #include "linked_list.h"       // for SLL_Next, SLL_Push, etc
 #include "page_heap.h"         // for PageHeap
@@ -50,19 +51,20 @@ using std::max;
 
 namespace tcmalloc {
 
-void CentralFreeList::Init(size_t cl) {
+void CentralFreeList::Init(size_t cl, int node) {
   size_class_ = cl;
+  node_ = node;
   tcmalloc::DLL_Init(&empty_);
   tcmalloc::DLL_Init(&nonempty_);
   num_spans_ = 0;
   counter_ = 0;
 
-  max_cache_size_ = kMaxNumTransferEntries;
+  int32_t max_cache_size = kMaxNumTransferEntries;
 #ifdef TCMALLOC_SMALL_BUT_SLOW
   // Disable the transfer cache for the small footprint case.
-  cache_size_ = 0;
+  int32_t cache_size = 0;
 #else
-  cache_size_ = 16;
+  int32_t cache_size = 16;
 #endif
   if (cl > 0) {
     // Limit the maximum size of the cache based on the size class.  If this
@@ -77,12 +79,33 @@ void CentralFreeList::Init(size_t cl) {
     // size classes then can't be greater than approximately
     // 1MB * kMaxNumTransferEntries.
     // min and max are in parens to avoid macro-expansion on windows.
-    max_cache_size_ = (min)(max_cache_size_,
-                          (max)(1, (1024 * 1024) / (bytes * objs_to_move)));
-    cache_size_ = (min)(cache_size_, max_cache_size_);
+    max_cache_size = (min)(max_cache_size,
+                         (max)(1, (1024 * 1024) / (bytes * objs_to_move)));
+    cache_size = (min)(cache_size, max_cache_size);
   }
-  used_slots_ = 0;
-  ASSERT(cache_size_ <= max_cache_size_);
+
+  // Spread both limits across shards, so that total stays the
+  // same. When there are fewer slots than shards, only first shards
+  // get any.
+  for (int i = 0; i < kNumTransferShards; i++) {
+    TransferShard* shard = &shards_[i];
+    shard->max_cache_size = (max_cache_size + kNumTransferShards - 1 - i) / kNumTransferShards;
+    shard->cache_size = (cache_size + kNumTransferShards - 1 - i) / kNumTransferShards;
+    shard->used_slots = 0;
+    ASSERT(shard->max_cache_size <= kMaxEntriesPerShard);
+    ASSERT(shard->cache_size <= shard->max_cache_size);
+  }
+}
+
+int CentralFreeList::HomeShard() {
+  int cpu = CpuCache::CurrentCpu();
+  if (cpu < 0) {
+    // No cheap way to know our CPU. Stacks of different threads are
+    // far apart, so this at least spreads threads across shards.
+    uintptr_t sp = reinterpret_cast<uintptr_t>(&cpu);
+    cpu = static_cast<int>((sp >> 23) & 0x7fffffff);
+  }
+  return cpu % kNumTransferShards;
 }
 
 void CentralFreeList::ReleaseListToSpans(void* start) {
@@ -98,6 +121,7 @@ void CentralFreeList::ReleaseToSpans(void* object) {
   Span* span = Static::pageheap()->GetDescriptor(p);
   ASSERT(span != NULL);
   ASSERT(span->refcount > 0);
+  ASSERT(span->node == node_);
 
   // If span is empty, move it to non-empty list
   if (span->objects == NULL) {
@@ -137,8 +161,7 @@ void CentralFreeList::ReleaseToSpans(void* object) {
   }
 }
 
-bool CentralFreeList::EvictRandomSizeClass(
-    int locked_size_class, bool force) {
+bool CentralFreeList::EvictRandomSizeClass(int locked_shard, bool force) {
   static int race_counter = 0;
   int t = race_counter++;  // Updated without a lock, but who cares.
   if (t >= Static::num_size_classes()) {
@@ -149,25 +172,26 @@ bool CentralFreeList::EvictRandomSizeClass(
   }
   ASSERT(t >= 0);
   ASSERT(t < Static::num_size_classes());
-  if (t == locked_size_class) return false;
-  return Static::central_cache()[t].ShrinkCache(locked_size_class, force);
+  if (t == size_class_) return false;
+  return Static::node_central_cache(node_)[t].ShrinkCache(size_class_, locked_shard, force);
 }
 
-bool CentralFreeList::MakeCacheSpace() {
+bool CentralFreeList::MakeCacheSpace(int shard_index) {
+  TransferShard* shard = &shards_[shard_index];
   // Is there room in the cache?
-  if (used_slots_ < cache_size_) return true;
+  if (shard->used_slots < shard->cache_size) return true;
   // Check if we can expand this cache?
-  if (cache_size_ == max_cache_size_) return false;
+  if (shard->cache_size == shard->max_cache_size) return false;
   // Ok, we'll try to grab an entry from some other size class.
-  if (EvictRandomSizeClass(size_class_, false) ||
-      EvictRandomSizeClass(size_class_, true)) {
+  if (EvictRandomSizeClass(shard_index, false) ||
+      EvictRandomSizeClass(shard_index, true)) {
     // Succeeded in evicting, we're going to make our cache larger.
     // However, we may have dropped and re-acquired the lock in
     // EvictRandomSizeClass (via ShrinkCache and the LockInverter), so the
     // cache_size may have changed.  Therefore, check and verify that it is
     // still OK to increase the cache_size.
-    if (cache_size_ < max_cache_size_) {
-      cache_size_++;
+    if (shard->cache_size < shard->max_cache_size) {
+      shard->cache_size++;
       return true;
     }
   }
@@ -189,63 +213,159 @@ class LockInverter {
 // This function is marked as NO_THREAD_SAFETY_ANALYSIS because it uses
 // LockInverter to release one lock and acquire another in scoped-lock
 // style, which our current annotation/analysis does not support.
-bool CentralFreeList::ShrinkCache(int locked_size_class, bool force)
+bool CentralFreeList::ShrinkCache(int locked_size_class, int shard_index, bool force)
     NO_THREAD_SAFETY_ANALYSIS {
+  TransferShard* shard = &shards_[shard_index];
   // Start with a quick check without taking a lock.
-  if (cache_size_ == 0) return false;
+  if (shard->cache_size == 0) return false;
   // We don't evict from a full cache unless we are 'forcing'.
-  if (force == false && used_slots_ == cache_size_) return false;
-
-  // Grab lock, but first release the other lock held by this thread.  We use
-  // the lock inverter to ensure that we never hold two size class locks
-  // concurrently.  That can create a deadlock because there is no well
-  // defined nesting order.
-  LockInverter li(&Static::central_cache()[locked_size_class].lock_, &lock_);
-  ASSERT(used_slots_ <= cache_size_);
-  ASSERT(0 <= cache_size_);
-  if (cache_size_ == 0) return false;
-  if (used_slots_ == cache_size_) {
+  if (force == false && shard->used_slots == shard->cache_size) return false;
+
+  SpinLock* held = &Static::node_central_cache(node_)[locked_size_class].shards_[shard_index].lock;
+  void* evicted = NULL;
+  {
+    // Grab lock, but first release the other lock held by this
+    // thread.  We use the lock inverter to ensure that we never hold
+    // two shard locks concurrently.  That can create a deadlock
+    // because there is no well defined nesting order.
+    LockInverter li(held, &shard->lock);
+    ASSERT(shard->used_slots <= shard->cache_size);
+    ASSERT(0 <= shard->cache_size);
+    if (shard->cache_size == 0) return false;
+    if (shard->used_slots < shard->cache_size) {
+      shard->cache_size--;
+      return true;
+    }
     if (force == false) return false;
-    // ReleaseListToSpans releases the lock, so we have to make all the
-    // updates to the central list before calling it.
-    cache_size_--;
-    used_slots_--;
-    ReleaseListToSpans(tc_slots_[used_slots_].head);
-    return true;
+    shard->cache_size--;
+    shard->used_slots--;
+    evicted = shard->slots[shard->used_slots].head;
+  }
+
+  // Releasing to spans may end up in pageheap, which nests outside
+  // of shard locks (see CentralCacheLockAll). So do it with no shard
+  // lock held at all.
+  held->Unlock();
+  {
+    SpinLockHolder h(&lock_);
+    ReleaseListToSpans(evicted);
   }
-  cache_size_--;
+  held->Lock();
   return true;
 }
 
 void CentralFreeList::InsertRange(void *start, void *end, int N) {
-  SpinLockHolder h(&lock_);
-  if (N == Static::sizemap()->num_objects_to_move(size_class_) &&
-    MakeCacheSpace()) {
-    int slot = used_slots_++;
-    ASSERT(slot >=0);
-    ASSERT(slot < max_cache_size_);
-    TCEntry *entry = &tc_slots_[slot];
-    entry->head = start;
-    entry->tail = end;
-    return;
+  if (PREDICT_FALSE(Numa::IsActive())) {
+    N = HandOffForeign(&start, &end, N);
+    if (N == 0) {
+      return;
+    }
+  }
+  InsertLocalRange(start, end, N);
+}
+
+int CentralFreeList::HandOffForeign(void **start, void **end, int N) {
+  void* heads[Numa::kMaxNodes] = {};
+  void* tails[Numa::kMaxNodes] = {};
+  int counts[Numa::kMaxNodes] = {};
+  // Objects of a batch mostly come from few spans, so we only look up
+  // span of an object that is not in the previous one.
+  const Span* span = NULL;
+  void* object = *start;
+  for (int i = 0; i < N; i++) {
+    void* next = SLL_Next(object);
+    const PageID p = reinterpret_cast<uintptr_t>(object) >> kPageShift;
+    if (span == NULL || p - span->start >= span->length) {
+      span = Static::pageheap()->GetDescriptor(p);
+    }
+    const int node = span->node;
+    if (heads[node] == NULL) {
+      tails[node] = object;
+    }
+    SLL_Push(&heads[node], object);
+    counts[node]++;
+    object = next;
+  }
+
+  for (int node = 0; node < Numa::kMaxNodes; node++) {
+    if (node != node_ && counts[node] > 0) {
+      Static::node_central_cache(node)[size_class_].InsertLocalRange(
+        heads[node], tails[node], counts[node]);
+    }
+  }
+  *start = heads[node_];
+  *end = tails[node_];
+  return counts[node_];
+}
+
+void CentralFreeList::InsertLocalRange(void *start, void *end, int N) {
+  if (N == Static::sizemap()->num_objects_to_move(size_class_)) {
+    // Home shard may grow to fit the batch. Other shards are only
+    // probed for free slots, and only if their lock is free.
+    const int home = HomeShard();
+    for (int i = 0; i < kNumTransferShards; i++) {
+      const int index = (home + i) % kNumTransferShards;
+      TransferShard* shard = &shards_[index];
+      if (i == 0) {
+        shard->lock.Lock();
+        if (!MakeCacheSpace(index)) {
+          shard->lock.Unlock();
+          continue;
+        }
+      } else {
+        if (shard->used_slots >= shard->cache_size || !shard->lock.TryLock()) {
+          continue;
+        }
+        if (shard->used_slots >= shard->cache_size) {
+          shard->lock.Unlock();
+          continue;
+        }
+      }
+      int slot = shard->used_slots++;
+      ASSERT(slot >=0);
+      ASSERT(slot < shard->max_cache_size);
+      TCEntry *entry = &shard->slots[slot];
+      entry->head = start;
+      entry->tail = end;
+      shard->lock.Unlock();
+      return;
+    }
   }
+
+  SpinLockHolder h(&lock_);
   ReleaseListToSpans(start);
 }
 
 int CentralFreeList::RemoveRange(void **start, void **end, int N) {
   ASSERT(N > 0);
-  lock_.Lock();
-  if (N == Static::sizemap()->num_objects_to_move(size_class_) &&
-      used_slots_ > 0) {
-    int slot = --used_slots_;
-    ASSERT(slot >= 0);
-    TCEntry *entry = &tc_slots_[slot];
-    *start = entry->head;
-    *end = entry->tail;
-    lock_.Unlock();
-    return N;
+  if (N == Static::sizemap()->num_objects_to_move(size_class_)) {
+    const int home = HomeShard();
+    for (int i = 0; i < kNumTransferShards; i++) {
+      TransferShard* shard = &shards_[(home + i) % kNumTransferShards];
+      // Peek without lock first. And don't wait for other shards'
+      // locks, it is cheaper to go to spans then.
+      if (shard->used_slots == 0) {
+        continue;
+      }
+      if (i == 0) {
+        shard->lock.Lock();
+      } else if (!shard->lock.TryLock()) {
+        continue;
+      }
+      if (shard->used_slots > 0) {
+        int slot = --shard->used_slots;
+        ASSERT(slot >= 0);
+        TCEntry *entry = &shard->slots[slot];
+        *start = entry->head;
+        *end = entry->tail;
+        shard->lock.Unlock();
+        return N;
+      }
+      shard->lock.Unlock();
+    }
   }
 
+  lock_.Lock();
   int result = 0;
   *start = NULL;
   *end = NULL;
@@ -311,7 +431,7 @@ void CentralFreeList::Populate() {
   lock_.Unlock();
   const size_t npages = Static::sizemap()->class_to_pages(size_class_);
 
-  Span* span = Static::pageheap()->NewWithSizeClass(npages, size_class_);
+  Span* span = Static::pageheap()->NewWithSizeClass(npages, size_class_, node_);
   if (span == nullptr) {
     Log(kLog, __FILE__, __LINE__,
         "tcmalloc: allocation failed", npages << kPageShift);
@@ -377,8 +497,12 @@ void CentralFreeList::Populate() {
 }
 
 int CentralFreeList::tc_length() {
-  SpinLockHolder h(&lock_);
-  return used_slots_ * Static::sizemap()->num_objects_to_move(size_class_);
+  int used_slots = 0;
+  for (TransferShard& shard : shards_) {
+    SpinLockHolder h(&shard.lock);
+    used_slots += shard.used_slots;
+  }
+  return used_slots * Static::sizemap()->num_objects_to_move(size_class_);
 }
 
 size_t CentralFreeList::OverheadBytes() {
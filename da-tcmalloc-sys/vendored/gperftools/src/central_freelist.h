@@ -49,12 +49,16 @@ class CACHELINE_ALIGNED CentralFreeList {
  public:
   constexpr CentralFreeList() {}
 
-  void Init(size_t cl);
+  // Sets up free list of size class 'cl' for memory node 'node' (0
+  // unless in NUMA mode).
+  void Init(size_t cl, int node);
 
   // These methods all do internal locking.
 
   // Insert the specified range into the central freelist.  N is the number of
   // elements in the range.  RemoveRange() is the opposite operation.
+  // In NUMA mode objects of other memory nodes are handed to free
+  // lists of those nodes, so that transfer cache only has local ones.
   void InsertRange(void *start, void *end, int N);
 
   // Returns the actual number of fetched elements and sets *start and *end.
@@ -75,14 +79,20 @@ class CACHELINE_ALIGNED CentralFreeList {
   // page full of 5-byte objects would have 2 bytes memory overhead).
   size_t OverheadBytes();
 
-  // Lock/Unlock the internal SpinLock. Used on the pthread_atfork call
-  // to set the lock in a consistent state before the fork.
+  // Lock/Unlock the internal SpinLocks. Used on the pthread_atfork call
+  // to set the locks in a consistent state before the fork.
   void Lock() EXCLUSIVE_LOCK_FUNCTION(lock_) {
+    for (TransferShard& shard : shards_) {
+      shard.lock.Lock();
+    }
     lock_.Lock();
   }
 
   void Unlock() UNLOCK_FUNCTION(lock_) {
     lock_.Unlock();
+    for (TransferShard& shard : shards_) {
+      shard.lock.Unlock();
+    }
   }
 
  private:
@@ -107,6 +117,42 @@ class CACHELINE_ALIGNED CentralFreeList {
   static const int kMaxNumTransferEntries = 64;
 #endif
 
+  // Transfer cache is split into shards, each with it's own lock, so
+  // that batch hand-offs done on different CPUs don't serialize on a
+  // single lock. Threads start at the shard of CPU they're running on
+  // and probe other shards before going to spans, so producer and
+  // consumer on different CPUs still hand batches to each other.
+#ifdef TCMALLOC_SMALL_BUT_SLOW
+  static const int kNumTransferShards = 1;
+#else
+  static const int kNumTransferShards = 8;
+#endif
+  static const int kMaxEntriesPerShard = kMaxNumTransferEntries / kNumTransferShards;
+
+  struct CACHELINE_ALIGNED TransferShard {
+    constexpr TransferShard() {}
+
+    // Protects all fields below. Never held together with another
+    // shard's lock. May be held while taking lock_, but not the other
+    // way around.
+    SpinLock lock;
+
+    // Number of currently used cached entries in slots.  This variable
+    // is updated under a lock but can be read without one.
+    int32_t used_slots{};
+    // The current number of slots for this shard.  This is an
+    // adaptive value that is increased if there is lots of traffic
+    // on a given size class.
+    int32_t cache_size{};
+    // Maximum size of the cache for this shard.
+    int32_t max_cache_size{};
+
+    TCEntry slots[kMaxEntriesPerShard];
+  };
+
+  // Returns index of shard that current thread should try first.
+  static int HomeShard();
+
   // REQUIRES: lock_ is held
   // Remove object from cache and return.
   // Return NULL if no free entries in cache.
@@ -118,6 +164,14 @@ class CACHELINE_ALIGNED CentralFreeList {
   // NULL on allocation failure.
   int FetchFromOneSpansSafe(int N, void **start, void **end) EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
+  // Does InsertRange for objects that all belong to our memory node.
+  void InsertLocalRange(void *start, void *end, int N);
+
+  // Hands objects of given list that belong to other memory nodes to
+  // free lists of those nodes. Updates the list to only have our
+  // objects, and returns how many there are.
+  int HandOffForeign(void **start, void **end, int N);
+
   // REQUIRES: lock_ is held
   // Release a linked list of objects to spans.
   // May temporarily release lock_.
@@ -133,34 +187,36 @@ class CACHELINE_ALIGNED CentralFreeList {
   // May temporarily release lock_.
   void Populate() EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
-  // REQUIRES: lock is held.
-  // Tries to make room for a TCEntry.  If the cache is full it will try to
-  // expand it at the cost of some other cache size.  Return false if there is
-  // no space.
-  bool MakeCacheSpace() EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  // REQUIRES: lock of shards_[shard] is held.
+  // Tries to make room for a TCEntry in given shard.  If the shard is
+  // full it will try to expand it at the cost of some other cache
+  // size.  Return false if there is no space.
+  bool MakeCacheSpace(int shard);
 
-  // REQUIRES: lock_ for locked_size_class is held.
+  // REQUIRES: lock of shard 'locked_shard' is held.
   // Picks a "random" size class to steal TCEntry slot from.  In reality it
   // just iterates over the sizeclasses but does so without taking a lock.
+  // Slot is stolen from the same shard index of the same memory node.
   // Returns true on success.
-  // May temporarily lock a "random" size class.
-  static bool EvictRandomSizeClass(int locked_size_class, bool force);
-
-  // REQUIRES: lock_ is *not* held.
-  // Tries to shrink the Cache.  If force is true it will relase objects to
-  // spans if it allows it to shrink the cache.  Return false if it failed to
-  // shrink the cache.  Decrements cache_size_ on succeess.
-  // May temporarily take lock_.  If it takes lock_, the locked_size_class
-  // lock is released to keep the thread from holding two size class locks
+  // May temporarily lock a "random" size class's shard.
+  bool EvictRandomSizeClass(int locked_shard, bool force);
+
+  // REQUIRES: lock of shards_[shard] is *not* held.
+  // Tries to shrink the shard.  If force is true it will relase objects to
+  // spans if it allows it to shrink the shard.  Return false if it failed to
+  // shrink the shard.  Decrements cache_size on succeess.
+  // May temporarily take shard lock.  If it does, the locked_size_class
+  // shard lock is released to keep the thread from holding two shard locks
   // concurrently which could lead to a deadlock.
-  bool ShrinkCache(int locked_size_class, bool force) LOCKS_EXCLUDED(lock_);
+  bool ShrinkCache(int locked_size_class, int shard, bool force);
 
-  // This lock protects all the data members.  cached_entries and cache_size_
-  // may be looked at without holding the lock.
+  // This lock protects span lists and counters below. Transfer cache
+  // shards have their own locks.
   SpinLock lock_;
 
   // We keep linked lists of empty and non-empty spans.
   size_t   size_class_{};   // My size class
+  int      node_{};         // Memory node my spans come from
   Span     empty_;          // Dummy header for list of empty spans
   Span     nonempty_;       // Dummy header for list of non-empty spans
   size_t   num_spans_{};    // Number of spans in empty_ plus nonempty_
@@ -171,17 +227,7 @@ class CACHELINE_ALIGNED CentralFreeList {
   // accumulate.  Not all size classes are allowed to accumulate
   // kMaxNumTransferEntries, so there is some wasted space for those size
   // classes.
-  TCEntry tc_slots_[kMaxNumTransferEntries];
-
-  // Number of currently used cached entries in tc_slots_.  This variable is
-  // updated under a lock but can be read without one.
-  int32_t used_slots_{};
-  // The current number of slots for this size class.  This is an
-  // adaptive value that is increased if there is lots of traffic
-  // on a given size class.
-  int32_t cache_size_{};
-  // Maximum size of the cache for a given size class.
-  int32_t max_cache_size_{};
+  TransferShard shards_[kNumTransferShards];
 };
 
 }  // namespace tcmalloc
@@ -34,6 +34,7 @@
 #include "config.h"
 
 #include <stdlib.h> // for strtol
+#include <string.h> // for memset
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -41,6 +42,7 @@
 #include <algorithm>
 
 #include "common.h"
+#include "static_vars.h"
 #include "system-alloc.h"
 #include "base/spinlock.h"
 #include "base/commandlineflags.h"
@@ -68,7 +70,7 @@ static inline void InitTCMallocTransferNumObjects()
 
 // Note: the following only works for "n"s that fit in 32-bits, but
 // that is fine since we only use it for small sizes.
-static inline int LgFloor(size_t n) {
+static constexpr int LgFloor(size_t n) {
   int log = 0;
   for (int i = 4; i >= 0; --i) {
     int shift = (1 << i);
@@ -82,7 +84,7 @@ static inline int LgFloor(size_t n) {
   return log;
 }
 
-static int AlignmentForSize(size_t size) {
+static constexpr int AlignmentForSize(size_t size) {
   int alignment = kAlignment;
   if (size > kMaxSize) {
     // Cap alignment at kPageSize for large sizes.
@@ -104,7 +106,7 @@ static int AlignmentForSize(size_t size) {
   return alignment;
 }
 
-int SizeMap::NumMoveSize(size_t size) {
+constexpr int SizeMap::NumMoveSize(size_t size, int transfer_num_objects) {
   if (size == 0) return 0;
   // Use approx 64k transfers between thread and central caches.
   int num = static_cast<int>(64.0 * 1024.0 / size);
@@ -120,16 +122,13 @@ int SizeMap::NumMoveSize(size_t size) {
   // - We go to the central freelist too often and we have to acquire
   //   its lock each time.
   // This value strikes a balance between the constraints above.
-  if (num > FLAGS_tcmalloc_transfer_num_objects)
-    num = FLAGS_tcmalloc_transfer_num_objects;
+  if (num > transfer_num_objects)
+    num = transfer_num_objects;
 
   return num;
 }
 
-// Initialize the mapping arrays
-void SizeMap::Init() {
-  InitTCMallocTransferNumObjects();
-
+void SizeMap::InitMinSpanSize() {
 #if (!defined(_WIN32) || defined(TCMALLOC_BRAVE_EFFECTIVE_PAGE_SIZE)) && !defined(TCMALLOC_COWARD_EFFECTIVE_PAGE_SIZE)
   size_t native_page_size = tcmalloc::commandlineflags::StringToLongLong(
     TCMallocGetenvSafe("TCMALLOC_OVERRIDE_PAGESIZE"), getpagesize());
@@ -154,17 +153,29 @@ void SizeMap::Init() {
   }
 
   min_span_size_in_pages_ = min_span_size / kPageSize;
+}
 
-  // Do some sanity checking on add_amount[]/shift_amount[]/class_array[]
-  if (ClassIndex(0) != 0) {
-    Log(kCrash, __FILE__, __LINE__,
-        "Invalid class index for size 0", ClassIndex(0));
-  }
-  if (ClassIndex(kMaxSize) >= sizeof(class_array_)) {
-    Log(kCrash, __FILE__, __LINE__,
-        "Invalid class index for kMaxSize", ClassIndex(kMaxSize));
-  }
+// Returns the span size in pages for objects of given size, moved
+// objects_to_move at a time.
+constexpr size_t SizeMap::PagesForSize(size_t size, int objects_to_move) {
+  const size_t min_span_size = min_span_size_in_pages_ << kPageShift;
+  int blocks_to_move = objects_to_move / 4;
+  size_t psize = 0;
+  do {
+    psize += min_span_size;
+    // Allocate enough pages so leftover is less than 1/8 of total.
+    // This bounds wasted space to at most 12.5%.
+    while ((psize % size) > (psize >> 3)) {
+      psize += min_span_size;
+    }
+    // Continue to add pages until there are at least as many objects in
+    // the span as are needed when moving objects from the central
+    // freelists and spans to the thread caches.
+  } while ((psize / size) < (blocks_to_move));
+  return psize >> kPageShift;
+}
 
+constexpr void SizeMap::InitDefaultClasses(int transfer_num_objects) {
   // Compute the size classes we want to use
   int sc = 1;   // Next size class to assign
   int alignment = kAlignment;
@@ -173,20 +184,7 @@ void SizeMap::Init() {
     alignment = AlignmentForSize(size);
     CHECK_CONDITION((size % alignment) == 0);
 
-    int blocks_to_move = NumMoveSize(size) / 4;
-    size_t psize = 0;
-    do {
-      psize += min_span_size;
-      // Allocate enough pages so leftover is less than 1/8 of total.
-      // This bounds wasted space to at most 12.5%.
-      while ((psize % size) > (psize >> 3)) {
-        psize += min_span_size;
-      }
-      // Continue to add pages until there are at least as many objects in
-      // the span as are needed when moving objects from the central
-      // freelists and spans to the thread caches.
-    } while ((psize / size) < (blocks_to_move));
-    const size_t my_pages = psize >> kPageShift;
+    const size_t my_pages = PagesForSize(size, NumMoveSize(size, transfer_num_objects));
 
     if (sc > 1 && my_pages == class_to_pages_[sc-1]) {
       // See if we can merge this into the previous class without
@@ -212,6 +210,120 @@ void SizeMap::Init() {
         "too many size classes: (found vs. max)", sc, kClassSizesMax);
   }
 
+  InitClassArray();
+
+  // Our fast-path aligned allocation functions rely on 'naturally
+  // aligned' sizes to produce aligned addresses. Lets check if that
+  // holds for size classes that we produced.
+  CHECK_CONDITION(SizesNaturallyAligned());
+
+  // Initialize the num_objects_to_move array.
+  for (size_t cl = 1; cl  < num_size_classes; ++cl) {
+    num_objects_to_move_[cl] = NumMoveSize(ByteSizeForClass(cl), transfer_num_objects);
+  }
+}
+
+static bool ParseSpecNumber(const char** p, size_t* value) {
+  // strtoul would also skip spaces and accept signs.
+  if (**p < '0' || **p > '9') {
+    return false;
+  }
+  char* end;
+  *value = strtoul(*p, &end, 10);
+  *p = end;
+  return true;
+}
+
+const char* SizeMap::InitClassesFromSpec(const char* spec) {
+  int sc = 1;
+  size_t prev_size = 0;
+  const char* p = spec;
+  for (;;) {
+    if (sc >= kClassSizesMax) {
+      return "too many size classes";
+    }
+
+    size_t size, pages = 0, objects_to_move = 0;
+    if (!ParseSpecNumber(&p, &size)) {
+      return "expected size";
+    }
+    if (*p == ':') {
+      p++;
+      if (!ParseSpecNumber(&p, &pages)) {
+        return "expected pages";
+      }
+      if (*p == ':') {
+        p++;
+        if (!ParseSpecNumber(&p, &objects_to_move)) {
+          return "expected objects_to_move";
+        }
+      }
+    }
+    if (*p != ',' && *p != '\0') {
+      return "unexpected character";
+    }
+
+    if (size <= prev_size) {
+      return "sizes are not increasing";
+    }
+    if (size > kMaxSize) {
+      return "size above kMaxSize";
+    }
+    if (size % kAlignment != 0 || (size >= kMinAlign && size % kMinAlign != 0)) {
+      return "size is not a multiple of minimal alignment";
+    }
+    // class_array_ has 128 byte granularity past kMaxSmallSize.
+    if (size > kMaxSmallSize && size % 128 != 0) {
+      return "size above 1024 is not a multiple of 128";
+    }
+
+    if (objects_to_move == 0) {
+      objects_to_move = NumMoveSize(size, FLAGS_tcmalloc_transfer_num_objects);
+    } else if (objects_to_move > kMaxDynamicFreeListLength) {
+      return "objects_to_move above kMaxDynamicFreeListLength";
+    }
+
+    if (pages == 0) {
+      pages = PagesForSize(size, objects_to_move);
+    } else if (pages % min_span_size_in_pages_ != 0) {
+      return "pages is not a multiple of system page size";
+    }
+    if (pages > kMaxPages) {
+      return "pages above kMaxPages";
+    }
+    const size_t objects_per_span = (pages << kPageShift) / size;
+    if (objects_per_span == 0) {
+      return "span cannot hold a single object";
+    }
+    // Span::refcount counts allocated objects in 16 bits.
+    if (objects_per_span > 0xffff) {
+      return "span holds too many objects";
+    }
+
+    class_to_size_[sc] = size;
+    class_to_pages_[sc] = pages;
+    num_objects_to_move_[sc] = objects_to_move;
+    sc++;
+    prev_size = size;
+
+    if (*p == '\0') {
+      break;
+    }
+    p++;
+  }
+  if (prev_size != kMaxSize) {
+    return "last size is not kMaxSize";
+  }
+  num_size_classes = sc;
+
+  InitClassArray();
+  if (!SizesNaturallyAligned()) {
+    return "size classes are not naturally aligned";
+  }
+  return NULL;
+}
+
+constexpr void SizeMap::InitClassArray() {
   // Initialize the mapping arrays
   int next_size = 0;
   for (int c = 1; c < num_size_classes; c++) {
@@ -244,28 +356,85 @@ void SizeMap::Init() {
       size += 128;
     }
   }
+}
 
-  // Our fast-path aligned allocation functions rely on 'naturally
-  // aligned' sizes to produce aligned addresses. Lets check if that
-  // holds for size classes that we produced.
-  //
-  // I.e. we're checking that
-  //
-  // align = (1 << shift), malloc(i * align) % align == 0,
-  //
-  // for all align values up to kPageSize.
+// Checks that
+//
+// align = (1 << shift), malloc(i * align) % align == 0,
+//
+// for all align values up to kPageSize.
+constexpr bool SizeMap::SizesNaturallyAligned() {
   for (size_t align = kMinAlign; align <= kPageSize; align <<= 1) {
     for (size_t size = align; size < kPageSize; size += align) {
-      CHECK_CONDITION(class_to_size_[SizeClass(size)] % align == 0);
+      if (class_to_size_[SizeClass(size)] % align != 0) {
+        return false;
+      }
     }
   }
+  return true;
+}
 
-  // Initialize the num_objects_to_move array.
-  for (size_t cl = 1; cl  < num_size_classes; ++cl) {
-    num_objects_to_move_[cl] = NumMoveSize(ByteSizeForClass(cl));
+constexpr SizeMap SizeMap::Default() {
+  // Do some sanity checking on add_amount[]/shift_amount[]/class_array[]
+  static_assert(ClassIndex(0) == 0, "Invalid class index for size 0");
+  static_assert(ClassIndex(kMaxSize) < kClassArraySize,
+                "Invalid class index for kMaxSize");
+
+  SizeMap map;
+  map.min_span_size_in_pages_ = 1;
+  map.InitDefaultClasses(kDefaultTransferNumObjecs);
+  return map;
+}
+
+// Defined here, where Default() can be evaluated. Being constexpr,
+// kDefaultSizeMap is computed by the compiler, so sizemap_ starts out
+// as plain data in the binary and needs no work at startup.
+static constexpr SizeMap kDefaultSizeMap = SizeMap::Default();
+SizeMap Static::sizemap_ = kDefaultSizeMap;
+
+// Programs define a strong version of this to pick their own size
+// classes, see malloc_extension_c.h.
+extern "C" ATTRIBUTE_WEAK ATTRIBUTE_NOINLINE
+const char* tc_size_classes_override(void) {
+  return NULL;
+}
+
+// Initialize the mapping arrays
+void SizeMap::Init() {
+  InitTCMallocTransferNumObjects();
+  InitMinSpanSize();
+
+  const char* source = "TCMALLOC_SIZE_CLASSES:";
+  const char* spec = TCMallocGetenvSafe("TCMALLOC_SIZE_CLASSES");
+  if (spec == NULL || *spec == '\0') {
+    source = "tc_size_classes_override():";
+    spec = tc_size_classes_override();
+  }
+  if (spec != NULL && *spec != '\0') {
+    const char* error = InitClassesFromSpec(spec);
+    if (error == NULL) {
+      custom_ = true;
+      return;
+    }
+    Log(kLog, __FILE__, __LINE__, "Ignoring invalid", source, error);
+    // The spec may have been partly applied.
+    InitDefaultClasses(FLAGS_tcmalloc_transfer_num_objects);
+    return;
+  }
+
+  if (min_span_size_in_pages_ != kDefaultSizeMap.min_span_size_in_pages_ ||
+      FLAGS_tcmalloc_transfer_num_objects != kDefaultTransferNumObjecs) {
+    InitDefaultClasses(FLAGS_tcmalloc_transfer_num_objects);
   }
 }
 
+const char* SizeMap::CheckSpec(const char* spec) {
+  InitTCMallocTransferNumObjects();
+  SizeMap map;
+  map.InitMinSpanSize();
+  return map.InitClassesFromSpec(spec);
+}
+
 // Metadata allocator -- keeps stats about how many bytes allocated.
 static uint64_t metadata_system_bytes_ = 0;
 static const size_t kMetadataAllocChunkSize = 8*1024*1024;
@@ -275,15 +444,20 @@ static const size_t kMetadataAllignment = sizeof(MemoryAligner);
 
 static char *metadata_chunk_alloc_;
 static size_t metadata_chunk_avail_;
+// Whether the rest of the current chunk reads as zeros. Metadata is
+// never freed, so this holds until a new chunk is taken.
+static bool metadata_chunk_zeroed_;
 
 static SpinLock metadata_alloc_lock;
 
-void* MetaDataAlloc(size_t bytes) {
+// Sets *zeroed to whether the returned memory reads as zeros.
+static void* MetaDataAllocImpl(size_t bytes, bool* zeroed) {
   if (bytes >= kMetadataAllocChunkSize) {
     void *rv = TCMalloc_SystemAlloc(bytes,
                                     NULL, kMetadataAllignment);
     if (rv != NULL) {
       metadata_system_bytes_ += bytes;
+      *zeroed = TCMalloc_SystemAllocZeroes();
     }
     return rv;
   }
@@ -307,6 +481,7 @@ void* MetaDataAlloc(size_t bytes) {
 
     metadata_chunk_alloc_ = static_cast<char *>(ptr);
     metadata_chunk_avail_ = real_size;
+    metadata_chunk_zeroed_ = TCMalloc_SystemAllocZeroes();
 
     alignment = 0;
   }
@@ -316,6 +491,23 @@ void* MetaDataAlloc(size_t bytes) {
   metadata_chunk_alloc_ += bytes;
   metadata_chunk_avail_ -= bytes;
   metadata_system_bytes_ += bytes;
+  *zeroed = metadata_chunk_zeroed_;
+  return rv;
+}
+
+void* MetaDataAlloc(size_t bytes) {
+  bool zeroed;
+  return MetaDataAllocImpl(bytes, &zeroed);
+}
+
+void* MetaDataAllocZeroed(size_t bytes) {
+  bool zeroed;
+  void* rv = MetaDataAllocImpl(bytes, &zeroed);
+  // Memory fresh from the system is left alone, so pages of large
+  // tables that are never written are never faulted in.
+  if (rv != NULL && !zeroed) {
+    memset(rv, 0, bytes);
+  }
   return rv;
 }
 
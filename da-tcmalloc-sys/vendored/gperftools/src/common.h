@@ -86,6 +86,13 @@ static const size_t kAlignment  = 8;
 // For all span-lengths <= kMaxPages we keep an exact-size list in PageHeap.
 static const size_t kMaxPages = 1 << (20 - kPageShift);
 
+// Transparent huge pages are 2 MiB on x86-64 and on arm64 with 4K
+// base pages. Hugepage aware page heap grows and releases memory in
+// such units.
+static const size_t kHugePageShift = 21;
+static const size_t kHugePageSize = 1 << kHugePageShift;
+static const Length kPagesPerHugePage = 1 << (kHugePageShift - kPageShift);
+
 // Default bound on the total amount of thread caches.
 #ifdef TCMALLOC_SMALL_BUT_SLOW
 // Make the overall thread cache no bigger than that of a single thread
@@ -177,13 +184,13 @@ class SizeMap {
   static const int kMaxSmallSize = 1024;
   static const size_t kClassArraySize =
       ((kMaxSize + 127 + (120 << 7)) >> 7) + 1;
-  unsigned char class_array_[kClassArraySize];
+  unsigned char class_array_[kClassArraySize] = {};
 
-  static inline size_t SmallSizeClass(size_t s) {
+  static constexpr size_t SmallSizeClass(size_t s) {
     return (static_cast<uint32_t>(s) + 7) >> 3;
   }
 
-  static inline size_t LargeSizeClass(size_t s) {
+  static constexpr size_t LargeSizeClass(size_t s) {
     return (static_cast<uint32_t>(s) + 127 + (120 << 7)) >> 7;
   }
 
@@ -203,7 +210,7 @@ class SizeMap {
   }
 
   // Compute index of the class_array[] entry for a given size
-  static inline size_t ClassIndex(size_t s) {
+  static constexpr size_t ClassIndex(size_t s) {
     // Use unsigned arithmetic to avoid unnecessary sign extensions.
     ASSERT(0 <= s);
     ASSERT(s <= kMaxSize);
@@ -219,29 +226,60 @@ class SizeMap {
   // amortize the lock overhead for accessing the central list.  Making
   // it too big may temporarily cause unnecessary memory wastage in the
   // per-thread free list until the scavenger cleans up the list.
-  int num_objects_to_move_[kClassSizesMax];
+  int num_objects_to_move_[kClassSizesMax] = {};
 
-  int NumMoveSize(size_t size);
+  // Number of objects to move at a time for objects of given size,
+  // capped at transfer_num_objects (TCMALLOC_TRANSFER_NUM_OBJ).
+  static constexpr int NumMoveSize(size_t size, int transfer_num_objects);
 
   // Mapping from size class to max size storable in that class
-  int32_t class_to_size_[kClassSizesMax];
+  int32_t class_to_size_[kClassSizesMax] = {};
 
   // Mapping from size class to number of pages to allocate at a time
-  size_t class_to_pages_[kClassSizesMax];
+  size_t class_to_pages_[kClassSizesMax] = {};
+
+  size_t min_span_size_in_pages_ = 0;
 
-  size_t min_span_size_in_pages_;
+  // True iff size classes came from TCMALLOC_SIZE_CLASSES or
+  // tc_size_classes_override().
+  bool custom_ = false;
+
+  void InitMinSpanSize();
+  constexpr size_t PagesForSize(size_t size, int objects_to_move);
+  constexpr void InitDefaultClasses(int transfer_num_objects);
+  const char* InitClassesFromSpec(const char* spec);
+  constexpr void InitClassArray();
+  constexpr bool SizesNaturallyAligned();
 
 public:
-  size_t num_size_classes;
+  size_t num_size_classes = 0;
+
+  constexpr SizeMap() { }
 
-  // Constructor should do nothing since we rely on explicit Init()
-  // call, which may or may not be called before the constructor runs.
-  SizeMap() { }
+  // Default size classes, for system pages no larger than kPageSize
+  // and default TCMALLOC_TRANSFER_NUM_OBJ. Static::sizemap_ is
+  // initialized with these at compile time.
+  static constexpr SizeMap Default();
 
-  // Initialize the mapping arrays
+  // Initialize the mapping arrays. Size classes are computed from
+  // the built-in formula, unless TCMALLOC_SIZE_CLASSES, or else
+  // tc_size_classes_override(), gives a valid custom table (see
+  // CheckSpec). Default() tables are kept as they are when they
+  // apply.
   void Init();
 
-  inline int SizeClass(size_t size) {
+  // Checks a custom size class table. Spec is a comma separated list
+  // of "size[:pages[:objects_to_move]]" entries, one per size class,
+  // in increasing size order, the last one being kMaxSize. Omitted
+  // pages and objects_to_move are computed as for built-in classes.
+  // Returns NULL if spec is usable, otherwise a description of the
+  // first problem found.
+  static const char* CheckSpec(const char* spec);
+
+  // True iff size classes came from a custom table.
+  bool custom() { return custom_; }
+
+  constexpr int SizeClass(size_t size) {
     return class_array_[ClassIndex(size)];
   }
 
@@ -258,7 +296,7 @@ public:
   }
 
   // Get the byte-size for a specified class
-  ALWAYS_INLINE int32_t ByteSizeForClass(uint32_t cl) {
+  ALWAYS_INLINE constexpr int32_t ByteSizeForClass(uint32_t cl) {
     return class_to_size_[cl];
   }
 
@@ -293,6 +331,9 @@ public:
 // fails.  Requires pageheap_lock is held.
 void* MetaDataAlloc(size_t bytes);
 
+// Like MetaDataAlloc, but the returned memory is zero-filled.
+void* MetaDataAllocZeroed(size_t bytes);
+
 // Returns the total number of bytes allocated from the system.
 // Requires pageheap_lock is held.
 uint64_t metadata_system_bytes();
@@ -0,0 +1,529 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include "cpu_cache.h"
+
+#include <sched.h>
+
+#include <algorithm>
+#include <new>
+
+#ifdef TCMALLOC_HAVE_RSEQ_CS
+#include <linux/membarrier.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "central_freelist.h"
+#include "internal_logging.h"
+#include "linked_list.h"
+#include "static_vars.h"
+
+namespace tcmalloc {
+
+// Capacity of any single size class grows up to that many batches
+// (as in SizeMap::num_objects_to_move).
+static const int kMaxBatchesPerList = 4;
+
+bool CpuCache::supported_;
+std::atomic<bool> CpuCache::active_;
+SpinLock CpuCache::create_lock_;
+std::atomic<CpuCache*> CpuCache::caches_[kMaxCpus];
+
+#ifdef TCMALLOC_HAVE_RSEQ_CS
+
+// Older kernel headers lack these.
+#ifndef MEMBARRIER_CMD_FLAG_CPU
+#define MEMBARRIER_CMD_FLAG_CPU (1 << 0)
+#endif
+#ifndef MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ
+#define MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ (1 << 7)
+#define MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ (1 << 8)
+#endif
+
+static_assert(offsetof(struct rseq, cpu_id) == 4, "cpu_id offset is hardcoded below");
+static_assert(offsetof(struct rseq, rseq_cs) == 8, "rseq_cs offset is hardcoded below");
+static_assert(RSEQ_SIG == 0x53053053, "RSEQ_SIG is hardcoded below");
+
+// Restartable sequence runs from label 1 to label 2, where it commits
+// with its final instruction, and is described by struct rseq_cs at
+// label 3. Kernel resumes at label 4 instead if the sequence got
+// interrupted, which has to be preceded by RSEQ_SIG. We jump to
+// 'abort' from there. Sequence bails out early if we no longer run on
+// %[cpu]. %[rseq] holds __rseq_offset. Clobbers rax.
+#define RSEQ_BEGIN                                              \
+  ".pushsection __rseq_cs, \"aw\"\n\t"                          \
+  ".balign 32\n\t"                                              \
+  "3:\n\t"                                                      \
+  ".long 0, 0\n\t"                                              \
+  ".quad 1f, 2f - 1f, 4f\n\t"                                   \
+  ".popsection\n\t"                                             \
+  "leaq 3b(%%rip), %%rax\n\t"                                   \
+  "movq %%rax, %%fs:8(%[rseq])\n\t"                             \
+  "1:\n\t"                                                      \
+  "cmpl %[cpu], %%fs:4(%[rseq])\n\t"                            \
+  "jnz 4f\n\t"
+
+#define RSEQ_END                                                \
+  "2:\n\t"                                                      \
+  ".pushsection __rseq_failure, \"ax\"\n\t"                     \
+  ".byte 0x0f, 0xb9, 0x3d\n\t"                                  \
+  ".long 0x53053053\n\t"                                        \
+  "4:\n\t"                                                      \
+  "jmp %l[abort]\n\t"                                           \
+  ".popsection\n\t"
+
+void* CpuCache::TryPop(uint32_t cl) {
+  void* result;
+  asm goto(
+    RSEQ_BEGIN
+    "cmpl $0, (%[lock])\n\t"
+    "jnz %l[abort]\n\t"
+    "movq (%[word]), %%rcx\n\t"
+    "movq %%rcx, %%rdx\n\t"
+    "shlq $16, %%rdx\n\t"
+    "shrq $16, %%rdx\n\t"
+    "jz %l[abort]\n\t"
+    "movq %%rdx, (%[result])\n\t"
+    "movq (%%rdx), %%rdx\n\t"
+    "shrq $48, %%rcx\n\t"
+    "decq %%rcx\n\t"
+    "shlq $48, %%rcx\n\t"
+    "orq %%rdx, %%rcx\n\t"
+    "movq %%rcx, (%[word])\n\t"
+    RSEQ_END
+    :
+    : [rseq] "r"(__rseq_offset), [cpu] "r"(cpu_), [lock] "r"(&lock_),
+      [word] "r"(&list_[cl].word), [result] "r"(&result)
+    : "memory", "cc", "rax", "rcx", "rdx"
+    : abort);
+  return result;
+abort:
+  return nullptr;
+}
+
+bool CpuCache::TryPush(uint32_t cl, void* ptr) {
+  asm goto(
+    RSEQ_BEGIN
+    "cmpl $0, (%[lock])\n\t"
+    "jnz %l[abort]\n\t"
+    "movq (%[word]), %%rcx\n\t"
+    "movq %%rcx, %%rdx\n\t"
+    "shrq $48, %%rdx\n\t"
+    "cmpl (%[max_length]), %%edx\n\t"
+    "jae %l[abort]\n\t"
+    "shlq $16, %%rcx\n\t"
+    "shrq $16, %%rcx\n\t"
+    "movq %%rcx, (%[ptr])\n\t"
+    "incq %%rdx\n\t"
+    "shlq $48, %%rdx\n\t"
+    "orq %[ptr], %%rdx\n\t"
+    "movq %%rdx, (%[word])\n\t"
+    RSEQ_END
+    :
+    : [rseq] "r"(__rseq_offset), [cpu] "r"(cpu_), [lock] "r"(&lock_),
+      [word] "r"(&list_[cl].word), [max_length] "r"(&max_length_[cl]),
+      [ptr] "r"(ptr)
+    : "memory", "cc", "rax", "rcx", "rdx"
+    : abort);
+  return true;
+abort:
+  return false;
+}
+
+// Once we've locked the cache while running on its CPU, no other
+// sequence can be in flight there. Commit is cmpxchg rather than plain
+// store, so that we don't race with LockCaches.
+bool CpuCache::TryLockOnCpu() {
+  asm goto(
+    RSEQ_BEGIN
+    "xorl %%eax, %%eax\n\t"
+    "movl $1, %%ecx\n\t"
+    "lock cmpxchgl %%ecx, (%[lock])\n\t"
+    RSEQ_END
+    "jnz %l[abort]\n\t"
+    :
+    : [rseq] "r"(__rseq_offset), [cpu] "r"(cpu_), [lock] "r"(&lock_)
+    : "memory", "cc", "rax", "rcx"
+    : abort);
+  return true;
+abort:
+  return false;
+}
+
+static long Membarrier(int cmd, unsigned flags, int cpu) {
+  return syscall(__NR_membarrier, cmd, flags, cpu);
+}
+
+void CpuCache::InitModule(bool enable) {
+  // glibc sets __rseq_size to 0 if it failed to register rseq area
+  // (or was asked not to).
+  supported_ = __rseq_size > 0 && CurrentCpu() >= 0 &&
+    Membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0) == 0;
+  active_.store(enable && supported_, std::memory_order_relaxed);
+}
+
+void CpuCache::LockCaches() NO_THREAD_SAFETY_ANALYSIS {
+  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
+    CpuCache* cache = caches_[cpu].load(std::memory_order_relaxed);
+    if (cache == nullptr) {
+      continue;
+    }
+    // Lock holders don't block, so they are done soon.
+    uint32_t unlocked = 0;
+    while (!cache->lock_.compare_exchange_weak(unlocked, 1, std::memory_order_acquire)) {
+      unlocked = 0;
+      sched_yield();
+    }
+  }
+  // Sequences that started before we locked may still commit. Get
+  // them aborted. Registration done in InitModule is inherited by
+  // forked children, so this can't fail.
+  CHECK_CONDITION(Membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0) == 0);
+}
+
+#else  // !TCMALLOC_HAVE_RSEQ_CS
+
+void* CpuCache::TryPop(uint32_t cl) { return nullptr; }
+bool CpuCache::TryPush(uint32_t cl, void* ptr) { return false; }
+bool CpuCache::TryLockOnCpu() { return false; }
+
+void CpuCache::InitModule(bool enable) {
+}
+
+void CpuCache::LockCaches() {
+}
+
+#endif  // !TCMALLOC_HAVE_RSEQ_CS
+
+void CpuCache::UnlockCaches() {
+  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
+    CpuCache* cache = caches_[cpu].load(std::memory_order_relaxed);
+    if (cache != nullptr) {
+      cache->Unlock();
+    }
+  }
+}
+
+bool CpuCache::SetActive(bool active) {
+  if (active && !supported_) {
+    return false;
+  }
+  active_.store(active, std::memory_order_relaxed);
+  if (!active) {
+    // Threads that saw us active just before may still put some
+    // objects back. They stay cached and counted by GetCpuStats.
+    DrainAll();
+  }
+  return true;
+}
+
+CpuCache* CpuCache::CreateCache(int cpu) {
+  SpinLockHolder h(&create_lock_);
+  CpuCache* cache = caches_[cpu].load(std::memory_order_relaxed);
+  if (cache != nullptr) {
+    return cache;
+  }
+
+  // MetaDataAlloc doesn't honor our cache line alignment, so we over
+  // allocate a bit. Per-CPU caches are never freed.
+  void* mem = MetaDataAlloc(sizeof(CpuCache) + alignof(CpuCache));
+  if (mem == nullptr) {
+    return nullptr;
+  }
+  uintptr_t addr = reinterpret_cast<uintptr_t>(mem);
+  addr = (addr + alignof(CpuCache) - 1) & ~(uintptr_t{alignof(CpuCache)} - 1);
+
+  cache = new (reinterpret_cast<void*>(addr)) CpuCache;
+  cache->lock_.store(0, std::memory_order_relaxed);
+  cache->cpu_ = cpu;
+  cache->next_steal_cl_ = 1;
+  cache->capacity_bytes_ = 0;
+  for (uint32_t cl = 0; cl < kClassSizesMax; ++cl) {
+    cache->list_[cl].word = 0;
+    // Classes we don't use don't take any of kMaxCacheSize.
+    cache->max_length_[cl] = 0;
+  }
+
+  caches_[cpu].store(cache, std::memory_order_release);
+  return cache;
+}
+
+void* CpuCache::Allocate(size_t size, uint32_t cl, void *(*oom_handler)(size_t size)) {
+  ASSERT(size <= kMaxSize);
+  ASSERT(size != 0);
+  ASSERT(size == Static::sizemap()->ByteSizeForClass(cl));
+
+  void* rv = TryPop(cl);
+  if (PREDICT_TRUE(rv != nullptr)) {
+    return rv;
+  }
+  return AllocateSlow(size, cl, oom_handler);
+}
+
+void CpuCache::Deallocate(void* ptr, uint32_t cl) {
+  if (PREDICT_FALSE(!TryPush(cl, ptr))) {
+    DeallocateSlow(ptr, cl);
+  }
+}
+
+// We may have migrated since we've picked our cache, so we start
+// over from current CPU.
+void* CpuCache::AllocateSlow(size_t size, uint32_t cl, void *(*oom_handler)(size_t size)) {
+  void* rv;
+  CpuCache* cache = GetIfActive();
+  if (cache != nullptr && cache->TryLockOnCpu()) {
+    FreeList* list = &cache->list_[cl];
+    void* head = Head(list->word);
+    if (head != nullptr) {
+      rv = head;
+      list->word = Pack(SLL_Next(head), Length(list->word) - 1);
+    } else {
+      rv = cache->FetchFromCentralCache(cl, size);
+    }
+    cache->Unlock();
+  } else {
+    void* end;
+    if (Static::local_central_cache()[cl].RemoveRange(&rv, &end, 1) == 0) {
+      rv = nullptr;
+    }
+  }
+
+  // oom_handler may well call back into malloc, so it is important
+  // that we don't hold our lock here.
+  if (PREDICT_FALSE(rv == nullptr)) {
+    return oom_handler(size);
+  }
+  return rv;
+}
+
+void CpuCache::DeallocateSlow(void* ptr, uint32_t cl) {
+  CpuCache* cache = GetIfActive();
+  if (cache == nullptr || !cache->TryLockOnCpu()) {
+    SLL_SetNext(ptr, nullptr);
+    Static::local_central_cache()[cl].InsertRange(ptr, ptr, 1);
+    return;
+  }
+
+  FreeList* list = &cache->list_[cl];
+  // Same cheap double-free check as in ThreadCache::Deallocate.
+  ASSERT(ptr != Head(list->word));
+
+  if (Length(list->word) >= cache->max_length_[cl] && !cache->Grow(cl)) {
+    if (cache->max_length_[cl] == 0) {
+      cache->Unlock();
+      SLL_SetNext(ptr, nullptr);
+      Static::local_central_cache()[cl].InsertRange(ptr, ptr, 1);
+      return;
+    }
+    cache->ReleaseToCentralCache(cl, Static::sizemap()->num_objects_to_move(cl));
+  }
+  SLL_SetNext(ptr, Head(list->word));
+  list->word = Pack(ptr, Length(list->word) + 1);
+  cache->Unlock();
+}
+
+// Gets batch of objects of class "cl" from central cache, or as
+// many as we have capacity for. Returns first one and keeps the
+// rest. Returns NULL if central cache is out of memory.
+void* CpuCache::FetchFromCentralCache(uint32_t cl, size_t byte_size) {
+  FreeList* list = &list_[cl];
+  ASSERT(Head(list->word) == nullptr);
+  const int batch_size = Static::sizemap()->num_objects_to_move(cl);
+  if (max_length_[cl] < batch_size - 1) {
+    Grow(cl);
+  }
+  const int want = std::min<int>(batch_size, max_length_[cl] + 1);
+
+  void *start, *end;
+  int fetch_count = Static::local_central_cache()[cl].RemoveRange(
+      &start, &end, want);
+  if (fetch_count == 0) {
+    ASSERT(start == NULL);
+    return nullptr;
+  }
+  ASSERT(start != NULL);
+
+  if (--fetch_count > 0) {
+    list->word = Pack(SLL_Next(start), fetch_count);
+  }
+  return start;
+}
+
+// Returns N objects of class "cl" to central cache. In prepackaged
+// chains of num_objects_to_move, like ThreadCache does.
+void CpuCache::ReleaseToCentralCache(uint32_t cl, int N) {
+  FreeList* list = &list_[cl];
+  void* head = Head(list->word);
+  const int length = Length(list->word);
+  if (N > length) N = length;
+
+  const int batch_size = Static::sizemap()->num_objects_to_move(cl);
+  int left = N;
+  while (left > 0) {
+    int count = left < batch_size ? left : batch_size;
+    void *start, *end;
+    SLL_PopRange(&head, count, &start, &end);
+    Static::local_central_cache()[cl].InsertRange(start, end, count);
+    left -= count;
+  }
+  list->word = Pack(head, length - N);
+}
+
+// Adds a batch to capacity of class "cl", unless it is at its limit
+// already. Takes capacity from other classes when we'd exceed
+// kMaxCacheSize. Returns false if capacity didn't grow.
+bool CpuCache::Grow(uint32_t cl) {
+  const uint32_t batch_size = Static::sizemap()->num_objects_to_move(cl);
+  // Length has to fit in 16 bits.
+  const uint32_t limit = std::min<uint32_t>(kMaxBatchesPerList * batch_size, 0xffff);
+  const uint32_t n = std::min(batch_size, limit - std::min(limit, max_length_[cl]));
+  if (n == 0) {
+    return false;
+  }
+  const size_t bytes = size_t{n} * Static::sizemap()->ByteSizeForClass(cl);
+  while (capacity_bytes_ + bytes > kMaxCacheSize) {
+    if (!StealCapacity(cl)) {
+      return false;
+    }
+  }
+  max_length_[cl] += n;
+  capacity_bytes_ += bytes;
+  return true;
+}
+
+// Halves capacity of some class other than "cl", returning objects
+// that no longer fit to central cache. We go round-robin across size
+// classes, continuing where previous call stopped, so that single
+// heavily used class doesn't get drained over and over again. Returns
+// false if no other class has any capacity.
+bool CpuCache::StealCapacity(uint32_t cl) {
+  const uint32_t num_classes = Static::num_size_classes();
+  for (uint32_t i = 1; i < num_classes; ++i) {
+    const uint32_t victim = next_steal_cl_;
+    next_steal_cl_ = (victim + 1 < num_classes) ? victim + 1 : 1;
+    const uint32_t capacity = max_length_[victim];
+    if (victim == cl || capacity == 0) {
+      continue;
+    }
+    const uint32_t new_capacity = capacity / 2;
+    const uint32_t length = Length(list_[victim].word);
+    if (length > new_capacity) {
+      ReleaseToCentralCache(victim, length - new_capacity);
+    }
+    max_length_[victim] = new_capacity;
+    capacity_bytes_ -= size_t{capacity - new_capacity} *
+      Static::sizemap()->ByteSizeForClass(victim);
+    return true;
+  }
+  return false;
+}
+
+// Also gives up all capacity, so that it goes to classes which get
+// used afterwards.
+void CpuCache::Drain() {
+  const uint32_t num_classes = Static::num_size_classes();
+  for (uint32_t cl = 1; cl < num_classes; ++cl) {
+    ReleaseToCentralCache(cl, Length(list_[cl].word));
+    max_length_[cl] = 0;
+  }
+  capacity_bytes_ = 0;
+}
+
+void CpuCache::DrainCurrent() {
+  int cpu = CurrentCpu();
+  if (static_cast<unsigned>(cpu) >= kMaxCpus) {
+    return;
+  }
+  CpuCache* cache = caches_[cpu].load(std::memory_order_acquire);
+  // We don't try hard: if we got migrated, or the cache is busy,
+  // somebody else is using it anyways.
+  if (cache != nullptr && cache->TryLockOnCpu()) {
+    cache->Drain();
+    cache->Unlock();
+  }
+}
+
+void CpuCache::DrainAll() {
+  if (!supported_) {
+    return;
+  }
+  SpinLockHolder h(&create_lock_);
+  LockCaches();
+  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
+    CpuCache* cache = caches_[cpu].load(std::memory_order_relaxed);
+    if (cache != nullptr) {
+      cache->Drain();
+    }
+  }
+  UnlockCaches();
+}
+
+void CpuCache::GetCpuStats(uint64_t* total_bytes, uint64_t* class_count) {
+  if (!supported_) {
+    return;
+  }
+  const uint32_t num_classes = Static::num_size_classes();
+  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
+    CpuCache* cache = caches_[cpu].load(std::memory_order_acquire);
+    if (cache == nullptr) {
+      continue;
+    }
+    for (uint32_t cl = 1; cl < num_classes; ++cl) {
+      const uint32_t length = Length(__atomic_load_n(&cache->list_[cl].word, __ATOMIC_RELAXED));
+      *total_bytes += uint64_t{length} * Static::sizemap()->ByteSizeForClass(cl);
+      if (class_count) {
+        class_count[cl] += length;
+      }
+    }
+  }
+}
+
+void CpuCache::LockAll() NO_THREAD_SAFETY_ANALYSIS {
+  if (!supported_) {
+    return;
+  }
+  create_lock_.Lock();
+  LockCaches();
+}
+
+void CpuCache::UnlockAll() NO_THREAD_SAFETY_ANALYSIS {
+  if (!supported_) {
+    return;
+  }
+  UnlockCaches();
+  create_lock_.Unlock();
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,223 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// cpu_cache.h holds optional per-CPU front-end cache. It is an
+// alternative to ThreadCache for small objects: when it is active
+// (see TCMALLOC_PER_CPU_CACHES and "tcmalloc.per_cpu_caches"
+// property), allocations and deallocations go through cache of the
+// CPU we're currently running on, so amount of memory held in
+// front-end caches scales with number of cores rather than with
+// number of threads. ThreadCache objects are still created, but only
+// for sampling; they hold no free objects unless per-CPU caching was
+// switched on after they were filled.
+//
+// Current CPU is taken from rseq area that glibc registers for every
+// thread. Free lists are pushed to and popped from inside restartable
+// sequences (x86-64 only): kernel restarts the sequence if the thread
+// gets preempted, migrated or signaled before its final store, so a
+// single store commits the change and no atomic instructions are
+// needed. Everything else (refills, releases to central cache,
+// drains) is done under per-CPU lock word, which fast path checks. A
+// thread that finds its CPU's cache locked goes to central cache
+// directly. Taking the lock of another CPU's cache needs
+// membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ) to abort
+// sequences in flight there. When rseq or membarrier isn't available
+// (old kernel or glibc, or registration disabled via
+// glibc.pthread.rseq tunable) we quietly keep using ThreadCache.
+#ifndef TCMALLOC_CPU_CACHE_H_
+#define TCMALLOC_CPU_CACHE_H_
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#if defined(__linux__) && defined(__has_include) && defined(__has_builtin)
+#if __has_include(<sys/rseq.h>) && __has_builtin(__builtin_thread_pointer)
+#include <sys/rseq.h>
+#ifdef RSEQ_SIG
+#define TCMALLOC_HAVE_RSEQ 1
+#if defined(__x86_64__) && __has_include(<linux/membarrier.h>)
+#define TCMALLOC_HAVE_RSEQ_CS 1
+#endif
+#endif
+#endif
+#endif
+
+#include "base/basictypes.h"
+#include "base/spinlock.h"
+#include "common.h"
+
+namespace tcmalloc {
+
+class CpuCache {
+ public:
+  // Upper bound on bytes cached by any single CPU. Each size class
+  // has capacity (in objects) its free list never exceeds, and
+  // capacities of all classes add up to at most that many bytes.
+  // Capacity grows by a batch when list overflows or gets refilled,
+  // taking it from other classes if needed.
+  static constexpr size_t kMaxCacheSize = 1 << 20;
+
+  // Cache is grown lazily for CPUs we actually run on. CPUs with
+  // higher ids are served by ThreadCache.
+  static constexpr int kMaxCpus = 1024;
+
+  // Called once from Static::InitStaticVars. Makes per-CPU caching
+  // active if 'enable' is set and supported.
+  static void InitModule(bool enable);
+
+  static bool IsActive() { return active_.load(std::memory_order_relaxed); }
+
+  // Switches per-CPU caching on or off at runtime. Switching it off
+  // drains all per-CPU caches. Returns false if per-CPU caching is
+  // not supported.
+  static bool SetActive(bool active);
+
+  // Returns CPU we're currently running on, or negative value if it
+  // cannot be obtained cheaply. Works even when per-CPU caching is not
+  // active.
+  static int CurrentCpu();
+
+  // Returns cache of CPU we're currently running on. Returns nullptr
+  // if per-CPU caching is not active or cache cannot be obtained. In
+  // which case ThreadCache has to be used.
+  static CpuCache* GetIfActive();
+
+  // Same contract as ThreadCache::Allocate/Deallocate.
+  void* Allocate(size_t size, uint32_t cl, void *(*oom_handler)(size_t size));
+  void Deallocate(void* ptr, uint32_t cl);
+
+  // Returns all objects cached by current CPU (DrainCurrent) or by
+  // all CPUs (DrainAll) to central cache.
+  // REQUIRES: no tcmalloc locks held.
+  static void DrainCurrent();
+  static void DrainAll();
+
+  // Adds to *total_bytes number of bytes held by all per-CPU caches
+  // and, if class_count is not NULL, increments it's elements by
+  // numbers of cached objects of each size class. Caches are not
+  // locked, so numbers are approximate while other threads allocate.
+  static void GetCpuStats(uint64_t* total_bytes, uint64_t* class_count);
+
+  // Called as part of CentralCacheLockAll/CentralCacheUnlockAll (i.e.
+  // around fork). Per-CPU locks are taken before central cache locks,
+  // so those are acquired first.
+  static void LockAll();
+  static void UnlockAll();
+
+ private:
+  // Head of the list is kept in low 48 bits of 'word' and length in
+  // high 16 bits, so that a single store updates both.
+  struct FreeList {
+    uint64_t word;
+  };
+
+  static constexpr int kLengthShift = 48;
+
+  static void* Head(uint64_t word) {
+    return reinterpret_cast<void*>(word & ((uint64_t{1} << kLengthShift) - 1));
+  }
+  static uint32_t Length(uint64_t word) { return word >> kLengthShift; }
+  static uint64_t Pack(void* head, uint32_t length) {
+    return reinterpret_cast<uintptr_t>(head) | (uint64_t{length} << kLengthShift);
+  }
+
+  static CpuCache* CreateCache(int cpu);
+
+  // Restartable sequences. They fail if we're no longer running on
+  // cpu_ or the cache is locked, as well as when list is empty
+  // (TryPop) or full (TryPush).
+  void* TryPop(uint32_t cl);
+  bool TryPush(uint32_t cl, void* ptr);
+  bool TryLockOnCpu();
+
+  // Slow paths, taken when restartable sequence fails.
+  static void* AllocateSlow(size_t size, uint32_t cl, void *(*oom_handler)(size_t size));
+  static void DeallocateSlow(void* ptr, uint32_t cl);
+
+  // Locks caches of all CPUs, from any CPU.
+  static void LockCaches();
+  static void UnlockCaches();
+  void Unlock() { lock_.store(0, std::memory_order_release); }
+
+  // REQUIRES: lock_ held.
+  void* FetchFromCentralCache(uint32_t cl, size_t byte_size);
+  void ReleaseToCentralCache(uint32_t cl, int N);
+  bool Grow(uint32_t cl);
+  bool StealCapacity(uint32_t cl);
+  void Drain();
+
+  ATTRIBUTE_HIDDEN static bool supported_;
+  ATTRIBUTE_HIDDEN static std::atomic<bool> active_;
+  ATTRIBUTE_HIDDEN static SpinLock create_lock_;  // Serializes CreateCache
+  ATTRIBUTE_HIDDEN static std::atomic<CpuCache*> caches_[kMaxCpus];
+
+  // Non-zero while locked. Restartable sequences read it, so it must
+  // not be a SpinLock.
+  std::atomic<uint32_t> lock_;
+  int cpu_;
+  uint32_t next_steal_cl_;  // Where StealCapacity() looks first
+  size_t capacity_bytes_;   // Sum of max_length_ in bytes
+  FreeList list_[kClassSizesMax];
+  uint32_t max_length_[kClassSizesMax];  // Capacity of list_
+} CACHELINE_ALIGNED;
+
+inline int CpuCache::CurrentCpu() {
+#ifdef TCMALLOC_HAVE_RSEQ
+  const struct rseq* area = reinterpret_cast<const struct rseq*>(
+    static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+  return static_cast<int32_t>(__atomic_load_n(&area->cpu_id, __ATOMIC_RELAXED));
+#else
+  return -1;
+#endif
+}
+
+inline CpuCache* CpuCache::GetIfActive() {
+  if (!IsActive()) {
+    return nullptr;
+  }
+  int cpu = CurrentCpu();
+  if (PREDICT_FALSE(static_cast<unsigned>(cpu) >= kMaxCpus)) {
+    return nullptr;
+  }
+  CpuCache* cache = caches_[cpu].load(std::memory_order_acquire);
+  if (PREDICT_FALSE(cache == nullptr)) {
+    cache = CreateCache(cpu);
+  }
+  return cache;
+}
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_CPU_CACHE_H_
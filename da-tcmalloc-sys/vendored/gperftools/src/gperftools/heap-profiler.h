@@ -94,20 +94,96 @@ struct HeapProfilerVars {
     bool mmap_log;
     bool mmap_profile;
     bool only_mmap_profile;
+    /* If non-zero, only record allocations sampled once every that
+     * many bytes on average, with counts scaled to estimate totals. */
+    int64_t heap_profile_sample_period;
+    /* If true, interval-triggered dumps are written by a background
+     * thread started by HeapProfilerStart, instead of by the thread
+     * whose allocation triggered the dump. */
+    bool background_dump;
+    /* If true, every dump to file except the first one after
+     * HeapProfilerStart only has call sites which allocated or freed
+     * anything since the previous dump. Comment line right after the
+     * header of such a profile refers to the number of the previous
+     * dump. If a dump can't be written, the next one is full again.
+     * With HeapProfilerSetExactPath all dumps are full, since each
+     * would overwrite the previous one. */
+    bool delta_dumps;
+    /* If true, allocations are timestamped, and profiles include log2
+     * histograms of lifetimes (in microseconds) of objects freed by
+     * each call site. Timestamps are kept in a separate map, which
+     * costs 24 bytes per tracked allocation, and nothing when this is
+     * off. */
+    bool lifetime_histograms;
+    /* If true, stack traces are captured by walking frame pointers
+     * (probing each new stack page before reading it) instead of by
+     * the default unwinder. Much cheaper, but only gives full stacks
+     * when all code is built with frame pointers. Turning it off
+     * restores the default unwinder. Unwinder is only switched when
+     * this changes, and the switch affects the whole process. */
+    bool frame_pointer_unwinder;
+    /* Longest stack trace to record per allocation, up to 256. 0 means
+     * default of 32. Sampled allocations (see above) have at most 31
+     * frames regardless. */
+    int32_t max_stack_depth;
+    /* If true, call sites' stack traces are kept in shared store where
+     * common callers are stored once, instead of each call site
+     * keeping full copy. Saves profiler memory with deep stacks. */
+    bool intern_stacks;
+    /* If true, in-use stats of every call site are remembered whenever
+     * total in-use bytes reach new peak, so that HeapProfilerDumpPeak
+     * can dump them. Peaks are checked every few (de)allocations. */
+    bool track_peak;
 };
 
 /* Set variables */
 PERFTOOLS_DLL_DECL void HeapProfilerSetVars(const struct HeapProfilerVars *vars);
 
+/* Get variables. Until first HeapProfilerSetVars these are defaults,
+ * so getting them, changing some and setting them back keeps the rest
+ * default.
+ */
+PERFTOOLS_DLL_DECL void HeapProfilerGetVars(struct HeapProfilerVars *vars);
+
 /* Disregard 'prefix' and set pathname for next dump */
 PERFTOOLS_DLL_DECL void HeapProfilerSetExactPath(const char *path);
 
+/* Formats of heap profile dumps written to files. */
+#define HEAP_PROFILE_FORMAT_TEXT 0      /* legacy "heap profile" text */
+#define HEAP_PROFILE_FORMAT_PPROF_GZ 1  /* gzip-compressed profile.proto */
+
+/* Set format of subsequent dumps. Dumps in HEAP_PROFILE_FORMAT_PPROF_GZ
+ * format get ".pb.gz" extension instead of ".heap" (unless exact path
+ * is set). GetHeapProfile() always returns text format.
+ */
+PERFTOOLS_DLL_DECL void HeapProfilerSetFormat(int format);
+
 /* Dump a profile now - can be used for dumping at a hopefully
  * quiescent state in your program, in order to more easily track down
  * memory leaks. Will include the reason in the logged message
  */
 PERFTOOLS_DLL_DECL void HeapProfilerDump(const char *reason);
 
+/* Dump profile of memory in use at the highest in-use bytes seen
+ * since HeapProfilerStart, if enabled by HeapProfilerVars::track_peak.
+ * Unless exact path is set, file name is like "prefix.0001.peak.heap".
+ */
+PERFTOOLS_DLL_DECL void HeapProfilerDumpPeak(const char *reason);
+
+/* Called by HeapProfilerWriteProfile for every chunk of profile. */
+typedef void (*HeapProfileWriteFn)(void* arg, const char* buf, size_t len);
+
+/* Generate current heap profile in given format (one of
+ * HEAP_PROFILE_FORMAT_XXX above) and pass it to 'write_fn' chunk by
+ * chunk, without touching filesystem or keeping whole profile in
+ * memory. 'write_fn' may allocate memory, but must not call other
+ * HeapProfiler functions. Returns non-zero on success and 0 if heap
+ * profiling is not active.
+ */
+PERFTOOLS_DLL_DECL int HeapProfilerWriteProfile(int format,
+                                                HeapProfileWriteFn write_fn,
+                                                void* arg);
+
 /* Generate current heap profiling information.
  * Returns an empty string when heap profiling is not active.
  * The returned pointer is a '\0'-terminated string allocated using malloc()
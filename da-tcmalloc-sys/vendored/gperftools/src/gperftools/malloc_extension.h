@@ -208,6 +208,11 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   //      is swapped out by the OS, they also count towards physical
   //      memory usage. This property is not writable.
   //
+  // "tcmalloc.cpu_cache_free_bytes"
+  //      Part of "tcmalloc.thread_cache_free_bytes" held by per-CPU
+  //      caches (see "tcmalloc.per_cpu_caches"). Each CPU holds at
+  //      most 1 MiB. This property is not writable.
+  //
   // "tcmalloc.pageheap_free_bytes"
   //      Number of bytes in free, mapped pages in page heap.  These
   //      bytes can be used to fulfill allocation requests.  They
@@ -224,6 +229,39 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   //        virtual memory usage, and depending on the OS, typically
   //        do not count towards physical memory usage.  This property
   //        is not writable.
+  //
+  // "tcmalloc.pageheap_lazy_unmapped_bytes"
+  //        Part of "tcmalloc.pageheap_unmapped_bytes" released with
+  //        lazy advice (MADV_FREE or MADV_COLD). The OS reclaims it
+  //        only when short of memory, so it may still count towards
+  //        physical memory usage.  This property is not writable.
+  //
+  // "tcmalloc.release_advice"
+  //        How memory is released to the OS: 0 for MADV_DONTNEED, 1
+  //        for MADV_FREE, 2 for MADV_COLD, 3 for MADV_PAGEOUT and 4
+  //        for MADV_DONTNEED batched through process_madvise. All but
+  //        0 are Linux only. If the kernel doesn't support the chosen
+  //        advice, tcmalloc falls back to 0.
+  //
+  // "tcmalloc.per_cpu_caches"
+  //        1 if small objects are cached per CPU rather than per
+  //        thread (see TCMALLOC_PER_CPU_CACHES). Writable; setting it
+  //        to 0 returns all per-CPU cached objects to central cache.
+  //        Setting it fails where per-CPU caches are not supported
+  //        (they need x86-64 Linux with rseq and membarrier).
+  //
+  // "tcmalloc.hugepage_aware"
+  //        1 if page heap keeps transparent huge pages intact (see
+  //        TCMALLOC_HUGEPAGE_AWARE). Writable. In this mode all
+  //        releases to the OS, including ReleaseToSystem,
+  //        ReleaseFreeMemory and aggressive decommit, return only
+  //        whole free hugepages.
+  //
+  // "tcmalloc.custom_size_classes"
+  //        1 if size classes were taken from TCMALLOC_SIZE_CLASSES
+  //        or tc_size_classes_override (see CheckSizeClasses), 0 if
+  //        built-in ones are used.
+  //        This property is not writable.
   // -------------------------------------------------------------------
 
   // Get the named "property"'s value.  Returns true if the property
@@ -286,6 +324,7 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   virtual void ReleaseToSystem(size_t num_bytes);
 
   // Same as ReleaseToSystem() but release as much memory as possible.
+  // tcmalloc also empties per-CPU caches first.
   virtual void ReleaseFreeMemory();
 
   // Sets the rate at which we release unused memory to the system.
@@ -415,6 +454,40 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   // Note, as of gperftools 3.11 it is identical to
   // MarkThreadIdle. See github issue #880
   virtual void MarkThreadTemporarilyIdle();
+
+  // Like ReleaseToSystem() but releases only free memory that has not
+  // been reused for at least min_age_ms milliseconds. Memory freed
+  // between two calls counts as freed at the time of the earlier one,
+  // so this is meant to be called periodically, e.g. from a background
+  // thread. Returns the number of bytes released. Set
+  // "tcmalloc.background_release" property to stop releasing memory
+  // as it is freed.  (Currently only implemented in tcmalloc.)
+  virtual size_t ReleaseOldFreeMemory(size_t num_bytes, size_t min_age_ms);
+
+  // Returns the size classes in use, smallest first. Objects of up
+  // to 'size' bytes are carved from spans of 'pages' malloc pages
+  // (8 KiB unless configured otherwise) and moved between caches
+  // 'objects_to_move' at a time.  (Currently only implemented in
+  // tcmalloc.)
+  struct SizeClassInfo {
+    size_t size;
+    size_t pages;
+    size_t objects_to_move;
+  };
+  virtual void GetSizeClasses(std::vector<SizeClassInfo>* v);
+
+  // Size classes are fixed at startup. tcmalloc takes them from the
+  // TCMALLOC_SIZE_CLASSES environment variable if it is set to a
+  // valid table, or else from tc_size_classes_override() (see
+  // malloc_extension_c.h). A table is a comma separated list of
+  // "size[:pages[:objects_to_move]]" entries, one per size class, in
+  // increasing size order and ending with the largest size class
+  // (the last size GetSizeClasses returns). Sizes are multiples of
+  // the minimal alignment (16 bytes unless built with 8 byte
+  // alignment). Omitted fields are computed as for built-in classes.
+  // An invalid table is logged and ignored. Returns NULL if spec would be accepted, otherwise a
+  // description of the first problem in it.
+  virtual const char* CheckSizeClasses(const char* spec);
 };
 
 namespace base {
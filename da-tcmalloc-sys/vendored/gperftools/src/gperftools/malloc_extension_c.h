@@ -83,6 +83,21 @@ PERFTOOLS_DLL_DECL size_t MallocExtension_GetEstimatedAllocatedSize(size_t size)
 PERFTOOLS_DLL_DECL size_t MallocExtension_GetAllocatedSize(const void* p);
 PERFTOOLS_DLL_DECL size_t MallocExtension_GetThreadCacheSize(void);
 PERFTOOLS_DLL_DECL void MallocExtension_MarkThreadTemporarilyIdle(void);
+PERFTOOLS_DLL_DECL size_t MallocExtension_ReleaseOldFreeMemory(size_t num_bytes, size_t min_age_ms);
+PERFTOOLS_DLL_DECL const char* MallocExtension_CheckSizeClasses(const char* spec);
+/* Fills up to max_classes entries of each array and returns the total
+ * number of size classes. */
+PERFTOOLS_DLL_DECL int MallocExtension_GetSizeClasses(size_t* sizes, size_t* pages,
+                                                      size_t* objects_to_move, int max_classes);
+
+/* tcmalloc's version is weak and returns NULL. A program can define
+ * its own to choose size classes without TCMALLOC_SIZE_CLASSES. It is
+ * called once, before the first allocation, so it must not allocate.
+ * It returns a table in the TCMALLOC_SIZE_CLASSES format (see
+ * MallocExtension_CheckSizeClasses), or NULL for the built-in one.
+ * TCMALLOC_SIZE_CLASSES takes precedence when it is set. Not
+ * supported with MSVC, which lacks weak symbols. */
+const char* tc_size_classes_override(void);
 
 /*
  * NOTE: These enum values MUST be kept in sync with the version in
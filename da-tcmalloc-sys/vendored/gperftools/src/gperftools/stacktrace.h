@@ -114,4 +114,11 @@ extern PERFTOOLS_DLL_DECL int GetStackTrace(void** result, int max_depth,
 extern PERFTOOLS_DLL_DECL int GetStackTraceWithContext(void** result, int max_depth,
                                     int skip_count, const void *uc);
 
+// Switches all the functions above to the stack capturing method with
+// given name (same names as accepted by TCMALLOC_STACKTRACE_METHOD
+// environment variable, e.g. "generic_fp" or "libunwind"). NULL or
+// empty name restores the default method. Returns false and changes
+// nothing if no such method is compiled in.
+extern PERFTOOLS_DLL_DECL bool SetStackTraceMethod(const char* name);
+
 #endif /* GOOGLE_STACKTRACE_H_ */
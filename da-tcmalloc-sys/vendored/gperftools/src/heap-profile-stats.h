@@ -64,6 +64,16 @@ struct HeapProfileStats {
   int64_t free_size;   // Total size of all freed objects so far.
 };
 
+// Histogram of lifetimes of freed objects. counts[0] is the number of
+// objects that lived less than 1 microsecond, counts[i] of those that
+// lived [2^(i-1), 2^i) microseconds. Last one also counts everything
+// longer.
+struct HeapProfileLifetimes {
+  static const int kBuckets = 32;
+
+  int64_t counts[kBuckets];
+};
+
 // Allocation and deallocation statistics per each stack trace.
 struct HeapProfileBucket : public HeapProfileStats {
   // Longest stack trace we record.
@@ -71,8 +81,25 @@ struct HeapProfileBucket : public HeapProfileStats {
 
   uintptr_t hash;           // Hash value of the stack trace.
   int depth;                // Depth of stack trace.
-  const void** stack;       // Stack trace.
+  const void** stack;       // Stack trace, or NULL if it is interned.
+  uint32_t stack_id;        // Id of interned stack trace (see StackStore).
   HeapProfileBucket* next;  // Next entry in hash-table.
+
+  // alloc_size and free_size as of the last dump (see delta dumps in
+  // HeapProfileTable).
+  int64_t dumped_alloc_size;
+  int64_t dumped_free_size;
+
+  // Lifetimes of objects freed so far, if HeapProfileTable tracks
+  // them. Allocated on first free.
+  HeapProfileLifetimes* lifetimes;
+
+  // In-use objects and bytes as of the peak number peak_epoch (see
+  // HeapProfileTable::NotePeak). Saved on first update of the bucket
+  // after that peak.
+  int64_t peak_inuse_count;
+  int64_t peak_inuse_size;
+  int64_t peak_epoch;
 };
 
 #endif  // HEAP_PROFILE_STATS_H_
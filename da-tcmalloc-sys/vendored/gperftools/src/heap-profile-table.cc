@@ -50,7 +50,9 @@
 #include <poll.h>
 #endif
 #include <errno.h>
+#include <math.h>     // for expm1()
 #include <stdarg.h>
+#include <time.h>     // for clock_gettime()
 
 #include <algorithm>  // for sort(), equal(), and copy()
 #include <map>
@@ -88,16 +90,55 @@ DEFINE_int32(heap_check_max_leaks,
 
 // header of the dumped heap profile
 static const char kProfileHeader[] = "heap profile: ";
+// delta profiles have this (as a comment line) right after the header
+static const char kDeltaProfileHeader[] = "heap profile delta of: ";
 static const char kProcSelfMapsHeader[] = "\nMAPPED_LIBRARIES:\n";
 
 //----------------------------------------------------------------------
 
 const char HeapProfileTable::kFileExt[] = ".heap";
+const char HeapProfileTable::kProtoFileExt[] = ".pb.gz";
 
 //----------------------------------------------------------------------
 
 static const int kHashTableSize = 179999;   // Size for bucket_table_.
 /*static*/ const int HeapProfileTable::kMaxStackDepth;
+/*static*/ const int HeapProfileTable::kStackDepthLimit;
+
+//----------------------------------------------------------------------
+
+// Bucket and shard stats are updated concurrently with readers (and,
+// for buckets, with other writers). HeapProfileStats is plain struct
+// shared with MemoryRegionMap, so we access its fields as atomics
+// (which is portable in practice).
+static void AtomicAdd(int64_t* counter, int64_t delta) {
+  reinterpret_cast<std::atomic<int64_t>*>(counter)->fetch_add(
+      delta, std::memory_order_relaxed);
+}
+
+static int64_t AtomicLoad(const int64_t* counter) {
+  return reinterpret_cast<const std::atomic<int64_t>*>(counter)->load(
+      std::memory_order_relaxed);
+}
+
+static void AtomicStore(int64_t* counter, int64_t value) {
+  reinterpret_cast<std::atomic<int64_t>*>(counter)->store(
+      value, std::memory_order_relaxed);
+}
+
+static void LoadStats(const HeapProfileStats& from, HeapProfileStats* to) {
+  to->allocs = AtomicLoad(&from.allocs);
+  to->frees = AtomicLoad(&from.frees);
+  to->alloc_size = AtomicLoad(&from.alloc_size);
+  to->free_size = AtomicLoad(&from.free_size);
+}
+
+static void AddStats(const HeapProfileStats& from, HeapProfileStats* to) {
+  to->allocs += from.allocs;
+  to->frees += from.frees;
+  to->alloc_size += from.alloc_size;
+  to->free_size += from.free_size;
+}
 
 //----------------------------------------------------------------------
 
@@ -113,44 +154,105 @@ static const int kStripFrames = 3;
 
 HeapProfileTable::HeapProfileTable(Allocator alloc,
                                    DeAllocator dealloc,
-                                   bool profile_mmap)
+                                   bool profile_mmap,
+                                   int64_t sample_period,
+                                   bool track_lifetimes,
+                                   bool intern_stacks)
     : alloc_(alloc),
       dealloc_(dealloc),
       profile_mmap_(profile_mmap),
+      sample_period_(sample_period),
+      track_lifetimes_(track_lifetimes),
+      stack_store_(NULL),
+      peak_epoch_(0),
       bucket_table_(NULL),
-      num_buckets_(0),
-      address_map_(NULL) {
+      num_buckets_(0) {
+  memset(&peak_total_, 0, sizeof(peak_total_));
+  if (intern_stacks) {
+    stack_store_ = new(alloc_(sizeof(tcmalloc::StackStore)))
+        tcmalloc::StackStore(alloc_, dealloc_);
+  }
+
   // Make a hash table for buckets.
   const int table_bytes = kHashTableSize * sizeof(*bucket_table_);
-  bucket_table_ = static_cast<Bucket**>(alloc_(table_bytes));
-  memset(bucket_table_, 0, table_bytes);
-
-  // Make an allocation map.
-  address_map_ =
-      new(alloc_(sizeof(AllocationMap))) AllocationMap(alloc_, dealloc_);
+  bucket_table_ = static_cast<std::atomic<Bucket*>*>(alloc_(table_bytes));
+  for (int i = 0; i < kHashTableSize; i++) {
+    new (&bucket_table_[i]) std::atomic<Bucket*>(nullptr);
+  }
 
-  // Initialize.
-  memset(&total_, 0, sizeof(total_));
-  num_buckets_ = 0;
+  // Make allocation maps.
+  static_assert((kShards & (kShards - 1)) == 0, "kShards must be power of 2");
+  static_assert(sizeof(Shard) == 64, "Shard must fill a cache line");
+  // Every tracked object has an entry of this, so keep it small.
+  static_assert(sizeof(AllocValue) == 2 * sizeof(void*),
+                "AllocValue must be bucket and size only");
+  for (Shard& shard : shards_) {
+    shard.address_map =
+        new(alloc_(sizeof(AllocationMap))) AllocationMap(alloc_, dealloc_);
+    shard.alloc_times = NULL;
+    if (track_lifetimes_) {
+      shard.alloc_times =
+          new(alloc_(sizeof(AllocTimeMap))) AllocTimeMap(alloc_, dealloc_);
+    }
+    memset(&shard.total, 0, sizeof(shard.total));
+  }
 }
 
 HeapProfileTable::~HeapProfileTable() {
-  // Free the allocation map.
-  address_map_->~AllocationMap();
-  dealloc_(address_map_);
-  address_map_ = NULL;
+  // Free the allocation maps.
+  for (Shard& shard : shards_) {
+    shard.address_map->~AllocationMap();
+    dealloc_(shard.address_map);
+    shard.address_map = NULL;
+    if (shard.alloc_times != NULL) {
+      shard.alloc_times->~AllocTimeMap();
+      dealloc_(shard.alloc_times);
+      shard.alloc_times = NULL;
+    }
+  }
 
   // Free the hash table.
   for (int i = 0; i < kHashTableSize; i++) {
-    for (Bucket* curr = bucket_table_[i]; curr != 0; /**/) {
+    for (Bucket* curr = bucket_table_[i].load(std::memory_order_relaxed); curr != 0; /**/) {
       Bucket* bucket = curr;
       curr = curr->next;
-      dealloc_(bucket->stack);
+      if (bucket->lifetimes != nullptr) {
+        dealloc_(bucket->lifetimes);
+      }
+      if (bucket->stack != nullptr) {
+        dealloc_(bucket->stack);
+      }
       dealloc_(bucket);
     }
   }
   dealloc_(bucket_table_);
   bucket_table_ = NULL;
+
+  if (stack_store_ != NULL) {
+    stack_store_->~StackStore();
+    dealloc_(stack_store_);
+    stack_store_ = NULL;
+  }
+}
+
+const void** HeapProfileTable::BucketStack(
+    const Bucket& b, const tcmalloc::StackStore* store, const void** buf) {
+  if (b.stack != nullptr) {
+    return b.stack;
+  }
+  store->Get(b.stack_id, b.depth, buf);
+  return buf;
+}
+
+bool HeapProfileTable::BucketHasStack(const Bucket& b, int depth,
+                                      const void* const key[]) const {
+  if (b.depth != depth) {
+    return false;
+  }
+  if (b.stack != nullptr) {
+    return equal(key, key + depth, b.stack);
+  }
+  return stack_store_->Equals(b.stack_id, key, depth);
 }
 
 HeapProfileTable::Bucket* HeapProfileTable::GetBucket(int depth,
@@ -167,73 +269,203 @@ HeapProfileTable::Bucket* HeapProfileTable::GetBucket(int depth,
 
   // Lookup stack trace in table
   unsigned int buck = ((unsigned int) h) % kHashTableSize;
-  for (Bucket* b = bucket_table_[buck]; b != 0; b = b->next) {
-    if ((b->hash == h) &&
-        (b->depth == depth) &&
-        equal(key, key + depth, b->stack)) {
-      return b;
+  std::atomic<Bucket*>* head = &bucket_table_[buck];
+  Bucket* first = head->load(std::memory_order_acquire);
+  Bucket* created = nullptr;
+  for (;;) {
+    for (Bucket* b = first; b != 0; b = b->next) {
+      if ((b->hash == h) && BucketHasStack(*b, depth, key)) {
+        if (created != nullptr) {
+          // Somebody else has just added same stack trace. Interned
+          // stack (if any) stays in the store, it is same as theirs.
+          if (created->stack != nullptr) {
+            dealloc_(created->stack);
+          }
+          dealloc_(created);
+        }
+        return b;
+      }
     }
-  }
 
-  // Create new bucket
-  const size_t key_size = sizeof(key[0]) * depth;
-  const void** kcopy = reinterpret_cast<const void**>(alloc_(key_size));
-  copy(key, key + depth, kcopy);
-  Bucket* b = reinterpret_cast<Bucket*>(alloc_(sizeof(Bucket)));
-  memset(b, 0, sizeof(*b));
-  b->hash  = h;
-  b->depth = depth;
-  b->stack = kcopy;
-  b->next  = bucket_table_[buck];
-  bucket_table_[buck] = b;
-  num_buckets_++;
-  return b;
+    // Create new bucket
+    if (created == nullptr) {
+      created = reinterpret_cast<Bucket*>(alloc_(sizeof(Bucket)));
+      memset(created, 0, sizeof(*created));
+      created->hash  = h;
+      created->depth = depth;
+      // Fall back to own copy of stack if store is full.
+      if (stack_store_ == nullptr
+          || !stack_store_->Intern(key, depth, &created->stack_id)) {
+        const size_t key_size = sizeof(key[0]) * depth;
+        const void** kcopy = reinterpret_cast<const void**>(alloc_(key_size));
+        copy(key, key + depth, kcopy);
+        created->stack = kcopy;
+      }
+    }
+    created->next = first;
+    if (head->compare_exchange_weak(first, created,
+                                    std::memory_order_acq_rel,
+                                    std::memory_order_acquire)) {
+      num_buckets_.fetch_add(1, std::memory_order_relaxed);
+      return created;
+    }
+    // Chain has changed under us (and 'first' is updated with new
+    // head), so we need to search it again.
+  }
 }
 
 int HeapProfileTable::GetCallerStackTrace(
-    int skip_count, void* stack[kMaxStackDepth]) {
+    int skip_count, void* stack[], int max_depth) {
+  RAW_DCHECK(max_depth <= kStackDepthLimit, "");
   return MallocHook::GetCallerStackTrace(
-      stack, kMaxStackDepth, kStripFrames + skip_count + 1);
+      stack, max_depth, kStripFrames + skip_count + 1);
+}
+
+void HeapProfileTable::ScaledStats(size_t bytes,
+                                   int64_t* count, int64_t* size) const {
+  if (sample_period_ <= 0) {
+    *count = 1;
+    *size = bytes;
+    return;
+  }
+  // Allocation of 'bytes' bytes is sampled with probability
+  // 1 - exp(-bytes/sample_period_). So each sample stands for
+  // 1/probability allocations of that size.
+  const double b = bytes > 0 ? static_cast<double>(bytes) : 1.0;
+  const double scale = 1.0 / (-expm1(-b / sample_period_));
+  *count = static_cast<int64_t>(scale + 0.5);
+  *size = static_cast<int64_t>(scale * bytes + 0.5);
+}
+
+// Timestamps for lifetime tracking. Monotonic clock is served by
+// vDSO, so it costs tens of nanoseconds, which is small compared to
+// taking stack trace.
+static int64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+HeapProfileLifetimes* HeapProfileTable::GetLifetimes(Bucket* b) {
+  auto* lifetimes = reinterpret_cast<std::atomic<HeapProfileLifetimes*>*>(&b->lifetimes);
+  HeapProfileLifetimes* result = lifetimes->load(std::memory_order_acquire);
+  if (result != nullptr) {
+    return result;
+  }
+
+  HeapProfileLifetimes* created =
+      static_cast<HeapProfileLifetimes*>(alloc_(sizeof(HeapProfileLifetimes)));
+  memset(created, 0, sizeof(*created));
+  if (lifetimes->compare_exchange_strong(result, created,
+                                         std::memory_order_acq_rel,
+                                         std::memory_order_acquire)) {
+    return created;
+  }
+  // Other thread was first.
+  dealloc_(created);
+  return result;
+}
+
+void HeapProfileTable::RecordLifetime(Bucket* b, int64_t alloc_time, int64_t count) {
+  const uint64_t lifetime_us = std::max<int64_t>(NowNanos() - alloc_time, 0) / 1000;
+  int index = 0;
+  if (lifetime_us > 0) {
+    index = std::min(64 - __builtin_clzll(lifetime_us),
+                     HeapProfileLifetimes::kBuckets - 1);
+  }
+  AtomicAdd(&GetLifetimes(b)->counts[index], count);
+}
+
+void HeapProfileTable::SavePeakStats(Bucket* b) {
+  const int64_t epoch = peak_epoch_.load(std::memory_order_acquire);
+  auto* bucket_epoch = reinterpret_cast<std::atomic<int64_t>*>(&b->peak_epoch);
+  int64_t saved = bucket_epoch->load(std::memory_order_relaxed);
+  if (PREDICT_TRUE(saved == epoch)) {
+    return;
+  }
+  // Bucket wasn't updated since the peak, so its current stats are
+  // as of the peak. Concurrent updaters of the same bucket race for
+  // saving them, and we are only consistent-enough here (like the
+  // rest of bucket stats).
+  if (!bucket_epoch->compare_exchange_strong(saved, epoch,
+                                             std::memory_order_relaxed)) {
+    return;
+  }
+  Stats s;
+  LoadStats(*b, &s);
+  AtomicStore(&b->peak_inuse_count, s.allocs - s.frees);
+  AtomicStore(&b->peak_inuse_size, s.alloc_size - s.free_size);
 }
 
 void HeapProfileTable::RecordAlloc(
     const void* ptr, size_t bytes, int stack_depth,
     const void* const call_stack[]) {
+  int64_t count, size;
+  ScaledStats(bytes, &count, &size);
+
   Bucket* b = GetBucket(stack_depth, call_stack);
-  b->allocs++;
-  b->alloc_size += bytes;
-  total_.allocs++;
-  total_.alloc_size += bytes;
+  SavePeakStats(b);
+  AtomicAdd(&b->allocs, count);
+  AtomicAdd(&b->alloc_size, size);
+
+  Shard* shard = &shards_[ShardOf(ptr)];
+  AtomicAdd(&shard->total.allocs, count);
+  AtomicAdd(&shard->total.alloc_size, size);
 
   AllocValue v;
   v.set_bucket(b);  // also did set_live(false); set_ignore(false)
   v.bytes = bytes;
-  address_map_->Insert(ptr, v);
+  shard->address_map->Insert(ptr, v);
+  if (track_lifetimes_) {
+    shard->alloc_times->Insert(ptr, NowNanos());
+  }
 }
 
 void HeapProfileTable::RecordFree(const void* ptr) {
+  Shard* shard = &shards_[ShardOf(ptr)];
   AllocValue v;
-  if (address_map_->FindAndRemove(ptr, &v)) {
+  if (shard->address_map->FindAndRemove(ptr, &v)) {
+    int64_t count, size;
+    ScaledStats(v.bytes, &count, &size);
+
     Bucket* b = v.bucket();
-    b->frees++;
-    b->free_size += v.bytes;
-    total_.frees++;
-    total_.free_size += v.bytes;
+    SavePeakStats(b);
+    AtomicAdd(&b->frees, count);
+    AtomicAdd(&b->free_size, size);
+    AtomicAdd(&shard->total.frees, count);
+    AtomicAdd(&shard->total.free_size, size);
+
+    int64_t alloc_time;
+    if (track_lifetimes_ && shard->alloc_times->FindAndRemove(ptr, &alloc_time)) {
+      RecordLifetime(b, alloc_time, count);
+    }
+  }
+}
+
+HeapProfileTable::Stats HeapProfileTable::total() const {
+  Stats result;
+  memset(&result, 0, sizeof(result));
+  for (const Shard& shard : shards_) {
+    Stats s;
+    LoadStats(shard.total, &s);
+    AddStats(s, &result);
   }
+  return result;
 }
 
 bool HeapProfileTable::FindAlloc(const void* ptr, size_t* object_size) const {
-  const AllocValue* alloc_value = address_map_->Find(ptr);
+  const AllocValue* alloc_value = address_map(ptr)->Find(ptr);
   if (alloc_value != NULL) *object_size = alloc_value->bytes;
   return alloc_value != NULL;
 }
 
 bool HeapProfileTable::FindAllocDetails(const void* ptr,
                                         AllocInfo* info) const {
-  const AllocValue* alloc_value = address_map_->Find(ptr);
+  const AllocValue* alloc_value = address_map(ptr)->Find(ptr);
   if (alloc_value != NULL) {
     info->object_size = alloc_value->bytes;
-    info->call_stack = alloc_value->bucket()->stack;
+    info->call_stack = BucketStack(*alloc_value->bucket(), stack_store_,
+                                   info->stack_storage);
     info->stack_depth = alloc_value->bucket()->depth;
   }
   return alloc_value != NULL;
@@ -243,14 +475,21 @@ bool HeapProfileTable::FindInsideAlloc(const void* ptr,
                                        size_t max_size,
                                        const void** object_ptr,
                                        size_t* object_size) const {
-  const AllocValue* alloc_value =
-    address_map_->FindInside(&AllocValueSize, max_size, ptr, object_ptr);
-  if (alloc_value != NULL) *object_size = alloc_value->bytes;
-  return alloc_value != NULL;
+  // Allocation containing ptr may start in another shard than
+  // ptr. But allocations don't overlap, so at most one shard has it.
+  for (const Shard& shard : shards_) {
+    const AllocValue* alloc_value =
+      shard.address_map->FindInside(&AllocValueSize, max_size, ptr, object_ptr);
+    if (alloc_value != NULL) {
+      *object_size = alloc_value->bytes;
+      return true;
+    }
+  }
+  return false;
 }
 
 bool HeapProfileTable::MarkAsLive(const void* ptr) {
-  AllocValue* alloc = address_map_->FindMutable(ptr);
+  AllocValue* alloc = address_map(ptr)->FindMutable(ptr);
   if (alloc && !alloc->live()) {
     alloc->set_live(true);
     return true;
@@ -259,7 +498,7 @@ bool HeapProfileTable::MarkAsLive(const void* ptr) {
 }
 
 void HeapProfileTable::MarkAsIgnored(const void* ptr) {
-  AllocValue* alloc = address_map_->FindMutable(ptr);
+  AllocValue* alloc = address_map(ptr)->FindMutable(ptr);
   if (alloc) {
     alloc->set_ignore(true);
   }
@@ -282,35 +521,628 @@ void HeapProfileTable::UnparseBucket(const Bucket& b,
   writer->AppendStr("\n");
 }
 
-void HeapProfileTable::SaveProfile(tcmalloc::GenericWriter* writer) const {
-  writer->AppendStr(kProfileHeader);
-  UnparseBucket(total_, writer, " heapprofile");
+// Lifetimes histogram of a bucket goes right after it, as a comment
+// line (so that pprof skips it). Only non-empty histogram buckets
+// are listed, as <upper bound in microseconds>:<count>.
+static void UnparseLifetimes(const HeapProfileLifetimes& lifetimes,
+                             tcmalloc::GenericWriter* writer) {
+  writer->AppendStr("# lifetimes(us):");
+  for (int i = 0; i < HeapProfileLifetimes::kBuckets; i++) {
+    const int64_t count = AtomicLoad(&lifetimes.counts[i]);
+    if (count == 0) {
+      continue;
+    }
+    if (i == HeapProfileLifetimes::kBuckets - 1) {
+      writer->AppendF(" <inf:%" PRId64, count);
+    } else {
+      writer->AppendF(" <%" PRId64 ":%" PRId64, int64_t{1} << i, count);
+    }
+  }
+  writer->AppendStr("\n");
+}
+
+void HeapProfileTable::NotePeak(const Stats& total) {
+  AtomicStore(&peak_total_.allocs, total.allocs - total.frees);
+  AtomicStore(&peak_total_.alloc_size, total.alloc_size - total.free_size);
+  peak_epoch_.fetch_add(1, std::memory_order_release);
+}
+
+bool HeapProfileTable::SelectForSave(SaveMode mode, Bucket* bucket,
+                                     const Bucket& b) {
+  if (mode == kSaveChanged
+      && b.alloc_size == bucket->dumped_alloc_size
+      && b.free_size == bucket->dumped_free_size) {
+    return false;
+  }
+  if (mode == kSaveAllAndMark || mode == kSaveChanged) {
+    bucket->dumped_alloc_size = b.alloc_size;
+    bucket->dumped_free_size = b.free_size;
+  }
+  return true;
+}
+
+bool HeapProfileTable::LoadBucketStats(SaveMode mode, const Bucket& bucket,
+                                       Bucket* b) const {
+  // Take consistent-enough copy of stats that may be updated
+  // concurrently.
+  memset(b, 0, sizeof(*b));
+  if (mode == kSavePeak) {
+    const int64_t epoch = peak_epoch_.load(std::memory_order_acquire);
+    if (epoch == 0) {
+      return false;
+    }
+    // Buckets not updated since the peak still have their peak stats.
+    if (AtomicLoad(&bucket.peak_epoch) == epoch) {
+      b->allocs = AtomicLoad(&bucket.peak_inuse_count);
+      b->alloc_size = AtomicLoad(&bucket.peak_inuse_size);
+    } else {
+      Stats s;
+      LoadStats(bucket, &s);
+      b->allocs = s.allocs - s.frees;
+      b->alloc_size = s.alloc_size - s.free_size;
+    }
+    return b->allocs != 0 || b->alloc_size != 0;
+  }
+  LoadStats(bucket, b);
+  b->lifetimes = reinterpret_cast<const std::atomic<HeapProfileLifetimes*>*>(
+      &bucket.lifetimes)->load(std::memory_order_acquire);
+  return true;
+}
+
+// Stats are kept in an array of entries, in the order IterateBuckets
+// visits live buckets.
+class HeapProfileTable::StatsCopy {
+ public:
+  struct Entry {
+    Bucket* bucket;
+    Stats stats;
+    const HeapProfileLifetimes* lifetimes;  // Points into lifetimes array
+  };
+
+  Stats total;
+  int num_entries;
+  int capacity;
+  Entry* entries;
+  HeapProfileLifetimes* lifetimes;  // capacity of them, or NULL
+};
+
+HeapProfileTable::StatsCopy* HeapProfileTable::CopyStats(SaveMode mode) {
+  const bool with_mmap = profile_mmap_ && mode != kSavePeak;
+
+  // Buckets created after we count them are newer than the copy
+  // anyway, so we just leave them out.
+  int capacity = num_buckets_.load(std::memory_order_relaxed);
+  if (with_mmap) {
+    MemoryRegionMap::LockHolder holder{};
+    MemoryRegionMap::IterateBuckets([&capacity] (HeapProfileBucket*) {
+      capacity++;
+    });
+  }
+  capacity = std::max(capacity, 1);
+
+  StatsCopy* copy = static_cast<StatsCopy*>(alloc_(sizeof(StatsCopy)));
+  memset(copy, 0, sizeof(*copy));
+  copy->capacity = capacity;
+  copy->entries = static_cast<StatsCopy::Entry*>(
+      alloc_(capacity * sizeof(StatsCopy::Entry)));
+  if (track_lifetimes_ && mode != kSavePeak) {
+    copy->lifetimes = static_cast<HeapProfileLifetimes*>(
+        alloc_(capacity * sizeof(HeapProfileLifetimes)));
+  }
+
+  if (mode == kSavePeak) {
+    copy->total.allocs = AtomicLoad(&peak_total_.allocs);
+    copy->total.alloc_size = AtomicLoad(&peak_total_.alloc_size);
+  } else {
+    copy->total = total();
+  }
+
+  auto add = [copy] (Bucket* bucket, const Bucket& b) {
+    if (copy->num_entries == copy->capacity) {
+      return;
+    }
+    const int index = copy->num_entries++;
+    StatsCopy::Entry* e = &copy->entries[index];
+    e->bucket = bucket;
+    e->stats = b;
+    e->lifetimes = nullptr;
+    if (b.lifetimes != nullptr && copy->lifetimes != nullptr) {
+      HeapProfileLifetimes* l = &copy->lifetimes[index];
+      for (int i = 0; i < HeapProfileLifetimes::kBuckets; i++) {
+        l->counts[i] = AtomicLoad(&b.lifetimes->counts[i]);
+      }
+      e->lifetimes = l;
+    }
+  };
+
+  if (with_mmap) {
+    MemoryRegionMap::LockHolder holder{};
+    MemoryRegionMap::IterateBuckets([&add] (HeapProfileBucket* bucket) {
+      add(bucket, *bucket);
+    });
+  }
+  for (int i = 0; i < kHashTableSize; i++) {
+    for (Bucket* curr = bucket_table_[i].load(std::memory_order_acquire);
+         curr != nullptr;
+         curr = curr->next) {
+      Bucket b;
+      if (LoadBucketStats(mode, *curr, &b)) {
+        add(curr, b);
+      }
+    }
+  }
+  return copy;
+}
+
+void HeapProfileTable::ReleaseStatsCopy(StatsCopy* copy) {
+  if (copy->lifetimes != nullptr) {
+    dealloc_(copy->lifetimes);
+  }
+  dealloc_(copy->entries);
+  dealloc_(copy);
+}
+
+template <typename Body>
+void HeapProfileTable::IterateBuckets(SaveMode mode, const StatsCopy* copy,
+                                      const Body& body) {
+  const void* stack[kStackDepthLimit];
+  auto visit = [this, mode, &body, &stack] (Bucket* bucket, Bucket* b) {
+    b->depth = bucket->depth;
+    b->stack = BucketStack(*bucket, stack_store_, stack);
+    if (SelectForSave(mode, bucket, *b)) {
+      body(*b);
+    }
+  };
+
+  if (copy != nullptr) {
+    for (int i = 0; i < copy->num_entries; i++) {
+      const StatsCopy::Entry& e = copy->entries[i];
+      Bucket b;
+      memset(&b, 0, sizeof(b));
+      static_cast<Stats&>(b) = e.stats;
+      b.lifetimes = const_cast<HeapProfileLifetimes*>(e.lifetimes);
+      visit(e.bucket, &b);
+    }
+    return;
+  }
 
-  // Dump the mmap list first.
-  if (profile_mmap_) {
+  if (profile_mmap_ && mode != kSavePeak) {
     MemoryRegionMap::LockHolder holder{};
-    MemoryRegionMap::IterateBuckets([writer] (const Bucket* bucket) {
-      UnparseBucket(*bucket, writer, "");
+    MemoryRegionMap::IterateBuckets([&visit] (HeapProfileBucket* bucket) {
+      Bucket b = *bucket;
+      visit(bucket, &b);
     });
   }
 
-  int bucket_count = 0;
   for (int i = 0; i < kHashTableSize; i++) {
-    for (Bucket* curr = bucket_table_[i]; curr != nullptr; curr = curr->next) {
-      UnparseBucket(*curr, writer, "");
-      bucket_count++;
+    for (Bucket* curr = bucket_table_[i].load(std::memory_order_acquire);
+         curr != nullptr;
+         curr = curr->next) {
+      Bucket b;
+      if (LoadBucketStats(mode, *curr, &b)) {
+        visit(curr, &b);
+      }
     }
   }
-  RAW_DCHECK(bucket_count == num_buckets_, "");
-  (void)bucket_count;
+}
+
+void HeapProfileTable::SaveProfile(tcmalloc::GenericWriter* writer,
+                                   SaveMode mode, int delta_base,
+                                   const StatsCopy* copy) {
+  Bucket total;
+  memset(&total, 0, sizeof(total));
+  if (copy != nullptr) {
+    static_cast<Stats&>(total) = copy->total;
+  } else if (mode == kSavePeak) {
+    total.allocs = AtomicLoad(&peak_total_.allocs);
+    total.alloc_size = AtomicLoad(&peak_total_.alloc_size);
+  } else {
+    static_cast<Stats&>(total) = this->total();
+  }
+
+  writer->AppendStr(kProfileHeader);
+  UnparseBucket(total, writer, " heapprofile");
+  // pprof wants the header first, and skips comment lines after it.
+  if (mode == kSaveChanged) {
+    writer->AppendF("# %s%d\n", kDeltaProfileHeader, delta_base);
+  }
+
+  // mmap buckets (if any) come first.
+  IterateBuckets(mode, copy, [writer] (const Bucket& b) {
+    UnparseBucket(b, writer, "");
+    if (b.lifetimes != nullptr) {
+      UnparseLifetimes(*b.lifetimes, writer);
+    }
+  });
 
   writer->AppendStr(kProcSelfMapsHeader);
   tcmalloc::SaveProcSelfMaps(writer);
 }
 
+//----------------------------------------------------------------------
+// profile.proto output
+//----------------------------------------------------------------------
+
+namespace {
+
+// Field numbers of messages in profile.proto we emit.
+enum {
+  kProfileSampleType = 1,
+  kProfileSample = 2,
+  kProfileMapping = 3,
+  kProfileLocation = 4,
+  kProfileStringTable = 6,
+  kProfilePeriodType = 11,
+  kProfilePeriod = 12,
+  kProfileComment = 13,
+  kProfileDefaultSampleType = 14,
+
+  kValueTypeType = 1,
+  kValueTypeUnit = 2,
+
+  kSampleLocationId = 1,
+  kSampleValue = 2,
+  kSampleLabel = 3,
+
+  kLabelKey = 1,
+  kLabelNum = 3,
+  kLabelNumUnit = 4,
+
+  kMappingId = 1,
+  kMappingMemoryStart = 2,
+  kMappingMemoryLimit = 3,
+  kMappingFileOffset = 4,
+  kMappingFilename = 5,
+
+  kLocationId = 1,
+  kLocationMappingId = 2,
+  kLocationAddress = 3,
+};
+
+enum {
+  kWireVarint = 0,
+  kWireLengthDelimited = 2,
+};
+
+// Indexes of our fixed strings in string table. Other strings
+// (comment, mapping file names) follow them.
+const char* const kFixedStrings[] = {
+  "", "alloc_objects", "count", "alloc_space", "bytes",
+  "inuse_objects", "inuse_space", "space"};
+enum {
+  kStrAllocObjects = 1,
+  kStrCount = 2,
+  kStrAllocSpace = 3,
+  kStrBytes = 4,
+  kStrInuseObjects = 5,
+  kStrInuseSpace = 6,
+  kStrSpace = 7,
+  kNumFixedStrings = 8,
+};
+
+int VarintSize(uint64_t v) {
+  int size = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    size++;
+  }
+  return size;
+}
+
+// Minimal protobuf encoder. All fields of Profile message are
+// repeated or scalar, so we can stream them in any order we like,
+// and we only need to know sizes of (small) nested messages.
+class ProtoWriter {
+public:
+  explicit ProtoWriter(tcmalloc::GenericWriter* writer) : writer_(writer) {}
+
+  void Varint(uint64_t v) {
+    char buf[10];
+    int len = 0;
+    while (v >= 0x80) {
+      buf[len++] = static_cast<char>(v | 0x80);
+      v >>= 7;
+    }
+    buf[len++] = static_cast<char>(v);
+    writer_->AppendMem(buf, len);
+  }
+
+  void Tag(int field, int wire_type) {
+    Varint((field << 3) | wire_type);
+  }
+
+  void LengthDelimited(int field, size_t length) {
+    Tag(field, kWireLengthDelimited);
+    Varint(length);
+  }
+
+  void UInt64(int field, uint64_t v) {
+    Tag(field, kWireVarint);
+    Varint(v);
+  }
+
+  void String(int field, const char* str) {
+    size_t len = strlen(str);
+    LengthDelimited(field, len);
+    writer_->AppendMem(str, len);
+  }
+
+  // Nested message of only varint fields. Zero values are skipped
+  // (as proto3 does).
+  struct Field {
+    int number;
+    uint64_t value;
+  };
+  static size_t VarintMessageSize(const Field* fields, int count) {
+    size_t size = 0;
+    for (int i = 0; i < count; i++) {
+      if (fields[i].value != 0) {
+        size += VarintSize(fields[i].number << 3) + VarintSize(fields[i].value);
+      }
+    }
+    return size;
+  }
+  void VarintMessage(int field, const Field* fields, int count) {
+    LengthDelimited(field, VarintMessageSize(fields, count));
+    for (int i = 0; i < count; i++) {
+      if (fields[i].value != 0) {
+        UInt64(fields[i].number, fields[i].value);
+      }
+    }
+  }
+
+private:
+  tcmalloc::GenericWriter* const writer_;
+};
+
+struct ProtoMapping {
+  uint64_t start;
+  uint64_t end;
+};
+
+// Set of locations we have already emitted. Open addressing hash of
+// pc values, grown via profile table's allocator.
+class LocationSet {
+public:
+  LocationSet(HeapProfileTable::Allocator alloc, HeapProfileTable::DeAllocator dealloc)
+    : alloc_(alloc), dealloc_(dealloc) {
+    Resize(4096);
+  }
+  ~LocationSet() {
+    dealloc_(slots_);
+  }
+
+  // Returns true if 'pc' wasn't in the set.
+  bool Insert(uintptr_t pc) {
+    if (2 * (size_ + 1) > capacity_) {
+      Resize(capacity_ * 2);
+    }
+    uintptr_t* slot = Find(slots_, capacity_, pc);
+    if (*slot == pc) {
+      return false;
+    }
+    *slot = pc;
+    size_++;
+    return true;
+  }
+
+private:
+  static uintptr_t* Find(uintptr_t* slots, size_t capacity, uintptr_t pc) {
+    size_t i = (static_cast<uint64_t>(pc) * 0x9E3779B97F4A7C15ULL) >> 20;
+    for (;; i++) {
+      uintptr_t* slot = &slots[i & (capacity - 1)];
+      if (*slot == pc || *slot == 0) {
+        return slot;
+      }
+    }
+  }
+
+  void Resize(size_t capacity) {
+    uintptr_t* slots = static_cast<uintptr_t*>(alloc_(capacity * sizeof(uintptr_t)));
+    memset(slots, 0, capacity * sizeof(uintptr_t));
+    for (size_t i = 0; i < capacity_; i++) {
+      if (slots_[i] != 0) {
+        *Find(slots, capacity, slots_[i]) = slots_[i];
+      }
+    }
+    if (slots_ != nullptr) {
+      dealloc_(slots_);
+    }
+    slots_ = slots;
+    capacity_ = capacity;
+  }
+
+  HeapProfileTable::Allocator alloc_;
+  HeapProfileTable::DeAllocator dealloc_;
+  uintptr_t* slots_ = nullptr;
+  size_t capacity_ = 0;
+  size_t size_ = 0;
+};
+
+}  // namespace
+
+void HeapProfileTable::SaveProfileProto(tcmalloc::GenericWriter* writer,
+                                        SaveMode mode, int delta_base,
+                                        const StatsCopy* copy) {
+  ProtoWriter proto(writer);
+
+  for (const char* str : kFixedStrings) {
+    proto.String(kProfileStringTable, str);
+  }
+  int next_string = kNumFixedStrings;
+
+  if (mode == kSaveChanged) {
+    char comment[64];
+    snprintf(comment, sizeof(comment), "%s%d", kDeltaProfileHeader, delta_base);
+    proto.String(kProfileStringTable, comment);
+    proto.UInt64(kProfileComment, next_string++);
+  }
+
+  const ProtoWriter::Field sample_types[][2] = {
+    {{kValueTypeType, kStrAllocObjects}, {kValueTypeUnit, kStrCount}},
+    {{kValueTypeType, kStrAllocSpace}, {kValueTypeUnit, kStrBytes}},
+    {{kValueTypeType, kStrInuseObjects}, {kValueTypeUnit, kStrCount}},
+    {{kValueTypeType, kStrInuseSpace}, {kValueTypeUnit, kStrBytes}},
+  };
+  for (const auto& sample_type : sample_types) {
+    proto.VarintMessage(kProfileSampleType, sample_type, 2);
+  }
+  proto.UInt64(kProfileDefaultSampleType, kStrInuseSpace);
+
+  if (sample_period_ > 0) {
+    const ProtoWriter::Field period_type[] = {
+      {kValueTypeType, kStrSpace}, {kValueTypeUnit, kStrBytes}};
+    proto.VarintMessage(kProfilePeriodType, period_type, 2);
+    proto.UInt64(kProfilePeriod, sample_period_);
+  }
+
+  // Mappings. We only care about executable ones, since those are
+  // what locations point into. Ids are 1-based indexes into
+  // 'mappings'. Mapping file names are appended to the string table.
+  int num_mappings = 0;
+  tcmalloc::ForEachProcMapping([&num_mappings] (const tcmalloc::ProcMapping& m) {
+    if (strchr(m.flags, 'x') != nullptr) {
+      num_mappings++;
+    }
+  });
+  ProtoMapping* mappings = static_cast<ProtoMapping*>(
+    alloc_(std::max(num_mappings, 1) * sizeof(ProtoMapping)));
+  // Lifetime histograms are numeric sample labels, one per non-empty
+  // histogram bucket. Label keys are upper bounds of those.
+  const int first_lifetime_key = next_string;
+  if (track_lifetimes_) {
+    for (int i = 0; i < HeapProfileLifetimes::kBuckets; i++) {
+      char key[64];
+      if (i == HeapProfileLifetimes::kBuckets - 1) {
+        snprintf(key, sizeof(key), "lifetime<inf");
+      } else {
+        snprintf(key, sizeof(key), "lifetime<%" PRId64 "us", int64_t{1} << i);
+      }
+      proto.String(kProfileStringTable, key);
+      next_string++;
+    }
+  }
+
+  int mappings_count = 0;
+  const int first_filename = next_string;
+  tcmalloc::ForEachProcMapping([&] (const tcmalloc::ProcMapping& m) {
+    if (strchr(m.flags, 'x') == nullptr || mappings_count >= num_mappings) {
+      return;
+    }
+    mappings[mappings_count++] = ProtoMapping{m.start, m.end};
+    proto.String(kProfileStringTable, m.filename);
+    const ProtoWriter::Field fields[] = {
+      {kMappingId, static_cast<uint64_t>(mappings_count)},
+      {kMappingMemoryStart, m.start},
+      {kMappingMemoryLimit, m.end},
+      {kMappingFileOffset, m.offset},
+      {kMappingFilename, static_cast<uint64_t>(first_filename + mappings_count - 1)},
+    };
+    proto.VarintMessage(kProfileMapping, fields, arraysize(fields));
+  });
+
+  auto mapping_id = [mappings, mappings_count] (uint64_t addr) -> uint64_t {
+    // /proc/self/maps is sorted by address
+    const ProtoMapping* it = std::upper_bound(
+      mappings, mappings + mappings_count, addr,
+      [] (uint64_t addr, const ProtoMapping& m) { return addr < m.start; });
+    if (it == mappings || addr >= (it - 1)->end) {
+      return 0;
+    }
+    return it - mappings;
+  };
+
+  // Samples, with locations emitted as we first see them. We use pc
+  // as location id, which conveniently is never 0.
+  LocationSet seen_locations(alloc_, dealloc_);
+  IterateBuckets(mode, copy, [&] (const Bucket& b) {
+    for (int d = 0; d < b.depth; d++) {
+      const uintptr_t pc = reinterpret_cast<uintptr_t>(b.stack[d]);
+      if (pc == 0 || !seen_locations.Insert(pc)) {
+        continue;
+      }
+      // Stack has return addresses, and pprof wants address within
+      // call instruction.
+      const ProtoWriter::Field fields[] = {
+        {kLocationId, pc},
+        {kLocationMappingId, mapping_id(pc)},
+        {kLocationAddress, pc - 1},
+      };
+      proto.VarintMessage(kProfileLocation, fields, arraysize(fields));
+    }
+
+    const uint64_t values[] = {
+      static_cast<uint64_t>(b.allocs),
+      static_cast<uint64_t>(b.alloc_size),
+      static_cast<uint64_t>(b.allocs - b.frees),
+      static_cast<uint64_t>(b.alloc_size - b.free_size),
+    };
+
+    size_t locations_size = 0;
+    for (int d = 0; d < b.depth; d++) {
+      const uintptr_t pc = reinterpret_cast<uintptr_t>(b.stack[d]);
+      locations_size += pc != 0 ? VarintSize(pc) : 0;
+    }
+    size_t values_size = 0;
+    for (uint64_t v : values) {
+      values_size += VarintSize(v);
+    }
+
+    // Counts may change concurrently, so we take them once.
+    int64_t lifetime_counts[HeapProfileLifetimes::kBuckets] = {};
+    if (b.lifetimes != nullptr) {
+      for (int i = 0; i < HeapProfileLifetimes::kBuckets; i++) {
+        lifetime_counts[i] = AtomicLoad(&b.lifetimes->counts[i]);
+      }
+    }
+    auto lifetime_label = [&] (int i, ProtoWriter::Field fields[3]) {
+      fields[0] = {kLabelKey, static_cast<uint64_t>(first_lifetime_key + i)};
+      fields[1] = {kLabelNum, static_cast<uint64_t>(lifetime_counts[i])};
+      fields[2] = {kLabelNumUnit, kStrCount};
+    };
+    size_t labels_size = 0;
+    for (int i = 0; i < HeapProfileLifetimes::kBuckets; i++) {
+      if (lifetime_counts[i] != 0) {
+        ProtoWriter::Field fields[3];
+        lifetime_label(i, fields);
+        const size_t size = ProtoWriter::VarintMessageSize(fields, 3);
+        labels_size += 1 + VarintSize(size) + size;
+      }
+    }
+
+    // Repeated fields are packed.
+    proto.LengthDelimited(
+      kProfileSample,
+      1 + VarintSize(locations_size) + locations_size
+      + 1 + VarintSize(values_size) + values_size
+      + labels_size);
+    proto.LengthDelimited(kSampleLocationId, locations_size);
+    for (int d = 0; d < b.depth; d++) {
+      const uintptr_t pc = reinterpret_cast<uintptr_t>(b.stack[d]);
+      if (pc != 0) {
+        proto.Varint(pc);
+      }
+    }
+    proto.LengthDelimited(kSampleValue, values_size);
+    for (uint64_t v : values) {
+      proto.Varint(v);
+    }
+    for (int i = 0; i < HeapProfileLifetimes::kBuckets; i++) {
+      if (lifetime_counts[i] != 0) {
+        ProtoWriter::Field fields[3];
+        lifetime_label(i, fields);
+        proto.VarintMessage(kSampleLabel, fields, 3);
+      }
+    }
+  });
+
+  dealloc_(mappings);
+}
+
 bool HeapProfileTable::WriteProfile(const char* file_name,
                                     const Bucket& total,
-                                    AllocationMap* allocations) {
+                                    AllocationMap* allocations,
+                                    const tcmalloc::StackStore* stack_store) {
   RAW_VLOG(1, "Dumping non-live heap profile to %s", file_name);
   RawFD fd = RawOpenForWriting(file_name);
   if (fd == kIllegalRawFD) {
@@ -324,7 +1156,8 @@ bool HeapProfileTable::WriteProfile(const char* file_name,
 
   UnparseBucket(total, &writer, " heapprofile");
 
-  allocations->Iterate([&writer] (const void* ptr, AllocValue* v) {
+  const void* stack[kStackDepthLimit];
+  allocations->Iterate([&] (const void* ptr, AllocValue* v) {
     if (v->live()) {
       v->set_live(false);
       return;
@@ -337,7 +1170,7 @@ bool HeapProfileTable::WriteProfile(const char* file_name,
     b.allocs = 1;
     b.alloc_size = v->bytes;
     b.depth = v->bucket()->depth;
-    b.stack = v->bucket()->stack;
+    b.stack = BucketStack(*v->bucket(), stack_store, stack);
     UnparseBucket(b, &writer, "");
   });
 
@@ -373,10 +1206,13 @@ void HeapProfileTable::CleanupOldProfiles(const char* prefix) {
 }
 
 HeapProfileTable::Snapshot* HeapProfileTable::TakeSnapshot() {
-  Snapshot* s = new (alloc_(sizeof(Snapshot))) Snapshot(alloc_, dealloc_);
-  address_map_->Iterate([s] (const void* ptr, AllocValue* v) {
-    s->Add(ptr, *v);
-  });
+  Snapshot* s = new (alloc_(sizeof(Snapshot)))
+      Snapshot(alloc_, dealloc_, stack_store_);
+  for (const Shard& shard : shards_) {
+    shard.address_map->Iterate([s] (const void* ptr, AllocValue* v) {
+      s->Add(ptr, *v);
+    });
+  }
   return s;
 }
 
@@ -387,22 +1223,26 @@ void HeapProfileTable::ReleaseSnapshot(Snapshot* s) {
 
 HeapProfileTable::Snapshot* HeapProfileTable::NonLiveSnapshot(
     Snapshot* base) {
+  const Stats t = total();
   RAW_VLOG(2, "NonLiveSnapshot input: %" PRId64 " %" PRId64 "\n",
-           total_.allocs - total_.frees,
-           total_.alloc_size - total_.free_size);
-
-  Snapshot* s = new (alloc_(sizeof(Snapshot))) Snapshot(alloc_, dealloc_);
-  address_map_->Iterate([&] (const void* ptr, AllocValue* v) {
-    if (v->live()) {
-      v->set_live(false);
-    } else {
-      if (base != nullptr && base->map_.Find(ptr) != nullptr) {
-        // Present in arg->base, so do not save
+           t.allocs - t.frees,
+           t.alloc_size - t.free_size);
+
+  Snapshot* s = new (alloc_(sizeof(Snapshot)))
+      Snapshot(alloc_, dealloc_, stack_store_);
+  for (const Shard& shard : shards_) {
+    shard.address_map->Iterate([&] (const void* ptr, AllocValue* v) {
+      if (v->live()) {
+        v->set_live(false);
       } else {
-        s->Add(ptr, *v);
+        if (base != nullptr && base->map_.Find(ptr) != nullptr) {
+          // Present in arg->base, so do not save
+        } else {
+          s->Add(ptr, *v);
+        }
       }
-    }
-  });
+    });
+  }
   RAW_VLOG(2, "NonLiveSnapshot output: %" PRId64 " %" PRId64 "\n",
            s->total_.allocs - s->total_.frees,
            s->total_.alloc_size - s->total_.free_size);
@@ -462,11 +1302,13 @@ void HeapProfileTable::Snapshot::ReportLeaks(const char* checker_name,
   RAW_LOG(ERROR, "The %d largest leaks:", to_report);
 
   // Print
+  const void* stack_buf[kStackDepthLimit];
   SymbolTable symbolization_table;
   for (int i = 0; i < to_report; i++) {
     const Entry& e = entries[i];
+    const void* const* stack = BucketStack(*e.bucket, stack_store_, stack_buf);
     for (int j = 0; j < e.bucket->depth; j++) {
-      symbolization_table.Add(e.bucket->stack[j]);
+      symbolization_table.Add(stack[j]);
     }
   }
   if (should_symbolize)
@@ -483,8 +1325,9 @@ void HeapProfileTable::Snapshot::ReportLeaks(const char* checker_name,
       const Entry& e = entries[i];
       printer.AppendF("Leak of %zu bytes in %d objects allocated from:\n",
                       e.bytes, e.count);
+      const void* const* stack = BucketStack(*e.bucket, stack_store_, stack_buf);
       for (int j = 0; j < e.bucket->depth; j++) {
-        const void* pc = e.bucket->stack[j];
+        const void* pc = stack[j];
         printer.AppendF("\t@ %" PRIxPTR " %s\n",
                         reinterpret_cast<uintptr_t>(pc), symbolization_table.GetSymbol(pc));
       }
@@ -497,7 +1340,7 @@ void HeapProfileTable::Snapshot::ReportLeaks(const char* checker_name,
   }
   delete[] entries;
 
-  if (!HeapProfileTable::WriteProfile(filename, total_, &map_)) {
+  if (!HeapProfileTable::WriteProfile(filename, total_, &map_, stack_store_)) {
     RAW_LOG(ERROR, "Could not write pprof profile to %s", filename);
   }
 }
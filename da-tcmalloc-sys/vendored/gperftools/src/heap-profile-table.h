@@ -36,17 +36,24 @@
 #ifndef BASE_HEAP_PROFILE_TABLE_H_
 #define BASE_HEAP_PROFILE_TABLE_H_
 
+#include <atomic>
+
 #include "addressmap-inl.h"
 #include "base/basictypes.h"
 #include "base/generic_writer.h"
 #include "base/logging.h"   // for RawFD
+#include "base/stack_store.h"
 #include "heap-profile-stats.h"
 
 // Table to maintain a heap profile data inside,
 // i.e. the set of currently active heap memory allocations.
-// thread-unsafe and non-reentrant code:
-// each instance object must be used by one thread
-// at a time w/o self-recursion.
+//
+// Allocations are kept in kShards independent shards by address (see
+// ShardOf). RecordAlloc and RecordFree may be called concurrently as
+// long as calls for the same shard are serialized by the caller
+// (heap-profiler.cc has lock per shard). Bucket table is lock-free,
+// so SaveProfile may also run concurrently with them. Everything else
+// requires exclusive access to the table. Code is non-reentrant.
 //
 // TODO(maxim): add a unittest for this class.
 class HeapProfileTable {
@@ -54,10 +61,26 @@ class HeapProfileTable {
 
   // Extension to be used for heap pforile files.
   static const char kFileExt[];
+  // Same for gzip-compressed profile.proto files.
+  static const char kProtoFileExt[];
 
-  // Longest stack trace we record.
+  // Longest stack trace we record by default.
   static const int kMaxStackDepth = 32;
 
+  // Longest stack trace we can be asked to record.
+  static const int kStackDepthLimit = 256;
+
+  // Number of independent allocation map shards.
+  static const int kShards = 32;
+
+  // Returns shard that records allocation at 'ptr'. We shard by 1 MiB
+  // address ranges, which matches AddressMap's cluster size, so that
+  // every cluster is owned by exactly one shard.
+  static int ShardOf(const void* ptr) {
+    uint64_t h = (reinterpret_cast<uintptr_t>(ptr) >> 20) * 0x9E3779B97F4A7C15ULL;
+    return static_cast<int>(h >> 59);  // top log2(kShards) bits
+  }
+
   // data types ----------------------------
 
   // Profile stats.
@@ -70,6 +93,8 @@ class HeapProfileTable {
     int stack_depth;  // depth of call_stack
     bool live;
     bool ignored;
+    // call_stack may point here, if it had to be read from StackStore.
+    const void* stack_storage[kStackDepthLimit];
   };
 
   // Memory (de)allocator interface we'll use.
@@ -78,7 +103,21 @@ class HeapProfileTable {
 
   // interface ---------------------------
 
-  HeapProfileTable(Allocator alloc, DeAllocator dealloc, bool profile_mmap);
+  // If 'sample_period' is non-zero, recorded allocations are assumed
+  // to be samples taken once every 'sample_period' bytes on average
+  // (see Sampler), and bucket stats are scaled up to estimate the
+  // real totals.
+  //
+  // If 'track_lifetimes' is true, allocations are timestamped and
+  // each bucket gets histogram of lifetimes of its freed objects
+  // (see HeapProfileLifetimes), which is included in profiles.
+  //
+  // If 'intern_stacks' is true, buckets refer to their stack traces
+  // by ids in shared StackStore instead of keeping own copies, which
+  // saves memory when stacks share callers.
+  HeapProfileTable(Allocator alloc, DeAllocator dealloc, bool profile_mmap,
+                   int64_t sample_period = 0, bool track_lifetimes = false,
+                   bool intern_stacks = false);
   ~HeapProfileTable();
 
   // Collect the stack trace for the function that asked to do the
@@ -87,8 +126,10 @@ class HeapProfileTable {
   // The stack trace is stored in 'stack'. The stack depth is returned.
   //
   // 'skip_count' gives the number of stack frames between this call
-  // and the memory allocation function.
-  static int GetCallerStackTrace(int skip_count, void* stack[kMaxStackDepth]);
+  // and the memory allocation function. At most 'max_depth' (which
+  // must not exceed kStackDepthLimit) frames are captured.
+  static int GetCallerStackTrace(int skip_count, void* stack[],
+                                 int max_depth = kMaxStackDepth);
 
   // Record an allocation at 'ptr' of 'bytes' bytes.  'stack_depth'
   // and 'call_stack' identifying the function that requested the
@@ -123,8 +164,9 @@ class HeapProfileTable {
   void MarkAsIgnored(const void* ptr);
 
   // Return current total (de)allocation statistics.  It doesn't contain
-  // mmap'ed regions.
-  const Stats& total() const { return total_; }
+  // mmap'ed regions.  Sums up all shards, so when recording is
+  // concurrent, the result is only approximately up-to-date.
+  Stats total() const;
 
   // Allocation data iteration callback: gets passed object pointer and
   // fully-filled AllocInfo.
@@ -133,18 +175,74 @@ class HeapProfileTable {
   // Iterate over the allocation profile data calling "callback"
   // for every allocation.
   void IterateAllocs(AllocIterator callback) const {
-    address_map_->Iterate([callback] (const void* ptr, AllocValue* v) {
-      AllocInfo info;
-      info.object_size = v->bytes;
-      info.call_stack = v->bucket()->stack;
-      info.stack_depth = v->bucket()->depth;
-      info.live = v->live();
-      info.ignored = v->ignore();
-      callback(ptr, info);
-    });
+    const tcmalloc::StackStore* store = stack_store_;
+    for (const Shard& shard : shards_) {
+      shard.address_map->Iterate([callback, store] (const void* ptr, AllocValue* v) {
+        AllocInfo info;
+        info.object_size = v->bytes;
+        info.call_stack = BucketStack(*v->bucket(), store, info.stack_storage);
+        info.stack_depth = v->bucket()->depth;
+        info.live = v->live();
+        info.ignored = v->ignore();
+        callback(ptr, info);
+      });
+    }
   }
 
-  void SaveProfile(tcmalloc::GenericWriter* write) const;
+  // Which buckets SaveProfile and SaveProfileProto emit. Delta
+  // profiles only have buckets which alloc_size or free_size changed
+  // since the last marked save, with their current (not
+  // differential) stats. So applying delta on top of previous
+  // profile gives full profile.
+  //
+  // Peak profiles have in-use stats of buckets as of the last
+  // NotePeak instead of current stats (and those stats are also
+  // reported as allocation stats). They don't include mmap buckets.
+  enum SaveMode {
+    kSaveAll,         // All buckets.
+    kSaveAllAndMark,  // All buckets, and remember their stats.
+    kSaveChanged,     // Only changed buckets, and remember their stats.
+    kSavePeak,        // Buckets in use at the last peak snapshot.
+  };
+
+  // Stats of buckets selected by a SaveMode, and their total, copied
+  // at one moment (see CopyStats).
+  class StatsCopy;
+
+  // For kSaveChanged, 'delta_base' is the number of the profile this
+  // one is delta of. It gets recorded in a comment after profile
+  // header. Marking modes update buckets, so saves are not const.
+  //
+  // If 'copy' is given, profile has stats from it (which must be
+  // taken for same 'mode') instead of current ones.
+  void SaveProfile(tcmalloc::GenericWriter* write,
+                   SaveMode mode = kSaveAll, int delta_base = 0,
+                   const StatsCopy* copy = nullptr);
+
+  // Same as SaveProfile, but in pprof's profile.proto format
+  // (https://github.com/google/pprof/blob/main/proto/profile.proto).
+  // Output is not compressed, pass GzipWriter to get what pprof
+  // expects. Like SaveProfile, it allocates memory only via our
+  // Allocator.
+  void SaveProfileProto(tcmalloc::GenericWriter* writer,
+                        SaveMode mode = kSaveAll, int delta_base = 0,
+                        const StatsCopy* copy = nullptr);
+
+  // Copies stats which profile saved in 'mode' would have now, so
+  // that it can be saved later, without blocking whoever decided it
+  // is time to save. Takes time proportional to the number of buckets
+  // (but doesn't do any formatting). Safe to run concurrently with
+  // recording. Caller must call ReleaseStatsCopy() on result when no
+  // longer needed.
+  StatsCopy* CopyStats(SaveMode mode);
+  void ReleaseStatsCopy(StatsCopy* copy);
+
+  // Marks current in-use stats of every bucket and given 'total' as
+  // peak ones, for kSavePeak profiles. Takes constant time: buckets
+  // save their stats as of the peak lazily, right before their first
+  // update after it (see SavePeakStats). Safe to run concurrently
+  // with recording, but not with another NotePeak.
+  void NotePeak(const Stats& total);
 
   // Cleanup any old profile files matching prefix + ".*" + kFileExt.
   static void CleanupOldProfiles(const char* prefix);
@@ -211,6 +309,26 @@ class HeapProfileTable {
 
   typedef AddressMap<AllocValue> AllocationMap;
 
+  // Allocation times (in nanoseconds) of currently allocated objects.
+  // Kept aside from AllocationMap, so that objects only pay for them
+  // (24 bytes each) when we track lifetimes.
+  typedef AddressMap<int64_t> AllocTimeMap;
+
+  // Map of currently allocated objects which addresses belong to
+  // given shard, and their (de)allocation stats. Padded to cache line
+  // size so that concurrently updated shards don't share it.
+  struct Shard {
+    AllocationMap* address_map;
+    AllocTimeMap* alloc_times;  // NULL unless we track lifetimes
+    Stats total;
+    char padding[64 - sizeof(AllocationMap*) - sizeof(AllocTimeMap*)
+                 - sizeof(Stats)];
+  };
+
+  AllocationMap* address_map(const void* ptr) const {
+    return shards_[ShardOf(ptr)].address_map;
+  }
+
   // helpers ----------------------------
 
   // Unparse bucket b and print its portion of profile dump into given
@@ -223,16 +341,58 @@ class HeapProfileTable {
                             tcmalloc::GenericWriter* writer,
                             const char* extra);
 
+  // Returns true if bucket with stats 'b' (a copy of *bucket) goes
+  // into profile saved in 'mode'. For marking modes also remembers
+  // its stats as dumped ones.
+  static bool SelectForSave(SaveMode mode, Bucket* bucket, const Bucket& b);
+
+  // Loads stats of 'bucket' that profile saved in 'mode' has into
+  // *b. Returns false if such profile skips the bucket.
+  bool LoadBucketStats(SaveMode mode, const Bucket& bucket, Bucket* b) const;
+
+  // Calls body with consistent-enough copy of every bucket (including
+  // mmap buckets, if we profile mmap) selected by 'mode', taken now
+  // or from 'copy'. Safe to run concurrently with recording, but not
+  // with another marking iteration.
+  template <typename Body>
+  void IterateBuckets(SaveMode mode, const StatsCopy* copy, const Body& body);
+
+  // Returns lifetimes histogram of the bucket, allocating it if
+  // needed.
+  HeapProfileLifetimes* GetLifetimes(Bucket* b);
+
+  // Records that allocation made at 'alloc_time' by bucket 'b', that
+  // stands for 'count' objects, is freed now.
+  void RecordLifetime(Bucket* b, int64_t alloc_time, int64_t count);
+
+  // Saves stats of 'b' as its peak ones, unless it already did since
+  // the last NotePeak. Must be called before updating 'b'.
+  void SavePeakStats(Bucket* b);
+
+  // Compute the estimated number and total size of allocations
+  // represented by recording an allocation of 'bytes' bytes.
+  void ScaledStats(size_t bytes, int64_t* count, int64_t* size) const;
+
   // Get the bucket for the caller stack trace 'key' of depth 'depth'
   // creating the bucket if needed.
   Bucket* GetBucket(int depth, const void* const key[]);
 
+  // Returns stack trace of bucket 'b'. If it is interned in 'store',
+  // it is read into 'buf' (of kStackDepthLimit entries) first.
+  static const void** BucketStack(const Bucket& b,
+                                  const tcmalloc::StackStore* store,
+                                  const void** buf);
+
+  // Returns true if bucket's stack trace is 'key' of depth 'depth'.
+  bool BucketHasStack(const Bucket& b, int depth, const void* const key[]) const;
+
   // Write contents of "*allocations" as a heap profile to
   // "file_name".  "total" must contain the total of all entries in
-  // "*allocations".
+  // "*allocations". Interned stacks are read from "stack_store".
   static bool WriteProfile(const char* file_name,
                            const Bucket& total,
-                           AllocationMap* allocations);
+                           AllocationMap* allocations,
+                           const tcmalloc::StackStore* stack_store);
 
   // data ----------------------------
 
@@ -240,21 +400,38 @@ class HeapProfileTable {
   Allocator alloc_;
   DeAllocator dealloc_;
 
-  // Overall profile stats; we use only the Stats part,
-  // but make it a Bucket to pass to UnparseBucket.
-  Bucket total_;
-
   bool profile_mmap_;
 
+  // Mean sampling period of recorded allocations, or 0 if every
+  // allocation is recorded.
+  int64_t sample_period_;
+
+  bool track_lifetimes_;
+
+  // Where bucket stack traces are interned, if we do that.
+  tcmalloc::StackStore* stack_store_;
+
+  // Total stats passed to the last NotePeak.
+  Stats peak_total_;
+
+  // Number of NotePeak calls so far.
+  std::atomic<int64_t> peak_epoch_;
+
   // Bucket hash table for malloc.
   // We hand-craft one instead of using one of the pre-written
   // ones because we do not want to use malloc when operating on the table.
   // It is only few lines of code, so no big deal.
-  Bucket** bucket_table_;
-  int num_buckets_;
+  //
+  // Buckets are never removed while the table exists, so chains are
+  // lock-free append-only lists (new buckets are CAS-ed at the head),
+  // and bucket stats are updated with atomic increments.
+  std::atomic<Bucket*>* bucket_table_;
 
-  // Map of all currently allocated objects and mapped regions we know about.
-  AllocationMap* address_map_;
+  // Number of buckets in bucket_table_.
+  std::atomic<int> num_buckets_;
+
+  // Map of all currently allocated objects we know about, by shard.
+  Shard shards_[kShards];
 
   DISALLOW_COPY_AND_ASSIGN(HeapProfileTable);
 };
@@ -290,7 +467,12 @@ class HeapProfileTable::Snapshot {
   // own object->bucket map.
   AllocationMap map_;
 
-  Snapshot(Allocator alloc, DeAllocator dealloc) : map_(alloc, dealloc) {
+  // Where parent table interns bucket stacks, if it does.
+  const tcmalloc::StackStore* stack_store_;
+
+  Snapshot(Allocator alloc, DeAllocator dealloc,
+           const tcmalloc::StackStore* stack_store)
+      : map_(alloc, dealloc), stack_store_(stack_store) {
     memset(&total_, 0, sizeof(total_));
   }
 
@@ -51,6 +51,7 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include <algorithm>
 #include <memory>
@@ -66,12 +67,15 @@
 #include "tcmalloc_guard.h"
 #include <gperftools/malloc_hook.h>
 #include <gperftools/malloc_extension.h>
+#include <gperftools/stacktrace.h>
 #include "base/spinlock.h"
 #include "base/low_level_alloc.h"
+#include "base/gzip_writer.h"
 #include "base/sysinfo.h"      // for GetUniquePathFromEnv()
 #include "heap-profile-table.h"
 #include "memory_region_map.h"
 #include "mmap_hook.h"
+#include "sampled_allocation_hooks.h"
 
 #ifndef	PATH_MAX
 #ifdef MAXPATHLEN
@@ -139,6 +143,38 @@ bool FLAGS_mmap_profile = EnvToBool("HEAP_PROFILE_MMAP", false);
 //            "If heap-profiling is on, only profile mmap, mremap, and sbrk; do not profile malloc/new/etc");
 bool FLAGS_only_mmap_profile = EnvToBool("HEAP_PROFILE_ONLY_MMAP", false);
 
+// If non-zero, instead of recording every allocation, only record
+// allocations picked by tcmalloc's sampler once every specified
+// number of bytes (on average), and scale them to estimate totals.
+int64_t FLAGS_heap_profile_sample_period = EnvToInt64("HEAP_PROFILE_SAMPLE_PERIOD", 0);
+
+// If true, HeapProfilerStart spawns a thread that writes
+// interval-triggered dumps, so that allocating threads don't.
+bool FLAGS_heap_profile_background_dump = EnvToBool("HEAP_PROFILE_BACKGROUND_DUMP", false);
+
+// If true, dumps after the first one only contain buckets that
+// changed since the previous dump. Not with exact path, and failed
+// dump makes the next one full again.
+bool FLAGS_heap_profile_delta_dumps = EnvToBool("HEAP_PROFILE_DELTA_DUMPS", false);
+
+// If true, profiles include per call site histograms of object
+// lifetimes.
+bool FLAGS_heap_profile_lifetimes = EnvToBool("HEAP_PROFILE_LIFETIMES", false);
+
+// Longest stack trace to record (0 means default,
+// HeapProfileTable::kMaxStackDepth).
+int32_t FLAGS_heap_profile_max_stack_depth = EnvToInt("HEAP_PROFILE_MAX_STACK_DEPTH", 0);
+
+// If true, stack traces of call sites are interned in shared store
+// (see StackStore) instead of each call site keeping own copy.
+bool FLAGS_heap_profile_intern_stacks = EnvToBool("HEAP_PROFILE_INTERN_STACKS", false);
+
+// If true, we keep in-use stats of every call site as of the highest
+// total in-use bytes seen, for HeapProfilerDumpPeak.
+bool FLAGS_heap_profile_track_peak = EnvToBool("HEAP_PROFILE_TRACK_PEAK", false);
+
+DECLARE_int64(tcmalloc_sample_parameter);
+
 //----------------------------------------------------------------------
 // Locking
 //----------------------------------------------------------------------
@@ -151,6 +187,36 @@ bool FLAGS_only_mmap_profile = EnvToBool("HEAP_PROFILE_ONLY_MMAP", false);
 // So we use a simple spinlock.
 static SpinLock heap_lock;
 
+// Recording of (de)allocations doesn't take heap_lock. Instead
+// heap_profile's allocation maps are sharded by address (see
+// HeapProfileTable::ShardOf), and each shard has its own lock, so
+// that threads working on unrelated memory don't contend. is_on is
+// only changed while holding all of those locks (see
+// LockAllRecordShards), so it is safe to check it under any of them.
+//
+// Every kRecordsPerDumpCheck (de)allocations recorded in a shard we
+// take heap_lock to see if it is time to dump the profile.
+static const int kRecordsPerDumpCheck = 16;
+
+struct RecordShard {
+  SpinLock lock;
+  int records_since_dump_check;  // Protected by lock.
+  char padding[64 - sizeof(SpinLock) - sizeof(int)];
+};
+static RecordShard record_shards[HeapProfileTable::kShards];
+
+static void LockAllRecordShards() {
+  for (RecordShard& shard : record_shards) {
+    shard.lock.Lock();
+  }
+}
+
+static void UnlockAllRecordShards() {
+  for (RecordShard& shard : record_shards) {
+    shard.lock.Unlock();
+  }
+}
+
 //----------------------------------------------------------------------
 // Simple allocator for heap profiler's internal memory
 //----------------------------------------------------------------------
@@ -171,16 +237,24 @@ static void ProfilerFree(void* p) {
 // Profiling control/state data
 //----------------------------------------------------------------------
 
-// Access to all of these is protected by heap_lock.
+// Access to all of these is protected by heap_lock. is_on and
+// heap_profile pointer are also protected by any of record_shards
+// locks (see above).
 static bool  is_on = false;           // If are on as a subsytem.
 static bool  dumping = false;         // Dumping status to prevent recursion
 static bool  exact_path = false;      // Use exact path
+static int   output_format = HEAP_PROFILE_FORMAT_TEXT;  // Format of dumps
+static bool  sampling = false;        // Recording only sampled allocations
+static int64_t saved_sample_parameter = 0;  // To restore at stop when sampling
+static int   max_stack_depth = HeapProfileTable::kMaxStackDepth;
 static char* filename_prefix = NULL;  // Prefix used for profile file names
                                       // (NULL if no need for dumping yet)
 static int   dump_count = 0;          // How many dumps so far
+static int   last_file_dump = 0;      // dump_count of last dump since start
 static int64_t last_dump_alloc = 0;     // alloc_size when did we last dump
 static int64_t last_dump_free = 0;      // free_size when did we last dump
 static int64_t high_water_mark = 0;     // In-use-bytes at last high-water dump
+static int64_t peak_inuse_bytes = 0;    // In-use-bytes at last noted peak
 static int64_t last_dump_time = 0;      // The time of the last dump
 
 static HeapProfileTable* heap_profile = NULL;  // the heap profile table
@@ -189,7 +263,6 @@ static HeapProfileTable* heap_profile = NULL;  // the heap profile table
 // Profile generation
 //----------------------------------------------------------------------
 
-// Input must be a buffer of size at least 1MB.
 static void DoDumpHeapProfileLocked(tcmalloc::GenericWriter* writer) {
   RAW_DCHECK(heap_lock.IsHeld(), "");
   if (is_on) {
@@ -210,50 +283,277 @@ extern "C" char* GetHeapProfile() {
 static void NewHook(const void* ptr, size_t size);
 static void DeleteHook(const void* ptr);
 
-// Helper for HeapProfilerDump.
-static void DumpProfileLocked(const char* reason) {
+// Saves profile in given HEAP_PROFILE_FORMAT_XXX format, from 'copy'
+// of stats if given. Requires dumping to be set.
+static void SaveProfileInFormat(tcmalloc::GenericWriter* writer, int format,
+                                HeapProfileTable::SaveMode mode, int delta_base,
+                                const HeapProfileTable::StatsCopy* copy = nullptr) {
+  RAW_DCHECK(dumping, "");
+  if (format == HEAP_PROFILE_FORMAT_PPROF_GZ) {
+    using tcmalloc::GzipWriter;
+    GzipWriter* gzip = new (ProfilerMalloc(sizeof(GzipWriter))) GzipWriter(writer);
+    heap_profile->SaveProfileProto(gzip, mode, delta_base, copy);
+    // Destructor writes gzip trailer.
+    gzip->~GzipWriter();
+    ProfilerFree(gzip);
+  } else {
+    heap_profile->SaveProfile(writer, mode, delta_base, copy);
+  }
+}
+
+// Where and how the next dump to file goes.
+struct DumpTarget {
+  char file_name[1000];
+  int format;
+  HeapProfileTable::SaveMode mode;
+  int delta_base;  // Number of dump this one is delta of
+};
+
+// Picks file name, format and contents for the next dump (or the
+// next peak dump) and marks us as dumping. Returns false if we do not
+// dump (yet).
+static bool BeginDumpLocked(DumpTarget* target, bool peak = false) {
   RAW_DCHECK(heap_lock.IsHeld(), "");
   RAW_DCHECK(is_on, "");
   RAW_DCHECK(!dumping, "");
 
-  if (filename_prefix == NULL) return;  // we do not yet need dumping
+  if (filename_prefix == NULL) return false;  // we do not yet need dumping
 
   dumping = true;
 
   // Make file name
-  char file_name[1000];
   dump_count++;
 
+  target->format = output_format;
   if (exact_path) {
-      snprintf(file_name, sizeof(file_name), "%s", filename_prefix);
+      snprintf(target->file_name, sizeof(target->file_name), "%s", filename_prefix);
   } else {
-      snprintf(file_name, sizeof(file_name), "%s.%04d%s",
-	      filename_prefix, dump_count, HeapProfileTable::kFileExt);
+      snprintf(target->file_name, sizeof(target->file_name), "%s.%04d%s%s",
+	      filename_prefix, dump_count, peak ? ".peak" : "",
+	      target->format == HEAP_PROFILE_FORMAT_PPROF_GZ
+	      ? HeapProfileTable::kProtoFileExt : HeapProfileTable::kFileExt);
   }
 
+  // Peak dumps are not part of delta dumps sequence.
+  if (peak) {
+    target->mode = HeapProfileTable::kSavePeak;
+    target->delta_base = 0;
+    return true;
+  }
+
+  // With delta dumps, all but first dump after start only have what
+  // changed since previous dump. Exact path would overwrite the
+  // chain's base, so there every dump is full.
+  if (!FLAGS_heap_profile_delta_dumps || exact_path) {
+    target->mode = HeapProfileTable::kSaveAll;
+  } else if (last_file_dump == 0) {
+    target->mode = HeapProfileTable::kSaveAllAndMark;
+  } else {
+    target->mode = HeapProfileTable::kSaveChanged;
+  }
+  target->delta_base = last_file_dump;
+  last_file_dump = dump_count;
+  return true;
+}
+
+// Writes the profile (from 'copy' of stats, if given) to the given
+// file. Requires dumping to be set (so that heap_profile stays alive
+// and nobody else dumps), but not necessarily heap_lock to be held.
+// Returns false if the file could not be written.
+static bool WriteDump(const DumpTarget& target, const char* reason,
+                      const HeapProfileTable::StatsCopy* copy = nullptr) {
+  RAW_DCHECK(dumping, "");
+  const char* file_name = target.file_name;
+
   // Dump the profile
   RAW_VLOG(10, "Dumping heap profile to %s (%s)", file_name, reason);
-  // We must use file routines that don't access memory, since we hold
-  // a memory lock now.
+  // We must use file routines that don't access memory, since we may
+  // hold a memory lock now.
   RawFD fd = RawOpenForWriting(file_name);
   if (fd == kIllegalRawFD) {
     RAW_LOG(ERROR, "Failed dumping heap profile to %s. Numeric errno is %d", file_name, errno);
-    dumping = false;
-    return;
+    return false;
   }
 
   using FileWriter = tcmalloc::RawFDGenericWriter<1 << 20>;
   FileWriter* writer = new (ProfilerMalloc(sizeof(FileWriter))) FileWriter(fd);
 
-  DoDumpHeapProfileLocked(writer);
+  SaveProfileInFormat(writer, target.format, target.mode, target.delta_base,
+                      copy);
 
   // Note: as part of running destructor, it saves whatever stuff we left buffered in the writer
   writer->~FileWriter();
   ProfilerFree(writer);
 
   RawClose(fd);
+  return true;
+}
+
+// Called when dump to 'target' was not written. Bucket marks may have
+// moved already (see HeapProfileTable::CopyStats), and later deltas
+// would name missing file as their base anyway, so delta chain starts
+// over with a full dump.
+static void DumpFailedLocked(const DumpTarget& target) {
+  RAW_DCHECK(heap_lock.IsHeld(), "");
+  if (target.mode == HeapProfileTable::kSaveAllAndMark
+      || target.mode == HeapProfileTable::kSaveChanged) {
+    last_file_dump = 0;
+  }
+}
+
+// Helper for HeapProfilerDump.
+static void DumpProfileLocked(const char* reason) {
+  DumpTarget target;
+  if (!BeginDumpLocked(&target)) {
+    return;
+  }
+  if (!WriteDump(target, reason)) {
+    DumpFailedLocked(target);
+  }
+  dumping = false;
+}
+
+//----------------------------------------------------------------------
+// Background dumping
+//----------------------------------------------------------------------
+
+// When enabled, interval-triggered dumps are not written by the
+// allocating thread (with heap_lock held), but handed over to a
+// background thread. Trigger begins the dump and copies bucket stats
+// (see HeapProfileTable::CopyStats), so that profile is of the moment
+// the dump was triggered. The dumper formats and writes the profile
+// from that copy without blocking anyone.
+//
+// Dumper state is protected by dumper_mutex. Lock ordering is
+// heap_lock -> dumper_mutex. dumper_cond is also broadcast whenever a
+// dump that runs without heap_lock held is done (see EndDumpLocked),
+// so everyone waiting on it rechecks their condition.
+static pthread_mutex_t dumper_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dumper_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t dumper_thread;
+static bool dumper_running = false;   // Also protected by heap_lock.
+static bool dumper_exit = false;
+static bool dump_requested = false;
+static char requested_reason[128];
+static DumpTarget requested_target;
+static HeapProfileTable::StatsCopy* requested_copy;
+
+// Set (under heap_lock) by signal handler that found another dump in
+// progress. It can't wait, so whoever ends that dump does it instead.
+static bool signal_dump_pending = false;
+
+// Waits until dump that runs without heap_lock held (by background
+// dumper or HeapProfilerWriteProfile) is done. Temporarily releases
+// heap_lock.
+static void WaitForDumpLocked() {
+  RAW_DCHECK(heap_lock.IsHeld(), "");
+  while (dumping) {
+    // Taking dumper_mutex before dropping heap_lock means
+    // EndDumpLocked can't broadcast before we wait.
+    pthread_mutex_lock(&dumper_mutex);
+    heap_lock.Unlock();
+    pthread_cond_wait(&dumper_cond, &dumper_mutex);
+    pthread_mutex_unlock(&dumper_mutex);
+    heap_lock.Lock();
+  }
+}
+
+static bool RequestBackgroundDumpLocked(const char* reason);
 
+// Ends dump that ran without heap_lock held and wakes up those
+// waiting for it. Signal dump that came in meanwhile is done now.
+static void EndDumpLocked() {
+  RAW_DCHECK(heap_lock.IsHeld(), "");
+  RAW_DCHECK(dumping, "");
   dumping = false;
+  if (signal_dump_pending && is_on) {
+    signal_dump_pending = false;
+    if (!RequestBackgroundDumpLocked("signal")) {
+      DumpProfileLocked("signal");
+    }
+  }
+  pthread_mutex_lock(&dumper_mutex);
+  pthread_cond_broadcast(&dumper_cond);
+  pthread_mutex_unlock(&dumper_mutex);
+}
+
+static void* BackgroundDumperMain(void*) {
+  pthread_mutex_lock(&dumper_mutex);
+  for (;;) {
+    while (!dump_requested && !dumper_exit) {
+      pthread_cond_wait(&dumper_cond, &dumper_mutex);
+    }
+    // Requested dump is already begun, so we finish it even if we
+    // are asked to exit.
+    if (!dump_requested) {
+      break;
+    }
+    char reason[sizeof(requested_reason)];
+    memcpy(reason, requested_reason, sizeof(reason));
+    const DumpTarget target = requested_target;
+    HeapProfileTable::StatsCopy* copy = requested_copy;
+    requested_copy = nullptr;
+    dump_requested = false;
+    pthread_mutex_unlock(&dumper_mutex);
+
+    const bool written = WriteDump(target, reason, copy);
+    {
+      SpinLockHolder l(&heap_lock);
+      heap_profile->ReleaseStatsCopy(copy);
+      if (!written) {
+        DumpFailedLocked(target);
+      }
+      EndDumpLocked();
+    }
+
+    pthread_mutex_lock(&dumper_mutex);
+  }
+  pthread_mutex_unlock(&dumper_mutex);
+  return nullptr;
+}
+
+// Begins the dump and hands it over to background dumper. Returns
+// false if there is no dumper running.
+static bool RequestBackgroundDumpLocked(const char* reason) {
+  RAW_DCHECK(heap_lock.IsHeld(), "");
+  if (!dumper_running) {
+    return false;
+  }
+  DumpTarget target;
+  if (!BeginDumpLocked(&target)) {
+    return true;
+  }
+  HeapProfileTable::StatsCopy* copy = heap_profile->CopyStats(target.mode);
+  pthread_mutex_lock(&dumper_mutex);
+  snprintf(requested_reason, sizeof(requested_reason), "%s", reason);
+  requested_target = target;
+  requested_copy = copy;
+  dump_requested = true;
+  pthread_cond_broadcast(&dumper_cond);
+  pthread_mutex_unlock(&dumper_mutex);
+  return true;
+}
+
+// Must be called without heap_lock held, since dumper may need it
+// to finish what it is doing.
+static void StopBackgroundDumper() {
+  {
+    SpinLockHolder l(&heap_lock);
+    if (!dumper_running) {
+      return;
+    }
+    dumper_running = false;
+  }
+
+  pthread_mutex_lock(&dumper_mutex);
+  dumper_exit = true;
+  pthread_cond_broadcast(&dumper_cond);
+  pthread_mutex_unlock(&dumper_mutex);
+
+  pthread_join(dumper_thread, nullptr);
+
+  dumper_exit = false;
+  dump_requested = false;
 }
 
 //----------------------------------------------------------------------
@@ -261,11 +561,22 @@ static void DumpProfileLocked(const char* reason) {
 //----------------------------------------------------------------------
 
 // Dump a profile after either an allocation or deallocation, if
-// the memory use has changed enough since the last dump.
+// the memory use has changed enough since the last dump. Also take
+// peak snapshot if we see new peak.
 static void MaybeDumpProfileLocked() {
+  const HeapProfileTable::Stats total = heap_profile->total();
+  const int64_t inuse_bytes = total.alloc_size - total.free_size;
+
+  // Noting peak is cheap, so we do it on every new peak we see. It
+  // only misses whatever got allocated (and freed) between dump checks.
+  // Only peak dumps read peak stats, and those copy them under
+  // heap_lock, so we don't wait for dumps.
+  if (FLAGS_heap_profile_track_peak && inuse_bytes > peak_inuse_bytes) {
+    heap_profile->NotePeak(total);
+    peak_inuse_bytes = inuse_bytes;
+  }
+
   if (!dumping) {
-    const HeapProfileTable::Stats& total = heap_profile->total();
-    const int64_t inuse_bytes = total.alloc_size - total.free_size;
     bool need_to_dump = false;
     char buf[128];
 
@@ -300,7 +611,9 @@ static void MaybeDumpProfileLocked() {
       }
     }
     if (need_to_dump) {
-      DumpProfileLocked(buf);
+      if (!RequestBackgroundDumpLocked(buf)) {
+        DumpProfileLocked(buf);
+      }
 
       last_dump_alloc = total.alloc_size;
       last_dump_free = total.free_size;
@@ -310,24 +623,64 @@ static void MaybeDumpProfileLocked() {
   }
 }
 
-// Record an allocation in the profile.
-static void RecordAlloc(const void* ptr, size_t bytes, int skip_count) {
-  // Take the stack trace outside the critical section.
-  void* stack[HeapProfileTable::kMaxStackDepth];
-  int depth = HeapProfileTable::GetCallerStackTrace(skip_count + 1, stack);
+// Check if it is time to dump the profile. Called without holding
+// any locks after every kRecordsPerDumpCheck records in a shard.
+static void MaybeDumpProfile() {
   SpinLockHolder l(&heap_lock);
   if (is_on) {
-    heap_profile->RecordAlloc(ptr, bytes, depth, stack);
     MaybeDumpProfileLocked();
   }
 }
 
+// Returns true if we need to call MaybeDumpProfile.
+// REQUIRES: shard->lock is held
+static bool CountRecordLocked(RecordShard* shard) {
+  if (++shard->records_since_dump_check < kRecordsPerDumpCheck) {
+    return false;
+  }
+  shard->records_since_dump_check = 0;
+  return true;
+}
+
+// Record an allocation with given stack trace in the profile.
+static void RecordAllocWithStack(const void* ptr, size_t bytes,
+                                 int depth, const void* const stack[]) {
+  RecordShard* shard = &record_shards[HeapProfileTable::ShardOf(ptr)];
+  bool check_dump = false;
+  {
+    SpinLockHolder l(&shard->lock);
+    if (is_on) {
+      heap_profile->RecordAlloc(ptr, bytes, depth, stack);
+      check_dump = CountRecordLocked(shard);
+    }
+  }
+  if (check_dump) {
+    MaybeDumpProfile();
+  }
+}
+
+// Record an allocation in the profile.
+static void RecordAlloc(const void* ptr, size_t bytes, int skip_count) {
+  // Take the stack trace outside the critical section.
+  void* stack[HeapProfileTable::kStackDepthLimit];
+  int depth = HeapProfileTable::GetCallerStackTrace(skip_count + 1, stack,
+                                                    max_stack_depth);
+  RecordAllocWithStack(ptr, bytes, depth, stack);
+}
+
 // Record a deallocation in the profile.
 static void RecordFree(const void* ptr) {
-  SpinLockHolder l(&heap_lock);
-  if (is_on) {
-    heap_profile->RecordFree(ptr);
-    MaybeDumpProfileLocked();
+  RecordShard* shard = &record_shards[HeapProfileTable::ShardOf(ptr)];
+  bool check_dump = false;
+  {
+    SpinLockHolder l(&shard->lock);
+    if (is_on) {
+      heap_profile->RecordFree(ptr);
+      check_dump = CountRecordLocked(shard);
+    }
+  }
+  if (check_dump) {
+    MaybeDumpProfile();
   }
 }
 
@@ -345,6 +698,23 @@ void DeleteHook(const void* ptr) {
   if (ptr != NULL) RecordFree(ptr);
 }
 
+//----------------------------------------------------------------------
+// Sampled allocation hooks (see sampled_allocation_hooks.h)
+//----------------------------------------------------------------------
+
+static void SampledNewHook(const void* ptr, size_t size,
+                           const tcmalloc::StackTrace& stack) {
+  // Sampler already captured the stack trace for us. It is never
+  // deeper than tcmalloc's kMaxStackDepth, but may be deeper than we
+  // want.
+  RecordAllocWithStack(ptr, size, std::min<int>(stack.depth, max_stack_depth),
+                       stack.stack);
+}
+
+static void SampledDeleteHook(const void* ptr) {
+  RecordFree(ptr);
+}
+
 static tcmalloc::MappingHookSpace mmap_logging_hook_space;
 
 static void LogMappingEvent(const tcmalloc::MappingEvent& evt) {
@@ -403,8 +773,6 @@ extern "C" void HeapProfilerStart(const char* prefix) {
 
   if (is_on) return;
 
-  is_on = true;
-
   RAW_VLOG(10, "Starting tracking the heap");
 
   // This should be done before the hooks are set up, since it should
@@ -429,22 +797,60 @@ extern "C" void HeapProfilerStart(const char* prefix) {
 
   heap_profiler_memory = LowLevelAlloc::NewArena(nullptr);
 
+  sampling = (FLAGS_heap_profile_sample_period > 0);
+  max_stack_depth = HeapProfileTable::kMaxStackDepth;
+  if (FLAGS_heap_profile_max_stack_depth > 0) {
+    max_stack_depth = std::min<int>(FLAGS_heap_profile_max_stack_depth,
+                                    HeapProfileTable::kStackDepthLimit);
+  }
+
   heap_profile = new(ProfilerMalloc(sizeof(HeapProfileTable)))
-      HeapProfileTable(ProfilerMalloc, ProfilerFree, FLAGS_mmap_profile);
+      HeapProfileTable(ProfilerMalloc, ProfilerFree, FLAGS_mmap_profile,
+                       sampling ? FLAGS_heap_profile_sample_period : 0,
+                       FLAGS_heap_profile_lifetimes,
+                       FLAGS_heap_profile_intern_stacks);
+
+  LockAllRecordShards();
+  is_on = true;
+  for (RecordShard& shard : record_shards) {
+    shard.records_since_dump_check = 0;
+  }
+  UnlockAllRecordShards();
 
   last_dump_alloc = 0;
   last_dump_free = 0;
   high_water_mark = 0;
+  peak_inuse_bytes = 0;
   last_dump_time = 0;
+  last_file_dump = 0;
 
   // We do not reset dump_count so if the user does a sequence of
   // HeapProfilerStart/HeapProfileStop, we will get a continuous
   // sequence of profiles.
 
+  // Spawn it before installing hooks, since creating thread mallocs,
+  // and our hooks may need heap_lock, which we hold.
+  if (FLAGS_heap_profile_background_dump) {
+    int err = pthread_create(&dumper_thread, nullptr, BackgroundDumperMain, nullptr);
+    if (err != 0) {
+      RAW_LOG(ERROR, "Failed to start heap profile dumper thread: %d", err);
+    } else {
+      dumper_running = true;
+    }
+  }
+
   if (FLAGS_only_mmap_profile == false) {
-    // Now set the hooks that capture new/delete and malloc/free.
-    RAW_CHECK(MallocHook::AddNewHook(&NewHook), "");
-    RAW_CHECK(MallocHook::AddDeleteHook(&DeleteHook), "");
+    if (sampling) {
+      // Let tcmalloc's sampler pick allocations for us. Sampled
+      // allocations are rare enough, so we leave malloc fast-path alone.
+      saved_sample_parameter = FLAGS_tcmalloc_sample_parameter;
+      FLAGS_tcmalloc_sample_parameter = FLAGS_heap_profile_sample_period;
+      RAW_CHECK(tcmalloc::SetSampledAllocationHooks(&SampledNewHook, &SampledDeleteHook), "");
+    } else {
+      // Now set the hooks that capture new/delete and malloc/free.
+      RAW_CHECK(MallocHook::AddNewHook(&NewHook), "");
+      RAW_CHECK(MallocHook::AddDeleteHook(&DeleteHook), "");
+    }
   }
 
   // Copy filename prefix
@@ -461,20 +867,38 @@ extern "C" int IsHeapProfilerRunning() {
 }
 
 extern "C" void HeapProfilerStop() {
+  StopBackgroundDumper();
+
   SpinLockHolder l(&heap_lock);
 
   if (!is_on) return;
 
+  // Streaming dump may still be using heap_profile.
+  WaitForDumpLocked();
+  if (!is_on) return;
+
   if (FLAGS_only_mmap_profile == false) {
-    // Unset our new/delete hooks, checking they were set:
-    RAW_CHECK(MallocHook::RemoveNewHook(&NewHook), "");
-    RAW_CHECK(MallocHook::RemoveDeleteHook(&DeleteHook), "");
+    if (sampling) {
+      RAW_CHECK(tcmalloc::SetSampledAllocationHooks(nullptr, nullptr), "");
+      FLAGS_tcmalloc_sample_parameter = saved_sample_parameter;
+    } else {
+      // Unset our new/delete hooks, checking they were set:
+      RAW_CHECK(MallocHook::RemoveNewHook(&NewHook), "");
+      RAW_CHECK(MallocHook::RemoveDeleteHook(&DeleteHook), "");
+    }
   }
   if (FLAGS_mmap_log) {
     // Restore mmap/sbrk hooks, checking that our hooks were set:
     tcmalloc::UnHookMMapEvents(&mmap_logging_hook_space);
   }
 
+  // Some threads may still be running our hooks. Once they see is_on
+  // being false, they won't touch heap_profile anymore.
+  LockAllRecordShards();
+  is_on = false;
+  UnlockAllRecordShards();
+  signal_dump_pending = false;
+
   // free profile
   heap_profile->~HeapProfileTable();
   ProfilerFree(heap_profile);
@@ -483,6 +907,7 @@ extern "C" void HeapProfilerStop() {
   // free prefix
   ProfilerFree(filename_prefix);
   filename_prefix = NULL;
+  exact_path = false;
 
   if (!LowLevelAlloc::DeleteArena(heap_profiler_memory)) {
     RAW_LOG(FATAL, "Memory leak in HeapProfiler:");
@@ -491,10 +916,14 @@ extern "C" void HeapProfilerStop() {
   if (FLAGS_mmap_profile) {
     MemoryRegionMap::Shutdown();
   }
-
-  is_on = false;
 }
 
+// True if HeapProfilerSetVars switched stack capturing to frame
+// pointer unwinder (see SetStackTraceMethod). We only switch it when
+// requested setting changes, so that we don't override method chosen
+// by other means.
+static bool using_frame_pointer_unwinder = false;
+
 /* Set variables */
 extern "C" void HeapProfilerSetVars(const struct HeapProfilerVars *vars)
 {
@@ -505,12 +934,48 @@ extern "C" void HeapProfilerSetVars(const struct HeapProfilerVars *vars)
     FLAGS_mmap_log = vars->mmap_log;
     FLAGS_mmap_profile = vars->mmap_profile;
     FLAGS_only_mmap_profile = vars->only_mmap_profile;
+    FLAGS_heap_profile_sample_period = vars->heap_profile_sample_period;
+    FLAGS_heap_profile_background_dump = vars->background_dump;
+    FLAGS_heap_profile_delta_dumps = vars->delta_dumps;
+    FLAGS_heap_profile_lifetimes = vars->lifetime_histograms;
+    FLAGS_heap_profile_max_stack_depth = vars->max_stack_depth;
+    FLAGS_heap_profile_intern_stacks = vars->intern_stacks;
+    FLAGS_heap_profile_track_peak = vars->track_peak;
+    if (vars->frame_pointer_unwinder != using_frame_pointer_unwinder) {
+      if (!vars->frame_pointer_unwinder) {
+        SetStackTraceMethod(nullptr);
+        using_frame_pointer_unwinder = false;
+      } else if (SetStackTraceMethod("generic_fp")) {
+        using_frame_pointer_unwinder = true;
+      } else {
+        RAW_LOG(WARNING, "Frame pointer unwinder is not supported on this platform");
+      }
+    }
+}
+
+extern "C" void HeapProfilerGetVars(struct HeapProfilerVars *vars)
+{
+    vars->heap_profile_allocation_interval = FLAGS_heap_profile_allocation_interval;
+    vars->heap_profile_deallocation_interval = FLAGS_heap_profile_deallocation_interval;
+    vars->heap_profile_inuse_interval = FLAGS_heap_profile_inuse_interval;
+    vars->heap_profile_time_interval = FLAGS_heap_profile_time_interval;
+    vars->mmap_log = FLAGS_mmap_log;
+    vars->mmap_profile = FLAGS_mmap_profile;
+    vars->only_mmap_profile = FLAGS_only_mmap_profile;
+    vars->heap_profile_sample_period = FLAGS_heap_profile_sample_period;
+    vars->background_dump = FLAGS_heap_profile_background_dump;
+    vars->delta_dumps = FLAGS_heap_profile_delta_dumps;
+    vars->lifetime_histograms = FLAGS_heap_profile_lifetimes;
+    vars->frame_pointer_unwinder = using_frame_pointer_unwinder;
+    vars->max_stack_depth = FLAGS_heap_profile_max_stack_depth;
+    vars->intern_stacks = FLAGS_heap_profile_intern_stacks;
+    vars->track_peak = FLAGS_heap_profile_track_peak;
 }
 
 /* Disregard 'prefix' and set pathname for next dump */
 extern "C" void HeapProfilerSetExactPath(const char *path) {
   SpinLockHolder l(&heap_lock);
-  RAW_DCHECK(filename_prefix == NULL, "");
+  // Replaces prefix given to HeapProfilerStart, if any.
   ProfilerFree(filename_prefix);
 
   const int prefix_length = strlen(path);
@@ -520,13 +985,89 @@ extern "C" void HeapProfilerSetExactPath(const char *path) {
   exact_path = true;
 }
 
+extern "C" void HeapProfilerSetFormat(int format) {
+  SpinLockHolder l(&heap_lock);
+  output_format = format;
+}
+
 extern "C" void HeapProfilerDump(const char *reason) {
   SpinLockHolder l(&heap_lock);
-  if (is_on && !dumping) {
+  // Don't lose on-demand dump to concurrent background one.
+  WaitForDumpLocked();
+  if (is_on) {
     DumpProfileLocked(reason);
   }
 }
 
+extern "C" void HeapProfilerDumpPeak(const char *reason) {
+  DumpTarget target;
+  HeapProfileTable::StatsCopy* copy;
+  {
+    SpinLockHolder l(&heap_lock);
+    if (!is_on) {
+      return;
+    }
+    if (!FLAGS_heap_profile_track_peak) {
+      RAW_LOG(WARNING, "Peak heap profile requested, but peak tracking is off");
+      return;
+    }
+    // Don't lose on-demand dump to concurrent background one.
+    WaitForDumpLocked();
+    if (!is_on || !BeginDumpLocked(&target, /* peak */ true)) {
+      return;
+    }
+    // Copy peak stats, so that new peaks don't change them under us,
+    // and write without holding heap_lock (dumping flag keeps
+    // heap_profile alive, see HeapProfilerStop).
+    copy = heap_profile->CopyStats(target.mode);
+  }
+
+  WriteDump(target, reason, copy);
+
+  SpinLockHolder l(&heap_lock);
+  heap_profile->ReleaseStatsCopy(copy);
+  EndDumpLocked();
+}
+
+namespace {
+
+struct CallbackWriteFn {
+  HeapProfileWriteFn fn;
+  void* arg;
+  void operator()(const char* buf, size_t amt) const {
+    fn(arg, buf, amt);
+  }
+};
+
+}  // namespace
+
+extern "C" int HeapProfilerWriteProfile(int format, HeapProfileWriteFn write_fn, void* arg) {
+  {
+    SpinLockHolder l(&heap_lock);
+    WaitForDumpLocked();
+    if (!is_on) {
+      return 0;
+    }
+    // We are going to call write_fn, which may allocate and thus
+    // need heap_lock. So we drop heap_lock and only have dumping
+    // flag to keep heap_profile alive (see HeapProfilerStop).
+    dumping = true;
+  }
+
+  const CallbackWriteFn callback{write_fn, arg};
+  using Writer = tcmalloc::WriteFnWriter<CallbackWriteFn, 1 << 20>;
+  Writer* writer = new (ProfilerMalloc(sizeof(Writer))) Writer(callback);
+
+  SaveProfileInFormat(writer, format, HeapProfileTable::kSaveAll, 0);
+
+  writer->~Writer();
+  ProfilerFree(writer);
+
+  SpinLockHolder l(&heap_lock);
+  EndDumpLocked();
+  return 1;
+}
+
 // Signal handler that is registered when a user selectable signal
 // number is defined in the environment variable HEAPPROFILESIGNAL.
 static void HeapProfilerDumpSignal(int signal_number) {
@@ -534,8 +1075,13 @@ static void HeapProfilerDumpSignal(int signal_number) {
   if (!heap_lock.TryLock()) {
     return;
   }
-  if (is_on && !dumping) {
-    DumpProfileLocked("signal");
+  if (is_on) {
+    if (dumping) {
+      // We can't wait here, so it is done when current dump ends.
+      signal_dump_pending = true;
+    } else {
+      DumpProfileLocked("signal");
+    }
   }
   heap_lock.Unlock();
 }
@@ -0,0 +1,232 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// large_span_index.h holds index of free spans longer than kMaxPages
+// that page heap uses for best-fit search. Spans are kept in
+// intrusive lists bucketed by length, log-linearly: every power of
+// two range of lengths is split into kSubBuckets equal parts. Bitmap
+// of non-empty buckets lets us find next suitable bucket with a
+// couple of bit scans. Since bucket order follows length order, best
+// fit is always either in bucket of requested length or in first
+// non-empty bucket after it. We don't look for best fit exactly but
+// take first span that fits from bucket of requested length, or head
+// of next non-empty bucket, where every span fits. Either way we get
+// a span from the same bucket as best fit, i.e. at most
+// 1/kSubBuckets longer. Insertions and removals are O(1) and only
+// touch neighbors of the span in its list.
+#ifndef TCMALLOC_LARGE_SPAN_INDEX_H_
+#define TCMALLOC_LARGE_SPAN_INDEX_H_
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "base/basictypes.h"
+#include "common.h"
+#include "internal_logging.h"
+#include "span.h"
+
+namespace tcmalloc {
+
+class LargeSpanIndex {
+ public:
+  static constexpr int kSubBucketBits = 3;
+  static constexpr int kSubBuckets = 1 << kSubBucketBits;
+  static constexpr int kNumBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+  static int BucketFor(Length length) {
+    ASSERT(length > 0);
+    if (length < kSubBuckets) {
+      return static_cast<int>(length);
+    }
+    const int msb = 63 - CountLeadingZeros(length);
+    const int shift = msb - kSubBucketBits;
+    return (shift + 1) * kSubBuckets
+        + static_cast<int>((length >> shift) & (kSubBuckets - 1));
+  }
+
+  bool empty() const {
+    for (int i = 0; i < kWords; i++) {
+      if (nonempty_[i] != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Inserts span. Span's next and prev fields are used for linking.
+  void Insert(Span* span) {
+    const int b = BucketFor(span->length);
+    span->prev = nullptr;
+    span->next = heads_[b];
+    if (span->next != nullptr) {
+      span->next->prev = span;
+    }
+    heads_[b] = span;
+    nonempty_[b / 64] |= uint64_t{1} << (b % 64);
+  }
+
+  // Removes span. Span's length must be same as when it was inserted.
+  void Remove(Span* span) {
+    const int b = BucketFor(span->length);
+    if (span->prev != nullptr) {
+      span->prev->next = span->next;
+    } else {
+      ASSERT(heads_[b] == span);
+      heads_[b] = span->next;
+      if (heads_[b] == nullptr) {
+        nonempty_[b / 64] &= ~(uint64_t{1} << (b % 64));
+      }
+    }
+    if (span->next != nullptr) {
+      span->next->prev = span->prev;
+    }
+    span->next = span->prev = nullptr;
+  }
+
+  // Returns span with length >= n from the same bucket as shortest
+  // such span, or NULL if there is none.
+  Span* FindGoodFit(Length n) const {
+    int b = BucketFor(n);
+    // Bucket of n may have spans both shorter and longer than n.
+    for (Span* s = heads_[b]; s != nullptr; s = s->next) {
+      if (s->length >= n) {
+        return s;
+      }
+    }
+    b = NextNonEmpty(b + 1);
+    return b < 0 ? nullptr : heads_[b];
+  }
+
+  // Returns some of the shortest spans, or NULL if index is empty.
+  Span* First() const {
+    const int b = NextNonEmpty(0);
+    return b < 0 ? nullptr : heads_[b];
+  }
+
+  // Calls body for each span at least min_length long (and maybe
+  // some shorter ones), roughly from the longest to the
+  // shortest. Stops when body returns false. Body may remove span it
+  // is given and insert spans not longer than that.
+  template <typename Body>
+  void ForEachFromLongest(Length min_length, const Body& body) {
+    const int lowest = BucketFor(min_length > 0 ? min_length : 1);
+    for (int b = PrevNonEmpty(kNumBuckets - 1); b >= lowest; b = PrevNonEmpty(b - 1)) {
+      for (Span* s = heads_[b]; s != nullptr; ) {
+        Span* next = s->next;
+        if (!body(s)) {
+          return;
+        }
+        s = next;
+      }
+    }
+  }
+
+  template <typename Body>
+  void ForEach(const Body& body) const {
+    for (int b = NextNonEmpty(0); b >= 0; b = NextNonEmpty(b + 1)) {
+      for (Span* s = heads_[b]; s != nullptr; s = s->next) {
+        body(s);
+      }
+    }
+  }
+
+ private:
+  static constexpr int kWords = (kNumBuckets + 63) / 64;
+
+  static int CountLeadingZeros(uint64_t v) {
+    ASSERT(v != 0);
+#if defined(__GNUC__)
+    return __builtin_clzll(v);
+#else
+    int n = 0;
+    while (!(v & (uint64_t{1} << 63))) {
+      v <<= 1;
+      n++;
+    }
+    return n;
+#endif
+  }
+
+  static int CountTrailingZeros(uint64_t v) {
+    ASSERT(v != 0);
+#if defined(__GNUC__)
+    return __builtin_ctzll(v);
+#else
+    int n = 0;
+    while (!(v & 1)) {
+      v >>= 1;
+      n++;
+    }
+    return n;
+#endif
+  }
+
+  // Returns first non-empty bucket >= b, or -1.
+  int NextNonEmpty(int b) const {
+    if (b >= kNumBuckets) {
+      return -1;
+    }
+    int w = b / 64;
+    uint64_t bits = nonempty_[w] & (~uint64_t{0} << (b % 64));
+    while (bits == 0) {
+      if (++w == kWords) {
+        return -1;
+      }
+      bits = nonempty_[w];
+    }
+    return w * 64 + CountTrailingZeros(bits);
+  }
+
+  // Returns last non-empty bucket <= b, or -1.
+  int PrevNonEmpty(int b) const {
+    if (b < 0) {
+      return -1;
+    }
+    int w = b / 64;
+    uint64_t bits = nonempty_[w] & (~uint64_t{0} >> (63 - b % 64));
+    while (bits == 0) {
+      if (--w < 0) {
+        return -1;
+      }
+      bits = nonempty_[w];
+    }
+    return w * 64 + 63 - CountLeadingZeros(bits);
+  }
+
+  Span* heads_[kNumBuckets] = {};
+  uint64_t nonempty_[kWords] = {};
+};
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_LARGE_SPAN_INDEX_H_
@@ -161,6 +161,20 @@ void MallocExtension::MarkThreadTemporarilyIdle() {
   // Default implementation does nothing
 }
 
+size_t MallocExtension::ReleaseOldFreeMemory(size_t num_bytes, size_t min_age_ms) {
+  // Default implementation does nothing
+  return 0;
+}
+
+void MallocExtension::GetSizeClasses(
+  std::vector<MallocExtension::SizeClassInfo>* v) {
+  v->clear();
+}
+
+const char* MallocExtension::CheckSizeClasses(const char* spec) {
+  return "size classes are not supported";
+}
+
 // The current malloc extension object.
 
 static std::atomic<MallocExtension*> current_instance;
@@ -333,6 +347,23 @@ C_SHIM(GetEstimatedAllocatedSize, size_t, (size_t size), (size));
 C_SHIM(GetAllocatedSize, size_t, (const void* p), (p));
 C_SHIM(GetThreadCacheSize, size_t, (void), ());
 C_SHIM(MarkThreadTemporarilyIdle, void, (void), ());
+C_SHIM(ReleaseOldFreeMemory, size_t,
+       (size_t num_bytes, size_t min_age_ms), (num_bytes, min_age_ms));
+C_SHIM(CheckSizeClasses, const char*, (const char* spec), (spec));
+
+// Can't use the shim here because of the need to flatten the vector.
+extern "C"
+int MallocExtension_GetSizeClasses(size_t* sizes, size_t* pages,
+                                   size_t* objects_to_move, int max_classes) {
+  std::vector<MallocExtension::SizeClassInfo> v;
+  MallocExtension::instance()->GetSizeClasses(&v);
+  for (int i = 0; i < max_classes && i < v.size(); i++) {
+    sizes[i] = v[i].size;
+    pages[i] = v[i].pages;
+    objects_to_move[i] = v[i].objects_to_move;
+  }
+  return v.size();
+}
 
 // Can't use the shim here because of the need to translate the enums.
 extern "C"
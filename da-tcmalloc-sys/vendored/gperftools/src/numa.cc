@@ -0,0 +1,115 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <config.h>
+
+#include "numa.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "internal_logging.h"
+
+// Avoid dependency on libnuma and on linux/mempolicy.h.
+#define TCMALLOC_MPOL_PREFERRED 1
+#define TCMALLOC_MPOL_F_MEMS_ALLOWED (1 << 2)
+
+namespace tcmalloc {
+
+int Numa::num_nodes_ = 1;
+
+void Numa::Init(bool enable) {
+#if defined(__linux__) && defined(SYS_get_mempolicy) && defined(SYS_mbind)
+  if (!enable) {
+    return;
+  }
+
+  // Kernel insists on mask being at least as large as number of
+  // nodes it supports. 1024 is most it supports by default.
+  static constexpr int kMaskBits = 1024;
+  static constexpr int kBitsPerWord = sizeof(unsigned long) * 8;
+  unsigned long mask[kMaskBits / kBitsPerWord] = {};
+  if (syscall(SYS_get_mempolicy, nullptr, mask, kMaskBits, nullptr,
+              TCMALLOC_MPOL_F_MEMS_ALLOWED) != 0) {
+    return;
+  }
+
+  int nodes = 0;
+  for (int i = 0; i < kMaskBits; i++) {
+    if (mask[i / kBitsPerWord] & (1UL << (i % kBitsPerWord))) {
+      nodes = i + 1;
+    }
+  }
+  if (nodes > kMaxNodes) {
+    Log(kLog, __FILE__, __LINE__,
+        "tcmalloc: too many NUMA nodes, NUMA mode disabled", nodes);
+    return;
+  }
+  if (nodes > 1) {
+    num_nodes_ = nodes;
+  }
+#endif
+}
+
+int Numa::CurrentNodeSlow() {
+  unsigned node = 0;
+#if defined(__linux__)
+#if defined(__GLIBC_PREREQ) && __GLIBC_PREREQ(2, 29)
+  // Served by vDSO, so doesn't cost us a syscall.
+  unsigned cpu;
+  if (getcpu(&cpu, &node) != 0) {
+    node = 0;
+  }
+#elif defined(SYS_getcpu)
+  if (syscall(SYS_getcpu, nullptr, &node, nullptr) != 0) {
+    node = 0;
+  }
+#endif
+#endif
+  return node < static_cast<unsigned>(num_nodes_) ? node : 0;
+}
+
+void Numa::BindToNode(void* ptr, size_t size, int node) {
+#if defined(__linux__) && defined(SYS_mbind)
+  ASSERT(IsActive());
+  ASSERT(0 <= node && node < num_nodes_);
+  unsigned long mask = 1UL << node;
+  // Failure is fine, we'll merely get memory from whatever node
+  // kernel prefers.
+  syscall(SYS_mbind, ptr, size, TCMALLOC_MPOL_PREFERRED,
+          &mask, sizeof(mask) * 8, 0);
+#endif
+}
+
+}  // namespace tcmalloc
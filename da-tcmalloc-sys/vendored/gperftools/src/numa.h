@@ -0,0 +1,96 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// numa.h holds optional NUMA awareness support. When it is enabled
+// (see TCMALLOC_NUMA_AWARE) and machine has more than one memory
+// node, page heap keeps separate span pools per node, there is one
+// set of central free lists per node and memory obtained from system
+// is bound (preferred, to be precise) to the node it is meant for.
+// Front-end caches then refill from and release to central free lists
+// of the node they're currently running on.
+//
+// Objects freed on another node than their memory's still go to the
+// freeing thread's front-end cache and may be reused there. Sorting
+// them out on every free would cost a span lookup (free path only
+// gets size class from the cache) and a central free list lock for
+// each such object. They are sorted out once front-end cache hands
+// them back (see CentralFreeList::InsertRange), so transfer caches
+// only have local memory.
+#ifndef TCMALLOC_NUMA_H_
+#define TCMALLOC_NUMA_H_
+
+#include "config.h"
+
+#include <stddef.h>
+
+#include "base/basictypes.h"
+
+namespace tcmalloc {
+
+class Numa {
+ public:
+  // Span::node has room for that many nodes. Machines with memory
+  // nodes numbered this or higher are run in non-NUMA mode.
+  static constexpr int kMaxNodes = 8;
+
+  // Called once from Static::InitStaticVars, before page heap and
+  // central free lists are set up.
+  static void Init(bool enable);
+
+  // Returns number of memory nodes we keep separate pools for. 1 if
+  // NUMA mode is not active.
+  static int num_nodes() { return num_nodes_; }
+
+  static bool IsActive() { return num_nodes_ > 1; }
+
+  // Returns memory node we're currently running on. Always 0 if NUMA
+  // mode is not active.
+  static int CurrentNode() {
+    if (PREDICT_TRUE(!IsActive())) {
+      return 0;
+    }
+    return CurrentNodeSlow();
+  }
+
+  // Asks kernel to place (not yet touched) pages of [ptr, ptr + size)
+  // on given node. Memory is still taken from other nodes if this one
+  // is full.
+  static void BindToNode(void* ptr, size_t size, int node);
+
+ private:
+  static int CurrentNodeSlow();
+
+  ATTRIBUTE_HIDDEN static int num_nodes_;
+};
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_NUMA_H_
@@ -45,11 +45,9 @@
 // kKeybits - kHashbits, and the values are bit strings of length kValuebits.
 //
 // In an effort to use minimal space, every cache entry represents
-// some <key, value> pair; the class provides no way to mark a cache
-// entry as empty or uninitialized.  In practice, you may want to have
-// reserved keys or values to get around this limitation.  For example, in
-// tcmalloc's PageID-to-sizeclass cache, a value of 0 is used as
-// "unknown sizeclass."
+// some <key, value> pair or is empty.  An entry is valid only if the
+// bit after the value bits is set, so all-zero entries are empty and a
+// cache placed in zero-filled storage needs no clearing.
 //
 // Usage Considerations
 // --------------------
@@ -86,12 +84,7 @@
 //    if the elided code contains no c.Put calls.
 //
 // 2. Has(key) will return false if no <key, value> pair with that key
-//    has ever been Put.  However, a newly initialized cache will have
-//    some <key, value> pairs already present.  When you create a new
-//    cache, you must specify an "initial value."  The initialization
-//    procedure is equivalent to Clear(initial_value), which is
-//    equivalent to Put(k, initial_value) for all keys k from 0 to
-//    2^kHashbits - 1.
+//    has ever been Put.  A newly initialized cache is empty.
 //
 // 3. If key and key' differ then the only way Put(key, value) may
 //    cause Has(key') to change is that Has(key') may change from true to
@@ -103,7 +96,8 @@
 // This is a direct-mapped cache with 2^kHashbits entries; the hash
 // function simply takes the low bits of the key.  We store whole keys
 // if a whole key plus a whole value fits in an entry.  Otherwise, an
-// entry is the high bits of a key and a value, packed together.
+// entry is the high bits of a key, the valid bit and a value, packed
+// together.
 // E.g., a 20 bit key and a 7 bit value only require a uint16 for each
 // entry if kHashbits >= 11.
 //
@@ -145,13 +139,17 @@ class PackedCache {
 #endif
   static const int kValuebits = 7;
   // one bit after value bits
-  static const int kInvalidMask = 0x80;
+  static const int kValidMask = 0x80;
 
-  explicit PackedCache() {
+  // Pass zeroed_storage if the cache is placed in zero-filled storage,
+  // to not fault in its pages just to clear them.
+  explicit PackedCache(bool zeroed_storage = false) {
     static_assert(kKeybits + kValuebits + 1 <= 8 * sizeof(T));
     static_assert(kHashbits <= kKeybits);
     static_assert(kHashbits >= kValuebits + 1);
-    Clear();
+    if (!zeroed_storage) {
+      Clear();
+    }
   }
 
   bool TryGet(K key, V* out) const {
@@ -162,6 +160,7 @@ class PackedCache {
     T hash = Hash(key);
     T expected_entry = key;
     expected_entry &= ~N_ONES_(T, kHashbits);
+    expected_entry |= kValidMask;
     T entry = array_[hash];
     entry ^= expected_entry;
     if (PREDICT_FALSE(entry >= (1 << kValuebits))) {
@@ -172,19 +171,18 @@ class PackedCache {
   }
 
   void Clear() {
-    // sets 'invalid' bit in every byte, include value byte
-    memset(const_cast<T* >(array_), kInvalidMask, sizeof(array_));
+    memset(const_cast<T* >(array_), 0, sizeof(array_));
   }
 
   void Put(K key, V value) {
     ASSERT(key == (key & kKeyMask));
     ASSERT(value == (value & kValueMask));
-    array_[Hash(key)] = KeyToUpper(key) | value;
+    array_[Hash(key)] = KeyToUpper(key) | kValidMask | value;
   }
 
   void Invalidate(K key) {
     ASSERT(key == (key & kKeyMask));
-    array_[Hash(key)] = KeyToUpper(key) | kInvalidMask;
+    array_[Hash(key)] = KeyToUpper(key);
   }
 
  private:
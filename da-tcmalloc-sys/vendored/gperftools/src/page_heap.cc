@@ -80,37 +80,58 @@ struct SCOPED_LOCKABLE PageHeap::LockingContext {
 };
 
 
-PageHeap::PageHeap(Length smallest_span_size)
+PageHeap::PageHeap(Length smallest_span_size, bool zeroed_storage)
     : smallest_span_size_(smallest_span_size),
-      pagemap_(MetaDataAlloc),
+      pagemap_cache_(zeroed_storage),
+      pagemap_(MetaDataAllocZeroed, zeroed_storage),
       scavenge_counter_(0),
       // Start scavenging at kMaxPages list
       release_index_(kMaxPages),
-      aggressive_decommit_(false) {
+      aggressive_decommit_(false),
+      hugepage_aware_(false),
+      background_release_(false),
+      clock_ms_(0) {
   static_assert(kClassSizesMax <= (1 << PageMapCache::kValuebits));
+  // Whole hugepages can only be found in large spans.
+  static_assert(kPagesPerHugePage > kMaxPages);
+  static_assert(Numa::kMaxNodes <= (1 << 3), "Span::node is too narrow");
   // smallest_span_size needs to be power of 2.
   CHECK_CONDITION((smallest_span_size_ & (smallest_span_size_-1)) == 0);
-  for (int i = 0; i < kMaxPages; i++) {
-    DLL_Init(&free_[i].normal);
-    DLL_Init(&free_[i].returned);
+  for (int node = 0; node < Numa::kMaxNodes; node++) {
+    pools_[node] = nullptr;
+    if (node >= Numa::num_nodes()) {
+      continue;
+    }
+    SpanPool* pool = &local_pool_;
+    if (node > 0) {
+      void* mem = MetaDataAlloc(sizeof(SpanPool));
+      CHECK_CONDITION(mem != NULL);
+      pool = new (mem) SpanPool;
+    }
+    for (int i = 0; i < kMaxPages; i++) {
+      DLL_Init(&pool->free[i].normal);
+      DLL_Init(&pool->free[i].returned);
+    }
+    pools_[node] = pool;
   }
 }
 
-Span* PageHeap::SearchFreeAndLargeLists(Length n) {
+Span* PageHeap::SearchFreeAndLargeLists(Length n, int node) {
   ASSERT(lock_.IsHeld());
   ASSERT(Check());
   ASSERT(n > 0);
+  SpanPool* pool = pools_[node];
 
   // Find first size >= n that has a non-empty list
   for (Length s = n; s <= kMaxPages; s++) {
-    Span* ll = &free_[s - 1].normal;
+    Span* ll = &pool->free[s - 1].normal;
     // If we're lucky, ll is non-empty, meaning it has a suitable span.
     if (!DLL_IsEmpty(ll)) {
       ASSERT(ll->next->location == Span::ON_NORMAL_FREELIST);
       return Carve(ll->next, n);
     }
     // Alternatively, maybe there's a usable returned span.
-    ll = &free_[s - 1].returned;
+    ll = &pool->free[s - 1].returned;
     if (!DLL_IsEmpty(ll)) {
       // We did not call EnsureLimit before, to avoid releasing the span
       // that will be taken immediately back.
@@ -127,7 +148,7 @@ Span* PageHeap::SearchFreeAndLargeLists(Length n) {
     }
   }
   // No luck in free lists, our last chance is in a larger class.
-  return AllocLarge(n);  // May be NULL
+  return AllocLarge(n, node);  // May be NULL
 }
 
 static const size_t kForcedCoalesceInterval = 128*1024*1024;
@@ -158,10 +179,14 @@ void PageHeap::HandleUnlock(LockingContext* context) {
   }
 }
 
-Span* PageHeap::NewWithSizeClass(Length n, uint32_t sizeclass) {
+Span* PageHeap::NewWithSizeClass(Length n, uint32_t sizeclass, int node) {
+  if (node < 0) {
+    node = Numa::CurrentNode();
+  }
+
   LockingContext context{this, &lock_};
 
-  Span* span = NewLocked(n, &context);
+  Span* span = NewLocked(n, node, &context);
   if (!span) {
     return span;
   }
@@ -172,14 +197,17 @@ Span* PageHeap::NewWithSizeClass(Length n, uint32_t sizeclass) {
   return span;
 }
 
-Span* PageHeap::NewLocked(Length n, LockingContext* context) {
+Span* PageHeap::NewLocked(Length n, int node, LockingContext* context) {
   ASSERT(lock_.IsHeld());
   ASSERT(Check());
+  ASSERT(0 <= node && node < Numa::num_nodes());
   n = RoundUpSize(n);
 
-  Span* result = SearchFreeAndLargeLists(n);
-  if (result != NULL)
+  Span* result = SearchFreeAndLargeLists(n, node);
+  if (result != NULL) {
+    ++stats_.numa_local_count;
     return result;
+  }
 
   if (stats_.free_bytes != 0 && stats_.unmapped_bytes != 0
       && stats_.free_bytes + stats_.unmapped_bytes >= stats_.system_bytes / 4
@@ -209,23 +237,43 @@ Span* PageHeap::NewLocked(Length n, LockingContext* context) {
     // insufficiently big large spans back to OS. So in case of really
     // unlucky memory fragmentation we'll be consuming virtual address
     // space, but not real memory
-    result = SearchFreeAndLargeLists(n);
-    if (result != NULL) return result;
+    result = SearchFreeAndLargeLists(n, node);
+    if (result != NULL) {
+      ++stats_.numa_local_count;
+      return result;
+    }
   }
 
   // Grow the heap and try again.
-  if (!GrowHeap(n, context)) {
-    ASSERT(stats_.unmapped_bytes+ stats_.committed_bytes==stats_.system_bytes);
-    ASSERT(Check());
-    // underlying SysAllocator likely set ENOMEM but we can get here
-    // due to EnsureLimit so we set it here too.
-    //
-    // Setting errno to ENOMEM here allows us to avoid dealing with it
-    // in fast-path.
-    errno = ENOMEM;
-    return NULL;
+  if (GrowHeap(n, node, context)) {
+    result = SearchFreeAndLargeLists(n, node);
+    if (result != NULL) {
+      ++stats_.numa_local_count;
+    }
+    return result;
+  }
+
+  // Remote memory is still better than no memory.
+  for (int other = 0; other < Numa::num_nodes(); other++) {
+    if (other == node) {
+      continue;
+    }
+    result = SearchFreeAndLargeLists(n, other);
+    if (result != NULL) {
+      ++stats_.numa_remote_count;
+      return result;
+    }
   }
-  return SearchFreeAndLargeLists(n);
+
+  ASSERT(stats_.unmapped_bytes+ stats_.committed_bytes==stats_.system_bytes);
+  ASSERT(Check());
+  // underlying SysAllocator likely set ENOMEM but we can get here
+  // due to EnsureLimit so we set it here too.
+  //
+  // Setting errno to ENOMEM here allows us to avoid dealing with it
+  // in fast-path.
+  errno = ENOMEM;
+  return NULL;
 }
 
 Span* PageHeap::NewAligned(Length n, Length align_pages) {
@@ -243,7 +291,7 @@ Span* PageHeap::NewAligned(Length n, Length align_pages) {
 
   LockingContext context{this, &lock_};
 
-  Span* span = NewLocked(alloc, &context);
+  Span* span = NewLocked(alloc, Numa::CurrentNode(), &context);
   if (PREDICT_FALSE(span == nullptr)) return nullptr;
 
   // Skip starting portion so that we end up aligned
@@ -268,33 +316,28 @@ Span* PageHeap::NewAligned(Length n, Length align_pages) {
   return span;
 }
 
-Span* PageHeap::AllocLarge(Length n) {
+Span* PageHeap::AllocLarge(Length n, int node) {
   ASSERT(lock_.IsHeld());
+  SpanPool* pool = pools_[node];
   Span *best = NULL;
   Span *best_normal = NULL;
 
-  // Create a Span to use as an upper bound.
-  Span bound;
-  bound.start = 0;
-  bound.length = n;
-
   // First search the NORMAL spans..
-  SpanSet::iterator place = large_normal_.upper_bound(SpanPtrWithLength(&bound));
-  if (place != large_normal_.end()) {
-    best = place->span;
+  Span* c = pool->large_normal.FindGoodFit(n);
+  if (c != NULL) {
+    best = c;
     best_normal = best;
     ASSERT(best->location == Span::ON_NORMAL_FREELIST);
   }
 
   // Try to find better fit from RETURNED spans.
-  place = large_returned_.upper_bound(SpanPtrWithLength(&bound));
-  if (place != large_returned_.end()) {
-    Span *c = place->span;
+  c = pool->large_returned.FindGoodFit(n);
+  if (c != NULL) {
     ASSERT(c->location == Span::ON_RETURNED_FREELIST);
     if (best_normal == NULL
         || c->length < best->length
         || (c->length == best->length && c->start < best->start))
-      best = place->span;
+      best = c;
   }
 
   if (best == best_normal) {
@@ -311,7 +354,7 @@ Span* PageHeap::AllocLarge(Length n) {
     // best could have been destroyed by coalescing.
     // best_normal is not a best-fit, and it could be destroyed as well.
     // We retry, the limit is already ensured:
-    return AllocLarge(n);
+    return AllocLarge(n, node);
   }
 
   // If best_normal existed, EnsureLimit would succeeded:
@@ -330,6 +373,8 @@ Span* PageHeap::Split(Span* span, Length n) {
   const int extra = span->length - n;
   Span* leftover = NewSpan(span->start + n, extra);
   ASSERT(leftover->location == Span::IN_USE);
+  leftover->node = span->node;
+  leftover->zeroed = span->zeroed;
   RecordSpan(leftover);
   pagemap_.set(span->start + n - 1, span); // Update map from pageid to span
   span->length = n;
@@ -340,8 +385,20 @@ Span* PageHeap::Split(Span* span, Length n) {
 void PageHeap::CommitSpan(Span* span) {
   ++stats_.commit_count;
 
-  TCMalloc_SystemCommit(reinterpret_cast<void*>(span->start << kPageShift),
-                        static_cast<size_t>(span->length << kPageShift));
+  void* start = reinterpret_cast<void*>(span->start << kPageShift);
+  const size_t length = static_cast<size_t>(span->length << kPageShift);
+  TCMalloc_SystemCommit(start, length);
+  // Committing flushes queued releases, and ours might have failed
+  // just now.
+  if (span->zeroed && TCMalloc_SystemReleaseFailed(start, length)) {
+    span->zeroed = 0;
+  }
+  span->lazy = 0;
+  if (span->kept) {
+    // Pages were never given back.
+    span->kept = 0;
+    return;
+  }
   stats_.committed_bytes += span->length << kPageShift;
   stats_.total_commit_bytes += (span->length << kPageShift);
 }
@@ -349,11 +406,22 @@ void PageHeap::CommitSpan(Span* span) {
 bool PageHeap::DecommitSpan(Span* span) {
   ++stats_.decommit_count;
 
+  ReleaseAdvice advice;
   bool rv = TCMalloc_SystemRelease(reinterpret_cast<void*>(span->start << kPageShift),
-                                   static_cast<size_t>(span->length << kPageShift));
+                                   static_cast<size_t>(span->length << kPageShift),
+                                   &advice);
   if (rv) {
-    stats_.committed_bytes -= span->length << kPageShift;
-    stats_.total_decommit_bytes += (span->length << kPageShift);
+    span->lazy = (advice == ReleaseAdvice::kFree);
+    span->zeroed = TCMalloc_SystemReleaseZeroes();
+    // MADV_COLD and MADV_PAGEOUT keep page contents, merely in swap or
+    // at the head of reclaim queue. Such pages still count as
+    // committed free memory rather than unmapped.
+    span->kept = (advice == ReleaseAdvice::kCold
+                  || advice == ReleaseAdvice::kPageOut);
+    if (!span->kept) {
+      stats_.committed_bytes -= span->length << kPageShift;
+      stats_.total_decommit_bytes += (span->length << kPageShift);
+    }
   }
 
   return rv;
@@ -369,25 +437,47 @@ Span* PageHeap::Carve(Span* span, Length n) {
   const int extra = span->length - n;
   ASSERT(extra >= 0);
   if (extra > 0) {
-    Span* leftover = NewSpan(span->start + n, extra);
+    // Normally we take leading pages of span. But if span starts at
+    // hugepage boundary and ends in the middle of some hugepage, then
+    // taking trailing pages packs allocation into that (partially
+    // used) hugepage instead of breaking up a free one.
+    const bool take_tail = hugepage_aware_
+        && span->start % kPagesPerHugePage == 0
+        && (span->start + span->length) % kPagesPerHugePage != 0;
+    Span* leftover = NewSpan(take_tail ? span->start : span->start + n, extra);
     leftover->location = old_location;
+    leftover->node = span->node;
+    leftover->lazy = span->lazy;
+    leftover->zeroed = span->zeroed;
+    leftover->kept = span->kept;
+    leftover->free_since = span->free_since;
     RecordSpan(leftover);
 
-    // The previous span of |leftover| was just splitted -- no need to
-    // coalesce them. The next span of |leftover| was not previously coalesced
-    // with |span|, i.e. is NULL or has got location other than |old_location|.
+    // The neighbor of |leftover| on |span| side was just splitted -- no
+    // need to coalesce them. The other neighbor of |leftover| was not
+    // previously coalesced with |span|, i.e. is NULL or has got
+    // location other than |old_location| (or different node or
+    // kept-ness, see CheckAndHandlePreMerge).
 #ifndef NDEBUG
     const PageID p = leftover->start;
     const Length len = leftover->length;
-    Span* next = GetDescriptor(p+len);
-    ASSERT (next == NULL ||
-            next->location == Span::IN_USE ||
-            next->location != leftover->location);
+    Span* other = take_tail ? GetDescriptor(p-1) : GetDescriptor(p+len);
+    ASSERT (other == NULL ||
+            other->location == Span::IN_USE ||
+            other->location != leftover->location ||
+            other->node != leftover->node ||
+            other->kept != leftover->kept);
 #endif
 
     PrependToFreeList(leftover);  // Skip coalescing - no candidates possible
-    span->length = n;
-    pagemap_.set(span->start + n - 1, span);
+    if (take_tail) {
+      span->start += extra;
+      span->length = n;
+      pagemap_.set(span->start, span);
+    } else {
+      span->length = n;
+      pagemap_.set(span->start + n - 1, span);
+    }
   }
   ASSERT(Check());
   if (old_location == Span::ON_RETURNED_FREELIST) {
@@ -402,6 +492,7 @@ Span* PageHeap::Carve(Span* span, Length n) {
 
 void PageHeap::Delete(Span* span) {
   SpinLockHolder h(&lock_);
+  span->zeroed = 0;
   DeleteLocked(span);
 }
 
@@ -416,8 +507,11 @@ void PageHeap::DeleteLocked(Span* span) {
   span->sizeclass = 0;
   span->sample = 0;
   span->location = Span::ON_NORMAL_FREELIST;
+  span->free_since = clock_ms_;
   MergeIntoFreeList(span);  // Coalesces if possible
   IncrementalScavenge(n);
+  TCMalloc_SystemFlushReleases();
+  HandleFailedReleases();
   ASSERT(stats_.unmapped_bytes+ stats_.committed_bytes==stats_.system_bytes);
   ASSERT(Check());
 }
@@ -431,23 +525,41 @@ Span* PageHeap::CheckAndHandlePreMerge(Span* span, Span* other) {
   if (other == NULL) {
     return other;
   }
+  // Spans of different nodes are never merged.
+  if (other->node != span->node) {
+    return NULL;
+  }
   // if we're in aggressive decommit mode and span is decommitted,
-  // then we try to decommit adjacent span.
-  if (aggressive_decommit_ && other->location == Span::ON_NORMAL_FREELIST
+  // then we try to decommit adjacent span. Unless that would break up
+  // a hugepage.
+  if (aggressive_decommit_ && !hugepage_aware_
+      && other->location == Span::ON_NORMAL_FREELIST
       && span->location == Span::ON_RETURNED_FREELIST) {
     bool worked = DecommitSpan(other);
     if (!worked) {
       return NULL;
     }
+    if (other->kept != span->kept) {
+      // Released differently (advice changed since), so it goes to
+      // returned freelist on its own.
+      RemoveFromFreeList(other);
+      other->location = Span::ON_RETURNED_FREELIST;
+      PrependToFreeList(other);
+      return NULL;
+    }
   } else if (other->location != span->location) {
     return NULL;
+  } else if (other->kept != span->kept) {
+    // Stats count kept pages as free rather than unmapped, so that
+    // must be same for the whole span.
+    return NULL;
   }
 
   RemoveFromFreeList(other);
   return other;
 }
 
-void PageHeap::MergeIntoFreeList(Span* span) {
+void PageHeap::MergeIntoFreeList(Span* span, bool decommit) {
   ASSERT(lock_.IsHeld());
   ASSERT(span->location != Span::IN_USE);
 
@@ -471,7 +583,10 @@ void PageHeap::MergeIntoFreeList(Span* span) {
   const PageID p = span->start;
   const Length n = span->length;
 
-  if (aggressive_decommit_ && span->location == Span::ON_NORMAL_FREELIST) {
+  // In hugepage aware mode we decommit after coalescing, and only
+  // whole hugepages.
+  if (decommit && aggressive_decommit_ && !hugepage_aware_
+      && span->location == Span::ON_NORMAL_FREELIST) {
     if (DecommitSpan(span)) {
       span->location = Span::ON_RETURNED_FREELIST;
     }
@@ -482,6 +597,13 @@ void PageHeap::MergeIntoFreeList(Span* span) {
     // Merge preceding span into this span
     ASSERT(prev->start + prev->length == p);
     const Length len = prev->length;
+    span->lazy |= prev->lazy;
+    span->zeroed &= prev->zeroed;
+    // Merged span is as old as its oldest part.
+    if (span->location == Span::ON_NORMAL_FREELIST
+        && FreeAge(prev) > FreeAge(span)) {
+      span->free_since = prev->free_since;
+    }
     DeleteSpan(prev);
     span->start -= len;
     span->length += len;
@@ -492,34 +614,48 @@ void PageHeap::MergeIntoFreeList(Span* span) {
     // Merge next span into this span
     ASSERT(next->start == p+n);
     const Length len = next->length;
+    span->lazy |= next->lazy;
+    span->zeroed &= next->zeroed;
+    if (span->location == Span::ON_NORMAL_FREELIST
+        && FreeAge(next) > FreeAge(span)) {
+      span->free_since = next->free_since;
+    }
     DeleteSpan(next);
     span->length += len;
     pagemap_.set(span->start + span->length - 1, span);
   }
 
   PrependToFreeList(span);
+
+  if (decommit && aggressive_decommit_ && hugepage_aware_
+      && span->location == Span::ON_NORMAL_FREELIST
+      && HasWholeHugePages(span)) {
+    ReleaseHugePagesOfSpan(span);
+  }
 }
 
 void PageHeap::PrependToFreeList(Span* span) {
   ASSERT(lock_.IsHeld());
   ASSERT(span->location != Span::IN_USE);
-  if (span->location == Span::ON_NORMAL_FREELIST)
+  if (span->location == Span::ON_NORMAL_FREELIST || span->kept) {
     stats_.free_bytes += (span->length << kPageShift);
-  else
+  } else {
     stats_.unmapped_bytes += (span->length << kPageShift);
+    if (span->lazy) {
+      stats_.lazy_unmapped_bytes += (span->length << kPageShift);
+    }
+  }
 
+  SpanPool* pool = pools_[span->node];
   if (span->length > kMaxPages) {
-    SpanSet *set = &large_normal_;
+    LargeSpanIndex *index = &pool->large_normal;
     if (span->location == Span::ON_RETURNED_FREELIST)
-      set = &large_returned_;
-    std::pair<SpanSet::iterator, bool> p =
-        set->insert(SpanPtrWithLength(span));
-    ASSERT(p.second); // We never have duplicates since span->start is unique.
-    span->SetSpanSetIterator(p.first);
+      index = &pool->large_returned;
+    index->Insert(span);
     return;
   }
 
-  SpanList* list = &free_[span->length - 1];
+  SpanList* list = &pool->free[span->length - 1];
   if (span->location == Span::ON_NORMAL_FREELIST) {
     DLL_Prepend(&list->normal, span);
   } else {
@@ -527,22 +663,68 @@ void PageHeap::PrependToFreeList(Span* span) {
   }
 }
 
+void PageHeap::HandleFailedReleases() {
+  ASSERT(lock_.IsHeld());
+  void* start;
+  size_t length;
+  while (TCMalloc_SystemTakeFailedRelease(&start, &length)) {
+    const PageID first = reinterpret_cast<uintptr_t>(start) >> kPageShift;
+    const PageID end = (reinterpret_cast<uintptr_t>(start) + length
+                        + kPageSize - 1) >> kPageShift;
+    // Failures are rare, so we simply look through all returned
+    // spans. Merging below only touches normal freelists.
+    auto unrelease = [&] (Span* s) {
+      if (s->start >= end || s->start + s->length <= first) {
+        return;
+      }
+      RemoveFromFreeList(s);
+      s->location = Span::ON_NORMAL_FREELIST;
+      s->lazy = 0;
+      s->zeroed = 0;
+      s->free_since = clock_ms_;
+      if (!s->kept) {
+        stats_.committed_bytes += s->length << kPageShift;
+        stats_.total_decommit_bytes -= s->length << kPageShift;
+      }
+      s->kept = 0;
+      // Releasing them again would most likely fail again.
+      MergeIntoFreeList(s, false);
+    };
+    for (int node = 0; node < Numa::num_nodes(); node++) {
+      SpanPool* pool = pools_[node];
+      pool->large_returned.ForEachFromLongest(0, [&] (Span* s) {
+        unrelease(s);
+        return true;
+      });
+      for (int i = 0; i < kMaxPages; i++) {
+        Span* list = &pool->free[i].returned;
+        for (Span* s = list->next; s != list; ) {
+          Span* next = s->next;
+          unrelease(s);
+          s = next;
+        }
+      }
+    }
+  }
+}
+
 void PageHeap::RemoveFromFreeList(Span* span) {
   ASSERT(lock_.IsHeld());
   ASSERT(span->location != Span::IN_USE);
-  if (span->location == Span::ON_NORMAL_FREELIST) {
+  if (span->location == Span::ON_NORMAL_FREELIST || span->kept) {
     stats_.free_bytes -= (span->length << kPageShift);
   } else {
     stats_.unmapped_bytes -= (span->length << kPageShift);
+    if (span->lazy) {
+      stats_.lazy_unmapped_bytes -= (span->length << kPageShift);
+    }
   }
   if (span->length > kMaxPages) {
-    SpanSet *set = &large_normal_;
+    SpanPool* pool = pools_[span->node];
+    LargeSpanIndex *index = &pool->large_normal;
     if (span->location == Span::ON_RETURNED_FREELIST)
-      set = &large_returned_;
-    SpanSet::iterator iter = span->ExtractSpanSetIterator();
-    ASSERT(iter->span == span);
-    ASSERT(set->find(SpanPtrWithLength(span)) == iter);
-    set->erase(iter);
+      index = &pool->large_returned;
+    index->Remove(span);
   } else {
     DLL_Remove(span);
   }
@@ -554,6 +736,12 @@ void PageHeap::IncrementalScavenge(Length n) {
   scavenge_counter_ -= n;
   if (scavenge_counter_ >= 0) return;  // Not yet time to scavenge
 
+  if (background_release_) {
+    // Releasing is done by ReleaseOldFreeSpans.
+    scavenge_counter_ = kDefaultReleaseDelay;
+    return;
+  }
+
   const double rate = FLAGS_tcmalloc_release_rate;
   if (rate <= 1e-6) {
     // Tiny release rate means that releasing is disabled.
@@ -563,7 +751,10 @@ void PageHeap::IncrementalScavenge(Length n) {
 
   ++stats_.scavenge_count;
 
-  Length released_pages = ReleaseAtLeastNPages(1);
+  // In hugepage aware mode background release never breaks up
+  // hugepages.
+  Length released_pages = hugepage_aware_
+      ? ReleaseWholeHugePages(1) : ReleaseAtLeastNPages(1);
 
   if (released_pages == 0) {
     // Nothing to scavenge, delay for a while.
@@ -597,30 +788,55 @@ Length PageHeap::ReleaseSpan(Span* s) {
 }
 
 Length PageHeap::ReleaseAtLeastNPages(Length num_pages) {
+  return ReleasePages(num_pages, false);
+}
+
+Length PageHeap::ReleasePages(Length num_pages, bool break_hugepages) {
+  ASSERT(lock_.IsHeld());
+  Length released_pages = 0;
+  TCMalloc_SystemBeginReleases();
+  if (hugepage_aware_) {
+    released_pages = ReleaseWholeHugePages(num_pages);
+  }
+  if (released_pages < num_pages && (!hugepage_aware_ || break_hugepages)) {
+    released_pages += ReleaseFreeSpans(num_pages - released_pages);
+  }
+  TCMalloc_SystemEndReleases();
+  HandleFailedReleases();
+  return released_pages;
+}
+
+Length PageHeap::ReleaseFreeSpans(Length num_pages) {
   ASSERT(lock_.IsHeld());
   Length released_pages = 0;
 
   // Round robin through the lists of free spans, releasing a
   // span from each list.  Stop after releasing at least num_pages
-  // or when there is nothing more to release.
-  while (released_pages < num_pages && stats_.free_bytes > 0) {
+  // or when there is nothing more to release. Note free_bytes can't
+  // tell the latter, as it counts kept pages too (see Span::kept).
+  bool found = true;
+  while (released_pages < num_pages && found) {
+    found = false;
     for (int i = 0; i < kMaxPages+1 && released_pages < num_pages;
          i++, release_index_++) {
-      Span *s;
+      Span *s = NULL;
       if (release_index_ > kMaxPages) release_index_ = 0;
 
-      if (release_index_ == kMaxPages) {
-        if (large_normal_.empty()) {
-          continue;
-        }
-        s = (large_normal_.begin())->span;
-      } else {
-        SpanList* slist = &free_[release_index_];
-        if (DLL_IsEmpty(&slist->normal)) {
-          continue;
+      for (int node = 0; node < Numa::num_nodes() && s == NULL; node++) {
+        SpanPool* pool = pools_[node];
+        if (release_index_ == kMaxPages) {
+          s = pool->large_normal.First();
+        } else {
+          SpanList* slist = &pool->free[release_index_];
+          if (!DLL_IsEmpty(&slist->normal)) {
+            s = slist->normal.prev;
+          }
         }
-        s = slist->normal.prev;
       }
+      if (s == NULL) {
+        continue;
+      }
+      found = true;
       // TODO(todd) if the remaining number of pages to release
       // is significantly smaller than s->length, and s is on the
       // large freelist, should we carve s instead of releasing?
@@ -634,6 +850,147 @@ Length PageHeap::ReleaseAtLeastNPages(Length num_pages) {
   return released_pages;
 }
 
+bool PageHeap::HasWholeHugePages(const Span* s) {
+  const PageID hp_start = (s->start + kPagesPerHugePage - 1) & ~(kPagesPerHugePage - 1);
+  const PageID hp_end = (s->start + s->length) & ~(kPagesPerHugePage - 1);
+  return hp_start < hp_end;
+}
+
+Length PageHeap::ReleaseHugePagesOfSpan(Span* s) {
+  ASSERT(s->location == Span::ON_NORMAL_FREELIST);
+  ASSERT(HasWholeHugePages(s));
+  const PageID hp_start = (s->start + kPagesPerHugePage - 1) & ~(kPagesPerHugePage - 1);
+  const PageID hp_end = (s->start + s->length) & ~(kPagesPerHugePage - 1);
+
+  // Chop off parts outside of whole hugepages. They stay normal.
+  // Neighbors are unchanged, so no coalescing is possible.
+  RemoveFromFreeList(s);
+  if (s->start < hp_start) {
+    Span* head = NewSpan(s->start, hp_start - s->start);
+    head->location = Span::ON_NORMAL_FREELIST;
+    head->node = s->node;
+    head->zeroed = s->zeroed;
+    head->free_since = s->free_since;
+    RecordSpan(head);
+    PrependToFreeList(head);
+  }
+  if (hp_end < s->start + s->length) {
+    Span* tail = NewSpan(hp_end, s->start + s->length - hp_end);
+    tail->location = Span::ON_NORMAL_FREELIST;
+    tail->node = s->node;
+    tail->zeroed = s->zeroed;
+    tail->free_since = s->free_since;
+    RecordSpan(tail);
+    PrependToFreeList(tail);
+  }
+  s->start = hp_start;
+  s->length = hp_end - hp_start;
+  RecordSpan(s);
+  PrependToFreeList(s);
+
+  return ReleaseSpan(s);
+}
+
+Length PageHeap::ReleaseWholeHugePages(Length num_pages) {
+  ASSERT(lock_.IsHeld());
+  Length released_pages = 0;
+
+  bool release_failed = false;
+  for (int node = 0; node < Numa::num_nodes() && released_pages < num_pages; node++) {
+    // We walk from the biggest spans, which are most likely to have
+    // whole hugepages in them. Spans shorter than a hugepage cannot
+    // have any.
+    pools_[node]->large_normal.ForEachFromLongest(kPagesPerHugePage, [&] (Span* s) {
+      if (released_pages >= num_pages) {
+        return false;
+      }
+      if (!HasWholeHugePages(s)) {
+        return true;
+      }
+      Length released_len = ReleaseHugePagesOfSpan(s);
+      // Some systems do not support release
+      if (released_len == 0) {
+        release_failed = true;
+        return false;
+      }
+      released_pages += released_len;
+      return true;
+    });
+    if (release_failed) {
+      break;
+    }
+  }
+  return released_pages;
+}
+
+Length PageHeap::ReleaseOldFreeSpans(uint32_t now_ms, uint32_t min_age_ms,
+                                     Length max_pages) {
+  ASSERT(lock_.IsHeld());
+  clock_ms_ = now_ms;
+  auto is_old = [&] (const Span* s) {
+    return FreeAge(s) >= min_age_ms;
+  };
+
+  Length released_pages = 0;
+  bool release_failed = false;
+  TCMalloc_SystemBeginReleases();
+  for (int node = 0; node < Numa::num_nodes() && released_pages < max_pages
+         && !release_failed; node++) {
+    SpanPool* pool = pools_[node];
+    pool->large_normal.ForEachFromLongest(0, [&] (Span* s) {
+      if (released_pages >= max_pages) {
+        return false;
+      }
+      if (!is_old(s) || (hugepage_aware_ && !HasWholeHugePages(s))) {
+        return true;
+      }
+      Length released_len = hugepage_aware_
+          ? ReleaseHugePagesOfSpan(s) : ReleaseSpan(s);
+      // Some systems do not support release
+      if (released_len == 0) {
+        release_failed = true;
+        return false;
+      }
+      released_pages += released_len;
+      return true;
+    });
+    // Small spans never have whole hugepages.
+    if (release_failed || hugepage_aware_) {
+      continue;
+    }
+    // Small lists are not kept sorted by age: merged and carved spans
+    // keep their oldest free_since but still go to the front. Scan
+    // each list from the tail, where most of the old spans are.
+    for (int i = kMaxPages - 1; i >= 0 && released_pages < max_pages
+           && !release_failed; i--) {
+      Span* list = &pool->free[i].normal;
+      Span* s = list->prev;
+      while (released_pages < max_pages && s != list) {
+        Span* prev = s->prev;
+        if (!is_old(s)) {
+          s = prev;
+          continue;
+        }
+        // Releasing may coalesce s with a free neighbour (aggressive
+        // decommit mode), which deletes the neighbour's span.
+        const bool prev_adjacent = prev != list
+            && (prev->start + prev->length == s->start
+                || s->start + s->length == prev->start);
+        Length released_len = ReleaseSpan(s);
+        if (released_len == 0) {
+          release_failed = true;
+          break;
+        }
+        released_pages += released_len;
+        s = prev_adjacent ? list->prev : prev;
+      }
+    }
+  }
+  TCMalloc_SystemEndReleases();
+  HandleFailedReleases();
+  return released_pages;
+}
+
 bool PageHeap::EnsureLimit(Length n, bool withRelease) {
   ASSERT(lock_.IsHeld());
   Length limit = (FLAGS_tcmalloc_heap_limit_mb*1024*1024) >> kPageShift;
@@ -652,7 +1009,11 @@ bool PageHeap::EnsureLimit(Length n, bool withRelease) {
   takenPages -= stats_.unmapped_bytes >> kPageShift;
 
   if (takenPages + n > limit && withRelease) {
-    takenPages -= ReleaseAtLeastNPages(takenPages + n - limit);
+    // Staying under the limit matters more than keeping hugepages.
+    ReleasePages(takenPages + n - limit, true);
+    // Pages released with MADV_COLD or MADV_PAGEOUT are still taken.
+    takenPages = (TCMalloc_SystemTaken >> kPageShift)
+        - (stats_.unmapped_bytes >> kPageShift);
   }
 
   return takenPages + n <= limit;
@@ -672,8 +1033,12 @@ void PageHeap::RegisterSizeClass(Span* span, uint32_t sc) {
 void PageHeap::GetSmallSpanStatsLocked(SmallSpanStats* result) {
   ASSERT(lock_.IsHeld());
   for (int i = 0; i < kMaxPages; i++) {
-    result->normal_length[i] = DLL_Length(&free_[i].normal);
-    result->returned_length[i] = DLL_Length(&free_[i].returned);
+    result->normal_length[i] = 0;
+    result->returned_length[i] = 0;
+    for (int node = 0; node < Numa::num_nodes(); node++) {
+      result->normal_length[i] += DLL_Length(&pools_[node]->free[i].normal);
+      result->returned_length[i] += DLL_Length(&pools_[node]->free[i].returned);
+    }
   }
 }
 
@@ -682,14 +1047,40 @@ void PageHeap::GetLargeSpanStatsLocked(LargeSpanStats* result) {
   result->spans = 0;
   result->normal_pages = 0;
   result->returned_pages = 0;
-  for (SpanSet::iterator it = large_normal_.begin(); it != large_normal_.end(); ++it) {
-    result->normal_pages += it->length;
-    result->spans++;
+  for (int node = 0; node < Numa::num_nodes(); node++) {
+    SpanPool* pool = pools_[node];
+    pool->large_normal.ForEach([result] (Span* s) {
+      result->normal_pages += s->length;
+      result->spans++;
+    });
+    pool->large_returned.ForEach([result] (Span* s) {
+      result->returned_pages += s->length;
+      result->spans++;
+    });
   }
-  for (SpanSet::iterator it = large_returned_.begin(); it != large_returned_.end(); ++it) {
-    result->returned_pages += it->length;
-    result->spans++;
+}
+
+void PageHeap::GetHugePageStatsLocked(HugePageStats* result) {
+  ASSERT(lock_.IsHeld());
+  result->system_hugepages = (stats_.system_bytes + kHugePageSize - 1) >> kHugePageShift;
+  result->free_hugepages = 0;
+  result->released_hugepages = 0;
+  auto whole_hugepages = [] (const Span* s) -> int64_t {
+    const PageID hp_start = (s->start + kPagesPerHugePage - 1) / kPagesPerHugePage;
+    const PageID hp_end = (s->start + s->length) / kPagesPerHugePage;
+    return hp_start < hp_end ? hp_end - hp_start : 0;
+  };
+  for (int node = 0; node < Numa::num_nodes(); node++) {
+    SpanPool* pool = pools_[node];
+    pool->large_normal.ForEach([&] (Span* s) {
+      result->free_hugepages += whole_hugepages(s);
+    });
+    pool->large_returned.ForEach([&] (Span* s) {
+      result->released_hugepages += whole_hugepages(s);
+    });
   }
+  result->fragmented_released_pages = (stats_.unmapped_bytes >> kPageShift)
+      - result->released_hugepages * kPagesPerHugePage;
 }
 
 bool PageHeap::GetNextRange(PageID start, base::MallocRange* r) {
@@ -724,22 +1115,28 @@ bool PageHeap::GetNextRange(PageID start, base::MallocRange* r) {
   return true;
 }
 
-bool PageHeap::GrowHeap(Length n, LockingContext* context) {
+bool PageHeap::GrowHeap(Length n, int node, LockingContext* context) {
   ASSERT(lock_.IsHeld());
   ASSERT(kMaxPages >= kMinSystemAlloc);
   if (n > kMaxValidPages) return false;
   Length ask = (n>kMinSystemAlloc) ? n : static_cast<Length>(kMinSystemAlloc);
+  size_t align = kPageSize;
+  if (hugepage_aware_ && n <= kMaxValidPages - kPagesPerHugePage) {
+    ask = (ask + kPagesPerHugePage - 1) & ~(kPagesPerHugePage - 1);
+    align = kHugePageSize;
+  }
   size_t actual_size;
   void* ptr = NULL;
   if (EnsureLimit(ask)) {
-      ptr = TCMalloc_SystemAlloc(ask << kPageShift, &actual_size, kPageSize);
+      ptr = TCMalloc_SystemAlloc(ask << kPageShift, &actual_size, align);
   }
   if (ptr == NULL) {
     if (n < ask) {
       // Try growing just "n" pages
       ask = n;
+      align = kPageSize;
       if (EnsureLimit(ask)) {
-        ptr = TCMalloc_SystemAlloc(ask << kPageShift, &actual_size, kPageSize);
+        ptr = TCMalloc_SystemAlloc(ask << kPageShift, &actual_size, align);
       }
     }
     if (ptr == NULL) return false;
@@ -747,6 +1144,14 @@ bool PageHeap::GrowHeap(Length n, LockingContext* context) {
   ask = actual_size >> kPageShift;
   context->grown_by += ask << kPageShift;
 
+  if (hugepage_aware_) {
+    TCMalloc_SystemAdviseHugePages(ptr, ask << kPageShift);
+  }
+
+  if (Numa::IsActive()) {
+    Numa::BindToNode(ptr, ask << kPageShift, node);
+  }
+
   ++stats_.reserve_count;
   ++stats_.commit_count;
 
@@ -776,6 +1181,8 @@ bool PageHeap::GrowHeap(Length n, LockingContext* context) {
     // Pretend the new area is allocated and then Delete() it to cause
     // any necessary coalescing to occur.
     Span* span = NewSpan(p, ask);
+    span->node = node;
+    span->zeroed = TCMalloc_SystemAllocZeroes();
     RecordSpan(span);
     DeleteLocked(span);
     ASSERT(stats_.unmapped_bytes+ stats_.committed_bytes==stats_.system_bytes);
@@ -795,11 +1202,14 @@ bool PageHeap::Check() {
 
 bool PageHeap::CheckExpensive() {
   bool result = Check();
-  CheckSet(&large_normal_, kMaxPages + 1, Span::ON_NORMAL_FREELIST);
-  CheckSet(&large_returned_, kMaxPages + 1, Span::ON_RETURNED_FREELIST);
-  for (int s = 1; s <= kMaxPages; s++) {
-    CheckList(&free_[s - 1].normal, s, s, Span::ON_NORMAL_FREELIST);
-    CheckList(&free_[s - 1].returned, s, s, Span::ON_RETURNED_FREELIST);
+  for (int node = 0; node < Numa::num_nodes(); node++) {
+    SpanPool* pool = pools_[node];
+    CheckLargeIndex(&pool->large_normal, kMaxPages + 1, Span::ON_NORMAL_FREELIST);
+    CheckLargeIndex(&pool->large_returned, kMaxPages + 1, Span::ON_RETURNED_FREELIST);
+    for (int s = 1; s <= kMaxPages; s++) {
+      CheckList(&pool->free[s - 1].normal, s, s, Span::ON_NORMAL_FREELIST);
+      CheckList(&pool->free[s - 1].returned, s, s, Span::ON_RETURNED_FREELIST);
+    }
   }
   return result;
 }
@@ -816,15 +1226,13 @@ bool PageHeap::CheckList(Span* list, Length min_pages, Length max_pages,
   return true;
 }
 
-bool PageHeap::CheckSet(SpanSet* spanset, Length min_pages,int freelist) {
-  for (SpanSet::iterator it = spanset->begin(); it != spanset->end(); ++it) {
-    Span* s = it->span;
-    CHECK_CONDITION(s->length == it->length);
+bool PageHeap::CheckLargeIndex(LargeSpanIndex* index, Length min_pages, int freelist) {
+  index->ForEach([&] (Span* s) {
     CHECK_CONDITION(s->location == freelist);  // NORMAL or RETURNED
     CHECK_CONDITION(s->length >= min_pages);
     CHECK_CONDITION(GetDescriptor(s->start) == s);
     CHECK_CONDITION(GetDescriptor(s->start+s->length-1) == s);
-  }
+  });
   return true;
 }
 
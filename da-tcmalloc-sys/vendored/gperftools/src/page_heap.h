@@ -41,6 +41,8 @@
 #include "base/spinlock.h"
 #include "base/thread_annotations.h"
 #include "common.h"
+#include "large_span_index.h"
+#include "numa.h"
 #include "packed-cache-inl.h"
 #include "pagemap.h"
 #include "span.h"
@@ -97,12 +99,28 @@ template <> class MapSelector<32> {
 //
 // Heap for page-level allocation.  We allow allocating and freeing a
 // contiguous runs of pages (called a "span").
+//
+// In NUMA mode (see numa.h) free spans are kept in separate pools per
+// memory node. Spans are only coalesced with spans of the same node,
+// and allocations are served from pool of the requested node, growing
+// heap on that node before resorting to pools of other nodes.
+//
+// In hugepage aware mode (see SetHugePageAware) heap grows in
+// hugepage-aligned multiples of kHugePageSize, allocations are carved
+// so that they don't break up free hugepages when that can be
+// avoided, and only whole free hugepages are released to the system,
+// be it by scavenging, explicit release or aggressive decommit. This
+// keeps transparent huge pages intact and saves TLB misses. Heap limit
+// is the exception: pages are released regardless to stay under it.
 // -------------------------------------------------------------------------
 
 class PageHeap {
  public:
   PageHeap() : PageHeap(1) {}
-  PageHeap(Length smallest_span_size);
+  // Pass zeroed_storage when constructing in zero-filled static
+  // storage. Then the large page map and size class cache are left
+  // untouched and only their pages that get used are faulted in.
+  PageHeap(Length smallest_span_size, bool zeroed_storage = false);
 
   SpinLock* pageheap_lock() {
     return &lock_;
@@ -113,12 +131,16 @@ class PageHeap {
 
   // Allocate a run of "n" pages.  Returns zero if out of memory.
   // Caller should not pass "n == 0" -- instead, n should have
-  // been rounded up already.
+  // been rounded up already. If span->zeroed is set, pages of the
+  // returned span read as zeros.
   Span* New(Length n) {
     return NewWithSizeClass(n, 0);
   }
 
-  Span* NewWithSizeClass(Length n, uint32_t sizeclass);
+  // Same as New, but also registers span for given size class. Span
+  // is allocated on given memory node, or on the node we're currently
+  // running on if node is negative.
+  Span* NewWithSizeClass(Length n, uint32_t sizeclass, int node = -1);
 
   // Same as above but with alignment. Requires page heap
   // lock, like New above.
@@ -133,6 +155,7 @@ class PageHeap {
   void PrepareAndDelete(Span* span, const Body& body) LOCKS_EXCLUDED(lock_) {
     SpinLockHolder h(&lock_);
     body();
+    span->zeroed = 0;
     DeleteLocked(span);
   }
 
@@ -163,9 +186,12 @@ class PageHeap {
     Stats() : system_bytes(0), free_bytes(0), unmapped_bytes(0), committed_bytes(0),
         scavenge_count(0), commit_count(0), total_commit_bytes(0),
         decommit_count(0), total_decommit_bytes(0),
-        reserve_count(0), total_reserve_bytes(0) {}
+        reserve_count(0), total_reserve_bytes(0),
+        numa_local_count(0), numa_remote_count(0),
+        lazy_unmapped_bytes(0) {}
     uint64_t system_bytes;    // Total bytes allocated from system
-    uint64_t free_bytes;      // Total bytes on normal freelists
+    uint64_t free_bytes;      // Total bytes on normal freelists, or kept
+                              // on returned ones (see Span::kept)
     uint64_t unmapped_bytes;  // Total bytes on returned freelists
     uint64_t committed_bytes;  // Bytes committed, always <= system_bytes_.
 
@@ -178,6 +204,13 @@ class PageHeap {
 
     uint64_t reserve_count;         // Number of virtual memory reserves
     uint64_t total_reserve_bytes;   // Bytes reserved in lifetime of process
+
+    uint64_t numa_local_count;   // Spans allocated on requested node
+    uint64_t numa_remote_count;  // Spans taken from some other node
+
+    // Part of unmapped_bytes released lazily (i.e. with MADV_FREE),
+    // so that the system reclaims it only when short of memory.
+    uint64_t lazy_unmapped_bytes;
   };
   inline Stats StatsLocked() const { return stats_; }
 
@@ -199,21 +232,46 @@ class PageHeap {
   };
   void GetLargeSpanStatsLocked(LargeSpanStats* result);
 
+  // Hugepage coverage of page heap memory. Counts only hugepages that
+  // are entirely inside some free span.
+  struct HugePageStats {
+    int64_t system_hugepages;    // Hugepages spanned by system bytes
+    int64_t free_hugepages;      // Whole hugepages on normal freelists
+    int64_t released_hugepages;  // Whole hugepages on returned freelists
+    // Returned pages outside of whole hugepages. Each of those broke
+    // up some hugepage.
+    int64_t fragmented_released_pages;
+  };
+  void GetHugePageStatsLocked(HugePageStats* result);
+
   bool Check();
   // Like Check() but does some more comprehensive checking.
   bool CheckExpensive();
   bool CheckList(Span* list, Length min_pages, Length max_pages,
                  int freelist);  // ON_NORMAL_FREELIST or ON_RETURNED_FREELIST
-  bool CheckSet(SpanSet *s, Length min_pages, int freelist);
+  bool CheckLargeIndex(LargeSpanIndex* index, Length min_pages, int freelist);
 
   // Try to release at least num_pages for reuse by the OS.  Returns
   // the actual number of pages released, which may be less than
   // num_pages if there weren't enough pages to release. The result
   // may also be larger than num_pages since page_heap might decide to
   // release one large range instead of fragmenting it into two
-  // smaller released and unreleased ranges.
+  // smaller released and unreleased ranges. In hugepage aware mode
+  // only whole free hugepages are released. All the ranges are
+  // released together, with as few system calls as possible (see
+  // TCMalloc_SystemBeginReleases), so callers releasing a lot should
+  // do it in parts and drop the lock in between.
   Length ReleaseAtLeastNPages(Length num_pages);
 
+  // Sets page heap clock to now_ms and releases spans that have been
+  // on normal freelists for at least min_age_ms, until at least
+  // max_pages are released. Spans freed between two calls are stamped
+  // with the time of the earlier one, so ages are only as precise as
+  // the calling period. In hugepage aware mode only whole hugepages
+  // are released. Returns the number of pages released.
+  Length ReleaseOldFreeSpans(uint32_t now_ms, uint32_t min_age_ms,
+                             Length max_pages);
+
   // Reads and writes to pagemap_cache_ do not require locking.
   bool TryGetSizeClass(PageID p, uint32_t* out) const {
     return pagemap_cache_.TryGet(p, out);
@@ -236,6 +294,19 @@ class PageHeap {
     aggressive_decommit_ = aggressive_decommit;
   }
 
+  bool GetHugePageAware(void) {return hugepage_aware_;}
+  void SetHugePageAware(bool hugepage_aware) {
+    hugepage_aware_ = hugepage_aware;
+  }
+
+  // In background release mode freed pages are not released
+  // incrementally. Instead whoever set it is expected to call
+  // ReleaseOldFreeSpans periodically.
+  bool GetBackgroundRelease(void) {return background_release_;}
+  void SetBackgroundRelease(bool background_release) {
+    background_release_ = background_release;
+  }
+
  private:
   struct LockingContext;
 
@@ -281,22 +352,28 @@ class PageHeap {
     Span        returned;
   };
 
-  // Sets of spans with length > kMaxPages.
-  //
-  // Rather than using a linked list, we use sets here for efficient
-  // best-fit search.
-  SpanSet large_normal_;
-  SpanSet large_returned_;
+  // Free spans of one memory node.
+  struct SpanPool {
+    // Spans with length > kMaxPages, indexed for efficient
+    // (near) best-fit search.
+    LargeSpanIndex large_normal;
+    LargeSpanIndex large_returned;
 
-  // Array mapping from span length to a doubly linked list of free spans
-  //
-  // NOTE: index 'i' stores spans of length 'i + 1'.
-  SpanList free_[kMaxPages];
+    // Array mapping from span length to a doubly linked list of free spans
+    //
+    // NOTE: index 'i' stores spans of length 'i + 1'.
+    SpanList free[kMaxPages];
+  };
+
+  // Pools of nodes other than 0 only exist in NUMA mode and are
+  // allocated at construction.
+  SpanPool local_pool_;
+  SpanPool* pools_[Numa::kMaxNodes];
 
   // Statistics on system, free, and unmapped bytes
   Stats stats_;
 
-  Span* NewLocked(Length n, LockingContext* context) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  Span* NewLocked(Length n, int node, LockingContext* context) EXCLUSIVE_LOCKS_REQUIRED(lock_);
   void DeleteLocked(Span* span) EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
   // Split an allocated span into two spans: one of length "n" pages
@@ -309,9 +386,9 @@ class PageHeap {
   // REQUIRES: span->sizeclass == 0
   Span* Split(Span* span, Length n);
 
-  Span* SearchFreeAndLargeLists(Length n);
+  Span* SearchFreeAndLargeLists(Length n, int node);
 
-  bool GrowHeap(Length n, LockingContext* context) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  bool GrowHeap(Length n, int node, LockingContext* context) EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
   // REQUIRES: span->length >= n
   // REQUIRES: span->location != IN_USE
@@ -331,11 +408,12 @@ class PageHeap {
 
   // Allocate a large span of length == n.  If successful, returns a
   // span of exactly the specified length.  Else, returns NULL.
-  Span* AllocLarge(Length n);
+  Span* AllocLarge(Length n, int node);
 
   // Coalesce span with neighboring spans if possible, prepend to
-  // appropriate free list, and adjust stats.
-  void MergeIntoFreeList(Span* span);
+  // appropriate free list, and adjust stats. In aggressive decommit
+  // mode normal span is released first, unless decommit is false.
+  void MergeIntoFreeList(Span* span, bool decommit = true);
 
   // Commit the span.
   void CommitSpan(Span* span);
@@ -346,6 +424,17 @@ class PageHeap {
   // Prepends span to appropriate free list, and adjusts stats.
   void PrependToFreeList(Span* span);
 
+  // Milliseconds of page heap clock since span was freed. Unsigned
+  // arithmetic keeps ages right when clock wraps around.
+  uint32_t FreeAge(const Span* s) const {
+    return clock_ms_ - s->free_since;
+  }
+
+  // Moves spans whose queued release failed (see
+  // TCMalloc_SystemTakeFailedRelease) back to normal freelists, and
+  // undoes their release in stats.
+  void HandleFailedReleases();
+
   // Removes span from its free list, and adjust stats.
   void RemoveFromFreeList(Span* span);
 
@@ -360,6 +449,30 @@ class PageHeap {
   // REQUIRES: 's' must be on the NORMAL freelist.
   Length ReleaseSpan(Span *s);
 
+  // Same as ReleaseAtLeastNPages, but if break_hugepages is set and
+  // whole free hugepages are not enough, it releases other free pages
+  // too in hugepage aware mode.
+  Length ReleasePages(Length num_pages, bool break_hugepages);
+
+  // Round robin through free lists, releasing one span from each,
+  // until at least num_pages are released.
+  Length ReleaseFreeSpans(Length num_pages);
+
+  // Releases whole hugepages of free spans, biggest spans first,
+  // until at least num_pages are released. Parts of spans outside of
+  // whole hugepages stay on normal freelists.
+  Length ReleaseWholeHugePages(Length num_pages);
+
+  // Returns true if 's' covers at least one whole hugepage.
+  static bool HasWholeHugePages(const Span* s);
+
+  // Releases whole hugepages of 's', leaving parts outside of them on
+  // normal freelist. Returns the number of pages released or zero if
+  // release failed.
+  //
+  // REQUIRES: 's' must be on the NORMAL freelist and have whole hugepages.
+  Length ReleaseHugePagesOfSpan(Span* s);
+
   // Checks if we are allowed to take more memory from the system.
   // If limit is reached and allowRelease is true, tries to release
   // some unused spans.
@@ -374,6 +487,13 @@ class PageHeap {
   int release_index_;
 
   bool aggressive_decommit_;
+
+  bool hugepage_aware_;
+
+  bool background_release_;
+
+  // Coarse clock in milliseconds, advanced by ReleaseOldFreeSpans.
+  uint32_t clock_ms_;
 };
 
 }  // namespace tcmalloc
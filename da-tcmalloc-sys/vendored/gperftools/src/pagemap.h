@@ -42,6 +42,12 @@
 // The BITS parameter should be the number of bits required to hold
 // a page number.  E.g., with 32 bit pointers and 4K pages (i.e.,
 // page offset fits in lower 12 bits), BITS == 20.
+//
+// The allocator must return zero-filled memory, which is not written
+// here, so pages of it that are never set are never faulted in.  For
+// the same reason, maps placed in storage that is already zero-filled
+// (e.g. untouched static storage) may pass zeroed_storage to skip
+// clearing themselves.
 
 #ifndef TCMALLOC_PAGEMAP_H_
 #define TCMALLOC_PAGEMAP_H_
@@ -66,9 +72,9 @@ class TCMalloc_PageMap1 {
  public:
   typedef uintptr_t Number;
 
-  explicit TCMalloc_PageMap1(void* (*allocator)(size_t)) {
+  explicit TCMalloc_PageMap1(void* (*allocator)(size_t),
+                             bool zeroed_storage = false) {
     array_ = reinterpret_cast<void**>((*allocator)(sizeof(void*) << BITS));
-    memset(array_, 0, sizeof(void*) << BITS);
   }
 
   // Ensure that the map contains initialized entries "x .. x+n-1".
@@ -133,9 +139,12 @@ class TCMalloc_PageMap2 {
  public:
   typedef uintptr_t Number;
 
-  explicit TCMalloc_PageMap2(void* (*allocator)(size_t)) {
+  explicit TCMalloc_PageMap2(void* (*allocator)(size_t),
+                             bool zeroed_storage = false) {
     allocator_ = allocator;
-    memset(root_, 0, sizeof(root_));
+    if (!zeroed_storage) {
+      memset(root_, 0, sizeof(root_));
+    }
   }
 
   ALWAYS_INLINE
@@ -167,7 +176,6 @@ class TCMalloc_PageMap2 {
       if (root_[i1] == NULL) {
         Leaf* leaf = reinterpret_cast<Leaf*>((*allocator_)(sizeof(Leaf)));
         if (leaf == NULL) return false;
-        memset(leaf, 0, sizeof(*leaf));
         root_[i1] = leaf;
       }
 
@@ -229,19 +237,18 @@ class TCMalloc_PageMap3 {
   void* (*allocator_)(size_t);          // Memory allocator
 
   Node* NewNode() {
-    Node* result = reinterpret_cast<Node*>((*allocator_)(sizeof(Node)));
-    if (result != NULL) {
-      memset(result, 0, sizeof(*result));
-    }
-    return result;
+    return reinterpret_cast<Node*>((*allocator_)(sizeof(Node)));
   }
 
  public:
   typedef uintptr_t Number;
 
-  explicit TCMalloc_PageMap3(void* (*allocator)(size_t)) {
+  explicit TCMalloc_PageMap3(void* (*allocator)(size_t),
+                             bool zeroed_storage = false) {
     allocator_ = allocator;
-    memset(&root_, 0, sizeof(root_));
+    if (!zeroed_storage) {
+      memset(&root_, 0, sizeof(root_));
+    }
   }
 
   ALWAYS_INLINE
@@ -284,7 +291,6 @@ class TCMalloc_PageMap3 {
       if (root_.ptrs[i1]->ptrs[i2] == NULL) {
         Leaf* leaf = reinterpret_cast<Leaf*>((*allocator_)(sizeof(Leaf)));
         if (leaf == NULL) return false;
-        memset(leaf, 0, sizeof(*leaf));
         root_.ptrs[i1]->ptrs[i2] = reinterpret_cast<Node*>(leaf);
       }
 
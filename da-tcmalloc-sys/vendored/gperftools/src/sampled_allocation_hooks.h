@@ -0,0 +1,64 @@
+/* -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+ * Copyright (c) 2024, gperftools Contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// sampled_allocation_hooks.h holds strictly non-public API for
+// observing allocations chosen by the per-thread Sampler (see
+// DoSampledAllocation in tcmalloc.cc). Unlike MallocHook, nothing is
+// invoked for non-sampled allocations, so the malloc/free fast-paths
+// stay untouched. The heap profiler uses it for its sampling mode.
+#ifndef SAMPLED_ALLOCATION_HOOKS_H
+#define SAMPLED_ALLOCATION_HOOKS_H
+
+#include <stddef.h>
+
+#include "base/basictypes.h"
+#include "common.h"
+
+namespace tcmalloc {
+
+// Called after sampled allocation of 'size' bytes at 'ptr' is
+// done. 'stack' is the backtrace captured for the sample. It is
+// called without any tcmalloc locks held.
+using SampledAllocHook = void (*)(const void* ptr, size_t size, const StackTrace& stack);
+
+// Called right before sampled allocation at 'ptr' is returned back
+// to the page heap. Also called without any tcmalloc locks held.
+using SampledFreeHook = void (*)(const void* ptr);
+
+// Installs (or, with nullptr arguments, removes) sampled allocation
+// hooks. There is only one set of hooks. Returns false if some other
+// hooks are already installed.
+ATTRIBUTE_VISIBILITY_HIDDEN bool SetSampledAllocationHooks(SampledAllocHook alloc_hook,
+                                                           SampledFreeHook free_hook);
+
+}  // namespace tcmalloc
+
+#endif  // SAMPLED_ALLOCATION_HOOKS_H
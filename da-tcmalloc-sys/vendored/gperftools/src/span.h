@@ -37,101 +37,37 @@
 #define TCMALLOC_SPAN_H_
 
 #include <config.h>
-#include <set>
 #include "common.h"
 #include "base/logging.h"
-#include "page_heap_allocator.h"
 
 namespace tcmalloc {
 
-struct SpanBestFitLess;
-struct Span;
-
-// Store a pointer to a span along with a cached copy of its length.
-// These are used as set elements to improve the performance of
-// comparisons during tree traversal: the lengths are inline with the
-// tree nodes and thus avoid expensive cache misses to dereference
-// the actual Span objects in most cases.
-struct SpanPtrWithLength {
-  explicit SpanPtrWithLength(Span* s);
-
-  Span* span;
-  Length length;
-};
-typedef std::set<SpanPtrWithLength, SpanBestFitLess, STLPageHeapAllocator<SpanPtrWithLength, void> > SpanSet;
-
-// Comparator for best-fit search, with address order as a tie-breaker.
-struct SpanBestFitLess {
-  bool operator()(SpanPtrWithLength a, SpanPtrWithLength b) const;
-};
-
 // Information kept for a span (a contiguous run of pages).
 struct Span {
   PageID        start;          // Starting page number
   Length        length;         // Number of pages in span
-  Span*         next;           // Used when in link list
-  Span*         prev;           // Used when in link list
-  union {
-    void* objects;              // Linked list of free objects
-
-    // Span may contain iterator pointing back at SpanSet entry of
-    // this span into set of large spans. It is used to quickly delete
-    // spans from those sets. span_iter_space is space for such
-    // iterator which lifetime is controlled explicitly.
-    char span_iter_space[sizeof(SpanSet::iterator)];
-  };
+  Span*         next;           // Used when in link list (or LargeSpanIndex)
+  Span*         prev;           // Used when in link list (or LargeSpanIndex)
+  void*         objects;        // Linked list of free objects
   unsigned int  refcount : 16;  // Number of non-free objects
-  unsigned int  sizeclass : 8;  // Size-class for small objects (or 0)
+  unsigned int  sizeclass : 7;  // Size-class for small objects (or 0)
   unsigned int  location : 2;   // Is the span on a freelist, and if so, which?
   unsigned int  sample : 1;     // Sampled object?
-  bool          has_span_iter : 1; // Iff span_iter_space has valid
-                                   // iterator. Only for debug builds.
+  unsigned int  node : 3;       // Memory node (see numa.h)
+  unsigned int  lazy : 1;       // Released lazily, i.e. maybe still resident
+  unsigned int  zeroed : 1;     // Not written since mapped or released
+  unsigned int  kept : 1;       // Released but kept (MADV_COLD, MADV_PAGEOUT)
+  uint32_t      free_since;     // Page heap clock when freed (oldest part if merged)
 
   constexpr Span()
-    : start{}, length{}, next{}, prev{}, objects{}, refcount{}, sizeclass{}, location{}, sample{}, has_span_iter{} {}
-
-  // Sets iterator stored in span_iter_space.
-  // Requires has_span_iter == 0.
-  void SetSpanSetIterator(const SpanSet::iterator& iter);
-  // Copies out and destroys iterator stored in span_iter_space.
-  SpanSet::iterator ExtractSpanSetIterator();
+    : start{}, length{}, next{}, prev{}, objects{}, refcount{}, sizeclass{}, location{}, sample{}, node{},
+      lazy{}, zeroed{}, kept{}, free_since{} {}
 
   // What freelist the span is on: IN_USE if on none, or normal or returned
   enum { IN_USE, ON_NORMAL_FREELIST, ON_RETURNED_FREELIST };
 };
 
-inline SpanPtrWithLength::SpanPtrWithLength(Span* s)
-    : span(s),
-      length(s->length) {
-}
-
-inline bool SpanBestFitLess::operator()(SpanPtrWithLength a, SpanPtrWithLength b) const {
-  if (a.length < b.length)
-    return true;
-  if (a.length > b.length)
-    return false;
-  return a.span->start < b.span->start;
-}
-
-inline void Span::SetSpanSetIterator(const SpanSet::iterator& iter) {
-  ASSERT(!has_span_iter);
-  has_span_iter = 1;
-
-  new (span_iter_space) SpanSet::iterator(iter);
-}
-
-inline SpanSet::iterator Span::ExtractSpanSetIterator() {
-  typedef SpanSet::iterator iterator_type;
-
-  ASSERT(has_span_iter);
-  has_span_iter = 0;
-
-  iterator_type* this_iter =
-    reinterpret_cast<iterator_type*>(span_iter_space);
-  iterator_type retval = *this_iter;
-  this_iter->~iterator_type();
-  return retval;
-}
+static_assert(kClassSizesMax <= 128, "size class must fit Span::sizeclass");
 
 // Allocator/deallocator for spans
 Span* NewSpan(PageID p, Length len);
@@ -422,6 +422,19 @@ static void maybe_convert_libunwind_to_generic_fp() {
 #endif  // have libunwind and generic_fp
 }
 
+// Implementation chosen at init time, see SetStackTraceMethod.
+static GetStackImplementation *default_stack_impl;
+
+static GetStackImplementation* find_stack_impl(const char* name) {
+  for (int i = 0; i < sizeof(all_impls) / sizeof(all_impls[0]); i++) {
+    GetStackImplementation *c = all_impls[i];
+    if (strcmp(c->name, name) == 0) {
+      return c;
+    }
+  }
+  return nullptr;
+}
+
 static void init_default_stack_impl_inner(void) {
   if (get_stack_impl_inited) {
     return;
@@ -433,16 +446,28 @@ static void init_default_stack_impl_inner(void) {
     // If no explicit implementation is requested, consider changing
     // libunwind->generic_fp in some cases.
     maybe_convert_libunwind_to_generic_fp();
-    return;
+  } else if (GetStackImplementation* c = find_stack_impl(val)) {
+    get_stack_impl = c;
+  } else {
+    fprintf(stderr, "Unknown or unsupported stacktrace method requested: %s. Ignoring it\n", val);
   }
-  for (int i = 0; i < sizeof(all_impls) / sizeof(all_impls[0]); i++) {
-    GetStackImplementation *c = all_impls[i];
-    if (strcmp(c->name, val) == 0) {
-      get_stack_impl = c;
-      return;
+  default_stack_impl = get_stack_impl;
+}
+
+PERFTOOLS_DLL_DECL bool SetStackTraceMethod(const char* name) {
+  init_default_stack_impl_inner();
+
+  GetStackImplementation* c = default_stack_impl;
+  if (name && *name) {
+    c = find_stack_impl(name);
+    if (c == nullptr) {
+      return false;
     }
   }
-  fprintf(stderr, "Unknown or unsupported stacktrace method requested: %s. Ignoring it\n", val);
+  // Concurrent stack captures see either old or new implementation,
+  // both of which are statically allocated and remain valid.
+  __atomic_store_n(&get_stack_impl, c, __ATOMIC_RELAXED);
+  return true;
 }
 
 ATTRIBUTE_NOINLINE
@@ -40,6 +40,7 @@
 #endif
 #include "internal_logging.h"  // for CHECK_CONDITION
 #include "common.h"
+#include "cpu_cache.h"
 #include "sampler.h"           // for Sampler
 #include "getenv_safe.h"       // TCMallocGetenvSafe
 #include "base/googleinit.h"
@@ -47,8 +48,9 @@
 namespace tcmalloc {
 
 bool Static::inited_;
-SizeMap Static::sizemap_;
+// Static::sizemap_ is defined in common.cc.
 CentralFreeList Static::central_cache_[kClassSizesMax];
+CentralFreeList* Static::node_central_caches_[Numa::kMaxNodes];
 PageHeapAllocator<Span> Static::span_allocator_;
 PageHeapAllocator<StackTrace> Static::stacktrace_allocator_;
 Span Static::sampled_objects_;
@@ -62,11 +64,28 @@ void Static::InitStaticVars() {
   span_allocator_.New(); // Reduce cache conflicts
   stacktrace_allocator_.Init();
 
-  for (int i = 0; i < num_size_classes(); ++i) {
-    central_cache_[i].Init(i);
+  Numa::Init(
+    tcmalloc::commandlineflags::StringToBool(
+      TCMallocGetenvSafe("TCMALLOC_NUMA_AWARE"), false));
+
+  node_central_caches_[0] = central_cache_;
+  for (int node = 1; node < Numa::num_nodes(); node++) {
+    // MetaDataAlloc doesn't honor cache line alignment of
+    // CentralFreeList, so we over allocate a bit.
+    constexpr size_t kAlign = alignof(CentralFreeList);
+    void* mem = MetaDataAlloc(sizeof(central_cache_) + kAlign);
+    CHECK_CONDITION(mem != NULL);
+    uintptr_t addr = (reinterpret_cast<uintptr_t>(mem) + kAlign - 1) & ~(kAlign - 1);
+    node_central_caches_[node] = new (reinterpret_cast<void*>(addr)) CentralFreeList[kClassSizesMax];
+  }
+
+  for (int node = 0; node < Numa::num_nodes(); node++) {
+    for (int i = 0; i < num_size_classes(); ++i) {
+      node_central_caches_[node][i].Init(i, node);
+    }
   }
 
-  new (pageheap()) PageHeap(sizemap_.min_span_size_in_pages());
+  new (pageheap()) PageHeap(sizemap_.min_span_size_in_pages(), true);
 
 #if defined(ENABLE_AGGRESSIVE_DECOMMIT_BY_DEFAULT)
   const bool kDefaultAggressiveDecommit = true;
@@ -82,6 +101,27 @@ void Static::InitStaticVars() {
 
   pageheap()->SetAggressiveDecommit(aggressive_decommit);
 
+#if defined(ENABLE_HUGEPAGE_AWARE_BY_DEFAULT)
+  const bool kDefaultHugePageAware = true;
+#else
+  const bool kDefaultHugePageAware = false;
+#endif
+
+  pageheap()->SetHugePageAware(
+    tcmalloc::commandlineflags::StringToBool(
+      TCMallocGetenvSafe("TCMALLOC_HUGEPAGE_AWARE"), kDefaultHugePageAware));
+
+#if defined(ENABLE_PER_CPU_CACHES_BY_DEFAULT)
+  const bool kDefaultPerCpuCaches = true;
+#else
+  const bool kDefaultPerCpuCaches = false;
+#endif
+
+  CpuCache::InitModule(
+    tcmalloc::commandlineflags::StringToBool(
+      TCMallocGetenvSafe("TCMALLOC_PER_CPU_CACHES"),
+                         kDefaultPerCpuCaches));
+
   inited_ = true;
 
   DLL_Init(&sampled_objects_);
@@ -94,16 +134,20 @@ void Static::InitStaticVars() {
 
 void CentralCacheLockAll() NO_THREAD_SAFETY_ANALYSIS
 {
+  CpuCache::LockAll();
   Static::pageheap_lock()->Lock();
-  for (int i = 0; i < Static::num_size_classes(); ++i)
-    Static::central_cache()[i].Lock();
+  for (int node = 0; node < Numa::num_nodes(); ++node)
+    for (int i = 0; i < Static::num_size_classes(); ++i)
+      Static::node_central_cache(node)[i].Lock();
 }
 
 void CentralCacheUnlockAll() NO_THREAD_SAFETY_ANALYSIS
 {
-  for (int i = 0; i < Static::num_size_classes(); ++i)
-    Static::central_cache()[i].Unlock();
+  for (int node = 0; node < Numa::num_nodes(); ++node)
+    for (int i = 0; i < Static::num_size_classes(); ++i)
+      Static::node_central_cache(node)[i].Unlock();
   Static::pageheap_lock()->Unlock();
+  CpuCache::UnlockAll();
 }
 
 void Static::InitLateMaybeRecursive() {
@@ -46,6 +46,7 @@
 #include "base/static_storage.h"
 #include "central_freelist.h"
 #include "common.h"
+#include "numa.h"
 #include "page_heap.h"
 #include "page_heap_allocator.h"
 #include "span.h"
@@ -64,8 +65,20 @@ class Static {
 
   // Central cache -- an array of free-lists, one per size-class.
   // We have a separate lock per free-list to reduce contention.
+  // In NUMA mode there is one such array per memory node, and this
+  // one is for node 0.
   static CentralFreeList* central_cache() { return central_cache_; }
 
+  static CentralFreeList* node_central_cache(int node) {
+    return node_central_caches_[node];
+  }
+
+  // Central cache of memory node we're currently running on. This is
+  // where front-end caches get objects from and return them to.
+  static CentralFreeList* local_central_cache() {
+    return node_central_cache(Numa::CurrentNode());
+  }
+
   static SizeMap* sizemap() { return &sizemap_; }
 
   static unsigned num_size_classes() { return sizemap_.num_size_classes; }
@@ -110,6 +123,7 @@ class Static {
 
   ATTRIBUTE_HIDDEN static SizeMap sizemap_;
   ATTRIBUTE_HIDDEN static CentralFreeList central_cache_[kClassSizesMax];
+  ATTRIBUTE_HIDDEN static CentralFreeList* node_central_caches_[Numa::kMaxNodes];
   ATTRIBUTE_HIDDEN static PageHeapAllocator<Span> span_allocator_;
   ATTRIBUTE_HIDDEN static PageHeapAllocator<StackTrace> stacktrace_allocator_;
   ATTRIBUTE_HIDDEN static Span sampled_objects_;
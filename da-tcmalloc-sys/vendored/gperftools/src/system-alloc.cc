@@ -42,6 +42,12 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>                     // for sbrk, getpagesize, off_t
 #endif
+#ifdef __linux__
+#include <sys/syscall.h>                // for SYS_process_madvise, etc
+#include <sys/uio.h>                    // for iovec
+#endif
+#include <algorithm>                    // for sort
+#include <atomic>
 #include <new>                          // for operator new
 #include <gperftools/malloc_extension.h>
 #include "base/basictypes.h"
@@ -50,6 +56,7 @@
 #include "base/static_storage.h"
 #include "common.h"
 #include "internal_logging.h"
+#include "system-alloc.h"
 
 // On systems (like freebsd) that don't define MAP_ANONYMOUS, use the old
 // form of the name instead.
@@ -57,17 +64,29 @@
 # define MAP_ANONYMOUS MAP_ANON
 #endif
 
-// Linux added support for MADV_FREE in 4.5 but we aren't ready to use it
-// yet. Among other things, using compile-time detection leads to poor
-// results when compiling on a system with MADV_FREE and running on a
-// system without it. See https://github.com/gperftools/gperftools/issues/780.
-#if defined(__linux__) && defined(MADV_FREE) && !defined(TCMALLOC_USE_MADV_FREE)
-# undef MADV_FREE
+// Linux added support for MADV_FREE in 4.5, MADV_COLD and
+// MADV_PAGEOUT in 5.4. Using compile-time detection leads to poor
+// results when compiling on a system with them and running on a
+// system without them (see
+// https://github.com/gperftools/gperftools/issues/780). So on Linux
+// advice is picked at run time (see TCMalloc_SystemSetReleaseAdvice),
+// and kernels that don't know it make us fall back to MADV_DONTNEED.
+#if defined(__linux__) && defined(HAVE_MMAP) && defined(MADV_DONTNEED) \
+    && !defined(FREE_MMAP_PROT_NONE)
+# define HAVE_RUNTIME_RELEASE_ADVICE 1
+# ifndef MADV_FREE
+#  define MADV_FREE 8
+# endif
+# ifndef MADV_COLD
+#  define MADV_COLD 20
+# endif
+# ifndef MADV_PAGEOUT
+#  define MADV_PAGEOUT 21
+# endif
 #endif
 
-// MADV_FREE is specifically designed for use by malloc(), but only
-// FreeBSD supports it; in linux we fall back to the somewhat inferior
-// MADV_DONTNEED.
+// MADV_FREE is specifically designed for use by malloc(). Where it
+// is missing we fall back to the somewhat inferior MADV_DONTNEED.
 #if !defined(MADV_FREE) && defined(MADV_DONTNEED)
 # define MADV_FREE  MADV_DONTNEED
 #endif
@@ -422,7 +441,285 @@ void* TCMalloc_SystemAlloc(size_t size, size_t *actual_size,
   return result;
 }
 
-bool TCMalloc_SystemRelease(void* start, size_t length) {
+using tcmalloc::ReleaseAdvice;
+
+#ifdef TCMALLOC_USE_MADV_FREE
+static constexpr ReleaseAdvice kDefaultReleaseAdvice = ReleaseAdvice::kFree;
+#else
+static constexpr ReleaseAdvice kDefaultReleaseAdvice = ReleaseAdvice::kDontNeed;
+#endif
+
+#ifdef HAVE_RUNTIME_RELEASE_ADVICE
+
+static std::atomic<ReleaseAdvice> release_advice{kDefaultReleaseAdvice};
+
+static int MadviseAdvice(ReleaseAdvice advice) {
+  switch (advice) {
+  case ReleaseAdvice::kFree:
+    return MADV_FREE;
+  case ReleaseAdvice::kCold:
+    return MADV_COLD;
+  case ReleaseAdvice::kPageOut:
+    return MADV_PAGEOUT;
+  default:
+    return MADV_DONTNEED;
+  }
+}
+
+// Releases range with *advice, or with kDontNeed if kernel rejects
+// *advice for it, updating *advice accordingly.
+static bool AdviseRelease(void* start, size_t length, ReleaseAdvice* advice) {
+  for (;;) {
+    if (madvise(start, length, MadviseAdvice(*advice)) == 0) {
+      return true;
+    }
+    if (errno == EAGAIN) {
+      continue;
+    }
+    if (errno == EINVAL && *advice != ReleaseAdvice::kDontNeed) {
+      // Kernel doesn't know this advice, or it doesn't apply to this
+      // mapping (e.g. MADV_FREE on shared or hugetlbfs memory). Other
+      // ranges may still take it, so we only fall back for this one.
+      *advice = ReleaseAdvice::kDontNeed;
+      continue;
+    }
+    return false;
+  }
+}
+
+// Ranges queued by TCMalloc_SystemRelease, all with the same
+// advice. Callers serialize access to them (see system-alloc.h).
+static constexpr int kMaxBatchedReleases = 256;
+static struct iovec batched_releases[kMaxBatchedReleases];
+static int num_batched_releases;
+static ReleaseAdvice batched_advice;
+// True between TCMalloc_SystemBeginReleases and TCMalloc_SystemEndReleases.
+static bool batching_releases;
+// Queued ranges that failed to be released, until they are taken by
+// TCMalloc_SystemTakeFailedRelease.
+static struct iovec failed_releases[kMaxBatchedReleases];
+static int num_failed_releases;
+
+static void RecordFailedRelease(const struct iovec& range) {
+  if (num_failed_releases < kMaxBatchedReleases) {
+    failed_releases[num_failed_releases++] = range;
+    return;
+  }
+  // Out of room, so grow the last one to cover this range too. Pages
+  // it wrongly covers are merely treated as not released.
+  struct iovec* last = &failed_releases[num_failed_releases - 1];
+  char* start = std::min(static_cast<char*>(last->iov_base),
+                         static_cast<char*>(range.iov_base));
+  char* end = std::max(static_cast<char*>(last->iov_base) + last->iov_len,
+                       static_cast<char*>(range.iov_base) + range.iov_len);
+  last->iov_base = start;
+  last->iov_len = end - start;
+}
+
+// Releases all of iov with a single system call. Returns false if that
+// didn't work out.
+static bool ProcessMadvise(const struct iovec* iov, int count, size_t length,
+                           ReleaseAdvice advice) {
+#if defined(SYS_process_madvise) && defined(SYS_pidfd_open)
+  // Older kernels allow only some advice here (MADV_COLD and
+  // MADV_PAGEOUT), newer ones allow any for the calling process.
+  static uint32_t unsupported_advice;
+  static int pidfd = -1;
+  static pid_t pidfd_owner;
+  const uint32_t advice_bit = 1u << static_cast<int>(advice);
+  if (unsupported_advice & advice_bit) {
+    return false;
+  }
+  const pid_t pid = getpid();
+  if (pidfd < 0 || pidfd_owner != pid) {
+    // After fork we must stop advising our parent.
+    if (pidfd >= 0) {
+      close(pidfd);
+    }
+    pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0) {
+      unsupported_advice = ~0u;
+      return false;
+    }
+    pidfd_owner = pid;
+  }
+  long rv = syscall(SYS_process_madvise, pidfd, iov, count,
+                    MadviseAdvice(advice), 0);
+  if (rv < 0 && errno != EAGAIN) {
+    unsupported_advice |= advice_bit;
+  }
+  return rv >= 0 && static_cast<size_t>(rv) == length;
+#else
+  return false;
+#endif
+}
+
+void TCMalloc_SystemFlushReleases() {
+  int count = num_batched_releases;
+  if (count == 0) {
+    return;
+  }
+  num_batched_releases = 0;
+
+  // Coalesce address-adjacent ranges, so that each maximal range
+  // needs at most one madvise.
+  std::sort(batched_releases, batched_releases + count,
+            [] (const struct iovec& a, const struct iovec& b) {
+              return a.iov_base < b.iov_base;
+            });
+  int merged = 0;
+  size_t length = 0;
+  for (int i = 0; i < count; i++) {
+    const struct iovec range = batched_releases[i];
+    length += range.iov_len;
+    if (merged > 0) {
+      struct iovec* last = &batched_releases[merged - 1];
+      if (static_cast<char*>(last->iov_base) + last->iov_len == range.iov_base) {
+        last->iov_len += range.iov_len;
+        continue;
+      }
+    }
+    batched_releases[merged++] = range;
+  }
+  count = merged;
+
+  if (count > 1 && ProcessMadvise(batched_releases, count, length, batched_advice)) {
+    return;
+  }
+  // Releasing is idempotent, so it is fine to redo it for ranges that
+  // might have been released already.
+  for (int i = 0; i < count; i++) {
+    // Spans were already accounted with batched_advice, so a range
+    // that falls back to kDontNeed is merely reported as less released
+    // than it is.
+    ReleaseAdvice advice = batched_advice;
+    if (!AdviseRelease(batched_releases[i].iov_base, batched_releases[i].iov_len,
+                       &advice)) {
+      RecordFailedRelease(batched_releases[i]);
+    }
+  }
+}
+
+bool TCMalloc_SystemTakeFailedRelease(void** start, size_t* length) {
+  if (num_failed_releases == 0) {
+    return false;
+  }
+  num_failed_releases--;
+  *start = failed_releases[num_failed_releases].iov_base;
+  *length = failed_releases[num_failed_releases].iov_len;
+  return true;
+}
+
+bool TCMalloc_SystemReleaseFailed(void* start, size_t length) {
+  char* end = static_cast<char*>(start) + length;
+  for (int i = 0; i < num_failed_releases; i++) {
+    char* failed = static_cast<char*>(failed_releases[i].iov_base);
+    if (failed < end && start < failed + failed_releases[i].iov_len) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool QueueRelease(void* start, size_t length, ReleaseAdvice advice) {
+  if (num_batched_releases > 0 && advice != batched_advice) {
+    TCMalloc_SystemFlushReleases();
+  }
+  if (num_batched_releases > 0) {
+    struct iovec* last = &batched_releases[num_batched_releases - 1];
+    if (static_cast<char*>(last->iov_base) + last->iov_len == start) {
+      last->iov_len += length;
+      return true;
+    }
+  }
+  if (num_batched_releases == kMaxBatchedReleases) {
+    TCMalloc_SystemFlushReleases();
+  }
+  batched_releases[num_batched_releases].iov_base = start;
+  batched_releases[num_batched_releases].iov_len = length;
+  num_batched_releases++;
+  batched_advice = advice;
+  return true;
+}
+
+void TCMalloc_SystemBeginReleases() {
+  ASSERT(!batching_releases);
+  batching_releases = true;
+}
+
+void TCMalloc_SystemEndReleases() {
+  ASSERT(batching_releases);
+  batching_releases = false;
+  TCMalloc_SystemFlushReleases();
+}
+
+bool TCMalloc_SystemSetReleaseAdvice(ReleaseAdvice advice) {
+  if (advice >= ReleaseAdvice::kCount) {
+    return false;
+  }
+  TCMalloc_SystemFlushReleases();
+  release_advice.store(advice, std::memory_order_relaxed);
+  return true;
+}
+
+ReleaseAdvice TCMalloc_SystemGetReleaseAdvice() {
+  return release_advice.load(std::memory_order_relaxed);
+}
+
+#else  // !HAVE_RUNTIME_RELEASE_ADVICE
+
+void TCMalloc_SystemFlushReleases() {
+}
+
+bool TCMalloc_SystemTakeFailedRelease(void** start, size_t* length) {
+  return false;
+}
+
+bool TCMalloc_SystemReleaseFailed(void* start, size_t length) {
+  return false;
+}
+
+void TCMalloc_SystemBeginReleases() {
+}
+
+void TCMalloc_SystemEndReleases() {
+}
+
+bool TCMalloc_SystemSetReleaseAdvice(ReleaseAdvice advice) {
+  return advice == kDefaultReleaseAdvice;
+}
+
+ReleaseAdvice TCMalloc_SystemGetReleaseAdvice() {
+  return kDefaultReleaseAdvice;
+}
+
+#endif  // !HAVE_RUNTIME_RELEASE_ADVICE
+
+bool TCMalloc_SystemAllocZeroes() {
+  SpinLockHolder lock_holder(&spinlock);
+  return tcmalloc_sys_alloc != NULL && tcmalloc_sys_alloc == default_space.get();
+}
+
+bool TCMalloc_SystemReleaseZeroes() {
+#ifdef HAVE_RUNTIME_RELEASE_ADVICE
+  // Released ranges are rounded in to system pages, so our pages are
+  // released whole only if those aren't larger.
+  if (pagesize == 0) pagesize = getpagesize();
+  if (pagesize > kPageSize || !TCMalloc_SystemAllocZeroes()) {
+    return false;
+  }
+  const ReleaseAdvice advice = TCMalloc_SystemGetReleaseAdvice();
+  return advice == ReleaseAdvice::kDontNeed || advice == ReleaseAdvice::kBatchedDontNeed;
+#else
+  return false;
+#endif
+}
+
+bool TCMalloc_SystemRelease(void* start, size_t length, ReleaseAdvice* used_advice) {
+  ReleaseAdvice advice = TCMalloc_SystemGetReleaseAdvice();
+  if (used_advice != NULL) {
+    *used_advice = advice;
+  }
 #if defined(FREE_MMAP_PROT_NONE) && defined(HAVE_MMAP) || defined(MADV_FREE)
   if (FLAGS_malloc_disable_memory_release) return false;
   if (pagesize == 0) pagesize = getpagesize();
@@ -443,6 +740,17 @@ bool TCMalloc_SystemRelease(void* start, size_t length) {
   ASSERT(new_end <= end);
 
   if (new_end > new_start) {
+#ifdef HAVE_RUNTIME_RELEASE_ADVICE
+    void* range = reinterpret_cast<void*>(new_start);
+    if (batching_releases || advice == ReleaseAdvice::kBatchedDontNeed) {
+      return QueueRelease(range, new_end - new_start, advice);
+    }
+    const bool result = AdviseRelease(range, new_end - new_start, &advice);
+    if (used_advice != NULL) {
+      *used_advice = advice;
+    }
+    return result;
+#else
     bool result, retry;
     do {
 #if defined(FREE_MMAP_PROT_NONE) && defined(HAVE_MMAP)
@@ -463,11 +771,20 @@ bool TCMalloc_SystemRelease(void* start, size_t length) {
     } while (!result && retry);
 
     return result;
+#endif
   }
 #endif 
   return false;
 }
 
+void TCMalloc_SystemAdviseHugePages(void* start, size_t length) {
+#if defined(HAVE_MMAP) && defined(MADV_HUGEPAGE)
+  // Failure is fine, we'll merely get whatever THP policy system has
+  // by default.
+  madvise(start, length, MADV_HUGEPAGE);
+#endif
+}
+
 void TCMalloc_SystemCommit(void* start, size_t length) {
 #if defined(FREE_MMAP_PROT_NONE) && defined(HAVE_MMAP)
   // remaping as MAP_FIXED to same address assuming span size did not change 
@@ -477,6 +794,7 @@ void TCMalloc_SystemCommit(void* start, size_t length) {
 #else
   // Nothing to do here.  TCMalloc_SystemRelease does not alter pages
   // such that they need to be re-committed before they can be used by the
-  // application.
+  // application. Except that they might still be queued for release.
+  TCMalloc_SystemFlushReleases();
 #endif
 }
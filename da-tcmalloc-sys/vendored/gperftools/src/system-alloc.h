@@ -42,6 +42,21 @@
 
 class SysAllocator;
 
+namespace tcmalloc {
+
+// How TCMalloc_SystemRelease gives memory back to the system. Only
+// kDontNeed is supported everywhere, the rest are Linux only.
+enum class ReleaseAdvice {
+  kDontNeed,         // MADV_DONTNEED: pages are dropped right away
+  kFree,             // MADV_FREE: pages are dropped under memory pressure
+  kCold,             // MADV_COLD: pages are kept, but reclaimed first
+  kPageOut,          // MADV_PAGEOUT: pages are reclaimed right away
+  kBatchedDontNeed,  // MADV_DONTNEED, many ranges per process_madvise call
+  kCount
+};
+
+}  // namespace tcmalloc
+
 // REQUIRES: "alignment" is a power of two or "0" to indicate default alignment
 //
 // Allocate and return "N" bytes of zeroed memory.
@@ -72,9 +87,13 @@ void* TCMalloc_SystemAlloc(size_t bytes, size_t *actual_bytes,
 // performance.  (Only pages fully covered by the memory region will
 // be released, partial pages will not.)
 //
-// Returns false if release failed or not supported.
+// Returns false if release failed or not supported. If used_advice is
+// not NULL, it is set to the advice the range was released with. It
+// differs from TCMalloc_SystemGetReleaseAdvice() when kernel rejected
+// that advice for this range.
 extern PERFTOOLS_DLL_DECL
-bool TCMalloc_SystemRelease(void* start, size_t length);
+bool TCMalloc_SystemRelease(void* start, size_t length,
+                            tcmalloc::ReleaseAdvice* used_advice = NULL);
 
 // Called to ressurect memory which has been previously released
 // to the system via TCMalloc_SystemRelease.  An attempt to
@@ -83,6 +102,64 @@ bool TCMalloc_SystemRelease(void* start, size_t length);
 extern PERFTOOLS_DLL_DECL
 void TCMalloc_SystemCommit(void* start, size_t length);
 
+// Hints the operating system that the specified range of memory is
+// best backed by transparent huge pages. Does nothing if that is not
+// supported.
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemAdviseHugePages(void* start, size_t length);
+
+// Sets advice used by TCMalloc_SystemRelease. Returns false if it is
+// not supported. Ranges for which running kernel rejects the advice
+// (e.g. it doesn't know it, or it doesn't apply to the mapping) are
+// released with kDontNeed instead, one call at a time.
+//
+// Callers must serialize this with TCMalloc_SystemRelease,
+// TCMalloc_SystemCommit and TCMalloc_SystemFlushReleases.
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemSetReleaseAdvice(tcmalloc::ReleaseAdvice advice);
+
+extern PERFTOOLS_DLL_DECL
+tcmalloc::ReleaseAdvice TCMalloc_SystemGetReleaseAdvice();
+
+// Returns true if memory TCMalloc_SystemAlloc gets from the system
+// reads as zeros, i.e. unless a custom SysAllocator is installed.
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemAllocZeroes();
+
+// Returns true if pages released with current advice read as zeros
+// once they are touched again. Unless releasing them fails later, for
+// ranges that were only queued (see TCMalloc_SystemFlushReleases).
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemReleaseZeroes();
+
+// With kBatchedDontNeed advice TCMalloc_SystemRelease only queues
+// ranges. This actually releases them, coalescing address-adjacent
+// ranges and issuing a single process_madvise (where supported) for
+// the whole queue. TCMalloc_SystemCommit does it too, so queued pages
+// are never dropped after they are reused.
+//
+// TCMalloc_SystemRelease returns true for queued ranges. Ranges that
+// fail to be released here are kept for TCMalloc_SystemTakeFailedRelease.
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemFlushReleases();
+
+// Takes a queued range that failed to be released, i.e. its pages are
+// still there. Returns false if there is none.
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemTakeFailedRelease(void** start, size_t* length);
+
+// Returns true if some range not taken by
+// TCMalloc_SystemTakeFailedRelease yet overlaps the given one.
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemReleaseFailed(void* start, size_t length);
+
+// Between these two calls TCMalloc_SystemRelease queues ranges with
+// any advice. TCMalloc_SystemEndReleases flushes them.
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemBeginReleases();
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemEndReleases();
+
 // The current system allocator.
 extern PERFTOOLS_DLL_DECL SysAllocator* tcmalloc_sys_alloc;
 
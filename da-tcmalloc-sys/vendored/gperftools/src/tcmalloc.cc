@@ -102,6 +102,8 @@
 #include <unistd.h>                     // for getpagesize, write, etc
 #endif
 #include <algorithm>                    // for max, min
+#include <atomic>
+#include <chrono>                       // for steady_clock
 #include <limits>                       // for numeric_limits
 #include <new>                          // for nothrow_t (ptr only), etc
 #include <vector>                       // for vector
@@ -115,11 +117,13 @@
 #include "base/spinlock.h"              // for SpinLockHolder
 #include "central_freelist.h"
 #include "common.h"            // for StackTrace, kPageShift, etc
+#include "cpu_cache.h"
 #include "internal_logging.h"  // for ASSERT, TCMalloc_Printer, etc
 #include "linked_list.h"       // for SLL_SetNext
 #include "malloc_hook-inl.h"       // for MallocHook::InvokeNewHook, etc
 #include "page_heap.h"         // for PageHeap, PageHeap::Stats
 #include "page_heap_allocator.h"  // for PageHeapAllocator
+#include "sampled_allocation_hooks.h"  // for SampledAllocHook, etc
 #include "span.h"              // for Span, DLL_Prepend, etc
 #include "stack_trace_table.h"  // for StackTraceTable
 #include "static_vars.h"       // for Static
@@ -146,9 +150,12 @@ using std::vector;
 
 #include "libc_override.h"
 
+using tcmalloc::CentralFreeList;
+using tcmalloc::CpuCache;
 using tcmalloc::kLog;
 using tcmalloc::kCrash;
 using tcmalloc::Log;
+using tcmalloc::Numa;
 using tcmalloc::PageHeap;
 using tcmalloc::PageHeapAllocator;
 using tcmalloc::SizeMap;
@@ -336,9 +343,15 @@ static void ExtractStats(TCMallocStats* r, uint64_t* class_count,
   r->central_bytes = 0;
   r->transfer_bytes = 0;
   for (int cl = 0; cl < Static::num_size_classes(); ++cl) {
-    const int length = Static::central_cache()[cl].length();
-    const int tc_length = Static::central_cache()[cl].tc_length();
-    const size_t cache_overhead = Static::central_cache()[cl].OverheadBytes();
+    int length = 0;
+    int tc_length = 0;
+    size_t cache_overhead = 0;
+    for (int node = 0; node < Numa::num_nodes(); ++node) {
+      CentralFreeList* list = &Static::node_central_cache(node)[cl];
+      length += list->length();
+      tc_length += list->tc_length();
+      cache_overhead += list->OverheadBytes();
+    }
     const size_t size = static_cast<uint64_t>(
         Static::sizemap()->ByteSizeForClass(cl));
     r->central_bytes += (size * length) + cache_overhead;
@@ -351,8 +364,10 @@ static void ExtractStats(TCMallocStats* r, uint64_t* class_count,
 
   }
 
-  // Add stats from per-thread heaps
+  // Add stats from per-thread heaps. Per-CPU caches, if active, are
+  // accounted as thread cache bytes too.
   r->thread_bytes = 0;
+  CpuCache::GetCpuStats(&r->thread_bytes, class_count);
   { // scope
     SpinLockHolder h(Static::pageheap_lock());
     ThreadCache::GetThreadStats(&r->thread_bytes, class_count);
@@ -435,6 +450,44 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
       uint64_t(ThreadCache::HeapsInUse()),
       uint64_t(kPageSize));
 
+  PageHeap::HugePageStats hugepages;
+  {
+    SpinLockHolder l(Static::pageheap_lock());
+    Static::pageheap()->GetHugePageStatsLocked(&hugepages);
+  }
+  out->printf(
+      "------------------------------------------------\n"
+      "HUGEPAGES: %s page heap, %zu MiB hugepages\n"
+      "HUGEPAGES: %12" PRId64 " hugepages spanned by page heap\n"
+      "HUGEPAGES: %12" PRId64 " free whole hugepages\n"
+      "HUGEPAGES: %12" PRId64 " released whole hugepages\n"
+      "HUGEPAGES: %12" PRId64 " (%7.1f MiB) pages released outside of whole hugepages\n",
+      Static::pageheap()->GetHugePageAware() ? "hugepage aware" : "regular",
+      kHugePageSize >> 20,
+      hugepages.system_hugepages,
+      hugepages.free_hugepages,
+      hugepages.released_hugepages,
+      hugepages.fragmented_released_pages,
+      PagesToMiB(hugepages.fragmented_released_pages));
+
+  static const char* const kReleaseAdviceNames[] = {
+    "MADV_DONTNEED", "MADV_FREE", "MADV_COLD", "MADV_PAGEOUT",
+    "batched MADV_DONTNEED",
+  };
+  static_assert(sizeof(kReleaseAdviceNames) / sizeof(kReleaseAdviceNames[0])
+                == size_t(tcmalloc::ReleaseAdvice::kCount));
+  const uint64_t lazy_unmapped_bytes = stats.pageheap.lazy_unmapped_bytes;
+  const uint64_t gone_unmapped_bytes = stats.pageheap.unmapped_bytes
+                                       - lazy_unmapped_bytes;
+  out->printf(
+      "------------------------------------------------\n"
+      "RELEASE: memory released to OS with %s\n"
+      "RELEASE: %12" PRIu64 " (%7.1f MiB) released lazily, may still be resident\n"
+      "RELEASE: %12" PRIu64 " (%7.1f MiB) actually unmapped\n",
+      kReleaseAdviceNames[size_t(TCMalloc_SystemGetReleaseAdvice())],
+      lazy_unmapped_bytes, lazy_unmapped_bytes / MiB,
+      gone_unmapped_bytes, gone_unmapped_bytes / MiB);
+
   if (level >= 2) {
     out->printf("------------------------------------------------\n");
     out->printf("Total size of freelists for per-thread caches,\n");
@@ -447,8 +500,10 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
         size_t cl_size = Static::sizemap()->ByteSizeForClass(cl);
         const uint64_t class_bytes = class_count[cl] * cl_size;
         cumulative_bytes += class_bytes;
-        const uint64_t class_overhead =
-            Static::central_cache()[cl].OverheadBytes();
+        uint64_t class_overhead = 0;
+        for (int node = 0; node < Numa::num_nodes(); ++node) {
+          class_overhead += Static::node_central_cache(node)[cl].OverheadBytes();
+        }
         cumulative_overhead += class_overhead;
         out->printf("class %3d [ %8zu bytes ] : "
                 "%8" PRIu64 " objs; %5.1f MiB; %5.1f cum MiB; "
@@ -637,6 +692,10 @@ class TCMallocImplementation : public MallocExtension {
   // NOTE: Protected by Static::pageheap_lock().
   size_t extra_bytes_released_;
 
+  // ReleaseToSystem() releases at most this much memory per page heap
+  // lock acquisition.
+  static constexpr size_t kMaxReleaseBatchBytes = 64 << 20;
+
  public:
   TCMallocImplementation()
       : extra_bytes_released_(0) {
@@ -767,6 +826,13 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.cpu_cache_free_bytes") == 0) {
+      uint64_t bytes = 0;
+      CpuCache::GetCpuStats(&bytes, NULL);
+      *value = bytes;
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.pageheap_free_bytes") == 0) {
       SpinLockHolder l(Static::pageheap_lock());
       *value = Static::pageheap()->StatsLocked().free_bytes;
@@ -779,6 +845,18 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.pageheap_lazy_unmapped_bytes") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->StatsLocked().lazy_unmapped_bytes;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.release_advice") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = size_t(TCMalloc_SystemGetReleaseAdvice());
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.pageheap_committed_bytes") == 0) {
       SpinLockHolder l(Static::pageheap_lock());
       *value = Static::pageheap()->StatsLocked().committed_bytes;
@@ -851,12 +929,67 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.hugepage_aware") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = size_t(Static::pageheap()->GetHugePageAware());
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.background_release") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = size_t(Static::pageheap()->GetBackgroundRelease());
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.custom_size_classes") == 0) {
+      *value = size_t(Static::sizemap()->custom());
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_free_hugepages") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      PageHeap::HugePageStats hugepages;
+      Static::pageheap()->GetHugePageStatsLocked(&hugepages);
+      *value = hugepages.free_hugepages;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.pageheap_released_hugepages") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      PageHeap::HugePageStats hugepages;
+      Static::pageheap()->GetHugePageStatsLocked(&hugepages);
+      *value = hugepages.released_hugepages;
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.heap_limit_mb") == 0) {
       SpinLockHolder l(Static::pageheap_lock());
       *value = FLAGS_tcmalloc_heap_limit_mb;
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.per_cpu_caches") == 0) {
+      *value = size_t(CpuCache::IsActive());
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.numa_nodes") == 0) {
+      *value = Numa::IsActive() ? Numa::num_nodes() : 0;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.numa_local_allocations") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->StatsLocked().numa_local_count;
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.numa_remote_allocations") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      *value = Static::pageheap()->StatsLocked().numa_remote_count;
+      return true;
+    }
+
     if (strcmp(name, "tcmalloc.impl.thread_cache_count") == 0) {
       SpinLockHolder h(Static::pageheap_lock());
       *value = ThreadCache::thread_heap_count();
@@ -892,6 +1025,30 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.hugepage_aware") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      Static::pageheap()->SetHugePageAware(value != 0);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.per_cpu_caches") == 0) {
+      return CpuCache::SetActive(value != 0);
+    }
+
+    if (strcmp(name, "tcmalloc.background_release") == 0) {
+      SpinLockHolder l(Static::pageheap_lock());
+      Static::pageheap()->SetBackgroundRelease(value != 0);
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.release_advice") == 0) {
+      if (value >= size_t(tcmalloc::ReleaseAdvice::kCount)) {
+        return false;
+      }
+      SpinLockHolder l(Static::pageheap_lock());
+      return TCMalloc_SystemSetReleaseAdvice(tcmalloc::ReleaseAdvice(value));
+    }
+
     if (strcmp(name, "tcmalloc.heap_limit_mb") == 0) {
       SpinLockHolder l(Static::pageheap_lock());
       FLAGS_tcmalloc_heap_limit_mb = value;
@@ -919,6 +1076,8 @@ class TCMallocImplementation : public MallocExtension {
       // When our thread had cache, lets delete it
       ThreadCache::DeleteCache(cache);
     }
+    // Our CPU is likely to go idle too.
+    CpuCache::DrainCurrent();
   }
 
   virtual void MarkThreadBusy();  // Implemented below
@@ -934,28 +1093,77 @@ class TCMallocImplementation : public MallocExtension {
   }
 
   virtual void ReleaseToSystem(size_t num_bytes) {
-    SpinLockHolder h(Static::pageheap_lock());
-    if (num_bytes <= extra_bytes_released_) {
-      // We released too much on a prior call, so don't release any
-      // more this time.
-      extra_bytes_released_ = extra_bytes_released_ - num_bytes;
-      return;
-    }
-    num_bytes = num_bytes - extra_bytes_released_;
-    // num_bytes might be less than one page.  If we pass zero to
-    // ReleaseAtLeastNPages, it won't do anything, so we release a whole
-    // page now and let extra_bytes_released_ smooth it out over time.
-    Length num_pages = max<Length>(num_bytes >> kPageShift, 1);
-    size_t bytes_released = Static::pageheap()->ReleaseAtLeastNPages(
-        num_pages) << kPageShift;
-    if (bytes_released > num_bytes) {
-      extra_bytes_released_ = bytes_released - num_bytes;
-    } else {
-      // The PageHeap wasn't able to release num_bytes.  Don't try to
-      // compensate with a big release next time.  Specifically,
-      // ReleaseFreeMemory() calls ReleaseToSystem(LONG_MAX).
+    {
+      SpinLockHolder h(Static::pageheap_lock());
+      if (num_bytes <= extra_bytes_released_) {
+        // We released too much on a prior call, so don't release any
+        // more this time.
+        extra_bytes_released_ = extra_bytes_released_ - num_bytes;
+        return;
+      }
+      num_bytes = num_bytes - extra_bytes_released_;
       extra_bytes_released_ = 0;
     }
+
+    // Releasing a lot of memory may take many system calls, so we do
+    // it in parts and let allocations in between.
+    for (;;) {
+      SpinLockHolder h(Static::pageheap_lock());
+      // num_bytes might be less than one page.  If we pass zero to
+      // ReleaseAtLeastNPages, it won't do anything, so we release a whole
+      // page now and let extra_bytes_released_ smooth it out over time.
+      Length num_pages = min<Length>(num_bytes >> kPageShift,
+                                     kMaxReleaseBatchBytes >> kPageShift);
+      num_pages = max<Length>(num_pages, 1);
+      size_t bytes_released = Static::pageheap()->ReleaseAtLeastNPages(
+          num_pages) << kPageShift;
+      if (bytes_released >= num_bytes) {
+        extra_bytes_released_ = bytes_released - num_bytes;
+        return;
+      }
+      num_bytes -= bytes_released;
+      if (bytes_released < (num_pages << kPageShift)) {
+        // The PageHeap wasn't able to release num_bytes.  Don't try to
+        // compensate with a big release next time.  Specifically,
+        // ReleaseFreeMemory() calls ReleaseToSystem(LONG_MAX).
+        return;
+      }
+    }
+  }
+
+  virtual void ReleaseFreeMemory() {
+    // Objects held by per-CPU caches may keep whole spans in use.
+    CpuCache::DrainAll();
+    ReleaseToSystem(static_cast<size_t>(-1));   // SIZE_T_MAX
+  }
+
+  virtual size_t ReleaseOldFreeMemory(size_t num_bytes, size_t min_age_ms) {
+    // Page heap clock only needs to be monotonic. It is fine for it
+    // to wrap around, as long as ages stay well below 49 days.
+    const uint32_t now_ms = static_cast<uint32_t>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    const uint32_t min_age = static_cast<uint32_t>(
+        min<size_t>(min_age_ms, numeric_limits<uint32_t>::max()));
+    Length num_pages = max<Length>(num_bytes >> kPageShift, 1);
+    SpinLockHolder h(Static::pageheap_lock());
+    return Static::pageheap()->ReleaseOldFreeSpans(
+        now_ms, min_age, num_pages) << kPageShift;
+  }
+
+  virtual void GetSizeClasses(vector<MallocExtension::SizeClassInfo>* v) {
+    v->clear();
+    for (int cl = 1; cl < Static::num_size_classes(); ++cl) {
+      MallocExtension::SizeClassInfo i;
+      i.size = Static::sizemap()->class_to_size(cl);
+      i.pages = Static::sizemap()->class_to_pages(cl);
+      i.objects_to_move = Static::sizemap()->num_objects_to_move(cl);
+      v->push_back(i);
+    }
+  }
+
+  virtual const char* CheckSizeClasses(const char* spec) {
+    return SizeMap::CheckSpec(spec);
   }
 
   virtual void SetMemoryReleaseRate(double rate) {
@@ -1009,14 +1217,18 @@ class TCMallocImplementation : public MallocExtension {
       MallocExtension::FreeListInfo i;
       i.min_object_size = prev_class_size + 1;
       i.max_object_size = class_size;
-      i.total_bytes_free =
-          Static::central_cache()[cl].length() * class_size;
+      int length = 0;
+      int tc_length = 0;
+      for (int node = 0; node < Numa::num_nodes(); ++node) {
+        length += Static::node_central_cache(node)[cl].length();
+        tc_length += Static::node_central_cache(node)[cl].tc_length();
+      }
+      i.total_bytes_free = length * class_size;
       i.type = kCentralCacheType;
       v->push_back(i);
 
       // transfer cache
-      i.total_bytes_free =
-          Static::central_cache()[cl].tc_length() * class_size;
+      i.total_bytes_free = tc_length * class_size;
       i.type = kTransferCacheType;
       v->push_back(i);
 
@@ -1239,6 +1451,30 @@ static ALWAYS_INLINE void* SpanToMallocResult(Span *span) {
       CheckedMallocResult(reinterpret_cast<void*>(span->start << kPageShift));
 }
 
+static std::atomic<tcmalloc::SampledAllocHook> sampled_alloc_hook;
+static std::atomic<tcmalloc::SampledFreeHook> sampled_free_hook;
+
+bool tcmalloc::SetSampledAllocationHooks(SampledAllocHook alloc_hook,
+                                         SampledFreeHook free_hook) {
+  static SpinLock hooks_lock;
+  SpinLockHolder h(&hooks_lock);
+
+  if (alloc_hook != nullptr
+      && sampled_alloc_hook.load(std::memory_order_relaxed) != nullptr) {
+    return false;
+  }
+  // Free hook goes first on install and last on removal, so that we
+  // never observe free of sample which allocation we didn't see.
+  if (alloc_hook != nullptr) {
+    sampled_free_hook.store(free_hook, std::memory_order_release);
+    sampled_alloc_hook.store(alloc_hook, std::memory_order_release);
+  } else {
+    sampled_alloc_hook.store(nullptr, std::memory_order_release);
+    sampled_free_hook.store(nullptr, std::memory_order_release);
+  }
+  return true;
+}
+
 static void* DoSampledAllocation(size_t size) {
 #ifndef NO_TCMALLOC_SAMPLES
   // Grab the stack trace outside the heap lock
@@ -1253,18 +1489,27 @@ static void* DoSampledAllocation(size_t size) {
     return NULL;
   }
 
-  SpinLockHolder h(Static::pageheap_lock());
+  {
+    SpinLockHolder h(Static::pageheap_lock());
 
-  // Allocate stack trace
-  StackTrace *stack = Static::stacktrace_allocator()->New();
-  if (PREDICT_TRUE(stack != nullptr)) {
-    *stack = tmp;
-    span->sample = 1;
-    span->objects = stack;
-    tcmalloc::DLL_Prepend(Static::sampled_objects(), span);
+    // Allocate stack trace
+    StackTrace *stack = Static::stacktrace_allocator()->New();
+    if (PREDICT_TRUE(stack != nullptr)) {
+      *stack = tmp;
+      span->sample = 1;
+      span->objects = stack;
+      tcmalloc::DLL_Prepend(Static::sampled_objects(), span);
+    }
   }
 
-  return SpanToMallocResult(span);
+  void* result = SpanToMallocResult(span);
+  // Only samples that made it to sampled_objects list are reported,
+  // so that we also see their frees (see do_free_pages).
+  tcmalloc::SampledAllocHook hook = sampled_alloc_hook.load(std::memory_order_acquire);
+  if (PREDICT_FALSE(hook != nullptr) && span->sample) {
+    hook(result, size, tmp);
+  }
+  return result;
 #else
   abort();
 #endif
@@ -1481,6 +1726,10 @@ ALWAYS_INLINE void* do_malloc(size_t size) {
 
   // The common case, and also the simplest.  This just pops the
   // size-appropriate freelist, after replenishing it if it's empty.
+  if (CpuCache* cpu_cache = CpuCache::GetIfActive()) {
+    return CheckedMallocResult(
+      cpu_cache->Allocate(allocated_size, cl, nop_oom_handler));
+  }
   return CheckedMallocResult(
     cache_ptr->Allocate(allocated_size, cl, nop_oom_handler));
 }
@@ -1516,6 +1765,15 @@ ALWAYS_INLINE void* do_calloc(size_t n, size_t elem_size) {
       // But we can do it only when not dealing with emergency
       // malloc-ed memory.
       total_size = tc_nallocx(size, 0);
+
+      // Large blocks are whole spans, often freshly mapped or
+      // released, whose pages are zeros already.
+      if (size > kMaxSize) {
+        const PageID p = reinterpret_cast<uintptr_t>(result) >> kPageShift;
+        if (Static::pageheap()->GetDescriptor(p)->zeroed) {
+          return result;
+        }
+      }
     }
     memset(result, 0, total_size);
   }
@@ -1537,6 +1795,13 @@ static ATTRIBUTE_NOINLINE void do_free_pages(Span* span, void* ptr) {
       span->start << kPageShift == reinterpret_cast<uintptr_t>(ptr),
       "Pointer is not pointing to the start of a span");
 
+  if (span->sample) {
+    tcmalloc::SampledFreeHook hook = sampled_free_hook.load(std::memory_order_acquire);
+    if (hook != nullptr) {
+      hook(ptr);
+    }
+  }
+
   Static::pageheap()->PrepareAndDelete(span, [&] () {
     if (span->sample) {
       StackTrace* st = reinterpret_cast<StackTrace*>(span->objects);
@@ -1609,6 +1874,13 @@ void do_free_with_callback(void* ptr,
     }
   }
 
+  // Per-CPU caches are only activated after Static::InitStaticVars,
+  // so if we've got one, we're inited.
+  if (CpuCache* cpu_cache = CpuCache::GetIfActive()) {
+    cpu_cache->Deallocate(ptr, cl);
+    return;
+  }
+
   if (PREDICT_TRUE(heap != NULL)) {
     ASSERT(Static::IsInited());
     // If we've hit initialized thread cache, so we're done.
@@ -1629,7 +1901,7 @@ void do_free_with_callback(void* ptr,
 
   // Otherwise, delete directly into central cache
   tcmalloc::SLL_SetNext(ptr, NULL);
-  Static::central_cache()[cl].InsertRange(ptr, ptr, 1);
+  Static::local_central_cache()[cl].InsertRange(ptr, ptr, 1);
 }
 
 // The default "do_free" that uses the default callback.
@@ -1980,6 +2252,9 @@ static void * malloc_fast_path(size_t size) {
     return tcmalloc::dispatch_allocate_full<OOMHandler>(size);
   }
 
+  if (CpuCache* cpu_cache = CpuCache::GetIfActive()) {
+    return CheckedMallocResult(cpu_cache->Allocate(allocated_size, cl, OOMHandler));
+  }
   return CheckedMallocResult(cache->Allocate(allocated_size, cl, OOMHandler));
 }
 
@@ -2022,8 +2297,8 @@ void tc_free(void* ptr) PERFTOOLS_NOTHROW {
   free_fast_path(ptr);
 }
 
-extern "C" PERFTOOLS_DLL_DECL CACHELINE_ALIGNED_FN
-void tc_free_sized(void *ptr, size_t size) PERFTOOLS_NOTHROW {
+static ALWAYS_INLINE
+void free_sized_fast_path(void *ptr, size_t size) {
   if (PREDICT_FALSE(!base::internal::delete_hooks_.empty())) {
     tcmalloc::invoke_hooks_and_free(ptr);
     return;
@@ -2044,6 +2319,11 @@ void tc_free_sized(void *ptr, size_t size) PERFTOOLS_NOTHROW {
   do_free_with_callback(ptr, &InvalidFree, true, size);
 }
 
+extern "C" PERFTOOLS_DLL_DECL CACHELINE_ALIGNED_FN
+void tc_free_sized(void *ptr, size_t size) PERFTOOLS_NOTHROW {
+  free_sized_fast_path(ptr, size);
+}
+
 #ifdef TC_ALIAS
 
 extern "C" PERFTOOLS_DLL_DECL void tc_delete_sized(void *p, size_t size) PERFTOOLS_NOTHROW
@@ -2206,11 +2486,16 @@ extern "C" PERFTOOLS_DLL_DECL void tc_delete_aligned(void* p, std::align_val_t)
   free_fast_path(p);
 }
 
-// There is no easy way to obtain the actual size used by do_memalign to allocate aligned storage, so for now
-// just ignore the size. It might get useful in the future.
+// Alignments up to kPageSize are served by plain malloc of size
+// rounded up to alignment (see memalign_fast_path), so we can use the
+// same size hint. Bigger ones come straight from page heap.
 extern "C" PERFTOOLS_DLL_DECL void tc_delete_sized_aligned(void* p, size_t size, std::align_val_t align) PERFTOOLS_NOTHROW
 {
-  free_fast_path(p);
+  if (PREDICT_FALSE(static_cast<size_t>(align) > kPageSize)) {
+    free_fast_path(p);
+    return;
+  }
+  free_sized_fast_path(p, align_size_up(size, static_cast<size_t>(align)));
 }
 
 extern "C" PERFTOOLS_DLL_DECL void tc_delete_aligned_nothrow(void* p, std::align_val_t, const std::nothrow_t&) PERFTOOLS_NOTHROW
@@ -2245,14 +2530,12 @@ TC_ALIAS(tc_delete_aligned);
 }
 #endif
 
-// There is no easy way to obtain the actual size used by do_memalign to allocate aligned storage, so for now
-// just ignore the size. It might get useful in the future.
 extern "C" PERFTOOLS_DLL_DECL void tc_deletearray_sized_aligned(void* p, size_t size, std::align_val_t align) PERFTOOLS_NOTHROW
 #ifdef TC_ALIAS
 TC_ALIAS(tc_delete_sized_aligned);
 #else
 {
-  free_fast_path(p);
+  tc_delete_sized_aligned(p, size, align);
 }
 #endif
 
@@ -0,0 +1,192 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+#include "config_for_unittests.h"
+
+#include "base/gzip_writer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <memory>
+#include <string>
+
+#include "gtest/gtest.h"
+
+using tcmalloc::GenericWriter;
+using tcmalloc::GzipWriter;
+
+namespace {
+
+// Minimal gzip decoder that handles only what GzipWriter emits
+// (i.e. fixed Huffman blocks). Returns false on malformed input.
+class FixedInflater {
+public:
+  explicit FixedInflater(const std::string& in) : in_(in) {}
+
+  bool Inflate(std::string* out) {
+    if (in_.size() < 18 || in_.substr(0, 3) != "\x1f\x8b\x08") {
+      return false;
+    }
+    pos_ = 10;
+
+    bool final_block;
+    do {
+      final_block = GetBits(1);
+      if (GetBits(2) != 1) {
+        return false;
+      }
+      for (;;) {
+        int sym = GetSymbol();
+        if (sym < 0) {
+          return false;
+        } else if (sym < 256) {
+          out->push_back(static_cast<char>(sym));
+        } else if (sym == 256) {
+          break;
+        } else {
+          int lcode = sym - 257;
+          int length = kLengthBase[lcode] + GetBits(kLengthExtra[lcode]);
+          int dcode = GetHuffman(5);
+          if (dcode >= 30) {
+            return false;
+          }
+          size_t distance = kDistanceBase[dcode] + GetBits(kDistanceExtra[dcode]);
+          if (distance > out->size()) {
+            return false;
+          }
+          for (int i = 0; i < length; i++) {
+            out->push_back((*out)[out->size() - distance]);
+          }
+        }
+      }
+    } while (!final_block && !eof_);
+
+    // Skip to byte boundary, then check trailer.
+    if (eof_ || pos_ + 8 != in_.size()) {
+      return false;
+    }
+    uint32_t size = 0;
+    for (int i = 0; i < 4; i++) {
+      size |= static_cast<uint32_t>(static_cast<uint8_t>(in_[pos_ + 4 + i])) << (8 * i);
+    }
+    return size == static_cast<uint32_t>(out->size());
+  }
+
+private:
+  uint32_t GetBits(int count) {
+    uint32_t v = 0;
+    for (int i = 0; i < count; i++) {
+      if (bit_ == 0) {
+        if (pos_ >= in_.size()) {
+          eof_ = true;
+          return 0;
+        }
+        byte_ = static_cast<uint8_t>(in_[pos_++]);
+        bit_ = 8;
+      }
+      v |= ((byte_ >> (8 - bit_)) & 1) << i;
+      bit_--;
+    }
+    return v;
+  }
+
+  int GetHuffman(int length) {
+    int code = 0;
+    for (int i = 0; i < length; i++) {
+      code = (code << 1) | GetBits(1);
+    }
+    return code;
+  }
+
+  int GetSymbol() {
+    int code = GetHuffman(7);
+    if (code <= 0x17) {
+      return 256 + code;
+    }
+    code = (code << 1) | GetBits(1);
+    if (code >= 0x30 && code <= 0xBF) {
+      return code - 0x30;
+    }
+    if (code >= 0xC0 && code <= 0xC7) {
+      return 280 + code - 0xC0;
+    }
+    code = (code << 1) | GetBits(1);
+    if (code >= 0x190 && code <= 0x1FF) {
+      return 144 + code - 0x190;
+    }
+    return -1;
+  }
+
+  static constexpr int kLengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+  static constexpr int kLengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+  static constexpr int kDistanceBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577};
+  static constexpr int kDistanceExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+  const std::string& in_;
+  size_t pos_ = 0;
+  uint8_t byte_ = 0;
+  int bit_ = 0;
+  bool eof_ = false;
+};
+
+std::string Compress(const std::string& data, size_t piece) {
+  std::string compressed;
+  {
+    tcmalloc::StringGenericWriter out(&compressed);
+    std::unique_ptr<GzipWriter> writer{new GzipWriter(&out)};
+    for (size_t i = 0; i < data.size(); i += piece) {
+      writer->AppendMem(data.data() + i, std::min(piece, data.size() - i));
+    }
+  }
+  return compressed;
+}
+
+}  // namespace
+
+TEST(GzipWriterTest, Empty) {
+  std::string compressed = Compress("", 1);
+  std::string output;
+  ASSERT_TRUE(FixedInflater(compressed).Inflate(&output));
+  EXPECT_EQ(output, "");
+}
+
+TEST(GzipWriterTest, Text) {
+  std::string data;
+  for (int i = 0; i < 20000; i++) {
+    char line[128];
+    snprintf(line, sizeof(line), "%6d: %8d [%6d: %8d] @ 0x%08x 0x%08x\n",
+             i % 7, i * 16, i % 11, i * 32, 0x401000 + (i % 97) * 16, 0x402000 + (i % 13));
+    data += line;
+  }
+
+  for (size_t piece : {size_t{1}, size_t{1000}, size_t{100000}}) {
+    std::string compressed = Compress(data, piece);
+    std::string output;
+    ASSERT_TRUE(FixedInflater(compressed).Inflate(&output));
+    EXPECT_EQ(output, data);
+    EXPECT_LT(compressed.size(), data.size() / 3);
+  }
+}
+
+TEST(GzipWriterTest, Binary) {
+  std::string data;
+  uint32_t x = 12345;
+  for (int i = 0; i < (300 << 10); i++) {
+    x = x * 1103515245 + 12345;
+    // Mix of incompressible bytes and long repeats.
+    data.push_back((i / 4096) % 2 ? static_cast<char>(x >> 16) : static_cast<char>(i % 3));
+  }
+
+  std::string compressed = Compress(data, 7777);
+  std::string output;
+  ASSERT_TRUE(FixedInflater(compressed).Inflate(&output));
+  EXPECT_EQ(output, data);
+}
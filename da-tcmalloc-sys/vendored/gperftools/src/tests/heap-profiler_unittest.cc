@@ -32,8 +32,8 @@
 // Author: Craig Silverstein
 //
 // A small program that just exercises our heap profiler by allocating
-// memory and letting the heap-profiler emit a profile.  We don't test
-// threads (TODO).  By itself, this unittest tests that the heap-profiler
+// memory and letting the heap-profiler emit a profile.  By itself,
+// this unittest tests that the heap-profiler
 // doesn't crash on simple programs, but its output can be analyzed by
 // another testing script to actually verify correctness.  See, eg,
 // heap-profiler_unittest.sh.
@@ -41,16 +41,22 @@
 #include "config_for_unittests.h"
 
 #include <gperftools/heap-profiler.h>
+#include <gperftools/stacktrace.h>
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>                  // for mkdir()
 #include <sys/stat.h>               // for mkdir() on freebsd and os x
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>                 // for fork()
 #endif
 #include <sys/wait.h>               // for wait()
+#include <dirent.h>                 // for opendir()
+#include <algorithm>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "base/basictypes.h"
 #include "base/logging.h"
@@ -86,6 +92,20 @@ static void Deallocate(int start, int end) {
   }
 }
 
+// Restores heap profiler vars, as they were when it was created, on
+// scope exit. So tests can start from vars as they found them, change
+// some and not leave them changed.
+class ScopedHeapProfilerVars {
+ public:
+  ScopedHeapProfilerVars() { HeapProfilerGetVars(&saved_); }
+  ~ScopedHeapProfilerVars() { HeapProfilerSetVars(&saved_); }
+
+  const HeapProfilerVars& saved() const { return saved_; }
+
+ private:
+  HeapProfilerVars saved_;
+};
+
 static void TestHeapProfilerStartStopIsRunning() {
   // If you run this with whole-program heap-profiling on, than
   // IsHeapProfilerRunning should return true.
@@ -125,6 +145,537 @@ static void TestDumpHeapProfiler() {
   }
 }
 
+static void TestProtoDumpHeapProfiler() {
+  if (!IsHeapProfilerRunning()) {
+    const char* tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL)
+      tmpdir = "/tmp";
+    mkdir(tmpdir, 0755);     // if necessary
+    const std::string path = std::string(tmpdir) + "/proto_dump.pb.gz";
+    unlink(path.c_str());
+
+    HeapProfilerStart((std::string(tmpdir) + "/proto_dump").c_str());
+    HeapProfilerSetFormat(HEAP_PROFILE_FORMAT_PPROF_GZ);
+    HeapProfilerSetExactPath(path.c_str());
+
+    Allocate(0, 40, 100);
+    HeapProfilerDump("proto");
+    Deallocate(0, 40);
+
+    HeapProfilerStop();
+    HeapProfilerSetFormat(HEAP_PROFILE_FORMAT_TEXT);
+
+    FILE* f = fopen(path.c_str(), "rb");
+    CHECK(f != NULL);
+    unsigned char header[3];
+    CHECK_EQ(fread(header, 1, sizeof(header), f), sizeof(header));
+    fclose(f);
+    // Gzip magic and deflate compression method.
+    CHECK_EQ(header[0], 0x1f);
+    CHECK_EQ(header[1], 0x8b);
+    CHECK_EQ(header[2], 8);
+  }
+}
+
+// Returns number of buckets in the text profile, or -1 if it cannot
+// be read. Also fills first line.
+// Returns number of buckets in text profile at 'path', and sets
+// *head to its first two lines.
+static int CountBuckets(const std::string& path, std::string* head) {
+  FILE* f = fopen(path.c_str(), "r");
+  if (f == NULL) {
+    return -1;
+  }
+  int lines = 0;
+  int buckets = 0;
+  char buf[4096];
+  while (fgets(buf, sizeof(buf), f) != NULL) {
+    if (lines++ < 2) {
+      head->append(buf);
+    }
+    if (strstr(buf, "] @ 0x") != NULL) {
+      buckets++;
+    }
+  }
+  fclose(f);
+  return buckets;
+}
+
+// Returns sorted names of files in 'dir', which are removed if
+// 'remove' is set.
+static std::vector<std::string> ListDir(const std::string& dir, bool remove) {
+  std::vector<std::string> names;
+  DIR* d = opendir(dir.c_str());
+  if (d == NULL) {
+    return names;
+  }
+  while (struct dirent* e = readdir(d)) {
+    if (e->d_name[0] == '.') {
+      continue;
+    }
+    names.push_back(dir + "/" + e->d_name);
+    if (remove) {
+      unlink(names.back().c_str());
+    }
+  }
+  closedir(d);
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+static void TestDeltaDumpHeapProfiler() {
+  if (!IsHeapProfilerRunning()) {
+    const char* tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL)
+      tmpdir = "/tmp";
+    mkdir(tmpdir, 0755);     // if necessary
+    // Dumps go to directory that doesn't exist yet, so the first one
+    // fails.
+    const std::string dir = std::string(tmpdir) + "/delta_dumps";
+    ListDir(dir, true);
+    rmdir(dir.c_str());
+
+    ScopedHeapProfilerVars scoped_vars;
+    HeapProfilerVars vars = scoped_vars.saved();
+    vars.delta_dumps = true;
+    HeapProfilerSetVars(&vars);
+
+    HeapProfilerStart((dir + "/delta").c_str());
+    Allocate(0, 40, 100);
+    HeapProfilerDump("failed");
+    CHECK_EQ(mkdir(dir.c_str(), 0755), 0);
+
+    // Chain can't be based on failed dump, so this one is full.
+    Allocate2(40, 80, 100);
+    HeapProfilerDump("full");
+
+    // Only this new call site changes now.
+    Allocate2(80, 120, 100);
+    HeapProfilerDump("delta");
+
+    // Each dump to exact path would overwrite the previous one, so
+    // they are all full.
+    const std::string exact_path = dir + "/exact.heap";
+    HeapProfilerSetExactPath(exact_path.c_str());
+    HeapProfilerDump("exact");
+
+    Deallocate(0, 120);
+    HeapProfilerStop();
+
+    std::vector<std::string> files = ListDir(dir, false);
+    CHECK_EQ(files.size(), 3);
+    const std::string& full_path = files[0];
+    const std::string& delta_path = files[1];
+    CHECK_EQ(files[2], exact_path);
+
+    std::string full_head, delta_head, exact_head;
+    const int full_buckets = CountBuckets(full_path, &full_head);
+    const int delta_buckets = CountBuckets(delta_path, &delta_head);
+    const int exact_buckets = CountBuckets(exact_path, &exact_head);
+    CHECK(full_head.find("heap profile: ") == 0);
+    CHECK(full_head.find("delta of: ") == std::string::npos);
+    // Delta marker is a comment, so that pprof still takes the profile.
+    // It names full dump as its base.
+    CHECK(delta_head.find("heap profile: ") == 0);
+    const size_t marker = delta_head.find("\n# heap profile delta of: ");
+    CHECK(marker != std::string::npos);
+    const int base = atoi(delta_head.c_str() + marker + strlen("\n# heap profile delta of: "));
+    char base_name[32];
+    snprintf(base_name, sizeof(base_name), "/delta.%04d.heap", base);
+    CHECK(full_path.find(base_name) != std::string::npos);
+    // First two call sites are unchanged, so only full profile has
+    // them.
+    CHECK_GE(full_buckets, 2);
+    CHECK_EQ(delta_buckets, 1);
+    CHECK(exact_head.find("delta of: ") == std::string::npos);
+    CHECK_GE(exact_buckets, 3);
+  }
+}
+
+static void TestWriteProfileHeapProfiler() {
+  if (!IsHeapProfilerRunning()) {
+    const char* tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL)
+      tmpdir = "/tmp";
+    mkdir(tmpdir, 0755);     // if necessary
+
+    std::string profile;
+    CHECK_EQ(HeapProfilerWriteProfile(HEAP_PROFILE_FORMAT_TEXT, [] (void* arg, const char* buf, size_t len) {}, nullptr), 0);
+
+    HeapProfilerStart((std::string(tmpdir) + "/write_profile").c_str());
+    Allocate(0, 40, 100);
+
+    // Callback allocates, which is recorded while we are writing.
+    int chunks = 0;
+    std::pair<std::string*, int*> arg{&profile, &chunks};
+    CHECK_EQ(HeapProfilerWriteProfile(HEAP_PROFILE_FORMAT_TEXT, [] (void* arg, const char* buf, size_t len) {
+      auto* p = static_cast<std::pair<std::string*, int*>*>(arg);
+      p->first->append(buf, len);
+      (*p->second)++;
+    }, &arg), 1);
+
+    Deallocate(0, 40);
+    HeapProfilerStop();
+
+    CHECK_GT(chunks, 0);
+    CHECK(profile.find("heap profile: ") == 0);
+    CHECK(profile.find("MAPPED_LIBRARIES:") != std::string::npos);
+  }
+}
+
+static void TestDumpDuringWriteProfileHeapProfiler() {
+  if (!IsHeapProfilerRunning()) {
+    const char* tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL)
+      tmpdir = "/tmp";
+    mkdir(tmpdir, 0755);     // if necessary
+    const std::string path = std::string(tmpdir) + "/dump_during_write.heap";
+    unlink(path.c_str());
+
+    HeapProfilerStart((std::string(tmpdir) + "/dump_during_write").c_str());
+    HeapProfilerSetExactPath(path.c_str());
+    Allocate(0, 40, 100);
+
+    // On-demand dump requested while streaming dump runs waits for it
+    // rather than being dropped.
+    std::thread dumper;
+    CHECK_EQ(HeapProfilerWriteProfile(HEAP_PROFILE_FORMAT_TEXT, [] (void* arg, const char* buf, size_t len) {
+      std::thread* t = static_cast<std::thread*>(arg);
+      if (!t->joinable()) {
+        *t = std::thread([] () { HeapProfilerDump("concurrent"); });
+      }
+    }, &dumper), 1);
+    dumper.join();
+
+    Deallocate(0, 40);
+    HeapProfilerStop();
+
+    struct stat st;
+    CHECK_EQ(stat(path.c_str(), &st), 0);
+    CHECK_GT(st.st_size, 0);
+  }
+}
+
+static void TestLifetimesHeapProfiler() {
+  if (!IsHeapProfilerRunning()) {
+    const char* tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL)
+      tmpdir = "/tmp";
+    mkdir(tmpdir, 0755);     // if necessary
+
+    ScopedHeapProfilerVars scoped_vars;
+    HeapProfilerVars vars = scoped_vars.saved();
+    vars.lifetime_histograms = true;
+    HeapProfilerSetVars(&vars);
+
+    HeapProfilerStart((std::string(tmpdir) + "/lifetimes").c_str());
+    Allocate(0, 40, 100);
+    usleep(20000);
+    Deallocate(0, 40);
+
+    char* output = GetHeapProfile();
+    HeapProfilerStop();
+
+    // All 40 objects lived for at least 20ms, i.e. fall into
+    // [2^14, 2^15) or later histogram buckets.
+    const char* histogram = strstr(output, "# lifetimes(us):");
+    CHECK(histogram != NULL);
+    int64_t lived_long = 0;
+    for (const char* p = strchr(histogram, '<'); p != NULL && *p != '\n'; p = strpbrk(p + 1, "<\n")) {
+      long long bound, count;
+      if (sscanf(p, "<%lld:%lld", &bound, &count) == 2) {
+        CHECK_GT(bound, 16384);
+        lived_long += count;
+      } else if (sscanf(p, "<inf:%lld", &count) == 1) {
+        lived_long += count;
+      }
+    }
+    CHECK_EQ(lived_long, 40);
+    free(output);
+  }
+}
+
+// Returns depth of the deepest stack in text profile that has return
+// address within first 256 bytes of function 'fn' (i.e. 0 if there
+// is no such stack).
+static int MaxStackDepth(const char* profile, uintptr_t fn) {
+  int result = 0;
+  for (const char* p = strstr(profile, " @ "); p != NULL; p = strstr(p + 1, " @ ")) {
+    const char* eol = strchr(p, '\n');
+    const char* q = p + 2;
+    int depth = 0;
+    bool found = false;
+    while (q < eol) {
+      char* end;
+      uintptr_t pc = strtoull(q, &end, 16);
+      if (end == q) {
+        break;  // e.g. "@ heapprofile" in header
+      }
+      depth++;
+      found = found || (pc > fn && pc < fn + 256);
+      q = end;
+    }
+    if (found) {
+      result = std::max(result, depth);
+    }
+  }
+  return result;
+}
+
+static void TestFramePointerHeapProfiler() {
+  if (!IsHeapProfilerRunning()) {
+    const char* tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL)
+      tmpdir = "/tmp";
+    mkdir(tmpdir, 0755);     // if necessary
+
+    ScopedHeapProfilerVars scoped_vars;
+    HeapProfilerVars vars = scoped_vars.saved();
+    vars.frame_pointer_unwinder = true;
+    HeapProfilerSetVars(&vars);
+
+    HeapProfilerStart((std::string(tmpdir) + "/frame_pointers").c_str());
+    Allocate(0, 40, 100);
+    char* output = GetHeapProfile();
+    Deallocate(0, 40);
+    HeapProfilerStop();
+
+    vars.frame_pointer_unwinder = false;
+    HeapProfilerSetVars(&vars);
+
+    // Some bucket's stack must have return address inside Allocate.
+    CHECK(MaxStackDepth(output, reinterpret_cast<uintptr_t>(&Allocate)) > 0);
+    free(output);
+
+    // Method chosen by other means survives setting vars with
+    // unchanged frame_pointer_unwinder.
+    CHECK(SetStackTraceMethod("null"));
+    HeapProfilerSetVars(&vars);
+    HeapProfilerStart((std::string(tmpdir) + "/null_stacks").c_str());
+    Allocate(0, 40, 100);
+    output = GetHeapProfile();
+    Deallocate(0, 40);
+    HeapProfilerStop();
+    CHECK(SetStackTraceMethod(nullptr));
+
+    CHECK_EQ(MaxStackDepth(output, reinterpret_cast<uintptr_t>(&Allocate)), 0);
+    free(output);
+  }
+}
+
+static ATTRIBUTE_NOINLINE void AllocateDeep(int depth) {
+  marker = "AllocateDeep";
+  if (depth > 0) {
+    AllocateDeep(depth - 1);
+  } else {
+    g_array[0] = new int[100];
+  }
+  // Prevent tail call, so that every level has its frame.
+  (void)*const_cast<const char* volatile*>(&marker);
+}
+
+static void TestStackDepthHeapProfiler() {
+  if (!IsHeapProfilerRunning()) {
+    const char* tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL)
+      tmpdir = "/tmp";
+    mkdir(tmpdir, 0755);     // if necessary
+
+    ScopedHeapProfilerVars scoped_vars;
+    const uintptr_t fn = reinterpret_cast<uintptr_t>(&AllocateDeep);
+    for (bool intern_stacks : {false, true}) {
+      HeapProfilerVars vars = scoped_vars.saved();
+      vars.intern_stacks = intern_stacks;
+
+      // Default depth cuts the stack.
+      HeapProfilerSetVars(&vars);
+      HeapProfilerStart((std::string(tmpdir) + "/stack_depth").c_str());
+      AllocateDeep(50);
+      char* output = GetHeapProfile();
+      Deallocate(0, 1);
+      HeapProfilerStop();
+      CHECK_EQ(MaxStackDepth(output, fn), 32);
+      free(output);
+
+      vars.max_stack_depth = 100;
+      HeapProfilerSetVars(&vars);
+      HeapProfilerStart((std::string(tmpdir) + "/stack_depth").c_str());
+      AllocateDeep(50);
+      Deallocate(0, 1);
+      AllocateDeep(40);
+      output = GetHeapProfile();
+      Deallocate(0, 1);
+      HeapProfilerStop();
+      CHECK_GT(MaxStackDepth(output, fn), 50);
+      free(output);
+    }
+  }
+}
+
+static void TestPeakHeapProfiler() {
+  if (!IsHeapProfilerRunning()) {
+    const char* tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL)
+      tmpdir = "/tmp";
+    mkdir(tmpdir, 0755);     // if necessary
+    const std::string path = std::string(tmpdir) + "/peak.heap";
+    unlink(path.c_str());
+
+    ScopedHeapProfilerVars scoped_vars;
+    HeapProfilerVars vars = scoped_vars.saved();
+    vars.track_peak = true;
+    HeapProfilerSetVars(&vars);
+
+    HeapProfilerStart((std::string(tmpdir) + "/peak").c_str());
+    HeapProfilerSetExactPath(path.c_str());
+    // Peak is 1000 * 4000 bytes from Allocate. Allocate2 comes after
+    // it, and so isn't part of it.
+    Allocate(0, 1000, 1000);
+    Deallocate(0, 1000);
+    Allocate2(0, 10, 1000);
+    HeapProfilerDumpPeak("test");
+    Deallocate(0, 10);
+    HeapProfilerStop();
+
+    std::string profile;
+    FILE* f = fopen(path.c_str(), "r");
+    CHECK(f != NULL);
+    char buf[4096];
+    size_t amt;
+    while ((amt = fread(buf, 1, sizeof(buf), f)) > 0) {
+      profile.append(buf, amt);
+    }
+    fclose(f);
+
+    long long inuse_count, inuse_size;
+    CHECK_EQ(sscanf(profile.c_str(), "heap profile: %lld: %lld [",
+                    &inuse_count, &inuse_size), 2);
+    CHECK_GE(inuse_size, 1000 * 4000 - 1000 * 4000 / 64);
+    CHECK_GT(MaxStackDepth(profile.c_str(), reinterpret_cast<uintptr_t>(&Allocate)), 0);
+    CHECK_EQ(MaxStackDepth(profile.c_str(), reinterpret_cast<uintptr_t>(&Allocate2)), 0);
+  }
+}
+
+static void TestSampledHeapProfiler() {
+  if (!IsHeapProfilerRunning()) {
+    const char* tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL)
+      tmpdir = "/tmp";
+    mkdir(tmpdir, 0755);     // if necessary
+
+    ScopedHeapProfilerVars scoped_vars;
+    HeapProfilerVars vars = scoped_vars.saved();
+    vars.heap_profile_sample_period = 64 << 10;
+    HeapProfilerSetVars(&vars);
+
+    HeapProfilerStart((std::string(tmpdir) + "/sampled").c_str());
+    CHECK(IsHeapProfilerRunning());
+
+    // ~40 MB worth of allocations. With 64k sampling period we
+    // expect hundreds of samples, scaled back to roughly 40 MB.
+    Allocate(0, 10000, 1000);
+
+    char* output = GetHeapProfile();
+    long long inuse_objects, inuse_bytes;
+    CHECK_EQ(sscanf(output, "heap profile: %lld: %lld", &inuse_objects, &inuse_bytes), 2);
+    free(output);
+    CHECK_GT(inuse_bytes, 20LL << 20);
+    CHECK_LT(inuse_bytes, 80LL << 20);
+
+    Deallocate(0, 10000);
+
+    // Note, debugallocation holds on to some freed memory for a
+    // while, so we cannot expect in-use to drop all the way to 0.
+    const long long allocated_bytes = inuse_bytes;
+    output = GetHeapProfile();
+    CHECK_EQ(sscanf(output, "heap profile: %lld: %lld", &inuse_objects, &inuse_bytes), 2);
+    free(output);
+    CHECK_LT(inuse_bytes, allocated_bytes);
+
+    HeapProfilerStop();
+    CHECK(!IsHeapProfilerRunning());
+  }
+}
+
+static void TestThreadedHeapProfiler() {
+  if (!IsHeapProfilerRunning()) {
+    const char* tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL)
+      tmpdir = "/tmp";
+    mkdir(tmpdir, 0755);     // if necessary
+    HeapProfilerStart((std::string(tmpdir) + "/threaded").c_str());
+    CHECK(IsHeapProfilerRunning());
+
+    // Threads record into different shards of the profile
+    // concurrently, and totals must still add up.
+    static const int kThreads = 8;
+    static const int kIterations = 20000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+      threads.emplace_back([] () {
+        std::vector<char*> ptrs;
+        for (int i = 0; i < kIterations; i++) {
+          ptrs.push_back(new char[16 + (i % 64) * 16]);
+          if (i % 3 == 0) {
+            delete[] ptrs.back();
+            ptrs.pop_back();
+          }
+        }
+        for (char* p : ptrs) {
+          delete[] p;
+        }
+      });
+    }
+    for (std::thread& t : threads) {
+      t.join();
+    }
+
+    char* output = GetHeapProfile();
+    long long inuse_objects, inuse_bytes, alloc_objects, alloc_bytes;
+    CHECK_EQ(sscanf(output, "heap profile: %lld: %lld [%lld: %lld]",
+                    &inuse_objects, &inuse_bytes, &alloc_objects, &alloc_bytes), 4);
+    free(output);
+    CHECK_GE(alloc_objects, kThreads * kIterations);
+
+    HeapProfilerStop();
+    CHECK(!IsHeapProfilerRunning());
+  }
+}
+
+static void TestBackgroundDumpHeapProfiler() {
+  if (!IsHeapProfilerRunning()) {
+    const char* tmpdir = getenv("TMPDIR");
+    if (tmpdir == NULL)
+      tmpdir = "/tmp";
+    mkdir(tmpdir, 0755);     // if necessary
+    const std::string first_dump = std::string(tmpdir) + "/background.heap";
+    unlink(first_dump.c_str());
+
+    ScopedHeapProfilerVars scoped_vars;
+    HeapProfilerVars vars = scoped_vars.saved();
+    vars.heap_profile_allocation_interval = 1 << 20;
+    vars.background_dump = true;
+    HeapProfilerSetVars(&vars);
+
+    HeapProfilerStart((std::string(tmpdir) + "/background").c_str());
+    HeapProfilerSetExactPath(first_dump.c_str());
+    CHECK(IsHeapProfilerRunning());
+
+    // Allocating thread only hands dump request over, so the file
+    // appears some time later.
+    Allocate(0, 1000, 1000);
+    struct stat st;
+    for (int i = 0; i < 1000 && stat(first_dump.c_str(), &st) != 0; i++) {
+      usleep(10000);
+    }
+    Deallocate(0, 1000);
+
+    // Stop waits for dumper to finish whatever it is doing.
+    HeapProfilerStop();
+    CHECK(!IsHeapProfilerRunning());
+    CHECK_EQ(stat(first_dump.c_str(), &st), 0);
+  }
+}
 
 int main(int argc, char** argv) {
   tcmalloc::TestingPortal::Get()->GetSampleParameter() = 512 << 10;
@@ -140,6 +691,17 @@ int main(int argc, char** argv) {
 
   TestHeapProfilerStartStopIsRunning();
   TestDumpHeapProfiler();
+  TestProtoDumpHeapProfiler();
+  TestDeltaDumpHeapProfiler();
+  TestWriteProfileHeapProfiler();
+  TestDumpDuringWriteProfileHeapProfiler();
+  TestLifetimesHeapProfiler();
+  TestFramePointerHeapProfiler();
+  TestStackDepthHeapProfiler();
+  TestPeakHeapProfiler();
+  TestSampledHeapProfiler();
+  TestThreadedHeapProfiler();
+  TestBackgroundDumpHeapProfiler();
 
   Allocate(0, 40, 100);
   Deallocate(0, 40);
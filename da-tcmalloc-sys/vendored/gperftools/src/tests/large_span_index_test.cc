@@ -0,0 +1,111 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+#include "config_for_unittests.h"
+
+#include "large_span_index.h"
+
+#include <stdint.h>
+
+#include <memory>
+#include <random>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using tcmalloc::LargeSpanIndex;
+using tcmalloc::Span;
+
+TEST(LargeSpanIndexTest, Buckets) {
+  int prev = 0;
+  for (Length len = 1; len < (Length{1} << 20); len++) {
+    int b = LargeSpanIndex::BucketFor(len);
+    ASSERT_GE(b, prev) << len;
+    ASSERT_LE(b, prev + 1) << len;
+    prev = b;
+  }
+  EXPECT_LT(LargeSpanIndex::BucketFor(~Length{0}), LargeSpanIndex::kNumBuckets);
+}
+
+TEST(LargeSpanIndexTest, GoodFit) {
+  // We check index against set ordered by (length, start), which
+  // gives us best fit.
+  std::unique_ptr<LargeSpanIndex> index(new LargeSpanIndex);
+  std::set<std::pair<Length, PageID>> reference;
+  std::vector<std::unique_ptr<Span>> spans;
+  std::vector<Span*> inserted;
+
+  std::mt19937_64 rng(42);
+  auto random_length = [&] () -> Length {
+    // Mostly few MiB, sometimes much more.
+    int bits = std::uniform_int_distribution<int>(8, 24)(rng);
+    return std::uniform_int_distribution<Length>(kMaxPages + 1, Length{1} << bits)(rng);
+  };
+
+  EXPECT_TRUE(index->empty());
+  EXPECT_EQ(index->First(), nullptr);
+  EXPECT_EQ(index->FindGoodFit(1), nullptr);
+
+  for (int i = 0; i < 20000; i++) {
+    if (inserted.empty() || rng() % 3 != 0) {
+      spans.emplace_back(new Span);
+      Span* s = spans.back().get();
+      s->start = i + 1;
+      s->length = random_length();
+      index->Insert(s);
+      reference.insert({s->length, s->start});
+      inserted.push_back(s);
+    } else {
+      size_t pos = rng() % inserted.size();
+      Span* s = inserted[pos];
+      inserted[pos] = inserted.back();
+      inserted.pop_back();
+      index->Remove(s);
+      reference.erase({s->length, s->start});
+    }
+
+    Length n = random_length();
+    Span* found = index->FindGoodFit(n);
+    auto it = reference.lower_bound({n, 0});
+    if (it == reference.end()) {
+      ASSERT_EQ(found, nullptr);
+    } else {
+      ASSERT_NE(found, nullptr);
+      ASSERT_EQ(reference.count({found->length, found->start}), 1);
+      ASSERT_GE(found->length, n);
+      ASSERT_EQ(LargeSpanIndex::BucketFor(found->length),
+                LargeSpanIndex::BucketFor(it->first));
+      ASSERT_LE(found->length - it->first, it->first / LargeSpanIndex::kSubBuckets);
+    }
+  }
+
+  size_t count = 0;
+  index->ForEach([&] (Span* s) {
+    EXPECT_EQ(reference.count({s->length, s->start}), 1);
+    count++;
+  });
+  EXPECT_EQ(count, reference.size());
+
+  // Walk from the longest spans removing everything longer than a
+  // threshold.
+  const Length threshold = Length{1} << 16;
+  index->ForEachFromLongest(threshold, [&] (Span* s) {
+    if (s->length >= threshold) {
+      index->Remove(s);
+      reference.erase({s->length, s->start});
+    }
+    return true;
+  });
+  EXPECT_EQ(index->FindGoodFit(threshold), nullptr);
+  EXPECT_TRUE(reference.lower_bound({threshold, 0}) == reference.end());
+
+  while (Span* s = index->First()) {
+    // First is from the bucket of the shortest span.
+    EXPECT_EQ(LargeSpanIndex::BucketFor(s->length),
+              LargeSpanIndex::BucketFor(reference.begin()->first));
+    index->Remove(s);
+    reference.erase({s->length, s->start});
+  }
+  EXPECT_TRUE(index->empty());
+  EXPECT_TRUE(reference.empty());
+}
@@ -34,6 +34,9 @@
 
 #include "packed-cache-inl.h"
 
+#include <stdlib.h>
+
+#include <new>
 #include <optional>
 
 #include "gtest/gtest.h"
@@ -78,3 +81,19 @@ TEST(PackedCacheTest, Basic) {
   ASSERT_FALSE(Has(cache, 0));
   ASSERT_TRUE(Has(cache, 1 << kHashbits));
 }
+
+TEST(PackedCacheTest, ZeroedStorage) {
+  void* storage = calloc(1, sizeof(PackedCache<20>));
+  PackedCache<20>& cache = *new (storage) PackedCache<20>(true);
+
+  ASSERT_FALSE(Has(cache, 0));
+  ASSERT_FALSE(Has(cache, 1));
+  ASSERT_FALSE(Has(cache, 1 << kHashbits));
+  ASSERT_FALSE(Has(cache, (1 << 20) - 1));
+
+  cache.Put(1 << kHashbits, 0);
+  ASSERT_EQ(Get(cache, 1 << kHashbits).value(), 0);
+  ASSERT_FALSE(Has(cache, 0));
+
+  free(storage);
+}
@@ -8,9 +8,14 @@
 #include "config_for_unittests.h"
 
 #include <stdio.h>
+#include <string.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 #include <limits>
 #include <memory>
+#include <vector>
 
 #include "page_heap.h"
 
@@ -21,6 +26,7 @@
 #include "gtest/gtest.h"
 
 DECLARE_int64(tcmalloc_heap_limit_mb);
+DECLARE_double(tcmalloc_release_rate);
 
 // TODO: add testing from >1 min_span_size setting.
 
@@ -82,6 +88,452 @@ TEST(PageHeapTest, Stats) {
   CheckStats(ph.get(), 256, 128, 128);
 }
 
+static void CheckHugePageStats(tcmalloc::PageHeap* ph,
+                               int64_t free_hugepages,
+                               int64_t released_hugepages) {
+  SpinLockHolder l(ph->pageheap_lock());
+  tcmalloc::PageHeap::HugePageStats stats;
+  ph->GetHugePageStatsLocked(&stats);
+  EXPECT_EQ(free_hugepages, stats.free_hugepages);
+  EXPECT_EQ(released_hugepages, stats.released_hugepages);
+  EXPECT_EQ(0, stats.fragmented_released_pages);
+}
+
+TEST(PageHeapTest, HugePageAware) {
+  // We want to release memory explicitly, not by incremental scavenging.
+  const double old_release_rate = FLAGS_tcmalloc_release_rate;
+  tcmalloc::Cleanup restore_release_rate_flag{[old_release_rate] () {
+    FLAGS_tcmalloc_release_rate = old_release_rate;
+  }};
+  FLAGS_tcmalloc_release_rate = 0;
+
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+  ph->SetHugePageAware(true);
+
+  // Heap grows by whole, aligned hugepages.
+  tcmalloc::Span* s1 = ph->New(kPagesPerHugePage);
+  ASSERT_NE(s1, nullptr);
+  EXPECT_EQ(0, s1->start % kPagesPerHugePage);
+  CheckStats(ph.get(), kPagesPerHugePage, 0, 0);
+
+  // Span of two hugepages. Free its first one and half of the second.
+  tcmalloc::Span* s2 = ph->New(2 * kPagesPerHugePage);
+  ASSERT_NE(s2, nullptr);
+  EXPECT_EQ(0, s2->start % kPagesPerHugePage);
+  const PageID base = s2->start;
+  const Length half = kPagesPerHugePage / 2;
+  tcmalloc::Span* s3 = ph->SplitForTest(s2, kPagesPerHugePage + half);
+  ph->Delete(s2);
+
+  // Free span starts at hugepage boundary, but doesn't end at
+  // one. Allocation is then taken from its end, so free hugepage
+  // stays intact.
+  tcmalloc::Span* s4 = ph->New(1);
+  ASSERT_NE(s4, nullptr);
+  EXPECT_EQ(base + kPagesPerHugePage + half - 1, s4->start);
+  CheckHugePageStats(ph.get(), 1, 0);
+
+  // Whole free hugepage is released first, and that is enough.
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    ph->ReleaseAtLeastNPages(1);
+  }
+  if (HaveSystemRelease()) {
+    CheckHugePageStats(ph.get(), 0, 1);
+  }
+  CheckStats(ph.get(), 3 * kPagesPerHugePage, half - 1, kPagesPerHugePage);
+
+  // Remaining free pages are part of a used hugepage, so explicit
+  // release doesn't touch them.
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    EXPECT_EQ(0, ph->ReleaseAtLeastNPages(kPagesPerHugePage));
+  }
+  CheckStats(ph.get(), 3 * kPagesPerHugePage, half - 1, kPagesPerHugePage);
+
+  ph->Delete(s1);
+  ph->Delete(s3);
+  ph->Delete(s4);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    EXPECT_TRUE(ph->CheckExpensive());
+  }
+}
+
+TEST(PageHeapTest, HugePageAwareAggressiveDecommit) {
+  if (!HaveSystemRelease()) {
+    printf("skipping: no system release\n");
+    return;
+  }
+
+  const double old_release_rate = FLAGS_tcmalloc_release_rate;
+  tcmalloc::Cleanup restore_release_rate_flag{[old_release_rate] () {
+    FLAGS_tcmalloc_release_rate = old_release_rate;
+  }};
+  FLAGS_tcmalloc_release_rate = 0;
+
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+  ph->SetHugePageAware(true);
+  ph->SetAggressiveDecommit(true);
+
+  tcmalloc::Span* s1 = ph->New(2 * kPagesPerHugePage);
+  ASSERT_NE(s1, nullptr);
+  const Length half = kPagesPerHugePage / 2;
+  tcmalloc::Span* s2 = ph->SplitForTest(s1, half);
+  tcmalloc::Span* s3 = ph->SplitForTest(s2, kPagesPerHugePage);
+
+  // Freed pages share a hugepage with used ones, so they stay
+  // committed.
+  ph->Delete(s1);
+  CheckStats(ph.get(), 2 * kPagesPerHugePage, half, 0);
+
+  // Now the first hugepage is free as a whole and gets released. Half
+  // of the second one is used, so its free half stays committed.
+  ph->Delete(s2);
+  CheckHugePageStats(ph.get(), 0, 1);
+  CheckStats(ph.get(), 2 * kPagesPerHugePage, half, kPagesPerHugePage);
+
+  ph->Delete(s3);
+  CheckHugePageStats(ph.get(), 0, 2);
+  CheckStats(ph.get(), 2 * kPagesPerHugePage, 0, 2 * kPagesPerHugePage);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    EXPECT_TRUE(ph->CheckExpensive());
+  }
+}
+
+TEST(PageHeapTest, ReleaseOldFreeSpans) {
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+  ph->SetBackgroundRelease(true);
+
+  auto release_old = [&] (uint32_t now_ms, Length max_pages) -> Length {
+    SpinLockHolder l(ph->pageheap_lock());
+    Length released = ph->ReleaseOldFreeSpans(now_ms, 5000, max_pages);
+    EXPECT_TRUE(ph->CheckExpensive());
+    return released;
+  };
+  auto expected = [] (Length pages) -> Length {
+    return HaveSystemRelease() ? pages : 0;
+  };
+
+  EXPECT_EQ(0, release_old(1000, 100));
+
+  // Alternate free and used spans, so that nothing coalesces. Last
+  // span is a large one.
+  tcmalloc::Span* a = ph->New(3 * kMaxPages);
+  tcmalloc::Span* b = ph->SplitForTest(a, 8);
+  tcmalloc::Span* c = ph->SplitForTest(b, 8);
+  tcmalloc::Span* d = ph->SplitForTest(c, 8);
+  tcmalloc::Span* e = ph->SplitForTest(d, 8);
+  tcmalloc::Span* f = ph->SplitForTest(e, 8);
+  tcmalloc::Span* g = ph->SplitForTest(f, 8);
+  const Length large = g->length;
+
+  ph->Delete(a);
+  ph->Delete(e);
+  ph->Delete(g);
+  // Nothing is released as pages are freed.
+  CheckStats(ph.get(), 3 * kMaxPages, 16 + large, 0);
+
+  EXPECT_EQ(0, release_old(2000, 100));
+  ph->Delete(c);
+
+  // Large spans go first.
+  EXPECT_EQ(expected(large), release_old(6500, 1));
+  CheckStats(ph.get(), 3 * kMaxPages, 24, large);
+
+  // 'c' is not old enough yet.
+  EXPECT_EQ(expected(16), release_old(6500, 100));
+  CheckStats(ph.get(), 3 * kMaxPages, 8, large + 16);
+
+  EXPECT_EQ(expected(8), release_old(7000, 100));
+  CheckStats(ph.get(), 3 * kMaxPages, 0, large + 24);
+
+  ph->Delete(b);
+  ph->Delete(d);
+  ph->Delete(f);
+}
+
+TEST(PageHeapTest, MergedSpansKeepAge) {
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+  ph->SetBackgroundRelease(true);
+
+  auto release_old = [&] (uint32_t now_ms) -> Length {
+    SpinLockHolder l(ph->pageheap_lock());
+    Length released = ph->ReleaseOldFreeSpans(now_ms, 5000, 100);
+    EXPECT_TRUE(ph->CheckExpensive());
+    return released;
+  };
+
+  tcmalloc::Span* a = ph->New(kMaxPages);
+  tcmalloc::Span* b = ph->SplitForTest(a, 4);
+  tcmalloc::Span* c = ph->SplitForTest(b, 4);
+
+  ph->Delete(a);
+  EXPECT_EQ(0, release_old(3000));
+  // 'b' coalesces with 'a' and the result is as old as 'a'.
+  ph->Delete(b);
+  // Carving leaves 6 pages that are still as old as 'a'.
+  tcmalloc::Span* d = ph->New(2);
+  CheckStats(ph.get(), kMaxPages, 6, 0);
+
+  EXPECT_EQ(HaveSystemRelease() ? 6 : 0, release_old(5500));
+
+  ph->Delete(c);
+  ph->Delete(d);
+}
+
+TEST(PageHeapTest, BatchedRelease) {
+  // We check that released pages read back as zeros.
+  if (!HaveSystemRelease()
+      || TCMalloc_SystemGetReleaseAdvice() != tcmalloc::ReleaseAdvice::kDontNeed) {
+    return;
+  }
+  const double old_release_rate = FLAGS_tcmalloc_release_rate;
+  tcmalloc::Cleanup restore_release_rate_flag{[old_release_rate] () {
+    FLAGS_tcmalloc_release_rate = old_release_rate;
+  }};
+  FLAGS_tcmalloc_release_rate = 0;
+
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+
+  // More single page spans than fit into one batch of releases.
+  static constexpr int kSpans = 1000;
+  std::vector<tcmalloc::Span*> spans(kSpans);
+  spans[0] = ph->New(kSpans);
+  for (int i = 1; i < kSpans; i++) {
+    spans[i] = ph->SplitForTest(spans[i - 1], 1);
+  }
+  auto page = [&] (int i) {
+    return reinterpret_cast<unsigned char*>(spans[i]->start << kPageShift);
+  };
+  for (int i = 0; i < kSpans; i++) {
+    memset(page(i), 0xab, kPageSize);
+  }
+
+  for (int i = 0; i < kSpans; i += 2) {
+    ph->Delete(spans[i]);
+  }
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    EXPECT_EQ(kSpans / 2, ph->ReleaseAtLeastNPages(kSpans));
+  }
+  CheckStats(ph.get(), kSpans, 0, kSpans / 2);
+
+  for (int i = 0; i < kSpans; i++) {
+    const unsigned char expected = i % 2 ? 0xab : 0;
+    EXPECT_EQ(expected, page(i)[0]) << i;
+    EXPECT_EQ(expected, page(i)[kPageSize - 1]) << i;
+  }
+
+  for (int i = 1; i < kSpans; i += 2) {
+    ph->Delete(spans[i]);
+  }
+}
+
+#ifdef HAVE_MMAP
+TEST(PageHeapTest, FailedRelease) {
+  if (!HaveSystemRelease()
+      || TCMalloc_SystemGetReleaseAdvice() != tcmalloc::ReleaseAdvice::kDontNeed) {
+    return;
+  }
+  const double old_release_rate = FLAGS_tcmalloc_release_rate;
+  tcmalloc::Cleanup restore_release_rate_flag{[old_release_rate] () {
+    FLAGS_tcmalloc_release_rate = old_release_rate;
+  }};
+  FLAGS_tcmalloc_release_rate = 0;
+
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+
+  tcmalloc::Span* a = ph->New(3);
+  tcmalloc::Span* b = ph->SplitForTest(a, 1);
+  tcmalloc::Span* c = ph->SplitForTest(b, 1);
+  auto page = [] (tcmalloc::Span* s) {
+    return reinterpret_cast<unsigned char*>(s->start << kPageShift);
+  };
+  memset(page(a), 0xab, 3 * kPageSize);
+  const PageID a_start = a->start;
+
+  // madvise(MADV_DONTNEED) fails for locked pages.
+  if (mlock(page(a), kPageSize) != 0) {
+    printf("mlock failed, skipping FailedRelease test\n");
+    ph->Delete(a);
+    ph->Delete(b);
+    ph->Delete(c);
+    return;
+  }
+  tcmalloc::Cleanup unlock{[&] () { munlock(page(a), kPageSize); }};
+
+  ph->Delete(a);
+  ph->Delete(c);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    ph->ReleaseAtLeastNPages(3);
+  }
+  // Heap grows by at least kMaxPages, and the rest is released too.
+  CheckStats(ph.get(), kMaxPages, 1, kMaxPages - 2);
+  EXPECT_EQ(0xab, page(a)[0]);
+  EXPECT_EQ(0, page(c)[0]);
+
+  tcmalloc::Span* d = ph->New(1);
+  EXPECT_EQ(a_start, d->start);
+  EXPECT_FALSE(d->zeroed);
+  EXPECT_EQ(0xab, page(d)[0]);
+  ph->Delete(d);
+  ph->Delete(b);
+}
+
+TEST(PageHeapTest, ReleaseAdviceFallsBackPerRange) {
+  const tcmalloc::ReleaseAdvice old_advice = TCMalloc_SystemGetReleaseAdvice();
+  if (!HaveSystemRelease()
+      || !TCMalloc_SystemSetReleaseAdvice(tcmalloc::ReleaseAdvice::kFree)) {
+    return;
+  }
+  tcmalloc::Cleanup restore_advice{[old_advice] () {
+    TCMalloc_SystemSetReleaseAdvice(old_advice);
+  }};
+
+  size_t actual;
+  void* private_range = TCMalloc_SystemAlloc(kPageSize, &actual, 0);
+  tcmalloc::ReleaseAdvice used;
+  ASSERT_TRUE(TCMalloc_SystemRelease(private_range, actual, &used));
+  if (used != tcmalloc::ReleaseAdvice::kFree) {
+    printf("MADV_FREE is not supported, skipping ReleaseAdviceFallsBackPerRange test\n");
+    return;
+  }
+
+  // MADV_FREE only applies to private anonymous memory.
+  void* shared_range = mmap(nullptr, kPageSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(shared_range, MAP_FAILED);
+  tcmalloc::Cleanup unmap{[&] () { munmap(shared_range, kPageSize); }};
+  EXPECT_TRUE(TCMalloc_SystemRelease(shared_range, kPageSize, &used));
+  EXPECT_EQ(tcmalloc::ReleaseAdvice::kDontNeed, used);
+
+  // Other ranges still get configured advice.
+  EXPECT_EQ(tcmalloc::ReleaseAdvice::kFree, TCMalloc_SystemGetReleaseAdvice());
+  EXPECT_TRUE(TCMalloc_SystemRelease(private_range, actual, &used));
+  EXPECT_EQ(tcmalloc::ReleaseAdvice::kFree, used);
+}
+
+TEST(PageHeapTest, ColdPagesStayCommitted) {
+  const tcmalloc::ReleaseAdvice old_advice = TCMalloc_SystemGetReleaseAdvice();
+  if (!HaveSystemRelease()
+      || !TCMalloc_SystemSetReleaseAdvice(tcmalloc::ReleaseAdvice::kCold)) {
+    return;
+  }
+  tcmalloc::Cleanup restore_advice{[old_advice] () {
+    TCMalloc_SystemSetReleaseAdvice(old_advice);
+  }};
+  const double old_release_rate = FLAGS_tcmalloc_release_rate;
+  tcmalloc::Cleanup restore_release_rate_flag{[old_release_rate] () {
+    FLAGS_tcmalloc_release_rate = old_release_rate;
+  }};
+  FLAGS_tcmalloc_release_rate = 0;
+
+  size_t actual;
+  void* probe = TCMalloc_SystemAlloc(kPageSize, &actual, 0);
+  tcmalloc::ReleaseAdvice used;
+  if (!TCMalloc_SystemRelease(probe, actual, &used)
+      || used != tcmalloc::ReleaseAdvice::kCold) {
+    printf("MADV_COLD is not supported, skipping ColdPagesStayCommitted test\n");
+    return;
+  }
+
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+  tcmalloc::Span* a = ph->New(kMaxPages);
+  tcmalloc::Span* b = ph->SplitForTest(a, 4);
+  memset(reinterpret_cast<void*>(a->start << kPageShift), 0xab, kPageSize);
+  ph->Delete(a);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    EXPECT_EQ(4, ph->ReleaseAtLeastNPages(4));
+    EXPECT_TRUE(ph->CheckExpensive());
+  }
+  // Cold pages are neither unmapped nor decommitted.
+  CheckStats(ph.get(), kMaxPages, 4, 0);
+  EXPECT_EQ(kMaxPages, ph->StatsLocked().committed_bytes >> kPageShift);
+
+  a = ph->New(4);
+  EXPECT_EQ(0xab, reinterpret_cast<unsigned char*>(a->start << kPageShift)[0]);
+  CheckStats(ph.get(), kMaxPages, 0, 0);
+  EXPECT_EQ(kMaxPages, ph->StatsLocked().committed_bytes >> kPageShift);
+
+  ph->Delete(a);
+  ph->Delete(b);
+}
+#endif
+
+TEST(PageHeapTest, ZeroedSpans) {
+  const double old_release_rate = FLAGS_tcmalloc_release_rate;
+  tcmalloc::Cleanup restore_release_rate_flag{[old_release_rate] () {
+    FLAGS_tcmalloc_release_rate = old_release_rate;
+  }};
+  FLAGS_tcmalloc_release_rate = 0;
+
+  std::unique_ptr<tcmalloc::PageHeap> ph(new tcmalloc::PageHeap());
+
+  auto pages = [] (tcmalloc::Span* s) {
+    return reinterpret_cast<unsigned char*>(s->start << kPageShift);
+  };
+  auto check_zeroed = [&] (tcmalloc::Span* s) {
+    if (!s->zeroed) {
+      return;
+    }
+    for (size_t i = 0; i < (s->length << kPageShift); i++) {
+      ASSERT_EQ(0, pages(s)[i]) << i;
+    }
+  };
+
+  // Pages fresh from the system.
+  tcmalloc::Span* a = ph->New(kMaxPages);
+  tcmalloc::Span* b = ph->SplitForTest(a, kMaxPages / 2);
+  EXPECT_EQ(TCMalloc_SystemAllocZeroes(), a->zeroed);
+  EXPECT_EQ(a->zeroed, b->zeroed);
+  check_zeroed(a);
+  check_zeroed(b);
+
+  // Freed pages might have been written.
+  const PageID a_start = a->start;
+  memset(pages(a), 0xab, a->length << kPageShift);
+  ph->Delete(a);
+  tcmalloc::Span* c = ph->New(kMaxPages / 2);
+  EXPECT_EQ(a_start, c->start);
+  EXPECT_FALSE(c->zeroed);
+
+  // Coalesced with a written span.
+  ph->Delete(b);
+  ph->Delete(c);
+  tcmalloc::Span* d = ph->New(kMaxPages);
+  EXPECT_EQ(a_start, d->start);
+  EXPECT_FALSE(d->zeroed);
+
+  // Released pages.
+  memset(pages(d), 0xab, d->length << kPageShift);
+  ph->Delete(d);
+  {
+    SpinLockHolder l(ph->pageheap_lock());
+    ph->ReleaseAtLeastNPages(std::numeric_limits<Length>::max());
+  }
+  tcmalloc::Span* e = ph->New(kMaxPages);
+  EXPECT_EQ(a_start, e->start);
+  EXPECT_EQ(HaveSystemRelease() && TCMalloc_SystemReleaseZeroes(), e->zeroed);
+  check_zeroed(e);
+  ph->Delete(e);
+
+  // Released right away by aggressive decommit.
+  tcmalloc::Span* f = ph->New(kMaxPages);
+  memset(pages(f), 0xab, f->length << kPageShift);
+  ph->SetAggressiveDecommit(true);
+  ph->Delete(f);
+  ph->SetAggressiveDecommit(false);
+  tcmalloc::Span* g = ph->New(kMaxPages);
+  EXPECT_EQ(a_start, g->start);
+  EXPECT_EQ(HaveSystemRelease() && TCMalloc_SystemReleaseZeroes(), g->zeroed);
+  check_zeroed(g);
+  ph->Delete(g);
+}
+
 // The number of kMaxPages-sized Spans we will allocate and free during the
 // tests.
 // We will also do twice this many kMaxPages/2-sized ones.
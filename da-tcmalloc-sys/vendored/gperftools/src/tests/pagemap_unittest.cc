@@ -38,6 +38,7 @@
 #include <stdlib.h>
 
 #include <algorithm>
+#include <new>
 #include <random>
 #include <vector>
 
@@ -46,13 +47,18 @@
 // Note: we leak memory every time a map is constructed, so do not
 // create too many maps.
 
+// Maps require zero-filled memory from their allocator.
+static void* ZeroedAlloc(size_t size) {
+  return calloc(1, size);
+}
+
 // Test specified map type
 template <class Type>
 void TestMap(int limit, bool limit_is_below_the_overflow_boundary) {
   printf("Running test with %d iterations...\n", limit);
 
   { // Test sequential ensure/assignment
-    Type map(malloc);
+    Type map(ZeroedAlloc);
     for (intptr_t i = 0; i < static_cast<intptr_t>(limit); i++) {
       map.Ensure(i, 1);
       map.set(i, (void*)(i+1));
@@ -64,7 +70,7 @@ void TestMap(int limit, bool limit_is_below_the_overflow_boundary) {
   }
 
   { // Test bulk Ensure
-    Type map(malloc);
+    Type map(ZeroedAlloc);
     map.Ensure(0, limit);
     for (intptr_t i = 0; i < static_cast<intptr_t>(limit); i++) {
       map.set(i, (void*)(i+1));
@@ -77,7 +83,7 @@ void TestMap(int limit, bool limit_is_below_the_overflow_boundary) {
 
   // Test that we correctly notice overflow
   {
-    Type map(malloc);
+    Type map(ZeroedAlloc);
     ASSERT_EQ(map.Ensure(limit, limit+1), limit_is_below_the_overflow_boundary);
   }
 
@@ -86,7 +92,7 @@ void TestMap(int limit, bool limit_is_below_the_overflow_boundary) {
     for (intptr_t i = 0; i < static_cast<intptr_t>(limit); i++) elements.push_back(i);
     std::shuffle(elements.begin(), elements.end(), std::mt19937(42));
 
-    Type map(malloc);
+    Type map(ZeroedAlloc);
     for (intptr_t i = 0; i < static_cast<intptr_t>(limit); i++) {
       map.Ensure(elements[i], 1);
       map.set(elements[i], (void*)(elements[i]+1));
@@ -106,7 +112,9 @@ void TestMap(int limit, bool limit_is_below_the_overflow_boundary) {
 template <class Type>
 void TestNext(const char* name) {
   printf("Running NextTest %s\n", name);
-  Type map(malloc);
+  // Placed in zero-filled storage, like the page heap's map.
+  void* storage = calloc(1, sizeof(Type));
+  Type& map = *new (storage) Type(ZeroedAlloc, true);
   char a, b, c, d, e;
 
   // When map is empty
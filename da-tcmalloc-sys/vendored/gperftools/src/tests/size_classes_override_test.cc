@@ -0,0 +1,47 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+// This tests that a program's tc_size_classes_override() picks the
+// size classes tcmalloc starts with.
+
+#include "config_for_unittests.h"
+
+#include <stdlib.h>
+
+#include <gperftools/malloc_extension.h>
+#include <gperftools/malloc_extension_c.h>
+#include <gperftools/nallocx.h>
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+static constexpr char kSpec[] =
+    "16,32,48,64,128,256,512,1024,2048,4096,8192,"
+    "16384,32768,65536,131072,262144";
+
+extern "C" const char* tc_size_classes_override(void) {
+  return kSpec;
+}
+
+TEST(SizeClassesOverride, Applied) {
+  if (getenv("TCMALLOC_SIZE_CLASSES") != nullptr) {
+    printf("TCMALLOC_SIZE_CLASSES is set, skipping\n");
+    return;
+  }
+  MallocExtension* e = MallocExtension::instance();
+
+  size_t custom;
+  ASSERT_TRUE(e->GetNumericProperty("tcmalloc.custom_size_classes", &custom));
+  EXPECT_EQ(custom, 1);
+
+  std::vector<MallocExtension::SizeClassInfo> classes;
+  e->GetSizeClasses(&classes);
+  std::string spec;
+  for (const MallocExtension::SizeClassInfo& c : classes) {
+    spec += (spec.empty() ? "" : ",") + std::to_string(c.size);
+  }
+  EXPECT_EQ(spec, kSpec);
+
+  EXPECT_EQ(nallocx(40, 0), 48);
+  EXPECT_EQ(nallocx(100, 0), 128);
+}
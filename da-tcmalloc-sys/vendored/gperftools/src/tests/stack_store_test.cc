@@ -0,0 +1,97 @@
+// -*- Mode: C++; c-basic-offset: 2; indent-tabs-mode: nil -*-
+#include "config_for_unittests.h"
+
+#include "base/stack_store.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+const void* Frame(uintptr_t pc) {
+  return reinterpret_cast<const void*>(pc);
+}
+
+std::vector<const void*> Get(const tcmalloc::StackStore& store, uint32_t id, int depth) {
+  std::vector<const void*> result(depth);
+  store.Get(id, depth, result.data());
+  return result;
+}
+
+}  // namespace
+
+TEST(StackStoreTest, RoundTrip) {
+  tcmalloc::StackStore store(malloc, free);
+
+  const void* a[] = {Frame(1), Frame(2), Frame(3)};
+  const void* b[] = {Frame(4), Frame(2), Frame(3)};
+  uint32_t id_a, id_b, id_a2, id_empty;
+  ASSERT_TRUE(store.Intern(a, 3, &id_a));
+  ASSERT_TRUE(store.Intern(b, 3, &id_b));
+  ASSERT_TRUE(store.Intern(a, 3, &id_a2));
+  ASSERT_TRUE(store.Intern(nullptr, 0, &id_empty));
+
+  EXPECT_EQ(id_a, id_a2);
+  EXPECT_NE(id_a, id_b);
+  EXPECT_EQ(id_empty, 0);
+
+  // Common callers 2 and 3 are stored once.
+  EXPECT_EQ(store.nodes(), 4);
+
+  EXPECT_EQ(Get(store, id_a, 3), std::vector<const void*>(a, a + 3));
+  EXPECT_EQ(Get(store, id_b, 3), std::vector<const void*>(b, b + 3));
+
+  EXPECT_TRUE(store.Equals(id_a, a, 3));
+  EXPECT_FALSE(store.Equals(id_a, b, 3));
+  EXPECT_FALSE(store.Equals(id_a, a, 2));
+  EXPECT_FALSE(store.Equals(id_a, a + 1, 2));
+  EXPECT_TRUE(store.Equals(id_empty, nullptr, 0));
+}
+
+TEST(StackStoreTest, Many) {
+  tcmalloc::StackStore store(malloc, free);
+
+  // Enough to grow the index and span many node chunks.
+  constexpr int kStacks = 20000;
+  constexpr int kDepth = 8;
+  std::vector<uint32_t> ids(kStacks);
+  for (int i = 0; i < kStacks; i++) {
+    const void* stack[kDepth];
+    for (int d = 0; d < kDepth; d++) {
+      stack[d] = Frame(d == 0 ? i + 100 : d);
+    }
+    ASSERT_TRUE(store.Intern(stack, kDepth, &ids[i]));
+  }
+  EXPECT_EQ(store.nodes(), kStacks + kDepth - 1);
+
+  for (int i = 0; i < kStacks; i++) {
+    std::vector<const void*> stack = Get(store, ids[i], kDepth);
+    ASSERT_EQ(stack[0], Frame(i + 100));
+    ASSERT_EQ(stack[kDepth - 1], Frame(kDepth - 1));
+  }
+}
+
+TEST(StackStoreTest, ConcurrentReaders) {
+  tcmalloc::StackStore store(malloc, free);
+
+  const void* base[] = {Frame(1), Frame(2)};
+  uint32_t base_id;
+  ASSERT_TRUE(store.Intern(base, 2, &base_id));
+
+  std::thread reader([&] () {
+    for (int i = 0; i < 100000; i++) {
+      ASSERT_TRUE(store.Equals(base_id, base, 2));
+    }
+  });
+  for (int i = 0; i < 10000; i++) {
+    const void* stack[] = {Frame(i + 100), Frame(i + 200), Frame(2)};
+    uint32_t id;
+    ASSERT_TRUE(store.Intern(stack, 3, &id));
+  }
+  reader.join();
+}
@@ -133,6 +133,7 @@ struct NumericProperty {
 };
 
 constexpr NumericProperty kAggressiveDecommit{"tcmalloc.aggressive_memory_decommit"};
+constexpr NumericProperty kHugePageAware{"tcmalloc.hugepage_aware"};
 
 }  // namespace
 
@@ -651,6 +652,41 @@ static void TestCalloc(size_t n, size_t s, bool ok) {
   }
 }
 
+// Large calloc skips zeroing pages that are known to be zeros. Make
+// sure memory that was written and freed, or released, still gets
+// zeroed.
+TEST(TCMallocTest, CallocReusedMemory) {
+  static const size_t kSizes[] = {
+    100, 8 << 10, 300 << 10, 1 << 20, 3 << 20, 8 << 20,
+  };
+  for (int release = 0; release < 2; release++) {
+    for (size_t size : kSizes) {
+      std::vector<char*> dirty;
+      for (int i = 0; i < 4; i++) {
+        char* p = static_cast<char*>(noopt(malloc)(size * (i + 1)));
+        ASSERT_NE(p, nullptr);
+        memset(p, 0xff, size * (i + 1));
+        dirty.push_back(p);
+      }
+      for (char* p : dirty) {
+        free(p);
+      }
+      if (release) {
+        MallocExtension::instance()->ReleaseFreeMemory();
+      }
+      for (int i = 0; i < 4; i++) {
+        char* p = static_cast<char*>(noopt(calloc)(size, i + 1));
+        ASSERT_NE(p, nullptr);
+        const size_t usable = MallocExtension::instance()->GetAllocatedSize(p);
+        const std::vector<char> zeros(usable);
+        ASSERT_EQ(0, memcmp(p, zeros.data(), usable)) << size << " " << i;
+        memset(p, 0xff, usable);
+        free(p);
+      }
+    }
+  }
+}
+
 // This makes sure that reallocing a small number of bytes in either
 // direction doesn't cause us to allocate new memory.
 TEST(TCMallocTest, Realloc) {
@@ -686,6 +722,34 @@ TEST(TCMallocTest, Realloc) {
   }
 }
 
+// Sized aligned delete has to return objects to the same size class
+// aligned new took them from, so that they are handed out again.
+TEST(TCMallocTest, SizedAlignedDelete) {
+  if (TestingPortal::Get()->IsDebuggingMalloc()) {
+    // debug alloc doesn't reuse freed memory right away
+    return;
+  }
+  // Per-cpu caches don't hand back last freed object if we migrate.
+  size_t per_cpu = 0;
+  MallocExtension::instance()->GetNumericProperty("tcmalloc.per_cpu_caches", &per_cpu);
+  tcmalloc::Cleanup cleanup = SetFlag(&TestingPortal::Get()->GetSampleParameter(), 0);
+
+  for (size_t align = 16; align <= (64 << 10); align <<= 1) {
+    for (size_t size : {1, 24, 100, 1000, 5000, 40000}) {
+      void* p = noopt(::operator new(size, std::align_val_t(align)));
+      ASSERT_EQ(reinterpret_cast<uintptr_t>(p) % align, 0);
+      memset(p, 'x', size);
+      ::operator delete(p, size, std::align_val_t(align));
+
+      void* q = noopt(::operator new(size, std::align_val_t(align)));
+      if (!per_cpu && align <= 4096) {
+        EXPECT_EQ(p, q) << "size " << size << " align " << align;
+      }
+      ::operator delete(q, size, std::align_val_t(align));
+    }
+  }
+}
+
 #if __cpp_exceptions
 static int news_handled = 0;
 
@@ -871,6 +935,164 @@ TEST(TCMallocTest, HugeThreadCache) {
   delete[] array;
 }
 
+// Objects allocated by one set of threads and freed by another travel
+// through central cache's transfer cache shards. Make sure nothing
+// gets lost or corrupted on the way.
+TEST(TCMallocTest, CrossThreadHandoff) {
+  printf("==== Testing cross-thread handoff\n");
+  static constexpr int kPairs = 4;
+  static constexpr int kRounds = 200;
+  static constexpr int kBatch = 512;
+
+  std::mutex mu;
+  std::vector<std::vector<char*>> queues(kPairs);
+  std::vector<std::thread> threads;
+  for (int p = 0; p < kPairs; p++) {
+    threads.emplace_back([&, p] () {
+      for (int r = 0; r < kRounds; r++) {
+        std::vector<char*> batch(kBatch);
+        for (int j = 0; j < kBatch; j++) {
+          batch[j] = noopt(static_cast<char*>(malloc(32)));
+          memset(batch[j], p, 32);
+        }
+        std::lock_guard<std::mutex> l(mu);
+        queues[p].insert(queues[p].end(), batch.begin(), batch.end());
+      }
+    });
+    threads.emplace_back([&, p] () {
+      int freed = 0;
+      while (freed < kRounds * kBatch) {
+        std::vector<char*> batch;
+        {
+          std::lock_guard<std::mutex> l(mu);
+          batch.swap(queues[p]);
+        }
+        for (char* ptr : batch) {
+          CHECK_EQ(ptr[0], p);
+          CHECK_EQ(ptr[31], p);
+          free(ptr);
+        }
+        freed += batch.size();
+        if (batch.empty()) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+TEST(TCMallocTest, PerCpuCaches) {
+  MallocExtension* e = MallocExtension::instance();
+  size_t per_cpu_caches;
+  ASSERT_TRUE(e->GetNumericProperty("tcmalloc.per_cpu_caches", &per_cpu_caches));
+  if (!per_cpu_caches) {
+    printf("==== Skipping per-CPU caches test (not active)\n");
+    return;
+  }
+  printf("==== Testing per-CPU caches\n");
+
+  // Lots of threads free lots of small objects. With per-CPU caches
+  // active none of that lands in thread caches and amount of cached
+  // memory is bounded by number of CPUs.
+  static constexpr int kThreads = 64;
+  static constexpr int kNum = 4096;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; i++) {
+    threads.emplace_back([] () {
+      std::vector<void*> ptrs(kNum);
+      for (int j = 0; j < kNum; j++) {
+        ptrs[j] = noopt(malloc(16 + (j % 32) * 16));
+      }
+      for (int j = 0; j < kNum; j++) {
+        free(ptrs[j]);
+      }
+      CHECK_EQ(MallocExtension::instance()->GetThreadCacheSize(), 0);
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  // Limit of 1 MiB per CPU is strict. Thread cache bytes include
+  // per-CPU ones, and also whatever threads cached before per-CPU
+  // caches got active, so we check per-CPU bytes apart.
+  size_t cached, cpu_cached;
+  ASSERT_TRUE(e->GetNumericProperty("tcmalloc.thread_cache_free_bytes", &cached));
+  ASSERT_TRUE(e->GetNumericProperty("tcmalloc.cpu_cache_free_bytes", &cpu_cached));
+  EXPECT_LE(cpu_cached, size_t(sysconf(_SC_NPROCESSORS_CONF)) << 20);
+  EXPECT_GE(cached, cpu_cached);
+
+  // Explicit release empties them.
+  e->ReleaseFreeMemory();
+  ASSERT_TRUE(e->GetNumericProperty("tcmalloc.cpu_cache_free_bytes", &cpu_cached));
+  EXPECT_EQ(cpu_cached, 0);
+
+  // And so does switching them off.
+  free(noopt(malloc(100)));
+  ASSERT_TRUE(e->SetNumericProperty("tcmalloc.per_cpu_caches", 0));
+  ASSERT_TRUE(e->GetNumericProperty("tcmalloc.per_cpu_caches", &per_cpu_caches));
+  EXPECT_EQ(per_cpu_caches, 0);
+  ASSERT_TRUE(e->GetNumericProperty("tcmalloc.cpu_cache_free_bytes", &cpu_cached));
+  EXPECT_EQ(cpu_cached, 0);
+  ASSERT_TRUE(e->SetNumericProperty("tcmalloc.per_cpu_caches", 1));
+  ASSERT_TRUE(e->GetNumericProperty("tcmalloc.per_cpu_caches", &per_cpu_caches));
+  EXPECT_EQ(per_cpu_caches, 1);
+}
+
+TEST(TCMallocTest, NumaAware) {
+  MallocExtension* e = MallocExtension::instance();
+  size_t nodes, local_before, local_after, remote_before, remote_after;
+  ASSERT_TRUE(e->GetNumericProperty("tcmalloc.numa_nodes", &nodes));
+  ASSERT_TRUE(e->GetNumericProperty("tcmalloc.numa_local_allocations", &local_before));
+  ASSERT_TRUE(e->GetNumericProperty("tcmalloc.numa_remote_allocations", &remote_before));
+  if (nodes == 0) {
+    printf("==== Skipping NUMA test (not active)\n");
+    return;
+  }
+  printf("==== Testing NUMA mode with %zu nodes\n", nodes);
+
+  // Every page heap allocation is counted either as node-local or as
+  // remote. Objects freed by other threads (possibly running on other
+  // nodes) must make their way back without trouble.
+  static constexpr int kThreads = 16;
+  static constexpr int kNum = 1024;
+  std::vector<void*> ptrs(kThreads * kNum);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; i++) {
+    threads.emplace_back([&ptrs, i] () {
+      for (int j = 0; j < kNum; j++) {
+        ptrs[i * kNum + j] = noopt(malloc(16 + (j % 64) * 64));
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  threads.clear();
+  for (int i = 0; i < kThreads; i++) {
+    threads.emplace_back([&ptrs, i] () {
+      for (int j = 0; j < kNum; j++) {
+        free(ptrs[((i + 1) % kThreads) * kNum + j]);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  void* large = noopt(malloc(1 << 20));
+  free(large);
+
+  ASSERT_TRUE(e->GetNumericProperty("tcmalloc.numa_local_allocations", &local_after));
+  ASSERT_TRUE(e->GetNumericProperty("tcmalloc.numa_remote_allocations", &remote_after));
+  EXPECT_GT(local_after + remote_after, local_before + remote_before);
+
+  e->ReleaseFreeMemory();
+}
+
 // Check that at least one of the callbacks from Ranges() contains
 // the specified address with the specified type, and has size
 // >= min_size.
@@ -903,6 +1125,9 @@ static void CheckRangeCallback(void* ptr, base::MallocRange::Type type,
 }
 
 TEST(TCMallocTest, Ranges) {
+  // Hugepage aware mode releases only whole hugepages.
+  tcmalloc::Cleanup hugepage_cleanup = kHugePageAware.Override(0);
+
   static const int MB = 1048576;
   void* a = malloc(MB);
   void* b = malloc(MB);
@@ -947,6 +1172,7 @@ TEST(TCMallocTest, ReleaseToSystem) {
 
   tcmalloc::Cleanup release_rate_cleanup = SetFlag(&TestingPortal::Get()->GetReleaseRate(), 0);
   tcmalloc::Cleanup decommit_cleanup = kAggressiveDecommit.Override(0);
+  tcmalloc::Cleanup hugepage_cleanup = kHugePageAware.Override(0);
 
   static const int MB = 1048576;
   void* a = noopt(malloc(MB));
@@ -1008,6 +1234,7 @@ TEST(TCMallocTest, AggressiveDecommit) {
   MallocExtension::instance()->ReleaseFreeMemory();
 
   tcmalloc::Cleanup cleanup = kAggressiveDecommit.Override(1);
+  tcmalloc::Cleanup hugepage_cleanup = kHugePageAware.Override(0);
 
   static const int MB = 1048576;
   void* a = noopt(malloc(MB));
@@ -1040,6 +1267,129 @@ TEST(TCMallocTest, AggressiveDecommit) {
   printf("Done testing aggressive de-commit\n");
 }
 
+TEST(TCMallocTest, ReleaseAdvice) {
+  MallocExtension* e = MallocExtension::instance();
+  size_t old_advice;
+  ASSERT_TRUE(e->GetNumericProperty("tcmalloc.release_advice", &old_advice));
+  tcmalloc::Cleanup cleanup{[old_advice] () {
+    CHECK(MallocExtension::instance()->SetNumericProperty(
+            "tcmalloc.release_advice", old_advice));
+  }};
+
+  // 0 (MADV_DONTNEED) is supported everywhere, and there are only 5
+  // options.
+  EXPECT_TRUE(e->SetNumericProperty("tcmalloc.release_advice", 0));
+  EXPECT_FALSE(e->SetNumericProperty("tcmalloc.release_advice", 5));
+
+  static const size_t kSize = 8 << 20;
+  for (size_t advice = 0; advice < 5; advice++) {
+    if (!e->SetNumericProperty("tcmalloc.release_advice", advice)) {
+      continue;
+    }
+
+    char* p = static_cast<char*>(noopt(malloc(kSize)));
+    memset(p, 'x', kSize);
+    free(p);
+    e->ReleaseFreeMemory();
+
+    // Kernel might not know the advice, then ranges fall back to 0.
+    size_t lazy_bytes, free_bytes;
+    ASSERT_TRUE(e->GetNumericProperty("tcmalloc.pageheap_lazy_unmapped_bytes",
+                                      &lazy_bytes));
+    ASSERT_TRUE(e->GetNumericProperty("tcmalloc.pageheap_free_bytes", &free_bytes));
+    const size_t unmapped_bytes = GetUnmappedBytes();
+    EXPECT_LE(lazy_bytes, unmapped_bytes);
+    if (!TestingPortal::Get()->IsDebuggingMalloc()
+        && TestingPortal::Get()->HaveSystemRelease()) {
+      if (advice == 1) {
+        EXPECT_TRUE(lazy_bytes >= kSize / 2
+                    || unmapped_bytes - lazy_bytes >= kSize / 2);
+      } else if (advice == 2 || advice == 3) {
+        // MADV_COLD and MADV_PAGEOUT keep pages, so they stay free
+        // rather than unmapped.
+        EXPECT_TRUE(free_bytes >= kSize / 2 || unmapped_bytes >= kSize / 2);
+      }
+    }
+
+    // Released memory is fine to reuse, even if release was batched.
+    p = static_cast<char*>(noopt(malloc(kSize)));
+    memset(p, 'y', kSize);
+    EXPECT_EQ('y', p[0]);
+    EXPECT_EQ('y', p[kSize - 1]);
+    free(p);
+  }
+}
+
+static std::string SizeClassesSpec(
+    const std::vector<MallocExtension::SizeClassInfo>& classes, bool full) {
+  std::string spec;
+  for (const MallocExtension::SizeClassInfo& c : classes) {
+    if (!spec.empty()) {
+      spec += ",";
+    }
+    spec += std::to_string(c.size);
+    if (full) {
+      spec += ":" + std::to_string(c.pages) + ":" + std::to_string(c.objects_to_move);
+    }
+  }
+  return spec;
+}
+
+TEST(TCMallocTest, SizeClasses) {
+  MallocExtension* e = MallocExtension::instance();
+  std::vector<MallocExtension::SizeClassInfo> classes;
+  e->GetSizeClasses(&classes);
+  ASSERT_GT(classes.size(), 1);
+  for (size_t i = 1; i < classes.size(); i++) {
+    EXPECT_LT(classes[i - 1].size, classes[i].size);
+  }
+  for (const MallocExtension::SizeClassInfo& c : classes) {
+    EXPECT_GE(c.pages, 1);
+    EXPECT_GE(c.objects_to_move, 1);
+    EXPECT_EQ(nallocx(c.size, 0), c.size);
+  }
+  const size_t max_size = classes.back().size;
+
+  // See PrepareEnv below.
+  size_t custom;
+  ASSERT_TRUE(e->GetNumericProperty("tcmalloc.custom_size_classes", &custom));
+  const char* env_spec = getenv("TCMALLOC_SIZE_CLASSES");
+  if (env_spec != nullptr && e->CheckSizeClasses(env_spec) == nullptr) {
+    EXPECT_EQ(custom, 1);
+    EXPECT_EQ(SizeClassesSpec(classes, false), env_spec);
+  } else {
+    EXPECT_EQ(custom, 0);
+  }
+
+  // Table in use is accepted, with and without the computed fields.
+  EXPECT_EQ(e->CheckSizeClasses(SizeClassesSpec(classes, true).c_str()), nullptr);
+  EXPECT_EQ(e->CheckSizeClasses(SizeClassesSpec(classes, false).c_str()), nullptr);
+
+  const std::string max = "," + std::to_string(max_size);
+  EXPECT_EQ(e->CheckSizeClasses(("16,32,64,128,256,512,1024,2048,4096" + max).c_str()),
+            nullptr);
+
+  static const char* const kBad[] = {
+    "x",
+    "32,16,64",                         // not increasing
+    "16,32,64 ",                        // trailing garbage
+    "16,32:,64",                        // missing pages
+    "12,16,32,64",                      // misaligned
+    "16,32,1088",                       // not a multiple of 128
+    "16,48,64",                         // malloc(32) would not be 32 aligned
+    "16:1:100000,32,64",                // objects_to_move too big
+    "16:100000,32,64",                  // span too big
+    "16,32,64,128,256,512,1024,2048,4096,16384:1", // span too small
+  };
+  for (const char* bad : kBad) {
+    std::string spec = std::string(bad) + max;
+    EXPECT_NE(e->CheckSizeClasses(spec.c_str()), nullptr) << spec;
+  }
+  EXPECT_NE(e->CheckSizeClasses(""), nullptr);
+  // Doesn't reach the largest size class.
+  EXPECT_NE(e->CheckSizeClasses("16,32,64"), nullptr);
+}
+
 // On MSVC10, in release mode, the optimizer convinces itself
 // g_no_memory is never changed (I guess it doesn't realize OnNoMemory
 // might be called).  Work around this by setting the var volatile.
@@ -1774,7 +2124,7 @@ struct EnvProperty {
 // by passing --gtest_filter or other flags, you'll need to set up
 // environment variables yourself. See SetupExec below.
 //
-// We test 4 extra settings:
+// We test 6 extra settings:
 //
 // * TCMALLOC_TRANSFER_NUM_OBJ = 40
 //
@@ -1786,12 +2136,20 @@ struct EnvProperty {
 //
 // * TCMALLOC_ENABLE_SIZED_DELETE = t (note, this one is no-op in most
 //     common builds)
+//
+// * TCMALLOC_PER_CPU_CACHES = t
+//
+// * TCMALLOC_SIZE_CLASSES = power of 2 classes up to 1024 bytes
 std::function<std::vector<const char*>()> PrepareEnv() {
   static constexpr EnvProperty kUpdateNoEnv{"TCMALLOC_UNITTEST_ENV_UPDATE_NO"};
   static constexpr EnvProperty kTransferNumObjEnv{"TCMALLOC_TRANSFER_NUM_OBJ"};
   static constexpr EnvProperty kAggressiveDecommitEnv{"TCMALLOC_AGGRESSIVE_DECOMMIT"};
   static constexpr EnvProperty kHeapLimitEnv{"TCMALLOC_HEAP_LIMIT_MB"};
   static constexpr EnvProperty kEnableSizedDeleteEnv{"TCMALLOC_ENABLE_SIZED_DELETE"};
+  static constexpr EnvProperty kPerCpuCachesEnv{"TCMALLOC_PER_CPU_CACHES"};
+  static constexpr EnvProperty kNumaAwareEnv{"TCMALLOC_NUMA_AWARE"};
+  static constexpr EnvProperty kHugePageAwareEnv{"TCMALLOC_HUGEPAGE_AWARE"};
+  static constexpr EnvProperty kSizeClassesEnv{"TCMALLOC_SIZE_CLASSES"};
 
   std::string_view testno = kUpdateNoEnv.Get();
   using override_set = EnvProperty::override_set;
@@ -1830,6 +2188,43 @@ std::function<std::vector<const char*>()> PrepareEnv() {
     });
   }
   if (testno == "5") {
+    return EnvProperty::DuplicateAndUpdateEnv([] (override_set* overrides) {
+      kEnableSizedDeleteEnv.Set(overrides, "");
+      kPerCpuCachesEnv.SetAndPrint(overrides, "t");
+      kUpdateNoEnv.Set(overrides, "6");
+    });
+  }
+  if (testno == "6") {
+    return EnvProperty::DuplicateAndUpdateEnv([] (override_set* overrides) {
+      kPerCpuCachesEnv.Set(overrides, "");
+      kNumaAwareEnv.SetAndPrint(overrides, "t");
+      kUpdateNoEnv.Set(overrides, "7");
+    });
+  }
+  if (testno == "7") {
+    return EnvProperty::DuplicateAndUpdateEnv([] (override_set* overrides) {
+      kNumaAwareEnv.Set(overrides, "");
+      kHugePageAwareEnv.SetAndPrint(overrides, "t");
+      kUpdateNoEnv.Set(overrides, "8");
+    });
+  }
+  if (testno == "8") {
+    return EnvProperty::DuplicateAndUpdateEnv([] (override_set* overrides) {
+      std::vector<MallocExtension::SizeClassInfo> classes;
+      MallocExtension::instance()->GetSizeClasses(&classes);
+      std::string spec;
+      for (const MallocExtension::SizeClassInfo& c : classes) {
+        if (c.size < 1024 && (c.size & (c.size - 1)) != 0) {
+          continue;
+        }
+        spec += (spec.empty() ? "" : ",") + std::to_string(c.size);
+      }
+      kHugePageAwareEnv.Set(overrides, "");
+      kSizeClassesEnv.SetAndPrint(overrides, spec.c_str());
+      kUpdateNoEnv.Set(overrides, "9");
+    });
+  }
+  if (testno == "9") {
     return {};
   }
   printf("Unknown %s: %.*s\n", kUpdateNoEnv.name, static_cast<int>(testno.size()), testno.data());
@@ -126,7 +126,7 @@ void* ThreadCache::FetchFromCentralCache(uint32_t cl, int32_t byte_size,
 
   const int num_to_move = min<int>(list->max_length(), batch_size);
   void *start, *end;
-  int fetch_count = Static::central_cache()[cl].RemoveRange(
+  int fetch_count = Static::local_central_cache()[cl].RemoveRange(
       &start, &end, num_to_move);
 
   if (fetch_count == 0) {
@@ -203,12 +203,12 @@ void ThreadCache::ReleaseToCentralCache(FreeList* src, uint32_t cl, int N) {
   while (N > batch_size) {
     void *tail, *head;
     src->PopRange(batch_size, &head, &tail);
-    Static::central_cache()[cl].InsertRange(head, tail, batch_size);
+    Static::local_central_cache()[cl].InsertRange(head, tail, batch_size);
     N -= batch_size;
   }
   void *tail, *head;
   src->PopRange(N, &head, &tail);
-  Static::central_cache()[cl].InsertRange(head, tail, N);
+  Static::local_central_cache()[cl].InsertRange(head, tail, N);
   size_ -= delta_bytes;
 }
 
@@ -147,7 +147,11 @@ void* TCMalloc_SystemAlloc(size_t size, size_t *actual_size,
 }
 
 extern PERFTOOLS_DLL_DECL
-bool TCMalloc_SystemRelease(void* start, size_t length) {
+bool TCMalloc_SystemRelease(void* start, size_t length,
+                            tcmalloc::ReleaseAdvice* used_advice) {
+  if (used_advice != NULL) {
+    *used_advice = tcmalloc::ReleaseAdvice::kDontNeed;
+  }
   if (VirtualFree(start, length, MEM_DECOMMIT))
     return true;
 
@@ -196,6 +200,56 @@ void TCMalloc_SystemCommit(void* start, size_t length) {
   }
 }
 
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemAdviseHugePages(void* start, size_t length) {
+  // Windows has no transparent huge pages. Nothing to do.
+}
+
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemSetReleaseAdvice(tcmalloc::ReleaseAdvice advice) {
+  // We always decommit.
+  return advice == tcmalloc::ReleaseAdvice::kDontNeed;
+}
+
+extern PERFTOOLS_DLL_DECL
+tcmalloc::ReleaseAdvice TCMalloc_SystemGetReleaseAdvice() {
+  return tcmalloc::ReleaseAdvice::kDontNeed;
+}
+
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemAllocZeroes() {
+  SpinLockHolder lock_holder(&spinlock);
+  return tcmalloc_sys_alloc != NULL && tcmalloc_sys_alloc == virtual_space.get();
+}
+
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemReleaseZeroes() {
+  // Decommitted pages are zero-filled when committed again.
+  return TCMalloc_SystemAllocZeroes();
+}
+
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemFlushReleases() {
+}
+
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemTakeFailedRelease(void** start, size_t* length) {
+  return false;
+}
+
+extern PERFTOOLS_DLL_DECL
+bool TCMalloc_SystemReleaseFailed(void* start, size_t length) {
+  return false;
+}
+
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemBeginReleases() {
+}
+
+extern PERFTOOLS_DLL_DECL
+void TCMalloc_SystemEndReleases() {
+}
+
 bool RegisterSystemAllocator(SysAllocator *allocator, int priority) {
   return false;   // we don't allow registration on windows, right now
 }
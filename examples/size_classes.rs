@@ -0,0 +1,72 @@
+//! Derives a size class table from an allocation size histogram.
+//!
+//! Reads the histogram from stdin, either as `<size> <count>` lines, or
+//! as a legacy text heap profile (e.g. dumped with
+//! `HeapProfilerVars::heap_profile_sample_period` set), in which case
+//! each call site counts as its average allocation size. Prints the
+//! `TCMALLOC_SIZE_CLASSES` value to start the workload with, which can
+//! also be built into it with `da_tcmalloc::size_classes_override!`.
+//!
+//! ```sh
+//! cargo run --example size_classes -- [max_classes] < histogram.txt
+//! ```
+
+use std::io::{self, BufRead};
+
+use da_tcmalloc::{derive_size_classes, size_classes, size_classes_spec, SizeClass, MAX_SIZE_CLASSES};
+
+fn parse_line(line: &str) -> Option<(usize, u64)> {
+    // Heap profile: "<inuse objs>: <inuse bytes> [<alloc objs>: <alloc bytes>] @ <stack>"
+    if let Some((_, rest)) = line.split_once('[') {
+        let (objects, bytes) = rest.split_once(']')?.0.split_once(':')?;
+        let objects: u64 = objects.trim().parse().ok()?;
+        let bytes: u64 = bytes.trim().parse().ok()?;
+        return (objects > 0).then(|| ((bytes / objects) as usize, objects));
+    }
+    let mut fields = line.split_whitespace();
+    let size = fields.next()?.parse().ok()?;
+    let count = fields.next()?.parse().ok()?;
+    Some((size, count))
+}
+
+fn waste(classes: &[SizeClass], histogram: &[(usize, u64)]) -> u128 {
+    histogram
+        .iter()
+        .filter_map(|&(size, count)| {
+            let class = classes.iter().find(|c| c.size >= size)?;
+            Some((class.size - size) as u128 * count as u128)
+        })
+        .sum()
+}
+
+fn main() -> io::Result<()> {
+    let max_classes = std::env::args().nth(1).map_or(MAX_SIZE_CLASSES, |arg| {
+        arg.parse().expect("max_classes should be a number")
+    });
+
+    let mut histogram = vec![];
+    for line in io::stdin().lock().lines() {
+        let line = line?;
+        if line.starts_with("heap profile:") || line.starts_with('#') {
+            continue;
+        }
+        if let Some(entry) = parse_line(&line) {
+            histogram.push(entry);
+        }
+    }
+
+    let current = size_classes();
+    let derived = derive_size_classes(&histogram, max_classes);
+    eprintln!(
+        "size classes: {} -> {}, bytes wasted to rounding: {} -> {}",
+        current.len(),
+        derived.len(),
+        waste(&current, &histogram),
+        waste(&derived, &histogram)
+    );
+    match size_classes_spec(&derived) {
+        Ok(spec) => println!("TCMALLOC_SIZE_CLASSES={}", spec),
+        Err(error) => eprintln!("derived table is invalid: {}", error),
+    }
+    Ok(())
+}
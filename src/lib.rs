@@ -1,7 +1,7 @@
-use std::{ffi::{c_char, c_int, c_void, CString}, path::PathBuf};
+use std::{alloc::{GlobalAlloc, Layout}, ffi::{c_char, c_int, c_void, CStr, CString}, io::{self, Write}, path::PathBuf, sync::{mpsc::{self, RecvTimeoutError}, Mutex}, thread::{self, JoinHandle}, time::{Duration, Instant}};
 
 pub use da_tcmalloc_sys::HeapProfilerVars;
-use da_tcmalloc_sys::{MallocExtension_GetAllocatedSize, MallocExtension_GetEstimatedAllocatedSize, MallocExtension_GetMemoryReleaseRate, MallocExtension_GetNumericProperty, MallocExtension_GetStats, MallocExtension_GetThreadCacheSize, MallocExtension_MallocMemoryStats, MallocExtension_MarkThreadBusy, MallocExtension_MarkThreadIdle, MallocExtension_MarkThreadTemporarilyIdle, MallocExtension_ReleaseFreeMemory, MallocExtension_ReleaseToSystem, MallocExtension_SetMemoryReleaseRate, MallocExtension_SetNumericProperty, MallocExtension_VerifyAllMemory, MallocExtension_VerifyArrayNewMemory, MallocExtension_VerifyMallocMemory, MallocExtension_VerifyNewMemory};
+use da_tcmalloc_sys::{MallocExtension_CheckSizeClasses, MallocExtension_GetAllocatedSize, MallocExtension_GetEstimatedAllocatedSize, MallocExtension_GetMemoryReleaseRate, MallocExtension_GetNumericProperty, MallocExtension_GetSizeClasses, MallocExtension_GetStats, MallocExtension_GetThreadCacheSize, MallocExtension_MallocMemoryStats, MallocExtension_MarkThreadBusy, MallocExtension_MarkThreadIdle, MallocExtension_MarkThreadTemporarilyIdle, MallocExtension_ReleaseFreeMemory, MallocExtension_ReleaseOldFreeMemory, MallocExtension_ReleaseToSystem, MallocExtension_SetMemoryReleaseRate, MallocExtension_SetNumericProperty, MallocExtension_VerifyAllMemory, MallocExtension_VerifyArrayNewMemory, MallocExtension_VerifyMallocMemory, MallocExtension_VerifyNewMemory, tc_calloc, tc_delete_sized_aligned, tc_free_sized, tc_malloc, tc_memalign, tc_nallocx, tc_realloc};
 
 pub fn start(path: PathBuf) {
     let cstr_path = CString::new(path.as_os_str().as_encoded_bytes()).unwrap();
@@ -17,6 +17,69 @@ pub fn set_exact_path(path: PathBuf) {
     }
 }
 
+/// Format of heap profile dumps written to files.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ProfileFormat {
+    /// Legacy "heap profile" text format.
+    Text,
+    /// Gzip-compressed pprof `profile.proto`.
+    PprofGz,
+}
+
+impl ProfileFormat {
+    fn as_raw(self) -> c_int {
+        let format = match self {
+            ProfileFormat::Text => da_tcmalloc_sys::HEAP_PROFILE_FORMAT_TEXT,
+            ProfileFormat::PprofGz => da_tcmalloc_sys::HEAP_PROFILE_FORMAT_PPROF_GZ,
+        };
+        format as c_int
+    }
+}
+
+/// Sets format of subsequent dumps.
+pub fn set_format(format: ProfileFormat) {
+    unsafe {
+        da_tcmalloc_sys::HeapProfilerSetFormat(format.as_raw());
+    }
+}
+
+/// Streams current heap profile into `writer`, chunk by chunk, without
+/// going through the filesystem or buffering the whole profile.
+///
+/// `writer` must not call into the heap profiler. Fails if the heap
+/// profiler is not running.
+pub fn dump_to(mut writer: impl Write, format: ProfileFormat) -> io::Result<()> {
+    struct State<'a> {
+        writer: &'a mut dyn Write,
+        result: io::Result<()>,
+    }
+
+    unsafe extern "C" fn write_chunk(arg: *mut c_void, buf: *const c_char, len: usize) {
+        let state = &mut *(arg as *mut State);
+        if state.result.is_ok() {
+            let chunk = std::slice::from_raw_parts(buf as *const u8, len);
+            state.result = state.writer.write_all(chunk);
+        }
+    }
+
+    let mut state = State {
+        writer: &mut writer,
+        result: Ok(()),
+    };
+    let written = unsafe {
+        da_tcmalloc_sys::HeapProfilerWriteProfile(
+            format.as_raw(),
+            Some(write_chunk),
+            &mut state as *mut State as *mut c_void,
+        )
+    };
+    if written == 0 {
+        return Err(io::Error::new(io::ErrorKind::Other, "heap profiler is not running"));
+    }
+    state.result?;
+    writer.flush()
+}
+
 pub fn dump(s: impl AsRef<str>) {
     let cstr_path = CString::new(s.as_ref()).unwrap();
     unsafe {
@@ -24,6 +87,15 @@ pub fn dump(s: impl AsRef<str>) {
     }
 }
 
+/// Dumps profile of memory in use at the highest heap usage seen so far.
+/// Requires `HeapProfilerVars::track_peak` to be set before `start`.
+pub fn dump_peak(s: impl AsRef<str>) {
+    let cstr_reason = CString::new(s.as_ref()).unwrap();
+    unsafe {
+        da_tcmalloc_sys::HeapProfilerDumpPeak(cstr_reason.as_ptr());
+    }
+}
+
 pub fn stop() {
     unsafe {
         da_tcmalloc_sys::HeapProfilerStop();
@@ -36,6 +108,17 @@ pub fn set_vars(vars: &HeapProfilerVars) {
     }
 }
 
+/// Returns current heap profiler variables. Until the first `set_vars`
+/// these are the defaults, so changing some fields of the result and
+/// passing it to `set_vars` keeps the rest default.
+pub fn get_vars() -> HeapProfilerVars {
+    let mut vars = HeapProfilerVars::default();
+    unsafe {
+        da_tcmalloc_sys::HeapProfilerGetVars(&mut vars);
+    }
+    vars
+}
+
 /// Verifies all memory. Returns the result code.
 pub fn verify_all_memory() -> i32 {
     unsafe { MallocExtension_VerifyAllMemory() }
@@ -92,14 +175,15 @@ pub fn get_stats(buffer: &mut [u8]) {
 
 /// Gets a numeric property.
 ///
-/// Returns Ok(value) on success or Err(error_code) on failure.
+/// Returns Ok(value) on success or Err(error_code) on failure. The C
+/// API returns non-zero for success, so the error code is always 0.
 pub fn get_numeric_property(property: &str) -> Result<usize, i32> {
     let c_property = CString::new(property).expect("CString conversion failed");
     let mut value: usize = 0;
     let ret = unsafe {
         MallocExtension_GetNumericProperty(c_property.as_ptr(), &mut value)
     };
-    if ret == 0 {
+    if ret != 0 {
         Ok(value)
     } else {
         Err(ret)
@@ -108,18 +192,20 @@ pub fn get_numeric_property(property: &str) -> Result<usize, i32> {
 
 /// Sets a numeric property.
 ///
-/// Returns Ok(()) on success or Err(error_code) on failure.
+/// Returns Ok(()) on success or Err(error_code) on failure, see
+/// [`get_numeric_property`].
 pub fn set_numeric_property(property: &str, value: usize) -> Result<(), i32> {
     let c_property = CString::new(property).expect("CString conversion failed");
     let ret = unsafe { MallocExtension_SetNumericProperty(c_property.as_ptr(), value) };
-    if ret == 0 {
+    if ret != 0 {
         Ok(())
     } else {
         Err(ret)
     }
 }
 
-/// Marks the current thread as idle.
+/// Marks the current thread as idle. Its thread cache is freed, and
+/// with per-CPU caches, the cache of the CPU it runs on is emptied.
 pub fn mark_thread_idle() {
     unsafe { MallocExtension_MarkThreadIdle() }
 }
@@ -134,7 +220,7 @@ pub fn release_to_system(num_bytes: usize) {
     unsafe { MallocExtension_ReleaseToSystem(num_bytes) }
 }
 
-/// Releases free memory.
+/// Releases free memory. Per-CPU caches are emptied first.
 pub fn release_free_memory() {
     unsafe { MallocExtension_ReleaseFreeMemory() }
 }
@@ -168,3 +254,454 @@ pub fn get_thread_cache_size() -> usize {
 pub fn mark_thread_temporarily_idle() {
     unsafe { MallocExtension_MarkThreadTemporarilyIdle() }
 }
+
+/// Switches per-CPU caches on or off. Switching them off returns the
+/// objects they hold to the central cache.
+///
+/// Returns false if per-CPU caches are not supported: they need
+/// x86-64 Linux with rseq (glibc 2.35+) and membarrier (Linux 5.10+).
+pub fn set_per_cpu_caches(enabled: bool) -> bool {
+    set_numeric_property("tcmalloc.per_cpu_caches", enabled as usize).is_ok()
+}
+
+/// Returns true if small objects are cached per CPU rather than per
+/// thread.
+pub fn per_cpu_caches() -> bool {
+    get_numeric_property("tcmalloc.per_cpu_caches") == Ok(1)
+}
+
+/// Switches hugepage aware page heap on or off. In this mode heap
+/// grows by whole 2 MiB hugepages, and memory is given back to the OS
+/// only in whole free hugepages, by background release,
+/// `release_free_memory` and aggressive decommit alike.
+pub fn set_hugepage_aware(enabled: bool) -> bool {
+    set_numeric_property("tcmalloc.hugepage_aware", enabled as usize).is_ok()
+}
+
+/// Returns true if page heap is hugepage aware.
+pub fn hugepage_aware() -> bool {
+    get_numeric_property("tcmalloc.hugepage_aware") == Ok(1)
+}
+
+/// How freed memory is given back to the OS. All but `DontNeed` are
+/// Linux only.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ReleaseAdvice {
+    /// `MADV_DONTNEED`: pages are dropped right away and zero-filled on
+    /// next touch.
+    DontNeed,
+    /// `MADV_FREE`: pages are dropped only when the system is short of
+    /// memory, so reusing them soon is cheap.
+    Free,
+    /// `MADV_COLD`: pages are kept, but are the first to be reclaimed.
+    /// They still count as free rather than unmapped bytes.
+    Cold,
+    /// `MADV_PAGEOUT`: pages are reclaimed (swapped out) right away,
+    /// keeping their contents. They still count as free rather than
+    /// unmapped bytes.
+    PageOut,
+    /// `MADV_DONTNEED` of many ranges at once via `process_madvise`.
+    BatchedDontNeed,
+}
+
+impl ReleaseAdvice {
+    const ALL: [ReleaseAdvice; 5] = [
+        ReleaseAdvice::DontNeed,
+        ReleaseAdvice::Free,
+        ReleaseAdvice::Cold,
+        ReleaseAdvice::PageOut,
+        ReleaseAdvice::BatchedDontNeed,
+    ];
+}
+
+/// Sets how memory is released to the OS. Ranges the kernel rejects
+/// `advice` for are released with `DontNeed` instead.
+pub fn set_release_advice(advice: ReleaseAdvice) -> Result<(), i32> {
+    set_numeric_property("tcmalloc.release_advice", advice as usize)
+}
+
+/// Gets how memory is released to the OS.
+pub fn get_release_advice() -> Result<ReleaseAdvice, i32> {
+    let advice = get_numeric_property("tcmalloc.release_advice")?;
+    ReleaseAdvice::ALL.get(advice).copied().ok_or(0)
+}
+
+/// Configuration of [`start_background_release`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct BackgroundReleaseConfig {
+    /// Free memory is given back to the OS only after it has not been
+    /// reused for at least this long.
+    pub min_age: Duration,
+    /// Average release rate limit.
+    pub bytes_per_second: usize,
+    /// How often the thread wakes up. Also the precision of `min_age`.
+    pub interval: Duration,
+}
+
+impl Default for BackgroundReleaseConfig {
+    fn default() -> Self {
+        BackgroundReleaseConfig {
+            min_age: Duration::from_secs(10),
+            bytes_per_second: 64 << 20,
+            interval: Duration::from_secs(1),
+        }
+    }
+}
+
+/// Background memory release thread started by
+/// [`start_background_release`]. Dropping it stops the thread.
+pub struct BackgroundRelease {
+    stop: Option<mpsc::Sender<()>>,
+    thread: Option<JoinHandle<()>>,
+}
+
+// Number of running background release threads. Memory is released
+// as it is freed only while there are none.
+static BACKGROUND_RELEASE_THREADS: Mutex<usize> = Mutex::new(0);
+
+fn set_background_release_threads(update: impl FnOnce(usize) -> usize) {
+    let mut threads = BACKGROUND_RELEASE_THREADS.lock().unwrap_or_else(|e| e.into_inner());
+    *threads = update(*threads);
+    let _ = set_numeric_property("tcmalloc.background_release", (*threads > 0) as usize);
+}
+
+/// Starts a thread that gives free memory back to the OS once it has
+/// not been reused for a while, instead of releasing it as it is freed.
+pub fn start_background_release(config: BackgroundReleaseConfig) -> io::Result<BackgroundRelease> {
+    let (stop, stopped) = mpsc::channel();
+    set_background_release_threads(|n| n + 1);
+    let thread = thread::Builder::new()
+        .name("tcmalloc-release".into())
+        .spawn(move || background_release_loop(config, stopped));
+    match thread {
+        Ok(thread) => Ok(BackgroundRelease { stop: Some(stop), thread: Some(thread) }),
+        Err(e) => {
+            set_background_release_threads(|n| n - 1);
+            Err(e)
+        }
+    }
+}
+
+fn background_release_loop(config: BackgroundReleaseConfig, stopped: mpsc::Receiver<()>) {
+    let rate = config.bytes_per_second as f64;
+    let min_age_ms = config.min_age.as_millis().try_into().unwrap_or(usize::MAX);
+    // Whole spans are released, so we may overshoot. That is paid
+    // back by negative budget on next ticks.
+    let mut budget = 0.0;
+    let mut last = Instant::now();
+    while let Err(RecvTimeoutError::Timeout) = stopped.recv_timeout(config.interval) {
+        let now = Instant::now();
+        let cap = rate * config.interval.as_secs_f64().max(1.0);
+        budget = (budget + rate * (now - last).as_secs_f64()).min(cap);
+        last = now;
+        if budget >= 1.0 {
+            let released = unsafe { MallocExtension_ReleaseOldFreeMemory(budget as usize, min_age_ms) };
+            budget -= released as f64;
+        }
+    }
+}
+
+impl Drop for BackgroundRelease {
+    fn drop(&mut self) {
+        drop(self.stop.take());
+        if let Some(thread) = self.thread.take() {
+            let _ = thread.join();
+        }
+        set_background_release_threads(|n| n - 1);
+    }
+}
+
+/// A size class: allocations are rounded up to the smallest class
+/// that fits them.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct SizeClass {
+    /// Largest object size in the class.
+    pub size: usize,
+    /// Size of spans objects are carved from, in tcmalloc pages. 0
+    /// means computed by tcmalloc.
+    pub pages: usize,
+    /// Number of objects moved between caches at a time. 0 means
+    /// computed by tcmalloc.
+    pub objects_to_move: usize,
+}
+
+/// Returns the size classes in use, smallest first.
+pub fn size_classes() -> Vec<SizeClass> {
+    let max = unsafe {
+        MallocExtension_GetSizeClasses(std::ptr::null_mut(), std::ptr::null_mut(), std::ptr::null_mut(), 0)
+    };
+    let n = max.max(0) as usize;
+    let (mut sizes, mut pages, mut objects_to_move) = (vec![0; n], vec![0; n], vec![0; n]);
+    let n = unsafe {
+        MallocExtension_GetSizeClasses(
+            sizes.as_mut_ptr(),
+            pages.as_mut_ptr(),
+            objects_to_move.as_mut_ptr(),
+            max,
+        )
+    }
+    .clamp(0, max) as usize;
+    (0..n)
+        .map(|i| SizeClass { size: sizes[i], pages: pages[i], objects_to_move: objects_to_move[i] })
+        .collect()
+}
+
+/// Formats `classes` as a `TCMALLOC_SIZE_CLASSES` value, or returns
+/// why tcmalloc would reject it.
+///
+/// Size classes are fixed when tcmalloc initializes, so the value only
+/// takes effect for processes started with it in their environment,
+/// or built into the program with [`size_classes_override!`].
+/// `tcmalloc.custom_size_classes` property tells whether it did.
+pub fn size_classes_spec(classes: &[SizeClass]) -> Result<String, String> {
+    let spec = classes
+        .iter()
+        .map(|c| match (c.pages, c.objects_to_move) {
+            (0, 0) => c.size.to_string(),
+            (pages, 0) => format!("{}:{}", c.size, pages),
+            (pages, objects_to_move) => format!("{}:{}:{}", c.size, pages, objects_to_move),
+        })
+        .collect::<Vec<_>>()
+        .join(",");
+    let c_spec = CString::new(spec.as_str()).expect("CString conversion failed");
+    let error = unsafe { MallocExtension_CheckSizeClasses(c_spec.as_ptr()) };
+    if error.is_null() {
+        Ok(spec)
+    } else {
+        Err(unsafe { CStr::from_ptr(error) }.to_string_lossy().into_owned())
+    }
+}
+
+/// Builds a size class table into the program, in the format
+/// [`size_classes_spec`] returns. tcmalloc picks it up before the
+/// first allocation, unless `TCMALLOC_SIZE_CLASSES` is set. An invalid
+/// table is logged and the built-in one is used instead. Use it once,
+/// in the binary crate.
+///
+/// Sizes are multiples of 16 bytes, so e.g. 72 and 136 byte
+/// allocations still round up to 80 and 144 unless the crate is built
+/// with the `align-8` feature.
+///
+/// ```ignore
+/// da_tcmalloc::size_classes_override!(
+///     "16,32,48,64,80,96,112,128,144,256,512,1024,2048,4096,8192,\
+///      16384,32768,65536,131072,262144"
+/// );
+/// ```
+#[macro_export]
+macro_rules! size_classes_override {
+    ($spec:expr) => {
+        #[no_mangle]
+        pub extern "C" fn tc_size_classes_override() -> *const ::std::os::raw::c_char {
+            ::std::concat!($spec, "\0").as_ptr() as *const ::std::os::raw::c_char
+        }
+    };
+}
+
+/// Largest number of size classes tcmalloc supports.
+pub const MAX_SIZE_CLASSES: usize = 127;
+
+/// Derives a size class table for a workload from its allocation size
+/// histogram, given as `(size, count)` pairs, e.g. from a sampled heap
+/// profile.
+///
+/// Classes in use are kept, so sizes missing from the histogram are
+/// served as well as before, and up to `max_classes` in total are
+/// chosen among the sizes seen so that bytes wasted to rounding are
+/// minimal. The result can be passed to [`size_classes_spec`].
+pub fn derive_size_classes(histogram: &[(usize, u64)], max_classes: usize) -> Vec<SizeClass> {
+    let base = size_classes();
+    let Some(max_size) = base.last().map(|c| c.size) else {
+        return base;
+    };
+    let extra = max_classes.min(MAX_SIZE_CLASSES).saturating_sub(base.len());
+
+    // Class sizes must be multiples of the minimal alignment (8 or 16
+    // bytes depending on build), and of 128 above 1024 bytes.
+    let min_align = if base.iter().any(|c| c.size > 8 && c.size % 16 != 0) { 8 } else { 16 };
+    let round_up = |size: usize| match size {
+        0..=8 => 8,
+        9..=1024 => size.next_multiple_of(min_align),
+        _ => size.next_multiple_of(128),
+    };
+
+    let mut samples: Vec<(usize, u64)> =
+        histogram.iter().copied().filter(|&(size, count)| size <= max_size && count > 0).collect();
+    samples.sort_unstable();
+
+    let mut candidates: Vec<(usize, bool)> = base.iter().map(|c| (c.size, true)).collect();
+    candidates.extend(samples.iter().map(|&(size, _)| (round_up(size), false)));
+    candidates.sort_unstable_by(|a, b| a.0.cmp(&b.0).then(b.1.cmp(&a.1)));
+    candidates.dedup_by_key(|c| c.0);
+
+    // Bytes wasted by rounding sizes in (from, to] up to to.
+    let counts: Vec<u128> = samples.iter().scan(0, |sum, &(_, count)| {
+        *sum += count as u128;
+        Some(*sum)
+    }).collect();
+    let bytes: Vec<u128> = samples.iter().scan(0, |sum, &(size, count)| {
+        *sum += size as u128 * count as u128;
+        Some(*sum)
+    }).collect();
+    let prefix = |size: usize| {
+        let n = samples.partition_point(|&(s, _)| s <= size);
+        if n == 0 { (0, 0) } else { (counts[n - 1], bytes[n - 1]) }
+    };
+    let waste = |from: usize, to: usize| {
+        let (c0, b0) = prefix(from);
+        let (c1, b1) = prefix(to);
+        (c1 - c0) * to as u128 - (b1 - b0)
+    };
+
+    // Aligned allocations rely on each class being a multiple of every
+    // power of 2 it serves.
+    let aligned = |from: usize, to: usize| {
+        let mut align = min_align;
+        while align <= to {
+            if (from / align + 1) * align <= to && to % align != 0 {
+                return false;
+            }
+            align *= 2;
+        }
+        true
+    };
+
+    // best[j][e]: least waste of a table ending with candidate j that
+    // has e classes not in use now, and the class before it.
+    let n = candidates.len();
+    let mut best = vec![vec![None::<(u128, Option<usize>)>; extra + 1]; n];
+    for j in 0..n {
+        let (to, kept) = candidates[j];
+        let added = !kept as usize;
+        if added > extra {
+            continue;
+        }
+        // Previous class is the last kept one or any added after it.
+        let first = (0..j).rev().find(|&i| candidates[i].1);
+        if first.is_none() && aligned(0, to) {
+            best[j][added] = Some((waste(0, to), None));
+        }
+        for i in first.into_iter().chain(first.map_or(0, |i| i + 1)..j) {
+            let from = candidates[i].0;
+            if !aligned(from, to) {
+                continue;
+            }
+            let cost = waste(from, to);
+            for e in 0..=extra - added {
+                if let Some((prev, _)) = best[i][e] {
+                    let slot = &mut best[j][e + added];
+                    if slot.map_or(true, |(c, _)| prev + cost < c) {
+                        *slot = Some((prev + cost, Some(i)));
+                    }
+                }
+            }
+        }
+    }
+
+    let last = n - 1;
+    let Some(mut e) = (0..=extra).filter_map(|e| Some((best[last][e]?.0, e))).min().map(|(_, e)| e) else {
+        return base;
+    };
+    let mut chosen = vec![];
+    let mut j = Some(last);
+    while let Some(i) = j {
+        chosen.push(i);
+        let (_, prev) = best[i][e].unwrap();
+        e -= !candidates[i].1 as usize;
+        j = prev;
+    }
+    chosen
+        .into_iter()
+        .rev()
+        .map(|i| {
+            let size = candidates[i].0;
+            base.iter().copied().find(|c| c.size == size).unwrap_or(SizeClass { size, pages: 0, objects_to_move: 0 })
+        })
+        .collect()
+}
+
+/// Global allocator that calls tcmalloc directly and passes it the size
+/// of freed blocks, which saves looking their size class up on every
+/// free. Zeroed allocations use `calloc`, which doesn't clear large
+/// blocks made of pages fresh from the system. `malloc` is tcmalloc
+/// for the whole process either way, so this is optional:
+///
+/// ```ignore
+/// #[global_allocator]
+/// static GLOBAL: da_tcmalloc::TCMalloc = da_tcmalloc::TCMalloc;
+/// ```
+pub struct TCMalloc;
+
+// tcmalloc aligns blocks of at least this size to it.
+#[cfg(not(feature = "align-8"))]
+const MIN_ALIGN: usize = 16;
+#[cfg(feature = "align-8")]
+const MIN_ALIGN: usize = 8;
+
+// Blocks larger than this are whole spans, which tcmalloc looks up
+// when freeing, whatever size it is passed.
+const MAX_SMALL_SIZE: usize = 256 << 10;
+
+impl TCMalloc {
+    #[inline]
+    fn plain_malloc(align: usize, size: usize) -> bool {
+        align <= MIN_ALIGN && align <= size
+    }
+}
+
+unsafe impl GlobalAlloc for TCMalloc {
+    #[inline]
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        if Self::plain_malloc(layout.align(), layout.size()) {
+            tc_malloc(layout.size()) as *mut u8
+        } else {
+            tc_memalign(layout.align(), layout.size()) as *mut u8
+        }
+    }
+
+    #[inline]
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        if Self::plain_malloc(layout.align(), layout.size()) {
+            return tc_calloc(1, layout.size()) as *mut u8;
+        }
+        let ptr = self.alloc(layout);
+        if !ptr.is_null() {
+            std::ptr::write_bytes(ptr, 0, layout.size());
+        }
+        ptr
+    }
+
+    #[inline]
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        if Self::plain_malloc(layout.align(), layout.size()) {
+            tc_free_sized(ptr as *mut c_void, layout.size())
+        } else {
+            tc_delete_sized_aligned(ptr as *mut c_void, layout.size(), layout.align())
+        }
+    }
+
+    // tc_realloc may keep the block when shrinking it, or allocate
+    // more than asked when growing it, so the size later passed to
+    // dealloc would point at the wrong size class. That's fine only
+    // for large sizes. Otherwise keep the block when the new size has
+    // the same class.
+    #[inline]
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        if layout.align() <= MIN_ALIGN && new_size > MAX_SMALL_SIZE {
+            return tc_realloc(ptr as *mut c_void, new_size) as *mut u8;
+        }
+        if Self::plain_malloc(layout.align(), layout.size())
+            && Self::plain_malloc(layout.align(), new_size)
+            && tc_nallocx(layout.size(), 0) == tc_nallocx(new_size, 0)
+        {
+            return ptr;
+        }
+        let new_layout = Layout::from_size_align_unchecked(new_size, layout.align());
+        let new_ptr = self.alloc(new_layout);
+        if !new_ptr.is_null() {
+            std::ptr::copy_nonoverlapping(ptr, new_ptr, layout.size().min(new_size));
+            self.dealloc(ptr, layout);
+        }
+        new_ptr
+    }
+}